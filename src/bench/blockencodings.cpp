@@ -0,0 +1,73 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <blockencodings.h>
+#include <txmempool.h>
+
+#include <vector>
+
+static void AddTx(const CTransactionRef& tx, CTxMemPool& pool)
+{
+    LockPoints lp;
+    pool.addUnchecked(tx->GetHash(), CTxMemPoolEntry(tx, 1000 /* fee */, 0 /* time */, 1 /* height */,
+                                                     false /* spendsCoinbase */, 4 /* sigOpCost */, lp));
+}
+
+// Matching the short IDs of a compact block of 1000 transactions against
+// mempools of growing size, all of the block's transactions being spread
+// through the mempool.
+static void CompactBlockReconstruction(benchmark::State& state, size_t nMempoolSize)
+{
+    const size_t BLOCK_TXS = 1000;
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    CBlock block;
+    block.nBits = 0x207fffff;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    block.vtx.push_back(MakeTransactionRef(coinbase));
+    for (size_t i = 0; i < nMempoolSize; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        tx.vout[0].nValue = COIN;
+        CTransactionRef ref = MakeTransactionRef(tx);
+        AddTx(ref, pool);
+        if (i % (nMempoolSize / BLOCK_TXS) == 0 && block.vtx.size() <= BLOCK_TXS) {
+            block.vtx.push_back(ref);
+        }
+    }
+
+    const CBlockHeaderAndShortTxIDs cmpctblock(block, true);
+    const std::vector<std::pair<uint256, CTransactionRef>> extra_txn;
+    while (state.KeepRunning()) {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        bool ok = partialBlock.InitData(cmpctblock, extra_txn) == READ_STATUS_OK;
+        assert(ok);
+    }
+}
+
+static void CompactBlockReconstruction1k(benchmark::State& state)
+{
+    CompactBlockReconstruction(state, 1000);
+}
+
+static void CompactBlockReconstruction10k(benchmark::State& state)
+{
+    CompactBlockReconstruction(state, 10000);
+}
+
+static void CompactBlockReconstruction100k(benchmark::State& state)
+{
+    CompactBlockReconstruction(state, 100000);
+}
+
+BENCHMARK(CompactBlockReconstruction1k, 5000);
+BENCHMARK(CompactBlockReconstruction10k, 1000);
+BENCHMARK(CompactBlockReconstruction100k, 150);
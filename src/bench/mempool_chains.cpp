@@ -0,0 +1,55 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <bench/bench.h>
+#include <policy/policy.h>
+#include <txmempool.h>
+#include <validation.h>
+
+#include <vector>
+
+// Accept chains of transactions as long as the default ancestor limit allows,
+// doing the same ancestor calculation and insertion AcceptToMemoryPool does,
+// and then remove them again as if they were mined.
+static void MempoolLongChains(benchmark::State& state)
+{
+    const int CHAINS = 8;
+    const int CHAIN_LENGTH = DEFAULT_ANCESTOR_LIMIT;
+
+    std::vector<CTransactionRef> vtx;
+    for (int chain = 0; chain < CHAINS; ++chain) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << chain;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        for (int i = 0; i < CHAIN_LENGTH; ++i) {
+            vtx.push_back(MakeTransactionRef(tx));
+            tx.vin[0].prevout = COutPoint(vtx.back()->GetHash(), 0);
+            tx.vin[0].scriptSig = CScript() << OP_1;
+            tx.vout[0].nValue -= 1000;
+        }
+    }
+
+    CTxMemPool pool;
+    const uint64_t nAncestorSizeLimit = DEFAULT_ANCESTOR_SIZE_LIMIT * 1000;
+    const uint64_t nDescendantSizeLimit = DEFAULT_DESCENDANT_SIZE_LIMIT * 1000;
+    LockPoints lp;
+
+    while (state.KeepRunning()) {
+        LOCK(pool.cs);
+        for (const CTransactionRef& tx : vtx) {
+            CTxMemPoolEntry entry(tx, 1000, 0, 1, false, 4, lp);
+            CTxMemPool::setEntries setAncestors;
+            std::string errString;
+            bool fLimitsOk = pool.CalculateMemPoolAncestors(entry, setAncestors, DEFAULT_ANCESTOR_LIMIT, nAncestorSizeLimit, DEFAULT_DESCENDANT_LIMIT, nDescendantSizeLimit, errString);
+            assert(fLimitsOk);
+            pool.addUnchecked(tx->GetHash(), entry, setAncestors);
+        }
+        pool.removeForBlock(vtx, 1);
+    }
+}
+
+BENCHMARK(MempoolLongChains, 100);
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <arith_uint256.h>
 #include <bench/bench.h>
 #include <policy/policy.h>
 #include <txmempool.h>
@@ -21,9 +22,8 @@ static void AddTx(const CTransaction& tx, const CAmount& nFee, CTxMemPool& pool)
                                         spendsCoinbase, sigOpCost, lp));
 }
 
-// Right now this is only testing eviction performance in an extremely small
-// mempool. Code needs to be written to generate a much wider variety of
-// unique transactions for a more meaningful performance measurement.
+// Eviction performance in an extremely small mempool; see
+// MempoolEvictionLarge for a mempool at a realistic size limit.
 static void MempoolEviction(benchmark::State& state)
 {
     CMutableTransaction tx1 = CMutableTransaction();
@@ -112,3 +112,53 @@ static void MempoolEviction(benchmark::State& state)
 }
 
 BENCHMARK(MempoolEviction, 41000);
+
+// A transaction spending a confirmed output that is unique to n, or the first
+// output of parent if one is given.
+static CTransactionRef MakeSpamTx(uint64_t n, const CTransactionRef& parent)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = parent ? COutPoint(parent->GetHash(), 0) : COutPoint(ArithToUint256(arith_uint256(n)), 0);
+    tx.vin[0].scriptSig = CScript() << n;
+    tx.vout.resize(2);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 1 * COIN;
+    tx.vout[1].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx.vout[1].nValue = 1 * COIN;
+    return MakeTransactionRef(tx);
+}
+
+// Keep a mempool at a 300 MB size limit while waves of better paying
+// transactions arrive, trimming it once per wave as happens after a reorg or
+// a package is accepted.
+static void MempoolEvictionLarge(benchmark::State& state)
+{
+    const size_t SIZE_LIMIT = 300 * 1000 * 1000;
+    const int WAVE_SIZE = 1000;
+
+    CTxMemPool pool;
+    LOCK(pool.cs);
+    uint64_t n = 0;
+    CTransactionRef parent;
+    auto add_spam = [&](CAmount nFee) {
+        // Every fourth transaction is a child of the previous one, so that
+        // the mempool holds both lone transactions and small clusters.
+        ++n;
+        CTransactionRef tx = MakeSpamTx(n, n % 4 == 0 ? parent : nullptr);
+        AddTx(*tx, nFee, pool);
+        parent = tx;
+    };
+    while (pool.DynamicMemoryUsage() < SIZE_LIMIT) {
+        add_spam(1000 + (n * 7919) % 10000);
+    }
+
+    while (state.KeepRunning()) {
+        for (int i = 0; i < WAVE_SIZE; ++i) {
+            add_spam(20000 + n);
+        }
+        pool.TrimToSize(SIZE_LIMIT);
+    }
+}
+
+BENCHMARK(MempoolEvictionLarge, 12);
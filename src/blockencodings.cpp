@@ -13,8 +13,84 @@
 #include <validation.h>
 #include <util.h>
 
+#include <algorithm>
+#include <system_error>
+#include <thread>
 #include <unordered_map>
 
+namespace {
+
+/** Minimum number of candidate transactions per thread matching short IDs */
+static const size_t SHORTID_MATCH_BATCH = 8192;
+/** Maximum number of threads matching the short IDs of one compact block */
+static const int MAX_SHORTID_MATCH_THREADS = 8;
+/** Number of bits in the filter on the low bits of a compact block's short IDs */
+static const size_t SHORTID_FILTER_BITS = 1 << 16;
+
+/** A candidate transaction whose short ID is in the compact block */
+struct ShortIDMatch {
+    size_t candidate; //!< Position in the candidate list
+    uint16_t index;   //!< Position in the block
+};
+
+/**
+ * Find the candidates, in <witness hash, T> form, whose short IDs are in
+ * shorttxids, in candidate order. Most candidates are not in the block and
+ * are turned away by the filter without a hash table lookup. Large candidate
+ * lists are split between up to nMaxThreads threads, which only read their
+ * arguments.
+ */
+template <typename T>
+std::vector<ShortIDMatch> MatchShortIDs(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::unordered_map<uint64_t, uint16_t>& shorttxids,
+                                        const std::vector<uint64_t>& filter, const std::vector<std::pair<uint256, T>>& candidates, int nMaxThreads)
+{
+    auto match_range = [&](size_t begin, size_t end, std::vector<ShortIDMatch>* matches) {
+        for (size_t i = begin; i < end; i++) {
+            const uint64_t shortid = cmpctblock.GetShortID(candidates[i].first);
+            const uint64_t bit = shortid % SHORTID_FILTER_BITS;
+            if (!((filter[bit / 64] >> (bit % 64)) & 1))
+                continue;
+            auto idit = shorttxids.find(shortid);
+            if (idit != shorttxids.end())
+                matches->push_back({i, idit->second});
+        }
+    };
+
+    size_t nThreads = 1;
+    if (candidates.size() >= 2 * SHORTID_MATCH_BATCH) {
+        nThreads = std::max<size_t>(1, std::min<size_t>(nMaxThreads, candidates.size() / SHORTID_MATCH_BATCH));
+    }
+    const size_t nChunk = (candidates.size() + nThreads - 1) / nThreads;
+    std::vector<std::vector<ShortIDMatch>> vMatches(nThreads);
+    std::vector<std::thread> threads;
+    size_t nSpawned = 1;
+    try {
+        for (; nSpawned < nThreads; nSpawned++) {
+            threads.emplace_back(match_range, nSpawned * nChunk, std::min(candidates.size(), (nSpawned + 1) * nChunk), &vMatches[nSpawned]);
+        }
+    } catch (const std::system_error& e) {
+        LogPrintf("%s: could not start thread: %s\n", __func__, e.what());
+    }
+    // Chunks without a thread are matched here
+    match_range(0, nChunk, &vMatches[0]);
+    match_range(nSpawned * nChunk, candidates.size(), &vMatches[0]);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    std::vector<ShortIDMatch> matches;
+    matches.swap(vMatches[0]);
+    for (size_t i = 1; i < nSpawned; i++) {
+        matches.insert(matches.end(), vMatches[i].begin(), vMatches[i].end());
+    }
+    if (nSpawned < nThreads) {
+        std::sort(matches.begin(), matches.end(), [](const ShortIDMatch& a, const ShortIDMatch& b) { return a.candidate < b.candidate; });
+    }
+    return matches;
+}
+
+} // namespace
+
 CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block, bool fUseWTXID) :
         nonce(GetRand(std::numeric_limits<uint64_t>::max())),
         shorttxids(block.vtx.size() - 1), prefilledtxn(1), header(block) {
@@ -78,11 +154,14 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     // of short IDs, any highly-uneven distribution of elements can be safely treated as a
     // READ_STATUS_FAILED.
     std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    std::vector<uint64_t> shortid_filter(SHORTID_FILTER_BITS / 64);
     uint16_t index_offset = 0;
     for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
         while (txn_available[i + index_offset])
             index_offset++;
         shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
+        const uint64_t bit = cmpctblock.shorttxids[i] % SHORTID_FILTER_BITS;
+        shortid_filter[bit / 64] |= uint64_t{1} << (bit % 64);
         // To determine the chance that the number of entries in a bucket exceeds N,
         // we use the fact that the number of elements in a single bucket is
         // binomially distributed (with n = the number of shorttxids S, and p =
@@ -101,26 +180,25 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     if (shorttxids.size() != cmpctblock.shorttxids.size())
         return READ_STATUS_FAILED; // Short ID collision
 
+    const int nMaxThreads = nMatchThreads > 0 ? nMatchThreads : std::min(GetNumCores(), MAX_SHORTID_MATCH_THREADS);
     std::vector<bool> have_txn(txn_available.size());
     {
     LOCK(pool->cs);
+    // The mempool keeps the witness hashes of its entries, so only their
+    // short IDs are computed here.
     const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
-    for (size_t i = 0; i < vTxHashes.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                have_txn[idit->second]  = true;
-                mempool_count++;
-            } else {
-                // If we find two mempool txn that match the short id, just request it.
-                // This should be rare enough that the extra bandwidth doesn't matter,
-                // but eating a round-trip due to FillBlock failure would be annoying
-                if (txn_available[idit->second]) {
-                    txn_available[idit->second].reset();
-                    mempool_count--;
-                }
+    for (const ShortIDMatch& match : MatchShortIDs(cmpctblock, shorttxids, shortid_filter, vTxHashes, nMaxThreads)) {
+        if (!have_txn[match.index]) {
+            txn_available[match.index] = vTxHashes[match.candidate].second->GetSharedTx();
+            have_txn[match.index]  = true;
+            mempool_count++;
+        } else {
+            // If we find two mempool txn that match the short id, just request it.
+            // This should be rare enough that the extra bandwidth doesn't matter,
+            // but eating a round-trip due to FillBlock failure would be annoying
+            if (txn_available[match.index]) {
+                txn_available[match.index].reset();
+                mempool_count--;
             }
         }
         // Though ideally we'd continue scanning for the two-txn-match-shortid case,
@@ -131,28 +209,27 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     }
     }
 
-    for (size_t i = 0; i < extra_txn.size(); i++) {
-        uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = extra_txn[i].second;
-                have_txn[idit->second]  = true;
-                mempool_count++;
-                extra_count++;
-            } else {
-                // If we find two mempool/extra txn that match the short id, just
-                // request it.
-                // This should be rare enough that the extra bandwidth doesn't matter,
-                // but eating a round-trip due to FillBlock failure would be annoying
-                // Note that we don't want duplication between extra_txn and mempool to
-                // trigger this case, so we compare witness hashes first
-                if (txn_available[idit->second] &&
-                        txn_available[idit->second]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
-                    txn_available[idit->second].reset();
-                    mempool_count--;
-                    extra_count--;
-                }
+    // The extra transactions are only looked at if the mempool left gaps
+    const std::vector<ShortIDMatch> extra_matches = mempool_count < shorttxids.size() ?
+        MatchShortIDs(cmpctblock, shorttxids, shortid_filter, extra_txn, nMaxThreads) : std::vector<ShortIDMatch>();
+    for (const ShortIDMatch& match : extra_matches) {
+        if (!have_txn[match.index]) {
+            txn_available[match.index] = extra_txn[match.candidate].second;
+            have_txn[match.index]  = true;
+            mempool_count++;
+            extra_count++;
+        } else {
+            // If we find two mempool/extra txn that match the short id, just
+            // request it.
+            // This should be rare enough that the extra bandwidth doesn't matter,
+            // but eating a round-trip due to FillBlock failure would be annoying
+            // Note that we don't want duplication between extra_txn and mempool to
+            // trigger this case, so we compare witness hashes first
+            if (txn_available[match.index] &&
+                    txn_available[match.index]->GetWitnessHash() != extra_txn[match.candidate].second->GetWitnessHash()) {
+                txn_available[match.index].reset();
+                mempool_count--;
+                extra_count--;
             }
         }
         // Though ideally we'd continue scanning for the two-txn-match-shortid case,
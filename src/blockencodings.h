@@ -198,6 +198,8 @@ protected:
     CTxMemPool* pool;
 public:
     CBlockHeader header;
+    //! Maximum number of threads matching short IDs in InitData, 0 to use the number of cores
+    int nMatchThreads = 0;
     explicit PartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn) {}
 
     // extra_txn is a list of extra transactions to look at, in <witness hash, reference> form
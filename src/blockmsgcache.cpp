@@ -0,0 +1,82 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockmsgcache.h>
+
+#include <memusage.h>
+
+CBlockMsgCache::CBlockMsgCache(size_t nMaxUsageIn) : nUsage(0), nMaxUsage(nMaxUsageIn)
+{
+}
+
+size_t CBlockMsgCache::MsgUsage(const CSharedNetMsg& msg)
+{
+    return memusage::MallocUsage(sizeof(CSharedNetMsg)) + memusage::DynamicUsage(*msg.data);
+}
+
+std::shared_ptr<const CSharedNetMsg> CBlockMsgCache::Get(const uint256& hash, Type type)
+{
+    LOCK(cs);
+    auto it = index.find(hash);
+    if (it == index.end())
+        return nullptr;
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->msgs[type];
+}
+
+void CBlockMsgCache::Add(const uint256& hash, Type type, std::shared_ptr<const CSharedNetMsg> msg)
+{
+    LOCK(cs);
+    // Rather than flush the whole cache for it, do not keep a message that
+    // would not fit on its own
+    if (MsgUsage(*msg) > nMaxUsage)
+        return;
+    auto it = index.find(hash);
+    if (it == index.end()) {
+        lru.emplace_front();
+        lru.front().hash = hash;
+        it = index.emplace(hash, lru.begin()).first;
+    } else {
+        lru.splice(lru.begin(), lru, it->second);
+    }
+    std::shared_ptr<const CSharedNetMsg>& cached = it->second->msgs[type];
+    if (cached)
+        nUsage -= MsgUsage(*cached);
+    cached = std::move(msg);
+    nUsage += MsgUsage(*cached);
+    Trim();
+}
+
+void CBlockMsgCache::SetMaxUsage(size_t nMaxUsageIn)
+{
+    LOCK(cs);
+    nMaxUsage = nMaxUsageIn;
+    Trim();
+}
+
+void CBlockMsgCache::Trim()
+{
+    AssertLockHeld(cs);
+    while (nUsage > nMaxUsage && !lru.empty()) {
+        const Entry& entry = lru.back();
+        for (const auto& msg : entry.msgs) {
+            if (msg)
+                nUsage -= MsgUsage(*msg);
+        }
+        index.erase(entry.hash);
+        lru.pop_back();
+    }
+}
+
+size_t CBlockMsgCache::Size() const
+{
+    LOCK(cs);
+    return lru.size();
+}
+
+size_t CBlockMsgCache::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    return nUsage;
+}
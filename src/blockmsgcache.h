@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKMSGCACHE_H
+#define BITCOIN_BLOCKMSGCACHE_H
+
+#include <net.h>
+#include <sync.h>
+#include <uint256.h>
+
+#include <array>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+/**
+ * Least recently used cache of serialized block and compact block messages,
+ * shared by all peers. After a new block, many peers ask for the last few
+ * blocks; with this cache each of them is read from disk and serialized once
+ * per encoding rather than once per request.
+ *
+ * The cache is bounded by the memory used by the messages it holds, and is
+ * safe to use from several message handler threads at once.
+ */
+class CBlockMsgCache
+{
+public:
+    /** The encodings a block is sent in */
+    enum Type {
+        BLOCK,
+        BLOCK_NO_WITNESS,
+        CMPCTBLOCK,
+        CMPCTBLOCK_NO_WITNESS,
+        NUM_TYPES
+    };
+
+    explicit CBlockMsgCache(size_t nMaxUsageIn);
+
+    /** Return the cached message for a block, or nullptr if there is none */
+    std::shared_ptr<const CSharedNetMsg> Get(const uint256& hash, Type type);
+
+    /** Cache a message for a block, evicting the least recently used blocks if over the limit */
+    void Add(const uint256& hash, Type type, std::shared_ptr<const CSharedNetMsg> msg);
+
+    /** Change the memory limit, evicting blocks if needed */
+    void SetMaxUsage(size_t nMaxUsageIn);
+
+    /** Number of blocks with at least one cached message */
+    size_t Size() const;
+
+    /** Memory used by the cached messages */
+    size_t DynamicMemoryUsage() const;
+
+private:
+    struct Entry {
+        uint256 hash;
+        std::array<std::shared_ptr<const CSharedNetMsg>, NUM_TYPES> msgs;
+    };
+
+    struct Hasher {
+        size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+    };
+
+    static size_t MsgUsage(const CSharedNetMsg& msg);
+
+    /** Evict least recently used blocks until usage is within the limit */
+    void Trim();
+
+    mutable CCriticalSection cs;
+    //! Most recently used first
+    std::list<Entry> lru;
+    std::unordered_map<uint256, std::list<Entry>::iterator, Hasher> index;
+    size_t nUsage;
+    size_t nMaxUsage;
+};
+
+#endif // BITCOIN_BLOCKMSGCACHE_H
@@ -13,6 +13,20 @@ std::vector<uint256> CCoinsView::GetHeadBlocks() const { return std::vector<uint
 bool CCoinsView::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) { return false; }
 CCoinsViewCursor *CCoinsView::Cursor() const { return nullptr; }
 
+size_t CCoinsView::GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const
+{
+    coins.assign(outpoints.size(), Coin());
+    size_t found = 0;
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        if (GetCoin(outpoints[i], coins[i]) && !coins[i].IsSpent()) {
+            ++found;
+        } else {
+            coins[i].Clear();
+        }
+    }
+    return found;
+}
+
 bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
 {
     Coin coin;
@@ -21,6 +35,7 @@ bool CCoinsView::HaveCoin(const COutPoint &outpoint) const
 
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetCoin(const COutPoint &outpoint, Coin &coin) const { return base->GetCoin(outpoint, coin); }
+size_t CCoinsViewBacked::GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const { return base->GetCoins(outpoints, coins); }
 bool CCoinsViewBacked::HaveCoin(const COutPoint &outpoint) const { return base->HaveCoin(outpoint); }
 uint256 CCoinsViewBacked::GetBestBlock() const { return base->GetBestBlock(); }
 std::vector<uint256> CCoinsViewBacked::GetHeadBlocks() const { return base->GetHeadBlocks(); }
@@ -63,6 +78,41 @@ bool CCoinsViewCache::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     return false;
 }
 
+size_t CCoinsViewCache::GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const {
+    PrefetchCoins(outpoints);
+    coins.assign(outpoints.size(), Coin());
+    size_t found = 0;
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        CCoinsMap::const_iterator it = cacheCoins.find(outpoints[i]);
+        if (it != cacheCoins.end() && !it->second.coin.IsSpent()) {
+            coins[i] = it->second.coin;
+            ++found;
+        }
+    }
+    return found;
+}
+
+void CCoinsViewCache::PrefetchCoins(const std::vector<COutPoint>& outpoints) const {
+    std::vector<COutPoint> missing;
+    for (const COutPoint& outpoint : outpoints) {
+        if (!cacheCoins.count(outpoint)) {
+            missing.push_back(outpoint);
+        }
+    }
+    if (missing.empty()) return;
+
+    std::vector<Coin> coins;
+    if (base->GetCoins(missing, coins) == 0) return;
+    for (size_t i = 0; i < missing.size(); ++i) {
+        // Outpoints that are not found are left uncached, as FetchCoin does.
+        if (coins[i].IsSpent()) continue;
+        auto inserted = cacheCoins.emplace(std::piecewise_construct, std::forward_as_tuple(missing[i]), std::forward_as_tuple(std::move(coins[i])));
+        if (inserted.second) {
+            cachedCoinsUsage += inserted.first->second.coin.DynamicMemoryUsage();
+        }
+    }
+}
+
 void CCoinsViewCache::AddCoin(const COutPoint &outpoint, Coin&& coin, bool possible_overwrite) {
     assert(!coin.IsSpent());
     if (coin.out.scriptPubKey.IsUnspendable()) return;
@@ -151,6 +151,13 @@ public:
      */
     virtual bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
 
+    /** Retrieve the Coins for several outpoints at once.
+     *  coins is resized to match outpoints, and coins[i] is left spent when no
+     *  unspent coin exists for outpoints[i]. Returns the number of unspent coins
+     *  found. Views backed by a database can serve this in a single batch.
+     */
+    virtual size_t GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const;
+
     //! Just check whether a given outpoint is unspent.
     virtual bool HaveCoin(const COutPoint &outpoint) const;
 
@@ -187,6 +194,7 @@ protected:
 public:
     CCoinsViewBacked(CCoinsView *viewIn);
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    size_t GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     std::vector<uint256> GetHeadBlocks() const override;
@@ -221,6 +229,7 @@ public:
 
     // Standard CCoinsView methods
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    size_t GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const override;
     bool HaveCoin(const COutPoint &outpoint) const override;
     uint256 GetBestBlock() const override;
     void SetBestBlock(const uint256 &hashBlock);
@@ -236,6 +245,14 @@ public:
      */
     bool HaveCoinInCache(const COutPoint &outpoint) const;
 
+    /**
+     * Load the coins for the given outpoints into the cache with a single
+     * GetCoins call on the backing view. Outpoints that are already cached
+     * are not looked up again. Use this before accessing all inputs of a
+     * transaction or block.
+     */
+    void PrefetchCoins(const std::vector<COutPoint>& outpoints) const;
+
     /**
      * Return a reference to Coin in the cache, or a pruned one if not found. This is
      * more efficient than GetCoin.
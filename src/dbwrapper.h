@@ -16,8 +16,13 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+#include <algorithm>
+#include <memory>
+
 static const size_t DBWRAPPER_PREALLOC_KEY_SIZE = 64;
 static const size_t DBWRAPPER_PREALLOC_VALUE_SIZE = 1024;
+//! Entries CDBWrapper::ReadMany steps over before seeking to the next key
+static const int DBWRAPPER_MAX_READMANY_STEPS = 16;
 
 class dbwrapper_error : public std::runtime_error
 {
@@ -25,6 +30,100 @@ public:
     explicit dbwrapper_error(const std::string& msg) : std::runtime_error(msg) {}
 };
 
+/**
+ * Serialization stream for database keys. Keys of up to
+ * DBWRAPPER_PREALLOC_KEY_SIZE bytes, which covers the fixed-width COutPoint
+ * and uint256 based keys, are built in an inline buffer on the stack; longer
+ * keys spill over to the heap.
+ */
+class CDBKeyWriter
+{
+private:
+    char m_inline[DBWRAPPER_PREALLOC_KEY_SIZE];
+    std::vector<char> m_heap;
+    size_t m_size;
+
+public:
+    template <typename K>
+    explicit CDBKeyWriter(const K& key) : m_size(0)
+    {
+        ::Serialize(*this, key);
+    }
+
+    CDBKeyWriter(const CDBKeyWriter&) = delete;
+    CDBKeyWriter& operator=(const CDBKeyWriter&) = delete;
+
+    void write(const char* pch, size_t nSize)
+    {
+        if (m_heap.empty() && m_size + nSize <= sizeof(m_inline)) {
+            memcpy(m_inline + m_size, pch, nSize);
+        } else {
+            if (m_heap.empty()) m_heap.assign(m_inline, m_inline + m_size);
+            m_heap.insert(m_heap.end(), pch, pch + nSize);
+        }
+        m_size += nSize;
+    }
+
+    template <typename T>
+    CDBKeyWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return *this;
+    }
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+
+    leveldb::Slice GetSlice() const
+    {
+        return leveldb::Slice(m_heap.empty() ? m_inline : m_heap.data(), m_size);
+    }
+};
+
+/**
+ * Deserialization stream reading directly from memory owned by LevelDB or by
+ * the caller, such as a leveldb::Slice, without copying it into a CDataStream.
+ */
+class CDBSliceReader
+{
+private:
+    const char* m_data;
+    size_t m_size;
+    size_t m_pos;
+
+public:
+    explicit CDBSliceReader(const leveldb::Slice& slice) : m_data(slice.data()), m_size(slice.size()), m_pos(0) {}
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > m_size - m_pos) {
+            throw std::ios_base::failure("CDBSliceReader::read(): end of data");
+        }
+        memcpy(pch, m_data + m_pos, nSize);
+        m_pos += nSize;
+    }
+
+    void ignore(size_t nSize)
+    {
+        if (nSize > m_size - m_pos) {
+            throw std::ios_base::failure("CDBSliceReader::ignore(): end of data");
+        }
+        m_pos += nSize;
+    }
+
+    template <typename T>
+    CDBSliceReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    int GetType() const { return SER_DISK; }
+    int GetVersion() const { return CLIENT_VERSION; }
+    size_t size() const { return m_size - m_pos; }
+    bool empty() const { return m_pos == m_size; }
+};
+
 class CDBWrapper;
 
 /** These should be considered an implementation detail of the specific database.
@@ -41,6 +140,45 @@ void HandleError(const leveldb::Status& status);
  */
 const std::vector<unsigned char>& GetObfuscateKey(const CDBWrapper &w);
 
+/** XOR data in place with the (repeated) obfuscation key. */
+inline void Xor(char* data, size_t size, const std::vector<unsigned char>& key)
+{
+    if (key.empty()) return;
+    for (size_t i = 0, j = 0; i < size; ++i) {
+        data[i] ^= key[j++];
+        if (j == key.size()) j = 0;
+    }
+}
+
+/** Whether values are stored XOR'ed with a non-zero key. */
+inline bool IsObfuscated(const std::vector<unsigned char>& key)
+{
+    return std::any_of(key.begin(), key.end(), [](unsigned char c) { return c != 0; });
+}
+
+/**
+ * Deserialize a value as stored in the database. Without obfuscation the value
+ * is read straight from the slice; otherwise it is de-obfuscated in buf, which
+ * callers can keep around to reuse its allocation across reads.
+ */
+template <typename V>
+bool UnserializeValue(const leveldb::Slice& slValue, const std::vector<unsigned char>& key,
+                      std::vector<char>& buf, V& value)
+{
+    try {
+        if (!IsObfuscated(key)) {
+            CDBSliceReader(slValue) >> value;
+        } else {
+            buf.assign(slValue.data(), slValue.data() + slValue.size());
+            Xor(buf.data(), buf.size(), key);
+            CDBSliceReader(leveldb::Slice(buf.data(), buf.size())) >> value;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    return true;
+}
+
 };
 
 /** Batch of changes queued to be written to a CDBWrapper */
@@ -52,7 +190,6 @@ private:
     const CDBWrapper &parent;
     leveldb::WriteBatch batch;
 
-    CDataStream ssKey;
     CDataStream ssValue;
 
     size_t size_estimate;
@@ -61,7 +198,7 @@ public:
     /**
      * @param[in] _parent   CDBWrapper that this batch is to be submitted to
      */
-    explicit CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
+    explicit CDBBatch(const CDBWrapper &_parent) : parent(_parent), ssValue(SER_DISK, CLIENT_VERSION), size_estimate(0) { };
 
     void Clear()
     {
@@ -72,9 +209,8 @@ public:
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        CDBKeyWriter ssKey(key);
+        leveldb::Slice slKey = ssKey.GetSlice();
 
         ssValue.reserve(DBWRAPPER_PREALLOC_VALUE_SIZE);
         ssValue << value;
@@ -90,16 +226,14 @@ public:
         // - byte[]: value
         // The formula below assumes the key and value are both less than 16k.
         size_estimate += 3 + (slKey.size() > 127) + slKey.size() + (slValue.size() > 127) + slValue.size();
-        ssKey.clear();
         ssValue.clear();
     }
 
     template <typename K>
     void Erase(const K& key)
     {
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        CDBKeyWriter ssKey(key);
+        leveldb::Slice slKey = ssKey.GetSlice();
 
         batch.Delete(slKey);
         // LevelDB serializes erases as:
@@ -108,7 +242,6 @@ public:
         // - byte[]: key
         // The formula below assumes the key is less than 16kB.
         size_estimate += 2 + (slKey.size() > 127) + slKey.size();
-        ssKey.clear();
     }
 
     size_t SizeEstimate() const { return size_estimate; }
@@ -120,6 +253,9 @@ private:
     const CDBWrapper &parent;
     leveldb::Iterator *piter;
 
+    //! buffer reused to de-obfuscate values
+    std::vector<char> value_buf;
+
 public:
 
     /**
@@ -135,20 +271,15 @@ public:
     void SeekToFirst();
 
     template<typename K> void Seek(const K& key) {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
-        piter->Seek(slKey);
+        CDBKeyWriter ssKey(key);
+        piter->Seek(ssKey.GetSlice());
     }
 
     void Next();
 
     template<typename K> bool GetKey(K& key) {
-        leveldb::Slice slKey = piter->key();
         try {
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            ssKey >> key;
+            CDBSliceReader(piter->key()) >> key;
         } catch (const std::exception&) {
             return false;
         }
@@ -156,15 +287,7 @@ public:
     }
 
     template<typename V> bool GetValue(V& value) {
-        leveldb::Slice slValue = piter->value();
-        try {
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(dbwrapper_private::GetObfuscateKey(parent));
-            ssValue >> value;
-        } catch (const std::exception&) {
-            return false;
-        }
-        return true;
+        return dbwrapper_private::UnserializeValue(piter->value(), dbwrapper_private::GetObfuscateKey(parent), value_buf, value);
     }
 
     unsigned int GetValueSize() {
@@ -224,29 +347,97 @@ public:
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        CDBKeyWriter ssKey(key);
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(readoptions, ssKey.GetSlice(), &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
             LogPrintf("LevelDB read failure: %s\n", status.ToString());
             dbwrapper_private::HandleError(status);
         }
+        // The value string is ours, so it can be de-obfuscated in place.
+        dbwrapper_private::Xor(&strValue[0], strValue.size(), obfuscate_key);
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
-            ssValue.Xor(obfuscate_key);
-            ssValue >> value;
+            CDBSliceReader(strValue) >> value;
         } catch (const std::exception&) {
             return false;
         }
         return true;
     }
 
+    /**
+     * Read the values of several keys at once. values is resized to match keys;
+     * values[i] is left default-constructed when keys[i] is absent or cannot be
+     * deserialized. Returns the number of values read.
+     *
+     * All keys are serialized into one buffer and looked up in sorted order
+     * with a single iterator, so keys that are adjacent in the database are
+     * reached by stepping the iterator rather than with a separate search
+     * through the memtables and table files for each of them.
+     */
+    template <typename K, typename V>
+    size_t ReadMany(const std::vector<K>& keys, std::vector<V>& values) const
+    {
+        values.assign(keys.size(), V());
+        if (keys.empty()) return 0;
+
+        CDataStream ssKeys(SER_DISK, CLIENT_VERSION);
+        ssKeys.reserve(keys.size() * DBWRAPPER_PREALLOC_KEY_SIZE);
+        std::vector<size_t> key_ends;
+        key_ends.reserve(keys.size());
+        for (const K& key : keys) {
+            ssKeys << key;
+            key_ends.push_back(ssKeys.size());
+        }
+        auto key_slice = [&](size_t i) {
+            size_t begin = i == 0 ? 0 : key_ends[i - 1];
+            return leveldb::Slice(ssKeys.data() + begin, key_ends[i] - begin);
+        };
+
+        std::vector<size_t> order(keys.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return key_slice(a).compare(key_slice(b)) < 0;
+        });
+
+        size_t found = 0;
+        std::vector<char> value_buf;
+        std::unique_ptr<leveldb::Iterator> piter(pdb->NewIterator(readoptions));
+        bool positioned = false;
+        for (size_t i : order) {
+            const leveldb::Slice slKey = key_slice(i);
+            if (positioned && piter->Valid()) {
+                // Step over a few entries before falling back to a new search.
+                for (int steps = 0; steps < DBWRAPPER_MAX_READMANY_STEPS && piter->Valid() &&
+                                    piter->key().compare(slKey) < 0; ++steps) {
+                    piter->Next();
+                }
+            }
+            if (!positioned || (piter->Valid() && piter->key().compare(slKey) < 0)) {
+                piter->Seek(slKey);
+                positioned = true;
+            }
+            // An exhausted iterator means none of the remaining keys exist.
+            if (!piter->Valid()) break;
+            if (piter->key() != slKey) continue;
+
+            if (dbwrapper_private::UnserializeValue(piter->value(), obfuscate_key, value_buf, values[i])) {
+                ++found;
+            } else {
+                values[i] = V();
+            }
+        }
+
+        const leveldb::Status status = piter->status();
+        if (!status.ok()) {
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            dbwrapper_private::HandleError(status);
+        }
+        return found;
+    }
+
     template <typename K, typename V>
     bool Write(const K& key, const V& value, bool fSync = false)
     {
@@ -258,13 +449,10 @@ public:
     template <typename K>
     bool Exists(const K& key) const
     {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey << key;
-        leveldb::Slice slKey(ssKey.data(), ssKey.size());
+        CDBKeyWriter ssKey(key);
 
         std::string strValue;
-        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        leveldb::Status status = pdb->Get(readoptions, ssKey.GetSlice(), &strValue);
         if (!status.ok()) {
             if (status.IsNotFound())
                 return false;
@@ -309,13 +497,9 @@ public:
     template<typename K>
     size_t EstimateSize(const K& key_begin, const K& key_end) const
     {
-        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
-        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey1 << key_begin;
-        ssKey2 << key_end;
-        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
-        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        CDBKeyWriter ssKey1(key_begin), ssKey2(key_end);
+        leveldb::Slice slKey1 = ssKey1.GetSlice();
+        leveldb::Slice slKey2 = ssKey2.GetSlice();
         uint64_t size = 0;
         leveldb::Range range(slKey1, slKey2);
         pdb->GetApproximateSizes(&range, 1, &size);
@@ -328,13 +512,9 @@ public:
     template<typename K>
     void CompactRange(const K& key_begin, const K& key_end) const
     {
-        CDataStream ssKey1(SER_DISK, CLIENT_VERSION), ssKey2(SER_DISK, CLIENT_VERSION);
-        ssKey1.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey2.reserve(DBWRAPPER_PREALLOC_KEY_SIZE);
-        ssKey1 << key_begin;
-        ssKey2 << key_end;
-        leveldb::Slice slKey1(ssKey1.data(), ssKey1.size());
-        leveldb::Slice slKey2(ssKey2.data(), ssKey2.size());
+        CDBKeyWriter ssKey1(key_begin), ssKey2(key_end);
+        leveldb::Slice slKey1 = ssKey1.GetSlice();
+        leveldb::Slice slKey2 = ssKey2.GetSlice();
         pdb->CompactRange(&slKey1, &slKey2);
     }
 
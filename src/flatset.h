@@ -0,0 +1,123 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATSET_H
+#define BITCOIN_FLATSET_H
+
+#include <prevector.h>
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+
+/** A set kept as a sorted prevector, as a drop-in replacement for std::set
+ *  when sets are usually small: up to N keys are stored without any heap
+ *  allocation, and lookups are a binary search over contiguous memory.
+ *
+ *  Inserting or erasing a single key is linear in the size of the set, so
+ *  add many keys at once with the range insert, which sorts and merges them.
+ *  Like for std::vector, any modification invalidates all iterators.
+ */
+template<unsigned int N, typename K, typename Compare = std::less<K>>
+class flatset {
+    static_assert(std::is_trivially_copyable<K>::value, "prevector elements are moved with memmove");
+
+    typedef prevector<N, K> storage_type;
+    storage_type v;
+
+    static bool equivalent(const K& a, const K& b) { return !Compare()(a, b) && !Compare()(b, a); }
+
+public:
+    typedef K key_type;
+    typedef K value_type;
+    typedef Compare key_compare;
+    typedef typename storage_type::size_type size_type;
+    typedef const K* const_iterator;
+    typedef const_iterator iterator;
+
+    flatset() {}
+
+    template<typename InputIterator>
+    flatset(InputIterator first, InputIterator last) { insert(first, last); }
+
+    flatset(std::initializer_list<K> init) { insert(init.begin(), init.end()); }
+
+    const_iterator begin() const { return &(*v.begin()); }
+    const_iterator end() const { return begin() + v.size(); }
+
+    size_type size() const { return v.size(); }
+    bool empty() const { return v.empty(); }
+    void clear() { v.clear(); }
+    void swap(flatset& other) { v.swap(other.v); }
+
+    /** Heap memory used, ie zero while there are no more than N keys */
+    size_t allocated_memory() const { return v.allocated_memory(); }
+
+    const_iterator lower_bound(const K& key) const { return std::lower_bound(begin(), end(), key, Compare()); }
+
+    const_iterator find(const K& key) const
+    {
+        const_iterator it = lower_bound(key);
+        return (it != end() && !Compare()(key, *it)) ? it : end();
+    }
+
+    size_type count(const K& key) const { return find(key) != end(); }
+
+    std::pair<const_iterator, bool> insert(const K& key)
+    {
+        const_iterator it = lower_bound(key);
+        if (it != end() && !Compare()(key, *it)) {
+            return std::make_pair(it, false);
+        }
+        const size_type pos = it - begin();
+        v.insert(v.begin() + pos, key);
+        return std::make_pair(begin() + pos, true);
+    }
+
+    template<typename InputIterator>
+    void insert(InputIterator first, InputIterator last)
+    {
+        const size_type old_size = v.size();
+        for (; first != last; ++first) {
+            v.push_back(*first);
+        }
+        // Operate on plain pointers, as prevector's iterators only take
+        // unsigned offsets.
+        K* data = &(*v.begin());
+        std::sort(data + old_size, data + v.size(), Compare());
+        if (old_size > 0 && old_size < v.size()) {
+            std::inplace_merge(data, data + old_size, data + v.size(), Compare());
+        }
+        K* new_end = std::unique(data, data + v.size(), equivalent);
+        v.erase(v.begin() + (new_end - data), v.end());
+    }
+
+    const_iterator erase(const_iterator pos)
+    {
+        const size_type index = pos - begin();
+        v.erase(v.begin() + index);
+        return begin() + index;
+    }
+
+    size_type erase(const K& key)
+    {
+        const_iterator it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    friend bool operator==(const flatset& a, const flatset& b)
+    {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+    }
+
+    friend bool operator!=(const flatset& a, const flatset& b) { return !(a == b); }
+};
+
+#endif // BITCOIN_FLATSET_H
@@ -83,6 +83,32 @@ static void JSONErrorReply(HTTPRequest* req, const UniValue& objError, const Uni
     req->WriteReply(nStatus, strReply);
 }
 
+/** Reply to a parked request with the result of func, see RPCResumeFn */
+static void JSONResumeReply(HTTPRequest* req, const UniValue& id, const std::function<UniValue()>& func)
+{
+    try {
+        UniValue result = func();
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, JSONRPCReply(result, NullUniValue, id));
+    } catch (const UniValue& objError) {
+        JSONErrorReply(req, objError, id);
+    } catch (const std::exception& e) {
+        JSONErrorReply(req, JSONRPCError(RPC_MISC_ERROR, e.what()), id);
+    }
+}
+
+/** Take over the reply to req, to be sent once the returned function is called */
+static RPCResumeFn ParkRequest(HTTPRequest* req, const UniValue& id)
+{
+    std::shared_ptr<HTTPRequest> parked = req->Detach();
+    return [parked, id](const std::function<UniValue()>& func) {
+        if (!QueueHTTPWork([parked, id, func] { JSONResumeReply(parked.get(), id, func); })) {
+            LogPrintf("WARNING: parked request rejected because http work queue depth exceeded, it can be increased with the -rpcworkqueue= setting\n");
+            parked->WriteReply(HTTP_INTERNAL_SERVER_ERROR, "Work queue depth exceeded");
+        }
+    };
+}
+
 //This function checks username and password against -rpcauth
 //entries from config file.
 static bool multiUserAuthorized(std::string strUserPass)
@@ -187,7 +213,14 @@ static bool HTTPReq_JSONRPC(HTTPRequest* req, const std::string &)
         if (valRequest.isObject()) {
             jreq.parse(valRequest);
 
+            bool parked = false;
+            jreq.parkRequest = [req, &jreq, &parked]() {
+                parked = true;
+                return ParkRequest(req, jreq.id);
+            };
             UniValue result = tableRPC.execute(jreq);
+            if (parked)
+                return true;
 
             // Send reply
             strReply = JSONRPCReply(result, NullUniValue, jreq.id);
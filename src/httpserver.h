@@ -8,6 +8,7 @@
 #include <string>
 #include <stdint.h>
 #include <functional>
+#include <memory>
 
 static const int DEFAULT_HTTP_THREADS=4;
 static const int DEFAULT_HTTP_WORKQUEUE=16;
@@ -51,6 +52,11 @@ void UnregisterHTTPHandler(const std::string &prefix, bool exactMatch);
  */
 struct event_base* EventBase();
 
+/** Run a function on one of the HTTP worker threads.
+ * Returns false if the work queue is full or the server is not running.
+ */
+bool QueueHTTPWork(const std::function<void()>& func);
+
 /** In-flight HTTP request.
  * Thin C++ wrapper around evhttp_request.
  */
@@ -114,6 +120,14 @@ public:
      * main thread, do not call any other HTTPRequest methods after calling this.
      */
     void WriteReply(int nStatus, const std::string& strReply = "");
+
+    /**
+     * Take over the reply to this request, so that it can be sent later,
+     * possibly from another thread.
+     *
+     * @note Do not call any other HTTPRequest methods on this object afterwards.
+     */
+    std::unique_ptr<HTTPRequest> Detach();
 };
 
 /** Event handler closure.
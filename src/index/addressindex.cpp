@@ -0,0 +1,263 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <coins.h>
+#include <crypto/sha256.h>
+#include <index/addressindex.h>
+#include <undo.h>
+#include <util.h>
+#include <validation.h>
+
+constexpr char DB_ADDRESS_DELTA = 'd';
+constexpr char DB_ADDRESS_UNSPENT = 'u';
+
+std::unique_ptr<AddressIndex> g_addressindex;
+
+namespace {
+
+/**
+ * Key of a delta entry. Integer fields are serialized big-endian so that the
+ * entries of a script are iterated in chain order.
+ */
+struct DeltaKey
+{
+    uint256 script_hash;
+    int height;
+    uint32_t tx_pos;
+    uint32_t index;
+    bool spending;
+
+    DeltaKey() : height(0), tx_pos(0), index(0), spending(false) {}
+    DeltaKey(const uint256& script_hash_in, int height_in, uint32_t tx_pos_in, uint32_t index_in, bool spending_in) :
+        script_hash(script_hash_in), height(height_in), tx_pos(tx_pos_in), index(index_in), spending(spending_in) {}
+
+    template<typename Stream>
+    void Serialize(Stream& s) const
+    {
+        s << script_hash;
+        ser_writedata32be(s, height);
+        ser_writedata32be(s, tx_pos);
+        ser_writedata32be(s, index);
+        s << spending;
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s)
+    {
+        s >> script_hash;
+        height = ser_readdata32be(s);
+        tx_pos = ser_readdata32be(s);
+        index = ser_readdata32be(s);
+        s >> spending;
+    }
+};
+
+struct DeltaValue
+{
+    uint256 txid;
+    CAmount amount;
+
+    ADD_SERIALIZE_METHODS;
+
+    DeltaValue() : amount(0) {}
+    DeltaValue(const uint256& txid_in, CAmount amount_in) : txid(txid_in), amount(amount_in) {}
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(txid);
+        READWRITE(amount);
+    }
+};
+
+struct UnspentKey
+{
+    uint256 script_hash;
+    COutPoint outpoint;
+
+    ADD_SERIALIZE_METHODS;
+
+    UnspentKey() {}
+    UnspentKey(const uint256& script_hash_in, const COutPoint& outpoint_in) :
+        script_hash(script_hash_in), outpoint(outpoint_in) {}
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(script_hash);
+        READWRITE(outpoint);
+    }
+};
+
+struct UnspentValue
+{
+    CAmount amount;
+    int height;
+
+    ADD_SERIALIZE_METHODS;
+
+    UnspentValue() : amount(0), height(0) {}
+    UnspentValue(CAmount amount_in, int height_in) : amount(amount_in), height(height_in) {}
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(amount);
+        READWRITE(VARINT(height));
+    }
+};
+
+} // namespace
+
+/**
+ * Access to the address index database (indexes/addressindex/)
+ */
+class AddressIndex::DB : public BaseIndex::DB
+{
+public:
+    explicit DB(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    bool ReadDeltas(const uint256& script_hash, std::vector<AddressDelta>& deltas);
+
+    bool ReadUnspent(const uint256& script_hash, std::vector<AddressUnspent>& unspent);
+};
+
+AddressIndex::DB::DB(size_t n_cache_size, bool f_memory, bool f_wipe) :
+    BaseIndex::DB(GetDataDir() / "indexes" / "addressindex", n_cache_size, f_memory, f_wipe)
+{}
+
+bool AddressIndex::DB::ReadDeltas(const uint256& script_hash, std::vector<AddressDelta>& deltas)
+{
+    std::unique_ptr<CDBIterator> cursor(NewIterator());
+    std::pair<char, DeltaKey> key;
+    for (cursor->Seek(std::make_pair(DB_ADDRESS_DELTA, script_hash)); cursor->Valid(); cursor->Next()) {
+        if (!cursor->GetKey(key) || key.first != DB_ADDRESS_DELTA || key.second.script_hash != script_hash) {
+            break;
+        }
+        DeltaValue value;
+        if (!cursor->GetValue(value)) {
+            return error("%s: cannot parse address delta record", __func__);
+        }
+        deltas.push_back(AddressDelta{key.second.height, value.txid, key.second.index, key.second.spending, value.amount});
+    }
+    return true;
+}
+
+bool AddressIndex::DB::ReadUnspent(const uint256& script_hash, std::vector<AddressUnspent>& unspent)
+{
+    std::unique_ptr<CDBIterator> cursor(NewIterator());
+    std::pair<char, UnspentKey> key;
+    for (cursor->Seek(std::make_pair(DB_ADDRESS_UNSPENT, script_hash)); cursor->Valid(); cursor->Next()) {
+        if (!cursor->GetKey(key) || key.first != DB_ADDRESS_UNSPENT || key.second.script_hash != script_hash) {
+            break;
+        }
+        UnspentValue value;
+        if (!cursor->GetValue(value)) {
+            return error("%s: cannot parse address unspent record", __func__);
+        }
+        unspent.push_back(AddressUnspent{key.second.outpoint, value.amount, value.height});
+    }
+    return true;
+}
+
+AddressIndex::AddressIndex(size_t n_cache_size, bool f_memory, bool f_wipe)
+    : m_db(MakeUnique<AddressIndex::DB>(n_cache_size, f_memory, f_wipe))
+{}
+
+AddressIndex::~AddressIndex() {}
+
+uint256 AddressIndex::GetScriptHash(const CScript& script)
+{
+    uint256 hash;
+    CSHA256().Write(script.data(), script.size()).Finalize(hash.begin());
+    return hash;
+}
+
+bool AddressIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    // The genesis block outputs are not spendable and are not part of the UTXO set.
+    if (pindex->nHeight == 0) return true;
+
+    CBlockUndo block_undo;
+    if (!UndoReadFromDisk(block_undo, pindex)) {
+        return false;
+    }
+
+    const int height = pindex->nHeight;
+    CDBBatch batch(*m_db);
+    for (size_t i = 0; i < block.vtx.size(); ++i) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        if (!tx.IsCoinBase()) {
+            const CTxUndo& tx_undo = block_undo.vtxundo[i - 1];
+            for (size_t j = 0; j < tx.vin.size(); ++j) {
+                const Coin& prev = tx_undo.vprevout[j];
+                const uint256 script_hash = GetScriptHash(prev.out.scriptPubKey);
+                batch.Write(std::make_pair(DB_ADDRESS_DELTA, DeltaKey(script_hash, height, i, j, true)),
+                            DeltaValue(txid, -prev.out.nValue));
+                batch.Erase(std::make_pair(DB_ADDRESS_UNSPENT, UnspentKey(script_hash, tx.vin[j].prevout)));
+            }
+        }
+
+        for (size_t j = 0; j < tx.vout.size(); ++j) {
+            const CTxOut& out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable()) continue;
+            const uint256 script_hash = GetScriptHash(out.scriptPubKey);
+            batch.Write(std::make_pair(DB_ADDRESS_DELTA, DeltaKey(script_hash, height, i, j, false)),
+                        DeltaValue(txid, out.nValue));
+            batch.Write(std::make_pair(DB_ADDRESS_UNSPENT, UnspentKey(script_hash, COutPoint(txid, j))),
+                        UnspentValue(out.nValue, height));
+        }
+    }
+    return m_db->WriteBatch(batch);
+}
+
+bool AddressIndex::RevertBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    if (pindex->nHeight == 0) return true;
+
+    CBlockUndo block_undo;
+    if (!UndoReadFromDisk(block_undo, pindex)) {
+        return false;
+    }
+
+    // Undo the block's transactions in reverse order, so that outputs created
+    // and spent within the block end up erased.
+    const int height = pindex->nHeight;
+    CDBBatch batch(*m_db);
+    for (size_t i = block.vtx.size(); i-- > 0;) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256& txid = tx.GetHash();
+
+        for (size_t j = 0; j < tx.vout.size(); ++j) {
+            const CTxOut& out = tx.vout[j];
+            if (out.scriptPubKey.IsUnspendable()) continue;
+            const uint256 script_hash = GetScriptHash(out.scriptPubKey);
+            batch.Erase(std::make_pair(DB_ADDRESS_DELTA, DeltaKey(script_hash, height, i, j, false)));
+            batch.Erase(std::make_pair(DB_ADDRESS_UNSPENT, UnspentKey(script_hash, COutPoint(txid, j))));
+        }
+
+        if (!tx.IsCoinBase()) {
+            const CTxUndo& tx_undo = block_undo.vtxundo[i - 1];
+            for (size_t j = 0; j < tx.vin.size(); ++j) {
+                const Coin& prev = tx_undo.vprevout[j];
+                const uint256 script_hash = GetScriptHash(prev.out.scriptPubKey);
+                batch.Erase(std::make_pair(DB_ADDRESS_DELTA, DeltaKey(script_hash, height, i, j, true)));
+                batch.Write(std::make_pair(DB_ADDRESS_UNSPENT, UnspentKey(script_hash, tx.vin[j].prevout)),
+                            UnspentValue(prev.out.nValue, prev.nHeight));
+            }
+        }
+    }
+    return m_db->WriteBatch(batch);
+}
+
+BaseIndex::DB& AddressIndex::GetDB() const { return *m_db; }
+
+bool AddressIndex::FindDeltas(const uint256& script_hash, std::vector<AddressDelta>& deltas) const
+{
+    return m_db->ReadDeltas(script_hash, deltas);
+}
+
+bool AddressIndex::FindUnspent(const uint256& script_hash, std::vector<AddressUnspent>& unspent) const
+{
+    return m_db->ReadUnspent(script_hash, unspent);
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_INDEX_ADDRESSINDEX_H
+#define BITCOIN_INDEX_ADDRESSINDEX_H
+
+#include <amount.h>
+#include <index/base.h>
+#include <script/script.h>
+
+#include <vector>
+
+static const bool DEFAULT_ADDRESSINDEX = false;
+
+/** A change to the balance of a script: an output paying to it, or an input spending from it. */
+struct AddressDelta
+{
+    int height;
+    uint256 txid;
+    uint32_t index;  //!< output index, or input index if spending
+    bool spending;
+    CAmount amount;  //!< negative if spending
+};
+
+/** An unspent output paying to a script. */
+struct AddressUnspent
+{
+    COutPoint outpoint;
+    CAmount amount;
+    int height;
+};
+
+/**
+ * AddressIndex is used to look up the history and unspent outputs of a
+ * script without a wallet rescan. The index is written to a LevelDB database
+ * keyed by the SHA256 hash of the scriptPubKey and records one delta entry
+ * per output created and per input spent, plus the set of outputs that are
+ * currently unspent. Entries are reverted when blocks are disconnected.
+ */
+class AddressIndex final : public BaseIndex
+{
+protected:
+    class DB;
+
+private:
+    const std::unique_ptr<DB> m_db;
+
+protected:
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    bool RevertBlock(const CBlock& block, const CBlockIndex* pindex) override;
+
+    BaseIndex::DB& GetDB() const override;
+
+    const char* GetName() const override { return "addressindex"; }
+
+public:
+    /// Constructs the index, which becomes available to be queried.
+    explicit AddressIndex(size_t n_cache_size, bool f_memory = false, bool f_wipe = false);
+
+    // Destructor is declared because this class contains a unique_ptr to an incomplete type.
+    virtual ~AddressIndex() override;
+
+    /// Hash under which a script is indexed.
+    static uint256 GetScriptHash(const CScript& script);
+
+    /// Look up all balance changes of a script, in chain order.
+    bool FindDeltas(const uint256& script_hash, std::vector<AddressDelta>& deltas) const;
+
+    /// Look up all outputs paying to a script that are unspent in the active chain.
+    bool FindUnspent(const uint256& script_hash, std::vector<AddressUnspent>& unspent) const;
+};
+
+/// The global address index. May be null.
+extern std::unique_ptr<AddressIndex> g_addressindex;
+
+#endif // BITCOIN_INDEX_ADDRESSINDEX_H
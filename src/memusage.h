@@ -5,6 +5,7 @@
 #ifndef BITCOIN_MEMUSAGE_H
 #define BITCOIN_MEMUSAGE_H
 
+#include <flatset.h>
 #include <indirectmap.h>
 
 #include <stdlib.h>
@@ -93,6 +94,12 @@ static inline size_t DynamicUsage(const prevector<N, X, S, D>& v)
     return MallocUsage(v.allocated_memory());
 }
 
+template<unsigned int N, typename X, typename C>
+static inline size_t DynamicUsage(const flatset<N, X, C>& s)
+{
+    return MallocUsage(s.allocated_memory());
+}
+
 template<typename X, typename Y>
 static inline size_t DynamicUsage(const std::set<X, Y>& s)
 {
@@ -28,6 +28,8 @@
 #include <validationinterface.h>
 
 #include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
 #include <queue>
 #include <utility>
@@ -93,7 +95,6 @@ BlockAssembler::BlockAssembler(const CChainParams& params) : BlockAssembler(para
 
 void BlockAssembler::resetBlock()
 {
-    inBlock.clear();
 
     // Reserve space for coinbase tx
     nBlockWeight = 4000;
@@ -149,8 +150,8 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     fIncludeWitness = IsWitnessEnabled(pindexPrev, chainparams.GetConsensus()) && fMineWitnessTx;
 
     int nPackagesSelected = 0;
-    int nDescendantsUpdated = 0;
-    addPackageTxs(nPackagesSelected, nDescendantsUpdated);
+    int nClustersSkipped = 0;
+    addPackageTxs(nPackagesSelected, nClustersSkipped);
 
     int64_t nTime1 = GetTimeMicros();
 
@@ -184,24 +185,11 @@ std::unique_ptr<CBlockTemplate> BlockAssembler::CreateNewBlock(const CScript& sc
     }
     int64_t nTime2 = GetTimeMicros();
 
-    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d updated descendants), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nDescendantsUpdated, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
+    LogPrint(BCLog::BENCH, "CreateNewBlock() packages: %.2fms (%d packages, %d clusters skipped), validity: %.2fms (total %.2fms)\n", 0.001 * (nTime1 - nTimeStart), nPackagesSelected, nClustersSkipped, 0.001 * (nTime2 - nTime1), 0.001 * (nTime2 - nTimeStart));
 
     return std::move(pblocktemplate);
 }
 
-void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
-{
-    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end(); ) {
-        // Only test txs not already in the block
-        if (inBlock.count(*iit)) {
-            testSet.erase(iit++);
-        }
-        else {
-            iit++;
-        }
-    }
-}
-
 bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const
 {
     // TODO: switch to weight-based accounting for packages instead of vsize-based accounting.
@@ -216,7 +204,7 @@ bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost
 // - transaction finality (locktime)
 // - premature witness (in case segwit transactions are added to mempool before
 //   segwit activation)
-bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package)
+bool BlockAssembler::TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package)
 {
     for (const CTxMemPool::txiter it : package) {
         if (!IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
@@ -236,7 +224,6 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     ++nBlockTx;
     nBlockSigOpsCost += iter->GetSigOpCost();
     nFees += iter->GetFee();
-    inBlock.insert(iter);
 
     bool fPrintPriority = gArgs.GetBoolArg("-printpriority", DEFAULT_PRINTPRIORITY);
     if (fPrintPriority) {
@@ -246,83 +233,40 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
     }
 }
 
-int BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
-        indexed_modified_transaction_set &mapModifiedTx)
+namespace {
+/** The next chunk of a cluster to consider for the block */
+struct ClusterCursor
 {
-    int nDescendantsUpdated = 0;
-    for (const CTxMemPool::txiter it : alreadyAdded) {
-        CTxMemPool::setEntries descendants;
-        mempool.CalculateDescendants(it, descendants);
-        // Insert all descendants (not yet in block) into the modified set
-        for (CTxMemPool::txiter desc : descendants) {
-            if (alreadyAdded.count(desc))
-                continue;
-            ++nDescendantsUpdated;
-            modtxiter mit = mapModifiedTx.find(desc);
-            if (mit == mapModifiedTx.end()) {
-                CTxMemPoolModifiedEntry modEntry(desc);
-                modEntry.nSizeWithAncestors -= it->GetTxSize();
-                modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
-                modEntry.nSigOpCostWithAncestors -= it->GetSigOpCost();
-                mapModifiedTx.insert(modEntry);
-            } else {
-                mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
-            }
-        }
-    }
-    return nDescendantsUpdated;
-}
+    const CTxMemPool::Cluster* cluster;
+    size_t nChunk;
 
-// Skip entries in mapTx that are already in a block or are present
-// in mapModifiedTx (which implies that the mapTx ancestor state is
-// stale due to ancestor inclusion in the block)
-// Also skip transactions that we've already failed to add. This can happen if
-// we consider a transaction in mapModifiedTx and it fails: we can then
-// potentially consider it again while walking mapTx.  It's currently
-// guaranteed to fail again, but as a belt-and-suspenders check we put it in
-// failedTx and avoid re-evaluation, since the re-evaluation would be using
-// cached size/sigops/fee values that are not actually correct.
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx)
-{
-    assert (it != mempool.mapTx.end());
-    return mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it);
-}
+    const CTxMemPool::ClusterChunk& Chunk() const { return cluster->vChunks[nChunk]; }
+};
 
-void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
+/** Order cursors so that the one with the best chunk feerate is on top of a std::priority_queue */
+struct CompareClusterCursorByFeerate
 {
-    // Sort package by ancestor count
-    // If a transaction A depends on transaction B, then A's ancestor count
-    // must be greater than B's.  So this is sufficient to validly order the
-    // transactions for block inclusion.
-    sortedEntries.clear();
-    sortedEntries.insert(sortedEntries.begin(), package.begin(), package.end());
-    std::sort(sortedEntries.begin(), sortedEntries.end(), CompareTxIterByAncestorCount());
-}
-
-// This transaction selection algorithm orders the mempool based
-// on feerate of a transaction including all unconfirmed ancestors.
-// Since we don't remove transactions from the mempool as we select them
-// for block inclusion, we need an alternate method of updating the feerate
-// of a transaction with its not-yet-selected ancestors as we go.
-// This is accomplished by walking the in-mempool descendants of selected
-// transactions and storing a temporary modified state in mapModifiedTxs.
-// Each time through the loop, we compare the best transaction in
-// mapModifiedTxs with the next transaction in the mempool to decide what
-// transaction package to work on next.
-void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated)
+    bool operator()(const ClusterCursor& a, const ClusterCursor& b) const
+    {
+        double f1 = (double)a.Chunk().nModFees * b.Chunk().nSize;
+        double f2 = (double)b.Chunk().nModFees * a.Chunk().nSize;
+        return f1 < f2;
+    }
+};
+} // namespace
+
+// This transaction selection algorithm walks the chunks of the mempool's
+// clusters in order of decreasing feerate.  Within a cluster, chunks already
+// have decreasing feerates and only depend on earlier chunks, so a heap
+// holding the next chunk of every cluster yields them in a valid order.
+// When a chunk can't be added, the rest of its cluster is skipped, as later
+// chunks may depend on it.
+void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nClustersSkipped)
 {
-    // mapModifiedTx will store sorted packages after they are modified
-    // because some of their txs are already in the block
-    indexed_modified_transaction_set mapModifiedTx;
-    // Keep track of entries that failed inclusion, to avoid duplicate work
-    CTxMemPool::setEntries failedTx;
-
-    // Start by adding all descendants of previously added txs to mapModifiedTx
-    // and modifying them for their already included ancestors
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
-
-    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
-    CTxMemPool::txiter iter;
+    std::priority_queue<ClusterCursor, std::vector<ClusterCursor>, CompareClusterCursorByFeerate> queue;
+    for (const auto& item : mempool.GetClusters()) {
+        queue.push({&item.second, 0});
+    }
 
     // Limit the number of attempts to add transactions to the block when it is
     // close to full; this is just a simple heuristic to finish quickly if the
@@ -330,68 +274,27 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
     const int64_t MAX_CONSECUTIVE_FAILURES = 1000;
     int64_t nConsecutiveFailed = 0;
 
-    while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty())
+    std::vector<CTxMemPool::txiter> package;
+    while (!queue.empty())
     {
-        // First try to find a new transaction in mapTx to evaluate.
-        if (mi != mempool.mapTx.get<ancestor_score>().end() &&
-                SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
-            ++mi;
-            continue;
-        }
-
-        // Now that mi is not stale, determine which transaction to evaluate:
-        // the next entry from mapTx, or the best from mapModifiedTx?
-        bool fUsingModified = false;
-
-        modtxscoreiter modit = mapModifiedTx.get<ancestor_score>().begin();
-        if (mi == mempool.mapTx.get<ancestor_score>().end()) {
-            // We're out of entries in mapTx; use the entry from mapModifiedTx
-            iter = modit->iter;
-            fUsingModified = true;
-        } else {
-            // Try to compare the mapTx entry to the mapModifiedTx entry
-            iter = mempool.mapTx.project<0>(mi);
-            if (modit != mapModifiedTx.get<ancestor_score>().end() &&
-                    CompareTxMemPoolEntryByAncestorFee()(*modit, CTxMemPoolModifiedEntry(iter))) {
-                // The best entry in mapModifiedTx has higher score
-                // than the one from mapTx.
-                // Switch which transaction (package) to consider
-                iter = modit->iter;
-                fUsingModified = true;
-            } else {
-                // Either no entry in mapModifiedTx, or it's worse than mapTx.
-                // Increment mi for the next loop iteration.
-                ++mi;
-            }
-        }
-
-        // We skip mapTx entries that are inBlock, and mapModifiedTx shouldn't
-        // contain anything that is inBlock.
-        assert(!inBlock.count(iter));
-
-        uint64_t packageSize = iter->GetSizeWithAncestors();
-        CAmount packageFees = iter->GetModFeesWithAncestors();
-        int64_t packageSigOpsCost = iter->GetSigOpCostWithAncestors();
-        if (fUsingModified) {
-            packageSize = modit->nSizeWithAncestors;
-            packageFees = modit->nModFeesWithAncestors;
-            packageSigOpsCost = modit->nSigOpCostWithAncestors;
-        }
+        ClusterCursor cursor = queue.top();
+        queue.pop();
+        const CTxMemPool::ClusterChunk& chunk = cursor.Chunk();
 
-        if (packageFees < blockMinFeeRate.GetFee(packageSize)) {
+        if (chunk.nModFees < blockMinFeeRate.GetFee(chunk.nSize)) {
             // Everything else we might consider has a lower fee rate
             return;
         }
 
-        if (!TestPackage(packageSize, packageSigOpsCost)) {
-            if (fUsingModified) {
-                // Since we always look at the best entry in mapModifiedTx,
-                // we must erase failed entries so that we can consider the
-                // next best entry on the next loop iteration
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        const size_t nStart = cursor.nChunk > 0 ? cursor.cluster->vChunks[cursor.nChunk - 1].nEnd : 0;
+        package.assign(cursor.cluster->vTxs.begin() + nStart, cursor.cluster->vTxs.begin() + chunk.nEnd);
+        int64_t packageSigOpsCost = 0;
+        for (CTxMemPool::txiter it : package) {
+            packageSigOpsCost += it->GetSigOpCost();
+        }
 
+        if (!TestPackage(chunk.nSize, packageSigOpsCost)) {
+            ++nClustersSkipped;
             ++nConsecutiveFailed;
 
             if (nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES && nBlockWeight >
@@ -402,40 +305,25 @@ void BlockAssembler::addPackageTxs(int &nPackagesSelected, int &nDescendantsUpda
             continue;
         }
 
-        CTxMemPool::setEntries ancestors;
-        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
-        std::string dummy;
-        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-
-        onlyUnconfirmed(ancestors);
-        ancestors.insert(iter);
-
         // Test if all tx's are Final
-        if (!TestPackageTransactions(ancestors)) {
-            if (fUsingModified) {
-                mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
-            }
+        if (!TestPackageTransactions(package)) {
+            ++nClustersSkipped;
             continue;
         }
 
-        // This transaction will make it in; reset the failed counter.
+        // This chunk will make it in; reset the failed counter.
         nConsecutiveFailed = 0;
 
-        // Package can be added. Sort the entries in a valid order.
-        std::vector<CTxMemPool::txiter> sortedEntries;
-        SortForBlock(ancestors, iter, sortedEntries);
-
-        for (size_t i=0; i<sortedEntries.size(); ++i) {
-            AddToBlock(sortedEntries[i]);
-            // Erase from the modified set, if present
-            mapModifiedTx.erase(sortedEntries[i]);
+        // The linearization is already a valid order for the block
+        for (CTxMemPool::txiter it : package) {
+            AddToBlock(it);
         }
 
         ++nPackagesSelected;
 
-        // Update transactions that depend on each of these
-        nDescendantsUpdated += UpdatePackagesForAdded(ancestors, mapModifiedTx);
+        if (++cursor.nChunk < cursor.cluster->vChunks.size()) {
+            queue.push(cursor);
+        }
     }
 }
 
@@ -457,3 +345,318 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
+
+std::unique_ptr<BlockTemplateCache> g_block_template_cache;
+
+BlockTemplateCache::BlockTemplateCache(const CChainParams& chainparams, int64_t refresh_interval)
+    : m_chainparams(chainparams), m_refresh_interval(refresh_interval),
+      m_builder_started(false), m_builder_stop(false), m_registered(false), m_building(false),
+      m_tip_changed(false), m_mempool_changed(false)
+{
+    // No caller so far
+    m_last_request[false] = m_last_request[true] =
+        std::chrono::steady_clock::now() - std::chrono::seconds(BLOCK_TEMPLATE_BUILDER_IDLE_TIMEOUT);
+}
+
+BlockTemplateCache::~BlockTemplateCache()
+{
+    Stop();
+}
+
+CachedBlockTemplate BlockTemplateCache::Build(bool supports_segwit)
+{
+    LOCK(cs_main);
+    CachedBlockTemplate cached;
+    // Record the mempool state before selecting transactions, so that any
+    // later change is noticed.
+    cached.transactions_updated = mempool.GetTransactionsUpdated();
+    cached.pindex_prev = chainActive.Tip();
+    cached.time_built = GetTime();
+    CScript script_dummy = CScript() << OP_TRUE;
+    cached.block_template = BlockAssembler(m_chainparams).CreateNewBlock(script_dummy, supports_segwit);
+    return cached;
+}
+
+void BlockTemplateCache::Store(bool supports_segwit, const CachedBlockTemplate& cached)
+{
+    {
+        LOCK(m_cs_templates);
+        m_templates[supports_segwit] = cached;
+        if (cached.block_template) {
+            m_latest = cached;
+        }
+    }
+
+    std::vector<std::function<void()>> ready;
+    {
+        WaitableLock lock(m_cs_builder);
+        TakeDueWaiters(cached, ready);
+    }
+    for (const auto& notify : ready) {
+        notify();
+    }
+}
+
+bool BlockTemplateCache::IsFresh(bool supports_segwit, CachedBlockTemplate& cached)
+{
+    AssertLockHeld(cs_main);
+    LOCK(m_cs_templates);
+    cached = m_templates[supports_segwit];
+    return cached.block_template && cached.pindex_prev == chainActive.Tip() &&
+        (cached.transactions_updated == mempool.GetTransactionsUpdated() ||
+         GetTime() - cached.time_built <= m_refresh_interval);
+}
+
+bool BlockTemplateCache::IsCurrent(bool supports_segwit)
+{
+    AssertLockHeld(cs_main);
+    LOCK(m_cs_templates);
+    const CachedBlockTemplate& cached = m_templates[supports_segwit];
+    return cached.block_template && cached.pindex_prev == chainActive.Tip() &&
+        cached.transactions_updated == mempool.GetTransactionsUpdated();
+}
+
+bool BlockTemplateCache::IsPrebuilt(bool supports_segwit, std::chrono::steady_clock::time_point now) const
+{
+    return now - m_last_request[supports_segwit] < std::chrono::seconds(BLOCK_TEMPLATE_BUILDER_IDLE_TIMEOUT);
+}
+
+CachedBlockTemplate BlockTemplateCache::GetLatest()
+{
+    LOCK(m_cs_templates);
+    return m_latest;
+}
+
+void BlockTemplateCache::TakeDueWaiters(const CachedBlockTemplate& latest, std::vector<std::function<void()>>& ready)
+{
+    if (!latest.block_template) return;
+    const uint256 latest_prev_hash = latest.pindex_prev->GetBlockHash();
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (auto it = m_waiters.begin(); it != m_waiters.end();) {
+        if (it->prev_hash != latest_prev_hash ||
+            (now >= it->not_before && it->transactions_updated != latest.transactions_updated)) {
+            ready.push_back(std::move(it->notify));
+            it = m_waiters.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void BlockTemplateCache::NotifyOnUpdate(const uint256& prev_hash, unsigned int transactions_updated,
+                                        std::chrono::steady_clock::time_point not_before, std::function<void()> notify)
+{
+    std::vector<std::function<void()>> ready;
+    {
+        WaitableLock lock(m_cs_builder);
+        if (m_builder_stop) {
+            ready.push_back(std::move(notify));
+        } else {
+            m_waiters.push_back(Waiter{prev_hash, transactions_updated, not_before, std::move(notify)});
+            TakeDueWaiters(GetLatest(), ready);
+        }
+    }
+    // Wake the builder so that it picks up the new deadline.
+    m_builder_cond.notify_all();
+    for (const auto& notify_ready : ready) {
+        notify_ready();
+    }
+}
+
+CachedBlockTemplate BlockTemplateCache::Get(bool supports_segwit)
+{
+    AssertLockNotHeld(cs_main);
+    CachedBlockTemplate cached;
+    {
+        LOCK(cs_main);
+        if (IsFresh(supports_segwit, cached)) return cached;
+    }
+
+    {
+        // The builder takes cs_main to build, so this waits without it.
+        WaitableLock lock(m_cs_builder);
+        while (m_builder_started && !m_builder_stop &&
+               (m_building || (m_tip_changed && IsPrebuilt(supports_segwit, std::chrono::steady_clock::now())))) {
+            m_builder_cond.wait(lock);
+        }
+    }
+
+    // Checking and building under one cs_main lock keeps the builder from
+    // building the same template as well, see ThreadBuild.
+    LOCK(cs_main);
+    if (IsFresh(supports_segwit, cached)) return cached;
+    cached = Build(supports_segwit);
+    Store(supports_segwit, cached);
+    return cached;
+}
+
+void BlockTemplateCache::UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload)
+{
+    if (fInitialDownload) return;
+    {
+        WaitableLock lock(m_cs_builder);
+        m_tip_changed = true;
+    }
+    m_builder_cond.notify_all();
+}
+
+void BlockTemplateCache::MempoolChanged()
+{
+    {
+        WaitableLock lock(m_cs_builder);
+        m_mempool_changed = true;
+    }
+    m_builder_cond.notify_all();
+}
+
+void BlockTemplateCache::TransactionAddedToMempool(const CTransactionRef& ptx)
+{
+    MempoolChanged();
+}
+
+void BlockTemplateCache::TransactionRemovedFromMempool(const CTransactionRef& ptx)
+{
+    MempoolChanged();
+}
+
+void BlockTemplateCache::ThreadBuild()
+{
+    std::chrono::steady_clock::time_point next_refresh = std::chrono::steady_clock::now();
+    WaitableLock lock(m_cs_builder);
+    while (!m_builder_stop) {
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        // Long-polling callers are notified by the next template, so keep one
+        // kind built while they wait.
+        const bool prebuild[2] = {IsPrebuilt(false, now), IsPrebuilt(true, now) || !m_waiters.empty()};
+        if (!prebuild[false] && !prebuild[true]) {
+            // Nobody asked for templates for a while; stop taking cs_main
+            // for them until the next caller starts the builder again.
+            m_builder_started = false;
+            LogPrint(BCLog::RPC, "%s: no getblocktemplate callers, stopping the template builder\n", __func__);
+            break;
+        }
+        // A new tip is picked up right away; mempool changes are batched up to
+        // one rebuild per refresh interval.
+        if (!m_tip_changed && !(m_mempool_changed && now >= next_refresh)) {
+            // Waiters whose grace period ended may be due on the current
+            // template already; otherwise they are notified by the next one.
+            std::vector<std::function<void()>> ready;
+            TakeDueWaiters(GetLatest(), ready);
+            if (!ready.empty()) {
+                lock.unlock();
+                for (const auto& notify : ready) {
+                    notify();
+                }
+                lock.lock();
+                continue;
+            }
+
+            std::chrono::steady_clock::time_point wake = std::chrono::steady_clock::time_point::max();
+            if (m_waiters.empty()) {
+                wake = std::max(m_last_request[false], m_last_request[true]) +
+                    std::chrono::seconds(BLOCK_TEMPLATE_BUILDER_IDLE_TIMEOUT);
+            }
+            if (m_mempool_changed) {
+                wake = std::min(wake, next_refresh);
+            }
+            for (const Waiter& waiter : m_waiters) {
+                if (waiter.not_before > now) {
+                    wake = std::min(wake, waiter.not_before);
+                }
+            }
+            if (wake == std::chrono::steady_clock::time_point::max()) {
+                m_builder_cond.wait(lock);
+            } else {
+                m_builder_cond.wait_until(lock, wake);
+            }
+            continue;
+        }
+        m_tip_changed = false;
+        m_mempool_changed = false;
+        m_building = true;
+        lock.unlock();
+
+        if (!IsInitialBlockDownload()) {
+            for (bool supports_segwit : {true, false}) {
+                if (!prebuild[supports_segwit]) continue;
+                try {
+                    // A caller may have built this template already.
+                    LOCK(cs_main);
+                    if (!IsCurrent(supports_segwit)) {
+                        Store(supports_segwit, Build(supports_segwit));
+                    }
+                } catch (const std::exception& e) {
+                    LogPrintf("%s: failed to build block template: %s\n", __func__, e.what());
+                }
+            }
+        }
+        next_refresh = std::chrono::steady_clock::now() + std::chrono::seconds(m_refresh_interval);
+
+        lock.lock();
+        m_building = false;
+        // Wake callers waiting for this build.
+        m_builder_cond.notify_all();
+    }
+}
+
+void BlockTemplateCache::Start(bool supports_segwit)
+{
+    std::lock_guard<std::mutex> thread_lock(m_builder_thread_mutex);
+    bool do_register;
+    {
+        WaitableLock lock(m_cs_builder);
+        const bool was_prebuilt = IsPrebuilt(supports_segwit, std::chrono::steady_clock::now());
+        m_last_request[supports_segwit] = std::chrono::steady_clock::now();
+        if (m_builder_stop) return;
+        if (m_builder_started) {
+            if (!was_prebuilt) {
+                // Have the builder pick up this kind of template right away.
+                m_tip_changed = true;
+                m_builder_cond.notify_all();
+            }
+            return;
+        }
+        m_builder_started = true;
+        // Build a first template right away.
+        m_tip_changed = true;
+        do_register = !m_registered;
+        m_registered = true;
+    }
+    // Reap a builder that stopped for lack of callers.
+    if (m_builder_thread.joinable()) {
+        m_builder_thread.join();
+    }
+    if (do_register) {
+        RegisterValidationInterface(this);
+    }
+    m_builder_thread = std::thread(&TraceThread<std::function<void()>>, "tmplbuild",
+                                   std::bind(&BlockTemplateCache::ThreadBuild, this));
+}
+
+void BlockTemplateCache::Stop()
+{
+    bool was_registered;
+    std::list<Waiter> waiters;
+    std::thread builder_thread;
+    {
+        std::lock_guard<std::mutex> thread_lock(m_builder_thread_mutex);
+        WaitableLock lock(m_cs_builder);
+        if (m_builder_stop) return;
+        m_builder_stop = true;
+        was_registered = m_registered;
+        waiters.swap(m_waiters);
+        builder_thread.swap(m_builder_thread);
+    }
+    if (was_registered) {
+        UnregisterValidationInterface(this);
+    }
+    m_builder_cond.notify_all();
+    // Joined without m_builder_thread_mutex, which Start takes under cs_main
+    // while the builder may be waiting for cs_main.
+    if (builder_thread.joinable()) {
+        builder_thread.join();
+    }
+    for (const Waiter& waiter : waiters) {
+        waiter.notify();
+    }
+}
@@ -7,12 +7,19 @@
 #define BITCOIN_MINER_H
 
 #include <primitives/block.h>
+#include <sync.h>
 #include <txmempool.h>
+#include <validationinterface.h>
 
 #include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <list>
 #include <memory>
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class CBlockIndex;
 class CChainParams;
@@ -21,6 +28,10 @@ class CScript;
 namespace Consensus { struct Params; };
 
 static const bool DEFAULT_PRINTPRIORITY = false;
+/** Default for -blocktemplaterefresh, in seconds */
+static const int64_t DEFAULT_BLOCK_TEMPLATE_REFRESH = 5;
+/** Seconds without getblocktemplate callers after which the background template builder stops */
+static const int64_t BLOCK_TEMPLATE_BUILDER_IDLE_TIMEOUT = 120;
 
 struct CBlockTemplate
 {
@@ -30,95 +41,6 @@ struct CBlockTemplate
     std::vector<unsigned char> vchCoinbaseCommitment;
 };
 
-// Container for tracking updates to ancestor feerate as we include (parent)
-// transactions in a block
-struct CTxMemPoolModifiedEntry {
-    explicit CTxMemPoolModifiedEntry(CTxMemPool::txiter entry)
-    {
-        iter = entry;
-        nSizeWithAncestors = entry->GetSizeWithAncestors();
-        nModFeesWithAncestors = entry->GetModFeesWithAncestors();
-        nSigOpCostWithAncestors = entry->GetSigOpCostWithAncestors();
-    }
-
-    int64_t GetModifiedFee() const { return iter->GetModifiedFee(); }
-    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
-    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
-    size_t GetTxSize() const { return iter->GetTxSize(); }
-    const CTransaction& GetTx() const { return iter->GetTx(); }
-
-    CTxMemPool::txiter iter;
-    uint64_t nSizeWithAncestors;
-    CAmount nModFeesWithAncestors;
-    int64_t nSigOpCostWithAncestors;
-};
-
-/** Comparator for CTxMemPool::txiter objects.
- *  It simply compares the internal memory address of the CTxMemPoolEntry object
- *  pointed to. This means it has no meaning, and is only useful for using them
- *  as key in other indexes.
- */
-struct CompareCTxMemPoolIter {
-    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct modifiedentry_iter {
-    typedef CTxMemPool::txiter result_type;
-    result_type operator() (const CTxMemPoolModifiedEntry &entry) const
-    {
-        return entry.iter;
-    }
-};
-
-// A comparator that sorts transactions based on number of ancestors.
-// This is sufficient to sort an ancestor package in an order that is valid
-// to appear in a block.
-struct CompareTxIterByAncestorCount {
-    bool operator()(const CTxMemPool::txiter &a, const CTxMemPool::txiter &b) const
-    {
-        if (a->GetCountWithAncestors() != b->GetCountWithAncestors())
-            return a->GetCountWithAncestors() < b->GetCountWithAncestors();
-        return CTxMemPool::CompareIteratorByHash()(a, b);
-    }
-};
-
-typedef boost::multi_index_container<
-    CTxMemPoolModifiedEntry,
-    boost::multi_index::indexed_by<
-        boost::multi_index::ordered_unique<
-            modifiedentry_iter,
-            CompareCTxMemPoolIter
-        >,
-        // sorted by modified ancestor fee rate
-        boost::multi_index::ordered_non_unique<
-            // Reuse same tag from CTxMemPool's similar index
-            boost::multi_index::tag<ancestor_score>,
-            boost::multi_index::identity<CTxMemPoolModifiedEntry>,
-            CompareTxMemPoolEntryByAncestorFee
-        >
-    >
-> indexed_modified_transaction_set;
-
-typedef indexed_modified_transaction_set::nth_index<0>::type::iterator modtxiter;
-typedef indexed_modified_transaction_set::index<ancestor_score>::type::iterator modtxscoreiter;
-
-struct update_for_parent_inclusion
-{
-    explicit update_for_parent_inclusion(CTxMemPool::txiter it) : iter(it) {}
-
-    void operator() (CTxMemPoolModifiedEntry &e)
-    {
-        e.nModFeesWithAncestors -= iter->GetFee();
-        e.nSizeWithAncestors -= iter->GetTxSize();
-        e.nSigOpCostWithAncestors -= iter->GetSigOpCost();
-    }
-
-    CTxMemPool::txiter iter;
-};
-
 /** Generate a new block, without valid proof-of-work */
 class BlockAssembler
 {
@@ -138,7 +60,6 @@ private:
     uint64_t nBlockTx;
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
-    CTxMemPool::setEntries inBlock;
 
     // Chain context for the block
     int nHeight;
@@ -166,32 +87,144 @@ private:
     void AddToBlock(CTxMemPool::txiter iter);
 
     // Methods for how to add transactions to a block.
-    /** Add transactions based on feerate including unconfirmed ancestors
-      * Increments nPackagesSelected / nDescendantsUpdated with corresponding
+    /** Add transactions by walking the chunks of all mempool clusters in
+      * order of decreasing feerate.
+      * Increments nPackagesSelected / nClustersSkipped with corresponding
       * statistics from the package selection (for logging statistics). */
-    void addPackageTxs(int &nPackagesSelected, int &nDescendantsUpdated);
+    void addPackageTxs(int &nPackagesSelected, int &nClustersSkipped);
 
     // helper functions for addPackageTxs()
-    /** Remove confirmed (inBlock) entries from given set */
-    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
     /** Test if a new package would "fit" in the block */
     bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost) const;
     /** Perform checks on each transaction in a package:
       * locktime, premature-witness, serialized size (if necessary)
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
-    bool TestPackageTransactions(const CTxMemPool::setEntries& package);
-    /** Return true if given transaction from mapTx has already been evaluated,
-      * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set &mapModifiedTx, CTxMemPool::setEntries &failedTx);
-    /** Sort the package in an order that is valid to appear in a block */
-    void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
-    /** Add descendants of given transactions to mapModifiedTx with ancestor
-      * state updated assuming given transactions are inBlock. Returns number
-      * of updated descendants. */
-    int UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set &mapModifiedTx);
+    bool TestPackageTransactions(const std::vector<CTxMemPool::txiter>& package);
+};
+
+/** A block template along with the chain and mempool state it was built from */
+struct CachedBlockTemplate
+{
+    std::shared_ptr<const CBlockTemplate> block_template;
+    //! The tip the template builds on
+    const CBlockIndex* pindex_prev = nullptr;
+    //! mempool.GetTransactionsUpdated() when the template was built
+    unsigned int transactions_updated = 0;
+    //! GetTime() when the template was built
+    int64_t time_built = 0;
 };
 
+/**
+ * Keeps block templates ready for getblocktemplate, so that requests do not
+ * have to run package selection and TestBlockValidity themselves.
+ *
+ * Once started, a background thread rebuilds the templates that callers
+ * asked for recently as soon as the tip changes, and when the mempool has
+ * changed, at most once per refresh interval. Callers that find the builder
+ * busy with their template wait for it rather than building it again. The
+ * builder stops once it has had no callers for
+ * BLOCK_TEMPLATE_BUILDER_IDLE_TIMEOUT, and the next caller starts it again.
+ *
+ * Long-polling callers can register to be notified once a new template is
+ * available, instead of each waiting on a thread of their own.
+ */
+class BlockTemplateCache final : public CValidationInterface
+{
+private:
+    const CChainParams& m_chainparams;
+    const int64_t m_refresh_interval;
+
+    struct Waiter
+    {
+        uint256 prev_hash;
+        unsigned int transactions_updated;
+        std::chrono::steady_clock::time_point not_before;
+        std::function<void()> notify;
+    };
+
+    //! Lock order: m_cs_builder before m_cs_templates
+    CCriticalSection m_cs_templates;
+    //! Cached templates for callers without and with segwit support
+    CachedBlockTemplate m_templates[2];
+    //! The template stored most recently
+    CachedBlockTemplate m_latest;
+
+    CWaitableCriticalSection m_cs_builder;
+    //! Signalled on changes for the builder, and when it finished a build
+    std::condition_variable m_builder_cond;
+    bool m_builder_started;
+    bool m_builder_stop;
+    bool m_registered;
+    //! Whether the builder is building templates right now
+    bool m_building;
+    bool m_tip_changed;
+    bool m_mempool_changed;
+    //! When callers without and with segwit support last asked for a template
+    std::chrono::steady_clock::time_point m_last_request[2];
+    std::list<Waiter> m_waiters;
+
+    //! Guards starting, stopping and joining m_builder_thread
+    std::mutex m_builder_thread_mutex;
+    std::thread m_builder_thread;
+
+    CachedBlockTemplate Build(bool supports_segwit);
+    void Store(bool supports_segwit, const CachedBlockTemplate& cached);
+    /** Whether the cached template may be returned to callers. cs_main must be held. */
+    bool IsFresh(bool supports_segwit, CachedBlockTemplate& cached);
+    /** Whether the cached template builds on the tip and holds the current mempool. cs_main must be held. */
+    bool IsCurrent(bool supports_segwit);
+    /** Whether the builder keeps the template up to date. m_cs_builder must be held. */
+    bool IsPrebuilt(bool supports_segwit, std::chrono::steady_clock::time_point now) const;
+    CachedBlockTemplate GetLatest();
+    /** Move the notifications of waiters that are due on latest to ready. m_cs_builder must be held. */
+    void TakeDueWaiters(const CachedBlockTemplate& latest, std::vector<std::function<void()>>& ready);
+    void MempoolChanged();
+    void ThreadBuild();
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindexNew, const CBlockIndex* pindexFork, bool fInitialDownload) override;
+    void TransactionAddedToMempool(const CTransactionRef& ptx) override;
+    void TransactionRemovedFromMempool(const CTransactionRef& ptx) override;
+
+public:
+    BlockTemplateCache(const CChainParams& chainparams, int64_t refresh_interval);
+    ~BlockTemplateCache();
+
+    /**
+     * Record a caller with or without segwit support, and start the
+     * background builder if it is not running yet and was not stopped
+     * before. The builder keeps templates ready for the kinds of callers seen
+     * recently.
+     */
+    void Start(bool supports_segwit);
+
+    /** Stop the background builder for good, and notify all waiters. */
+    void Stop();
+
+    /**
+     * Call notify once there is a template that builds on another block than
+     * prev_hash, or one with other transactions than transactions_updated if
+     * not_before has passed. This happens right away if such a template is
+     * cached already, and for all waiters on Stop(). The notification runs on
+     * an arbitrary thread and must not block.
+     */
+    void NotifyOnUpdate(const uint256& prev_hash, unsigned int transactions_updated,
+                        std::chrono::steady_clock::time_point not_before, std::function<void()> notify);
+
+    /**
+     * Return a template on the current tip. A new one is built if none is
+     * cached for this tip, or if the cached one is older than the refresh
+     * interval and the mempool has changed since it was built. When the
+     * builder is about to build it or is building it, that build is waited
+     * for instead. Must be called without cs_main held.
+     */
+    CachedBlockTemplate Get(bool supports_segwit);
+};
+
+/** The template cache used by getblocktemplate. */
+extern std::unique_ptr<BlockTemplateCache> g_block_template_cache;
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -25,6 +25,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -43,6 +48,29 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+/** Maximum time the socket handler waits for socket events, in milliseconds */
+static const int SELECT_TIMEOUT_MILLISECONDS = 50;
+
+#ifdef USE_EPOLL
+/** Maximum number of ready sockets handled per epoll_wait() call */
+static const int MAX_SOCKET_EVENTS = 256;
+#endif
+
+#ifndef WIN32
+/** Maximum number of queued buffers passed to a single sendmsg() call */
+static const int MAX_SEND_IOVECS = 64;
+#endif
+
+/** Received messages at least this large are hashed by the checksum threads */
+static const unsigned int MIN_OFFLOAD_CHECKSUM_SIZE = 64 * 1024;
+
+/** Most memory allocated for a received message before its data arrives */
+static const size_t MAX_RECV_PREALLOC = 1024 * 1024;
+/** Maximum number of free receive buffers kept for reuse */
+static const size_t MAX_POOLED_RECV_BUFFERS = 256;
+/** Maximum memory held by free receive buffers kept for reuse */
+static const size_t MAX_POOLED_RECV_BYTES = 16 * 1024 * 1024;
+
 #if !defined(HAVE_MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -487,8 +515,12 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint(BCLog::NET, "disconnecting peer=%d\n", id);
+        // Closing the socket also removes it from the epoll set
         CloseSocket(hSocket);
     }
+#ifdef USE_EPOLL
+    nSocketEvents = -1;
+#endif
 }
 
 void CConnman::ClearBanned()
@@ -814,22 +846,96 @@ int CNode::GetSendVersion() const
 }
 
 
+/**
+ * Free list of receive buffers. Messages are read into a buffer taken from
+ * here, and give it back once they have been processed, so that a busy
+ * connection does not allocate and grow a new buffer for every message.
+ */
+class CRecvBufferPool
+{
+public:
+    /**
+     * Take the smallest free buffer that holds nSize bytes, or else the
+     * largest one to grow from.
+     */
+    CDataStream Get(size_t nSize, int nTypeIn, int nVersionIn)
+    {
+        LOCK(cs);
+        if (vFree.empty())
+            return CDataStream(nTypeIn, nVersionIn);
+        auto best = vFree.end();
+        for (auto it = vFree.begin(); it != vFree.end(); ++it) {
+            if (it->capacity() >= nSize && (best == vFree.end() || it->capacity() < best->capacity()))
+                best = it;
+        }
+        if (best == vFree.end()) {
+            best = std::max_element(vFree.begin(), vFree.end(), [](const CDataStream& a, const CDataStream& b) {
+                return a.capacity() < b.capacity();
+            });
+        }
+        CDataStream stream(std::move(*best));
+        *best = std::move(vFree.back());
+        vFree.pop_back();
+        nFreeBytes -= stream.capacity();
+        stream.SetType(nTypeIn);
+        stream.SetVersion(nVersionIn);
+        return stream;
+    }
+
+    /** Give back a buffer, which is freed instead if the pool is full */
+    void Release(CDataStream&& stream)
+    {
+        stream.clear();
+        const size_t nCapacity = stream.capacity();
+        if (nCapacity == 0)
+            return;
+        LOCK(cs);
+        if (vFree.size() >= MAX_POOLED_RECV_BUFFERS || nFreeBytes + nCapacity > MAX_POOLED_RECV_BYTES)
+            return;
+        vFree.push_back(std::move(stream));
+        nFreeBytes += nCapacity;
+    }
+
+private:
+    CCriticalSection cs;
+    std::vector<CDataStream> vFree;
+    size_t nFreeBytes = 0;
+};
+
+static CRecvBufferPool recvBufferPool;
+
+CNetMessage::CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) :
+    hdr(pchMessageStartIn), vRecv(recvBufferPool.Get(CMessageHeader::HEADER_SIZE, nTypeIn, nVersionIn))
+{
+    in_data = false;
+    nHdrPos = 0;
+    nDataPos = 0;
+    nTime = 0;
+    fHashOffload = false;
+    fHashReady = true;
+}
+
+CNetMessage::~CNetMessage()
+{
+    recvBufferPool.Release(std::move(vRecv));
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
-    // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    // copy data to the parsing buffer
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    vRecv.insert(vRecv.end(), pch, pch + nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        vRecv >> hdr;
     }
     catch (const std::exception&) {
         return -1;
@@ -839,6 +945,22 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     if (hdr.nMessageSize > MAX_SIZE)
         return -1;
 
+    // Make room for the message data up front, from a bigger pooled buffer if
+    // needed. Large messages only get more memory as their data arrives.
+    vRecv.clear();
+    const size_t nPrealloc = std::min<size_t>(hdr.nMessageSize, MAX_RECV_PREALLOC);
+    if (vRecv.capacity() < nPrealloc) {
+        const int nType = vRecv.GetType();
+        const int nVersion = vRecv.GetVersion();
+        recvBufferPool.Release(std::move(vRecv));
+        vRecv = recvBufferPool.Get(nPrealloc, nType, nVersion);
+        vRecv.reserve(nPrealloc);
+    }
+
+    // Large messages are hashed once complete, away from the socket handler
+    fHashOffload = hdr.nMessageSize >= MIN_OFFLOAD_CHECKSUM_SIZE;
+    fHashReady = !fHashOffload;
+
     // switch state to reading message data
     in_data = true;
 
@@ -850,13 +972,14 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+    if (vRecv.capacity() < nDataPos + nCopy) {
+        // Grow geometrically, but never beyond the total message size
+        vRecv.reserve(std::min<size_t>(hdr.nMessageSize, std::max<size_t>(2 * vRecv.capacity(), nDataPos + nCopy)));
     }
 
-    hasher.Write((const unsigned char*)pch, nCopy);
-    memcpy(&vRecv[nDataPos], pch, nCopy);
+    if (!fHashOffload)
+        hasher.Write((const unsigned char*)pch, nCopy);
+    vRecv.insert(vRecv.end(), pch, pch + nCopy);
     nDataPos += nCopy;
 
     return nCopy;
@@ -864,12 +987,18 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 const uint256& CNetMessage::GetMessageHash() const
 {
-    assert(complete());
-    if (data_hash.IsNull())
+    assert(complete() && fHashReady);
+    if (!fHashOffload && data_hash.IsNull())
         hasher.Finalize(data_hash.begin());
     return data_hash;
 }
 
+void CNetMessage::ComputeMessageHash()
+{
+    assert(complete() && fHashOffload);
+    data_hash = Hash(vRecv.begin(), vRecv.end());
+}
+
 
 
 
@@ -881,30 +1010,55 @@ const uint256& CNetMessage::GetMessageHash() const
 // requires LOCK(cs_vSend)
 size_t CConnman::SocketSendData(CNode *pnode) const
 {
-    auto it = pnode->vSendMsg.begin();
     size_t nSentSize = 0;
 
-    while (it != pnode->vSendMsg.end()) {
-        const auto &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+    while (!pnode->vSendMsg.empty()) {
+        assert(pnode->vSendMsg.front()->size() > pnode->nSendOffset);
         int nBytes = 0;
         {
             LOCK(pnode->cs_hSocket);
             if (pnode->hSocket == INVALID_SOCKET)
                 break;
+#ifdef WIN32
+            const auto& data = *pnode->vSendMsg.front();
             nBytes = send(pnode->hSocket, reinterpret_cast<const char*>(data.data()) + pnode->nSendOffset, data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+            // Hand the queued buffers to the kernel in a single call, rather
+            // than one send() per buffer or copying them together first.
+            struct iovec iov[MAX_SEND_IOVECS];
+            int nIov = 0;
+            size_t nOffset = pnode->nSendOffset;
+            for (auto it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++it) {
+                iov[nIov].iov_base = const_cast<unsigned char*>((*it)->data()) + nOffset;
+                iov[nIov].iov_len = (*it)->size() - nOffset;
+                nIov++;
+                nOffset = 0;
+            }
+            struct msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = nIov;
+            nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         }
         if (nBytes > 0) {
             pnode->nLastSend = GetSystemTimeInSeconds();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             nSentSize += nBytes;
-            if (pnode->nSendOffset == data.size()) {
+            // Release the buffers that were sent in full
+            size_t nRemaining = nBytes;
+            while (nRemaining > 0) {
+                const size_t nBufferSize = pnode->vSendMsg.front()->size();
+                if (nRemaining < nBufferSize - pnode->nSendOffset) {
+                    pnode->nSendOffset += nRemaining;
+                    break;
+                }
+                nRemaining -= nBufferSize - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
-                it++;
-            } else {
+                pnode->nSendSize -= nBufferSize;
+                pnode->vSendMsg.pop_front();
+            }
+            pnode->fPauseSend = pnode->nSendSize > nSendBufferMaxSize;
+            if (pnode->nSendOffset != 0) {
                 // could not send full message; stop sending more
                 break;
             }
@@ -923,11 +1077,10 @@ size_t CConnman::SocketSendData(CNode *pnode) const
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
     return nSentSize;
 }
 
@@ -1146,12 +1299,22 @@ void CConnman::AcceptConnection(const ListenSocket& hListenSocket) {
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+#ifdef USE_EPOLL
+        RegisterNodeSocket(pnode);
+#endif
     }
 }
 
-void CConnman::ThreadSocketHandler()
+size_t CConnman::GetShard(const CNode* pnode) const
+{
+    return pnode->GetId() % vShards.size();
+}
+
+void CConnman::ThreadSocketHandler(size_t nShard)
 {
+    NetShard& shard = *vShards[nShard];
     unsigned int nPrevNodeCount = 0;
+    int64_t nLastInactivityCheck = 0;
     while (!interruptNet)
     {
         //
@@ -1163,7 +1326,7 @@ void CConnman::ThreadSocketHandler()
             std::vector<CNode*> vNodesCopy = vNodes;
             for (CNode* pnode : vNodesCopy)
             {
-                if (pnode->fDisconnect)
+                if (pnode->fDisconnect && GetShard(pnode) == nShard)
                 {
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
@@ -1176,13 +1339,13 @@ void CConnman::ThreadSocketHandler()
 
                     // hold in disconnected pool until all refs are released
                     pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
+                    shard.vNodesDisconnected.push_back(pnode);
                 }
             }
         }
         {
             // Delete disconnected nodes
-            std::list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+            std::list<CNode*> vNodesDisconnectedCopy = shard.vNodesDisconnected;
             for (CNode* pnode : vNodesDisconnectedCopy)
             {
                 // wait until threads are done using it
@@ -1198,7 +1361,7 @@ void CConnman::ThreadSocketHandler()
                         }
                     }
                     if (fDelete) {
-                        vNodesDisconnected.remove(pnode);
+                        shard.vNodesDisconnected.remove(pnode);
                         DeleteNode(pnode);
                     }
                 }
@@ -1209,249 +1372,418 @@ void CConnman::ThreadSocketHandler()
             LOCK(cs_vNodes);
             vNodesSize = vNodes.size();
         }
-        if(vNodesSize != nPrevNodeCount) {
+        if(nShard == 0 && vNodesSize != nPrevNodeCount) {
             nPrevNodeCount = vNodesSize;
             if(clientInterface)
                 clientInterface->NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+#ifdef USE_EPOLL
+        SocketHandlerEpoll(nShard);
+#else
+        SocketHandlerSelect(nShard);
+#endif
+        if (interruptNet)
+            return;
+
         //
-        // Find which sockets have data to receive
+        // Inactivity checking
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
+        int64_t nTime = GetSystemTimeInSeconds();
+        if (nTime != nLastInactivityCheck) {
+            nLastInactivityCheck = nTime;
+            LOCK(cs_vNodes);
+            for (CNode* pnode : vNodes) {
+                if (GetShard(pnode) == nShard)
+                    InactivityCheck(pnode, nTime);
+            }
+        }
+    }
+}
 
+void CConnman::SocketHandlerSelect(size_t nShard)
+{
+    //
+    // Find which sockets have data to receive
+    //
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SELECT_TIMEOUT_MILLISECONDS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    if (nShard == 0) {
         for (const ListenSocket& hListenSocket : vhListenSocket) {
             FD_SET(hListenSocket.socket, &fdsetRecv);
             hSocketMax = std::max(hSocketMax, hListenSocket.socket);
             have_fds = true;
         }
+    }
 
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes)
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodes)
+            if (GetShard(pnode) != nShard)
+                continue;
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is space left in the receive buffer, select() for
+            //   receiving data.
+            // * Hand off all complete messages to the processor, to be handled without
+            //   blocking here.
+
+            bool select_recv = !pnode->fPauseRecv;
+            bool select_send;
             {
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is space left in the receive buffer, select() for
-                //   receiving data.
-                // * Hand off all complete messages to the processor, to be handled without
-                //   blocking here.
-
-                bool select_recv = !pnode->fPauseRecv;
-                bool select_send;
-                {
-                    LOCK(pnode->cs_vSend);
-                    select_send = !pnode->vSendMsg.empty();
-                }
+                LOCK(pnode->cs_vSend);
+                select_send = !pnode->vSendMsg.empty();
+            }
 
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
 
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
 
-                if (select_send) {
-                    FD_SET(pnode->hSocket, &fdsetSend);
-                    continue;
-                }
-                if (select_recv) {
-                    FD_SET(pnode->hSocket, &fdsetRecv);
-                }
+            if (select_send) {
+                FD_SET(pnode->hSocket, &fdsetSend);
+                continue;
+            }
+            if (select_recv) {
+                FD_SET(pnode->hSocket, &fdsetRecv);
             }
         }
+    }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        if (interruptNet)
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    if (interruptNet)
+        return;
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        if (!interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS)))
             return;
+    }
 
-        if (nSelect == SOCKET_ERROR)
+    //
+    // Accept new connections
+    //
+    for (const ListenSocket& hListenSocket : vhListenSocket)
+    {
+        if (nShard == 0 && hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
         {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
+            AcceptConnection(hListenSocket);
+        }
+    }
+
+    //
+    // Service each socket
+    //
+    std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodes) {
+            if (GetShard(pnode) == nShard) {
+                pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            if (!interruptNet.sleep_for(std::chrono::milliseconds(timeout.tv_usec/1000)))
-                return;
         }
+    }
+    for (CNode* pnode : vNodesCopy)
+    {
+        if (interruptNet)
+            break;
 
-        //
-        // Accept new connections
-        //
-        for (const ListenSocket& hListenSocket : vhListenSocket)
+        bool recvSet = false;
+        bool sendSet = false;
+        bool errorSet = false;
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
-            {
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
+            sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
+            errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
+        }
+        ServiceNodeSocket(pnode, recvSet, sendSet, errorSet);
+    }
+    {
+        LOCK(cs_vNodes);
+        for (CNode* pnode : vNodesCopy)
+            pnode->Release();
+    }
+}
+
+#ifdef USE_EPOLL
+/** Events the socket handler waits on for pnode, following the same logic as
+ *  SocketHandlerSelect(): drain a non-empty send queue before receiving more,
+ *  and only receive while fPauseRecv is unset. Errors and hangups are always
+ *  reported by epoll. Requires LOCK(cs_vSend). */
+static int GetSocketEvents(const CNode* pnode)
+{
+    if (!pnode->vSendMsg.empty())
+        return EPOLLOUT;
+    if (!pnode->fPauseRecv)
+        return EPOLLIN;
+    return 0;
+}
+
+void CConnman::RegisterNodeSocket(CNode* pnode)
+{
+    if (vShards.empty())
+        return;
+    const int epollfd = vShards[GetShard(pnode)]->epollfd;
+    LOCK2(pnode->cs_vSend, pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event = {};
+    event.events = GetSocketEvents(pnode);
+    event.data.ptr = pnode;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("socket epoll_ctl error %s, disconnecting peer=%d\n", NetworkErrorString(WSAGetLastError()), pnode->GetId());
+        pnode->fDisconnect = true;
+        return;
+    }
+    pnode->nSocketEvents = event.events;
+}
+#endif
+
+void CConnman::UpdateSocketEvents(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (vShards.empty())
+        return;
+    const int epollfd = vShards[GetShard(pnode)]->epollfd;
+    LOCK2(pnode->cs_vSend, pnode->cs_hSocket);
+    if (pnode->hSocket == INVALID_SOCKET || pnode->nSocketEvents == -1)
+        return;
+    struct epoll_event event = {};
+    event.events = GetSocketEvents(pnode);
+    event.data.ptr = pnode;
+    if ((int)event.events == pnode->nSocketEvents)
+        return;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, pnode->hSocket, &event) == SOCKET_ERROR) {
+        LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        return;
+    }
+    pnode->nSocketEvents = event.events;
+#endif
+}
+
+#ifdef USE_EPOLL
+void CConnman::SocketHandlerEpoll(size_t nShard)
+{
+    // Sockets stay registered for their whole lifetime and are only
+    // re-armed through UpdateSocketEvents() when their interest changes, so a
+    // wait costs time proportional to the number of ready sockets. Queueing a
+    // message that cannot be sent optimistically arms EPOLLOUT, which wakes
+    // this thread immediately rather than after the timeout.
+    struct epoll_event events[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(vShards[nShard]->epollfd, events, MAX_SOCKET_EVENTS, SELECT_TIMEOUT_MILLISECONDS);
+    if (interruptNet)
+        return;
+
+    if (nEvents == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            interruptNet.sleep_for(std::chrono::milliseconds(SELECT_TIMEOUT_MILLISECONDS));
+        }
+        return;
+    }
+
+    // Listening sockets are registered with a pointer to their entry in
+    // vhListenSocket, peers with a pointer to their CNode. Nodes are only
+    // deleted by the socket handler of their own shard, that is this
+    // thread, so the pointers are valid until the loop comes around again.
+    std::vector<std::pair<CNode*, uint32_t>> vReady;
+    vReady.reserve(nEvents);
+    for (int i = 0; i < nEvents; i++) {
+        bool fListen = false;
+        for (const ListenSocket& hListenSocket : vhListenSocket) {
+            if (events[i].data.ptr == &hListenSocket) {
                 AcceptConnection(hListenSocket);
+                fListen = true;
+                break;
             }
         }
+        if (!fListen)
+            vReady.emplace_back(static_cast<CNode*>(events[i].data.ptr), uint32_t{events[i].events});
+    }
 
-        //
-        // Service each socket
-        //
-        std::vector<CNode*> vNodesCopy;
+    {
+        LOCK(cs_vNodes);
+        for (const auto& ready : vReady)
+            ready.first->AddRef();
+    }
+    for (const auto& ready : vReady)
+    {
+        if (interruptNet)
+            break;
+        ServiceNodeSocket(ready.first, ready.second & EPOLLIN, ready.second & EPOLLOUT, ready.second & (EPOLLERR | EPOLLHUP));
+    }
+    {
+        LOCK(cs_vNodes);
+        for (const auto& ready : vReady)
+            ready.first->Release();
+    }
+}
+#endif
+
+void CConnman::ServiceNodeSocket(CNode* pnode, bool recvSet, bool sendSet, bool errorSet)
+{
+    //
+    // Receive
+    //
+    if (recvSet || errorSet)
+    {
+        // typical socket buffer is 8K-64K
+        char pchBuf[0x10000];
+        int nBytes = 0;
         {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy)
-                pnode->AddRef();
+            LOCK(pnode->cs_hSocket);
+            if (pnode->hSocket == INVALID_SOCKET)
+                return;
+            nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
         }
-        for (CNode* pnode : vNodesCopy)
+        if (nBytes > 0)
         {
-            if (interruptNet)
-                return;
-
-            //
-            // Receive
-            //
-            bool recvSet = false;
-            bool sendSet = false;
-            bool errorSet = false;
-            {
-                LOCK(pnode->cs_hSocket);
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                recvSet = FD_ISSET(pnode->hSocket, &fdsetRecv);
-                sendSet = FD_ISSET(pnode->hSocket, &fdsetSend);
-                errorSet = FD_ISSET(pnode->hSocket, &fdsetError);
-            }
-            if (recvSet || errorSet)
-            {
-                // typical socket buffer is 8K-64K
-                char pchBuf[0x10000];
-                int nBytes = 0;
-                {
-                    LOCK(pnode->cs_hSocket);
-                    if (pnode->hSocket == INVALID_SOCKET)
-                        continue;
-                    nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                }
-                if (nBytes > 0)
-                {
-                    bool notify = false;
-                    if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
-                        pnode->CloseSocketDisconnect();
-                    RecordBytesRecv(nBytes);
-                    if (notify) {
-                        size_t nSizeAdded = 0;
-                        auto it(pnode->vRecvMsg.begin());
-                        for (; it != pnode->vRecvMsg.end(); ++it) {
-                            if (!it->complete())
-                                break;
-                            nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
-                        }
-                        {
-                            LOCK(pnode->cs_vProcessMsg);
-                            pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
-                            pnode->nProcessQueueSize += nSizeAdded;
-                            pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
-                        }
-                        WakeMessageHandler();
-                    }
-                }
-                else if (nBytes == 0)
-                {
-                    // socket closed gracefully
-                    if (!pnode->fDisconnect) {
-                        LogPrint(BCLog::NET, "socket closed\n");
-                    }
-                    pnode->CloseSocketDisconnect();
+            bool notify = false;
+            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, notify))
+                pnode->CloseSocketDisconnect();
+            RecordBytesRecv(nBytes);
+            if (notify) {
+                size_t nSizeAdded = 0;
+                std::vector<CNetMessage*> vHashMsgs;
+                auto it(pnode->vRecvMsg.begin());
+                for (; it != pnode->vRecvMsg.end(); ++it) {
+                    if (!it->complete())
+                        break;
+                    nSizeAdded += it->vRecv.size() + CMessageHeader::HEADER_SIZE;
+                    if (it->fHashOffload)
+                        vHashMsgs.push_back(&*it);
                 }
-                else if (nBytes < 0)
                 {
-                    // error
-                    int nErr = WSAGetLastError();
-                    if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                    {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                        pnode->CloseSocketDisconnect();
-                    }
+                    LOCK(pnode->cs_vProcessMsg);
+                    pnode->vProcessMsg.splice(pnode->vProcessMsg.end(), pnode->vRecvMsg, pnode->vRecvMsg.begin(), it);
+                    pnode->nProcessQueueSize += nSizeAdded;
+                    pnode->fPauseRecv = pnode->nProcessQueueSize > nReceiveFloodSize;
                 }
+                if (pnode->fPauseRecv)
+                    UpdateSocketEvents(pnode);
+                if (!vHashMsgs.empty())
+                    QueueMessageChecksums(pnode, vHashMsgs);
+                WakeMessageHandler(GetShard(pnode));
             }
-
-            //
-            // Send
-            //
-            if (sendSet)
-            {
-                LOCK(pnode->cs_vSend);
-                size_t nBytes = SocketSendData(pnode);
-                if (nBytes) {
-                    RecordBytesSent(nBytes);
-                }
+        }
+        else if (nBytes == 0)
+        {
+            // socket closed gracefully
+            if (!pnode->fDisconnect) {
+                LogPrint(BCLog::NET, "socket closed\n");
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetSystemTimeInSeconds();
-            if (nTime - pnode->nTimeConnected > 60)
+            pnode->CloseSocketDisconnect();
+        }
+        else if (nBytes < 0)
+        {
+            // error
+            int nErr = WSAGetLastError();
+            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-                else if (!pnode->fSuccessfullyConnected)
-                {
-                    LogPrintf("version handshake timeout from %d\n", pnode->GetId());
-                    pnode->fDisconnect = true;
-                }
+                if (!pnode->fDisconnect)
+                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+                pnode->CloseSocketDisconnect();
             }
         }
+    }
+
+    //
+    // Send
+    //
+    if (sendSet)
+    {
+        LOCK(pnode->cs_vSend);
+        size_t nBytes = SocketSendData(pnode);
+        if (nBytes) {
+            RecordBytesSent(nBytes);
+        }
+        if (pnode->vSendMsg.empty())
+            UpdateSocketEvents(pnode);
+    }
+}
+
+void CConnman::InactivityCheck(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint(BCLog::NET, "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->GetId());
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
         {
-            LOCK(cs_vNodes);
-            for (CNode* pnode : vNodesCopy)
-                pnode->Release();
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+        else if (!pnode->fSuccessfullyConnected)
+        {
+            LogPrintf("version handshake timeout from %d\n", pnode->GetId());
+            pnode->fDisconnect = true;
         }
     }
 }
 
 void CConnman::WakeMessageHandler()
 {
+    for (size_t nShard = 0; nShard < vShards.size(); nShard++)
+        WakeMessageHandler(nShard);
+}
+
+void CConnman::WakeMessageHandler(size_t nShard)
+{
+    NetShard& shard = *vShards[nShard];
     {
         std::lock_guard<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = true;
+        shard.fMsgProcWake = true;
     }
-    condMsgProc.notify_one();
+    shard.condMsgProc.notify_one();
 }
 
 
@@ -1990,24 +2322,39 @@ void CConnman::OpenNetworkConnection(const CAddress& addrConnect, bool fCountFai
     {
         LOCK(cs_vNodes);
         vNodes.push_back(pnode);
+#ifdef USE_EPOLL
+        RegisterNodeSocket(pnode);
+#endif
     }
 }
 
-void CConnman::ThreadMessageHandler()
+void CConnman::ThreadMessageHandler(size_t nShard)
 {
+    NetShard& shard = *vShards[nShard];
     while (!flagInterruptMsgProc)
     {
+        // Message handlers of different shards run concurrently; anything
+        // needing cs_main serializes on it, while messages that do not (ping,
+        // addr, feefilter, getdata for the most recent block, ...) are
+        // processed in parallel. A node's messages are only ever processed by
+        // its own shard, so they are still handled in order.
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            for (CNode* pnode : vNodesCopy) {
-                pnode->AddRef();
+            for (CNode* pnode : vNodes) {
+                if (GetShard(pnode) == nShard) {
+                    pnode->AddRef();
+                    vNodesCopy.push_back(pnode);
+                }
             }
         }
 
         bool fMoreWork = false;
 
+        m_msgproc->PrepareMessages(vNodesCopy, flagInterruptMsgProc);
+        if (flagInterruptMsgProc)
+            return;
+
         for (CNode* pnode : vNodesCopy)
         {
             if (pnode->fDisconnect)
@@ -2036,9 +2383,51 @@ void CConnman::ThreadMessageHandler()
 
         std::unique_lock<std::mutex> lock(mutexMsgProc);
         if (!fMoreWork) {
-            condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [this] { return fMsgProcWake; });
+            shard.condMsgProc.wait_until(lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(100), [&shard] { return shard.fMsgProcWake; });
         }
-        fMsgProcWake = false;
+        shard.fMsgProcWake = false;
+    }
+}
+
+void CConnman::QueueMessageChecksums(CNode* pnode, const std::vector<CNetMessage*>& vMsgs)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutexChecksum);
+        for (CNetMessage* pmsg : vMsgs) {
+            pnode->AddRef();
+            vChecksumQueue.emplace_back(pnode, pmsg);
+        }
+    }
+    if (vMsgs.size() > 1)
+        condChecksum.notify_all();
+    else
+        condChecksum.notify_one();
+}
+
+void CConnman::ThreadMessageChecksum()
+{
+    while (true)
+    {
+        CNode* pnode;
+        CNetMessage* pmsg;
+        {
+            std::unique_lock<std::mutex> lock(mutexChecksum);
+            condChecksum.wait(lock, [this] { return flagInterruptMsgProc || !vChecksumQueue.empty(); });
+            if (flagInterruptMsgProc)
+                return;
+            std::tie(pnode, pmsg) = vChecksumQueue.front();
+            vChecksumQueue.pop_front();
+        }
+
+        // The message stays at its place in vProcessMsg meanwhile, and
+        // ProcessMessages does not take it before it is marked ready.
+        pmsg->ComputeMessageHash();
+        {
+            LOCK(pnode->cs_vProcessMsg);
+            pmsg->fHashReady = true;
+        }
+        WakeMessageHandler(GetShard(pnode));
+        pnode->Release();
     }
 }
 
@@ -2270,6 +2659,32 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         return false;
     }
 
+    vShards.clear();
+    for (int i = 0; i < nNetThreads; i++) {
+        vShards.emplace_back(new NetShard());
+#ifdef USE_EPOLL
+        vShards.back()->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (vShards.back()->epollfd == -1) {
+            if (clientInterface) {
+                clientInterface->ThreadSafeMessageBox(
+                    strprintf(_("Failed to create epoll instance: %s"), NetworkErrorString(WSAGetLastError())),
+                    "", CClientUIInterface::MSG_ERROR);
+            }
+            return false;
+        }
+#endif
+    }
+#ifdef USE_EPOLL
+    for (ListenSocket& hListenSocket : vhListenSocket) {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = &hListenSocket;
+        if (epoll_ctl(vShards[0]->epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) == SOCKET_ERROR) {
+            LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+        }
+    }
+#endif
+
     for (const auto& strDest : connOptions.vSeedNodes) {
         AddOneShot(strDest);
     }
@@ -2329,13 +2744,11 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
     interruptNet.reset();
     flagInterruptMsgProc = false;
 
-    {
-        std::unique_lock<std::mutex> lock(mutexMsgProc);
-        fMsgProcWake = false;
-    }
-
     // Send and receive from sockets, accept connections
-    threadSocketHandler = std::thread(&TraceThread<std::function<void()> >, "net", std::function<void()>(std::bind(&CConnman::ThreadSocketHandler, this)));
+    for (size_t nShard = 0; nShard < vShards.size(); nShard++) {
+        std::string strName = nShard == 0 ? "net" : strprintf("net.%d", nShard);
+        vShards[nShard]->threadSocketHandler = std::thread([this, nShard, strName] { TraceThread(strName.c_str(), std::bind(&CConnman::ThreadSocketHandler, this, nShard)); });
+    }
 
     if (!gArgs.GetBoolArg("-dnsseed", true))
         LogPrintf("DNS seeding disabled\n");
@@ -2357,7 +2770,17 @@ bool CConnman::Start(CScheduler& scheduler, const Options& connOptions)
         threadOpenConnections = std::thread(&TraceThread<std::function<void()> >, "opencon", std::function<void()>(std::bind(&CConnman::ThreadOpenConnections, this, connOptions.m_specified_outgoing)));
 
     // Process messages
-    threadMessageHandler = std::thread(&TraceThread<std::function<void()> >, "msghand", std::function<void()>(std::bind(&CConnman::ThreadMessageHandler, this)));
+    for (size_t nShard = 0; nShard < vShards.size(); nShard++) {
+        std::string strName = nShard == 0 ? "msghand" : strprintf("msghand.%d", nShard);
+        vShards[nShard]->threadMessageHandler = std::thread([this, nShard, strName] { TraceThread(strName.c_str(), std::bind(&CConnman::ThreadMessageHandler, this, nShard)); });
+    }
+    // Hash large received messages, one checksum thread per shard
+    for (size_t nShard = 0; nShard < vShards.size(); nShard++) {
+        std::string strName = nShard == 0 ? "nethash" : strprintf("nethash.%d", nShard);
+        threadMessageChecksum.emplace_back([this, strName] { TraceThread(strName.c_str(), std::bind(&CConnman::ThreadMessageChecksum, this)); });
+    }
+    if (vShards.size() > 1)
+        LogPrintf("Using %u network threads\n", vShards.size());
 
     // Dump network addresses
     scheduler.scheduleEvery(std::bind(&CConnman::DumpData, this), DUMP_ADDRESSES_INTERVAL * 1000);
@@ -2386,7 +2809,14 @@ void CConnman::Interrupt()
         std::lock_guard<std::mutex> lock(mutexMsgProc);
         flagInterruptMsgProc = true;
     }
-    condMsgProc.notify_all();
+    for (const auto& shard : vShards)
+        shard->condMsgProc.notify_all();
+    {
+        // Checksum threads wait on their own mutex; take it so that none of
+        // them misses the interrupt between checking for it and waiting.
+        std::lock_guard<std::mutex> lock(mutexChecksum);
+    }
+    condChecksum.notify_all();
 
     interruptNet();
     InterruptSocks5(true);
@@ -2406,16 +2836,26 @@ void CConnman::Interrupt()
 
 void CConnman::Stop()
 {
-    if (threadMessageHandler.joinable())
-        threadMessageHandler.join();
+    for (const auto& shard : vShards) {
+        if (shard->threadMessageHandler.joinable())
+            shard->threadMessageHandler.join();
+    }
+    for (std::thread& thread : threadMessageChecksum)
+        thread.join();
+    threadMessageChecksum.clear();
+    for (const auto& job : vChecksumQueue)
+        job.first->Release();
+    vChecksumQueue.clear();
     if (threadOpenConnections.joinable())
         threadOpenConnections.join();
     if (threadOpenAddedConnections.joinable())
         threadOpenAddedConnections.join();
     if (threadDNSAddressSeed.joinable())
         threadDNSAddressSeed.join();
-    if (threadSocketHandler.joinable())
-        threadSocketHandler.join();
+    for (const auto& shard : vShards) {
+        if (shard->threadSocketHandler.joinable())
+            shard->threadSocketHandler.join();
+    }
 
     if (fAddressesInitialized)
     {
@@ -2435,11 +2875,17 @@ void CConnman::Stop()
     for (CNode *pnode : vNodes) {
         DeleteNode(pnode);
     }
-    for (CNode *pnode : vNodesDisconnected) {
-        DeleteNode(pnode);
+    for (const auto& shard : vShards) {
+        for (CNode *pnode : shard->vNodesDisconnected) {
+            DeleteNode(pnode);
+        }
+#ifdef USE_EPOLL
+        if (shard->epollfd != -1)
+            close(shard->epollfd);
+#endif
     }
     vNodes.clear();
-    vNodesDisconnected.clear();
+    vShards.clear();
     vhListenSocket.clear();
     semOutbound.reset();
     semAddnode.reset();
@@ -2742,6 +3188,9 @@ CNode::CNode(NodeId idIn, ServiceFlags nLocalServicesIn, int nMyStartingHeightIn
     nextSendTimeFeeFilter = 0;
     fPauseRecv = false;
     fPauseSend = false;
+#ifdef USE_EPOLL
+    nSocketEvents = -1;
+#endif
     nProcessQueueSize = 0;
 
     for (const std::string &msg : getAllNetMessageTypes())
@@ -2799,19 +3248,48 @@ bool CConnman::NodeFullyConnected(const CNode* pnode)
     return pnode && pnode->fSuccessfullyConnected && !pnode->fDisconnect;
 }
 
-void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+/** Serialize the header of a message with the given payload */
+static std::vector<unsigned char> SerializeMessageHeader(const std::string& command, const std::vector<unsigned char>& data)
 {
-    size_t nMessageSize = msg.data.size();
-    size_t nTotalSize = nMessageSize + CMessageHeader::HEADER_SIZE;
-    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
-
     std::vector<unsigned char> serializedHeader;
     serializedHeader.reserve(CMessageHeader::HEADER_SIZE);
-    uint256 hash = Hash(msg.data.data(), msg.data.data() + nMessageSize);
-    CMessageHeader hdr(Params().MessageStart(), msg.command.c_str(), nMessageSize);
+    uint256 hash = Hash(data.data(), data.data() + data.size());
+    CMessageHeader hdr(Params().MessageStart(), command.c_str(), data.size());
     memcpy(hdr.pchChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
 
     CVectorWriter{SER_NETWORK, INIT_PROTO_VERSION, serializedHeader, 0, hdr};
+    return serializedHeader;
+}
+
+CSharedNetMsg::CSharedNetMsg(CSerializedNetMsg&& msg) : command(std::move(msg.command))
+{
+    std::vector<unsigned char> serialized = SerializeMessageHeader(command, msg.data);
+    serialized.insert(serialized.end(), msg.data.begin(), msg.data.end());
+    data = std::make_shared<const std::vector<unsigned char>>(std::move(serialized));
+}
+
+void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
+{
+    size_t nMessageSize = msg.data.size();
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), nMessageSize, pnode->GetId());
+
+    CSendBufferRef header = std::make_shared<const std::vector<unsigned char>>(SerializeMessageHeader(msg.command, msg.data));
+    CSendBufferRef payload;
+    if (nMessageSize)
+        payload = std::make_shared<const std::vector<unsigned char>>(std::move(msg.data));
+    QueueSendBuffers(pnode, msg.command, std::move(header), std::move(payload));
+}
+
+void CConnman::PushMessage(CNode* pnode, const CSharedNetMsg& msg)
+{
+    LogPrint(BCLog::NET, "sending %s (%d bytes) peer=%d\n",  SanitizeString(msg.command.c_str()), msg.data->size() - CMessageHeader::HEADER_SIZE, pnode->GetId());
+
+    QueueSendBuffers(pnode, msg.command, msg.data, nullptr);
+}
+
+void CConnman::QueueSendBuffers(CNode* pnode, const std::string& command, CSendBufferRef header, CSendBufferRef payload)
+{
+    size_t nTotalSize = header->size() + (payload ? payload->size() : 0);
 
     size_t nBytesSent = 0;
     {
@@ -2819,18 +3297,22 @@ void CConnman::PushMessage(CNode* pnode, CSerializedNetMsg&& msg)
         bool optimisticSend(pnode->vSendMsg.empty());
 
         //log total amount of bytes per command
-        pnode->mapSendBytesPerMsgCmd[msg.command] += nTotalSize;
+        pnode->mapSendBytesPerMsgCmd[command] += nTotalSize;
         pnode->nSendSize += nTotalSize;
 
         if (pnode->nSendSize > nSendBufferMaxSize)
             pnode->fPauseSend = true;
-        pnode->vSendMsg.push_back(std::move(serializedHeader));
-        if (nMessageSize)
-            pnode->vSendMsg.push_back(std::move(msg.data));
+        pnode->vSendMsg.push_back(std::move(header));
+        if (payload)
+            pnode->vSendMsg.push_back(std::move(payload));
 
         // If write queue empty, attempt "optimistic write"
-        if (optimisticSend == true)
+        if (optimisticSend == true) {
             nBytesSent = SocketSendData(pnode);
+            // Have the socket handler finish sending what did not fit
+            if (!pnode->vSendMsg.empty())
+                UpdateSocketEvents(pnode);
+        }
     }
     if (nBytesSent)
         RecordBytesSent(nBytesSent);
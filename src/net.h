@@ -35,6 +35,7 @@
 
 
 class CScheduler;
+class CNetMessage;
 class CNode;
 
 namespace boost {
@@ -83,6 +84,10 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -netthreads default: number of socket and message handler thread pairs */
+static const int DEFAULT_NET_THREADS = 1;
+/** Maximum number of socket and message handler thread pairs */
+static const int MAX_NET_THREADS = 16;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
@@ -113,6 +118,22 @@ struct CSerializedNetMsg
     std::string command;
 };
 
+/** Immutable, reference counted buffer queued for sending to a peer */
+typedef std::shared_ptr<const std::vector<unsigned char>> CSendBufferRef;
+
+/**
+ * A serialized message including its header. It is immutable, so it can be
+ * queued for any number of peers without copying, e.g. to send a new block
+ * to every peer asking for it.
+ */
+struct CSharedNetMsg
+{
+    explicit CSharedNetMsg(CSerializedNetMsg&& msg);
+
+    std::string command;
+    CSendBufferRef data;
+};
+
 class NetEventsInterface;
 class CConnman
 {
@@ -132,6 +153,7 @@ public:
         int nMaxOutbound = 0;
         int nMaxAddnode = 0;
         int nMaxFeeler = 0;
+        int nNetThreads = DEFAULT_NET_THREADS;
         int nBestHeight = 0;
         CClientUIInterface* uiInterface = nullptr;
         NetEventsInterface* m_msgproc = nullptr;
@@ -153,6 +175,7 @@ public:
         nMaxOutbound = std::min(connOptions.nMaxOutbound, connOptions.nMaxConnections);
         nMaxAddnode = connOptions.nMaxAddnode;
         nMaxFeeler = connOptions.nMaxFeeler;
+        nNetThreads = std::max(1, std::min(connOptions.nNetThreads, MAX_NET_THREADS));
         nBestHeight = connOptions.nBestHeight;
         clientInterface = connOptions.uiInterface;
         m_msgproc = connOptions.m_msgproc;
@@ -183,6 +206,11 @@ public:
     bool ForNode(NodeId id, std::function<bool(CNode* pnode)> func);
 
     void PushMessage(CNode* pnode, CSerializedNetMsg&& msg);
+    void PushMessage(CNode* pnode, const CSharedNetMsg& msg);
+
+    /** Bring the socket events the socket handler waits on for pnode in line
+     *  with its send queue and fPauseRecv. Only does work with epoll. */
+    void UpdateSocketEvents(CNode* pnode);
 
     template<typename Callable>
     void ForEachNode(Callable&& func)
@@ -322,6 +350,29 @@ private:
         ListenSocket(SOCKET socket_, bool whitelisted_) : socket(socket_), whitelisted(whitelisted_) {}
     };
 
+    /**
+     * State of one socket handler and message handler thread pair. Every
+     * node is owned by the shard GetShard() picks for it: only that shard's
+     * threads service its socket, process its messages and delete it once it
+     * has been disconnected. Listening sockets belong to shard 0.
+     */
+    struct NetShard {
+#ifdef USE_EPOLL
+        /** epoll instance the shard's sockets are registered with */
+        int epollfd = -1;
+#endif
+        std::list<CNode*> vNodesDisconnected;
+
+        /** flag for waking the message processor, protected by mutexMsgProc */
+        bool fMsgProcWake = false;
+        std::condition_variable condMsgProc;
+
+        std::thread threadSocketHandler;
+        std::thread threadMessageHandler;
+    };
+
+    size_t GetShard(const CNode* pnode) const;
+
     bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
     bool Bind(const CService &addr, unsigned int flags);
     bool InitBinds(const std::vector<CService>& binds, const std::vector<CService>& whiteBinds);
@@ -329,9 +380,19 @@ private:
     void AddOneShot(const std::string& strDest);
     void ProcessOneShot();
     void ThreadOpenConnections(std::vector<std::string> connect);
-    void ThreadMessageHandler();
+    void ThreadMessageHandler(size_t nShard);
+    void WakeMessageHandler(size_t nShard);
+    void ThreadMessageChecksum();
+    void QueueMessageChecksums(CNode* pnode, const std::vector<CNetMessage*>& vMsgs);
     void AcceptConnection(const ListenSocket& hListenSocket);
-    void ThreadSocketHandler();
+    void ThreadSocketHandler(size_t nShard);
+    void SocketHandlerSelect(size_t nShard);
+#ifdef USE_EPOLL
+    void SocketHandlerEpoll(size_t nShard);
+    void RegisterNodeSocket(CNode* pnode);
+#endif
+    void ServiceNodeSocket(CNode* pnode, bool recvSet, bool sendSet, bool errorSet);
+    void InactivityCheck(CNode* pnode, int64_t nTime);
     void ThreadDNSAddressSeed();
 
     uint64_t CalculateKeyedNetGroup(const CAddress& ad) const;
@@ -350,6 +411,7 @@ private:
     NodeId GetNewNodeId();
 
     size_t SocketSendData(CNode *pnode) const;
+    void QueueSendBuffers(CNode* pnode, const std::string& command, CSendBufferRef header, CSendBufferRef payload);
     //!check is the banlist has unwritten changes
     bool BannedSetIsDirty();
     //!set the "dirty" flag for the banlist
@@ -398,7 +460,6 @@ private:
     std::vector<std::string> vAddedNodes GUARDED_BY(cs_vAddedNodes);
     CCriticalSection cs_vAddedNodes;
     std::vector<CNode*> vNodes;
-    std::list<CNode*> vNodesDisconnected;
     mutable CCriticalSection cs_vNodes;
     std::atomic<NodeId> nLastNodeId;
 
@@ -411,6 +472,7 @@ private:
     int nMaxOutbound;
     int nMaxAddnode;
     int nMaxFeeler;
+    int nNetThreads;
     std::atomic<int> nBestHeight;
     CClientUIInterface* clientInterface;
     NetEventsInterface* m_msgproc;
@@ -418,20 +480,27 @@ private:
     /** SipHasher seeds for deterministic randomness */
     const uint64_t nSeed0, nSeed1;
 
-    /** flag for waking the message processor. */
-    bool fMsgProcWake;
-
-    std::condition_variable condMsgProc;
     std::mutex mutexMsgProc;
     std::atomic<bool> flagInterruptMsgProc;
 
     CThreadInterrupt interruptNet;
 
+    /** Socket and message handler thread pairs, created by Start() */
+    std::vector<std::unique_ptr<NetShard>> vShards;
+
+    /**
+     * Large received messages waiting for a checksum thread to hash them, so
+     * that socket handlers never spend their time hashing. The node is
+     * referenced until its message is done. Protected by mutexChecksum.
+     */
+    std::deque<std::pair<CNode*, CNetMessage*>> vChecksumQueue;
+    std::mutex mutexChecksum;
+    std::condition_variable condChecksum;
+    std::vector<std::thread> threadMessageChecksum;
+
     std::thread threadDNSAddressSeed;
-    std::thread threadSocketHandler;
     std::thread threadOpenAddedConnections;
     std::thread threadOpenConnections;
-    std::thread threadMessageHandler;
 
     /** flag for deciding to connect to an extra outbound peer,
      *  in excess of nMaxOutbound
@@ -467,6 +536,7 @@ struct CombinerAll
 class NetEventsInterface
 {
 public:
+    virtual void PrepareMessages(const std::vector<CNode*>& nodes, std::atomic<bool>& interrupt) = 0;
     virtual bool ProcessMessages(CNode* pnode, std::atomic<bool>& interrupt) = 0;
     virtual bool SendMessages(CNode* pnode, std::atomic<bool>& interrupt) = 0;
     virtual void InitializeNode(CNode* pnode) = 0;
@@ -560,22 +630,21 @@ private:
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // partially received header, then received message data
     unsigned int nDataPos;
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), hdr(pchMessageStartIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
-        in_data = false;
-        nHdrPos = 0;
-        nDataPos = 0;
-        nTime = 0;
-    }
+    bool fHashOffload;              // checksum computed by a checksum thread instead of while reading
+    bool fHashReady;                // checksum known; set under the node's cs_vProcessMsg once offloaded
+
+    CNetMessage(const CMessageHeader::MessageStartChars& pchMessageStartIn, int nTypeIn, int nVersionIn);
+    CNetMessage(CNetMessage&&) = default;
+    CNetMessage& operator=(CNetMessage&&) = default;
+    ~CNetMessage();
 
     bool complete() const
     {
@@ -585,10 +654,11 @@ public:
     }
 
     const uint256& GetMessageHash() const;
+    /** Compute the checksum of a complete offloaded message in one pass */
+    void ComputeMessageHash();
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
@@ -608,7 +678,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<std::vector<unsigned char>> vSendMsg;
+    std::deque<CSendBufferRef> vSendMsg;
     CCriticalSection cs_vSend;
     CCriticalSection cs_hSocket;
     CCriticalSection cs_vRecv;
@@ -660,6 +730,10 @@ public:
     const uint64_t nKeyedNetGroup;
     std::atomic_bool fPauseRecv;
     std::atomic_bool fPauseSend;
+#ifdef USE_EPOLL
+    // epoll events hSocket is registered for, or -1 if it is not registered
+    int nSocketEvents; //protected by cs_hSocket
+#endif
 protected:
 
     mapMsgCmdSize mapSendBytesPerMsgCmd;
@@ -670,8 +744,9 @@ public:
     std::atomic<int> nStartingHeight;
 
     // flood relay
-    std::vector<CAddress> vAddrToSend;
-    CRollingBloomFilter addrKnown;
+    CCriticalSection cs_addrSend;
+    std::vector<CAddress> vAddrToSend; //protected by cs_addrSend
+    CRollingBloomFilter addrKnown; //protected by cs_addrSend
     bool fGetAddr;
     std::set<uint256> setKnown;
     int64_t nNextAddrSend;
@@ -679,7 +754,9 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
-    // Set of transaction ids we still have to announce.
+    // Set of transaction ids we still have to announce to this peer alone.
+    // Transactions relayed to all peers go through a queue shared between
+    // them in net_processing instead.
     // They are sorted by the mempool before relay, so the order is not important.
     std::set<uint256> setInventoryTxToSend;
     // List of block ids we still have announce.
@@ -792,6 +869,7 @@ public:
 
     void AddAddressKnown(const CAddress& _addr)
     {
+        LOCK(cs_addrSend);
         addrKnown.insert(_addr.GetKey());
     }
 
@@ -800,6 +878,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrSend);
         if (_addr.IsValid() && !addrKnown.contains(_addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand.randrange(vAddrToSend.size())] = _addr;
@@ -8,9 +8,11 @@
 #include <addrman.h>
 #include <arith_uint256.h>
 #include <blockencodings.h>
+#include <blockmsgcache.h>
 #include <chainparams.h>
 #include <consensus/validation.h>
 #include <hash.h>
+#include <index/blockfilterindex.h>
 #include <init.h>
 #include <validation.h>
 #include <merkleblock.h>
@@ -24,7 +26,9 @@
 #include <reverse_iterator.h>
 #include <scheduler.h>
 #include <tinyformat.h>
+#include <txannouncequeue.h>
 #include <txmempool.h>
+#include <txorphanage.h>
 #include <ui_interface.h>
 #include <util.h>
 #include <utilmoneystr.h>
@@ -38,25 +42,7 @@
 
 std::atomic<int64_t> nTimeBestReceived(0); // Used only to inform the wallet of when we last received a block
 
-struct IteratorComparator
-{
-    template<typename I>
-    bool operator()(const I& a, const I& b) const
-    {
-        return &(*a) < &(*b);
-    }
-};
-
-struct COrphanTx {
-    // When modifying, adapt the copy of this definition in tests/DoS_tests.
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-static CCriticalSection g_cs_orphans;
-std::map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(g_cs_orphans);
-std::map<COutPoint, std::set<std::map<uint256, COrphanTx>::iterator, IteratorComparator>> mapOrphanTransactionsByPrev GUARDED_BY(g_cs_orphans);
-void EraseOrphansFor(NodeId peer);
+static TxOrphanage g_orphanage GUARDED_BY(g_cs_orphans);
 
 static size_t vExtraTxnForCompactIt GUARDED_BY(g_cs_orphans) = 0;
 static std::vector<std::pair<uint256, CTransactionRef>> vExtraTxnForCompact GUARDED_BY(g_cs_orphans);
@@ -71,6 +57,20 @@ static const int STALE_RELAY_AGE_LIMIT = 30 * 24 * 60 * 60;
 /// limiting block relay. Set to one week, denominated in seconds.
 static const int HISTORICAL_BLOCK_AGE = 7 * 24 * 60 * 60;
 
+/// Time after which a transaction announcement is dropped from the shared
+/// queue, even if some peer has not been sent it yet. Matches the time
+/// relayed transactions are kept in mapRelay, in seconds.
+static const int64_t TX_ANNOUNCE_QUEUE_EXPIRY = 15 * 60;
+
+/// Blocks at most this deep in the active chain are kept in the block message
+/// cache once served, as lagging peers are likely to ask for them again.
+static const int BLOCK_MSG_CACHE_DEPTH = 24;
+
+/** Maximum number of compact filters that may be requested with one getcfilters. See BIP 157. */
+static constexpr uint32_t MAX_GETCFILTERS_SIZE = 1000;
+/** Maximum number of cf hashes that may be requested with one getcfheaders. See BIP 157. */
+static constexpr uint32_t MAX_GETCFHEADERS_SIZE = 2000;
+
 // Internal stuff
 namespace {
     /** Number of nodes with fSyncStarted. */
@@ -114,6 +114,7 @@ namespace {
         const CBlockIndex* pindex;                               //!< Optional.
         bool fValidatedHeaders;                                  //!< Whether this block has validated headers at the time of request.
         std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
+        int64_t nTimeRequested;                                  //!< When the block was requested (in microseconds).
     };
     std::map<uint256, std::pair<NodeId, std::list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -126,6 +127,10 @@ namespace {
     /** Number of peers from which we're downloading blocks. */
     int nPeersWithValidatedDownloads = 0;
 
+    /** Sum of the block download rates of peers, and the number of peers with one. */
+    int64_t nBlockDownloadRateSum = 0;
+    int nPeersWithBlockDownloadRate = 0;
+
     /** Number of outbound peers with m_chain_sync.m_protect. */
     int g_outbound_peers_with_protect_from_disconnect = 0;
 
@@ -137,6 +142,9 @@ namespace {
     MapRelay mapRelay;
     /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
     std::deque<std::pair<int64_t, MapRelay::iterator>> vRelayExpiration;
+
+    /** Transactions to announce to all peers, protected by cs_main. */
+    CTxAnnounceQueue txAnnounceQueue;
 } // namespace
 
 namespace {
@@ -187,6 +195,12 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the rate at which the peer delivered requested blocks (in bytes per second), or 0 if none lately.
+    int64_t nBlockDownloadRate;
+    //! When the last requested block from this peer arrived (in microseconds).
+    int64_t nLastBlockReceived;
+    //! Number of blocks re-requested from other peers after this peer stalled on them.
+    int nBlocksReRequested;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
@@ -239,6 +253,9 @@ struct CNodeState {
     //! Time of last new block announcement
     int64_t m_last_block_announcement;
 
+    //! Position of the next transaction to announce in txAnnounceQueue.
+    uint64_t nTxAnnounceSeq;
+
     CNodeState(CAddress addrIn, std::string addrNameIn) : address(addrIn), name(addrNameIn) {
         fCurrentlyConnected = false;
         nMisbehavior = 0;
@@ -254,6 +271,9 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockDownloadRate = 0;
+        nLastBlockReceived = 0;
+        nBlocksReRequested = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -263,6 +283,7 @@ struct CNodeState {
         fSupportsDesiredCmpctVersion = false;
         m_chain_sync = { 0, nullptr, false, false };
         m_last_block_announcement = 0;
+        nTxAnnounceSeq = 0;
     }
 };
 
@@ -354,7 +375,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     MarkBlockAsReceived(hash);
 
     std::list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr)});
+            {hash, pindex, pindex != nullptr, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : nullptr), GetTimeMicros()});
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -370,6 +391,80 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const CBlockIndex*
     return true;
 }
 
+// Requires cs_main.
+/** Update the download rate of the peer a block was requested from, if the block came from it */
+void UpdateBlockDownloadRate(NodeId nodeid, const uint256& hash, size_t nBytes, int64_t nTimeReceived) {
+    auto itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState *state = State(nodeid);
+    assert(state != nullptr);
+    // Blocks from a peer arrive one after another, so the transfer of this
+    // one started when it was requested or when the previous one arrived,
+    // whichever was later.
+    const int64_t nStart = std::max(itInFlight->second.second->nTimeRequested, state->nLastBlockReceived);
+    const int64_t nRate = (int64_t)nBytes * 1000000 / std::max<int64_t>(nTimeReceived - nStart, 1000);
+    state->nLastBlockReceived = nTimeReceived;
+
+    nBlockDownloadRateSum -= state->nBlockDownloadRate;
+    if (state->nBlockDownloadRate == 0) {
+        state->nBlockDownloadRate = nRate;
+        nPeersWithBlockDownloadRate++;
+    } else {
+        state->nBlockDownloadRate = (3 * state->nBlockDownloadRate + nRate) / 4;
+    }
+    state->nBlockDownloadRate = std::max<int64_t>(state->nBlockDownloadRate, 1);
+    nBlockDownloadRateSum += state->nBlockDownloadRate;
+}
+
+// Requires cs_main.
+/** Number of blocks a peer may have in flight during block download: more
+ *  for peers that deliver blocks faster than average, fewer for slower ones. */
+int GetBlocksInTransitLimit(const CNodeState& state) {
+    if (state.nBlockDownloadRate == 0 || nPeersWithBlockDownloadRate < 2)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    const int64_t nAverageRate = nBlockDownloadRateSum / nPeersWithBlockDownloadRate;
+    const int64_t nLimit = MAX_BLOCKS_IN_TRANSIT_PER_PEER * state.nBlockDownloadRate / std::max<int64_t>(nAverageRate, 1);
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_SLOW_PEER, std::min<int64_t>(MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER, nLimit));
+}
+
+// Requires cs_main.
+/** Once nothing is pending from a peer it no longer stalls the download. Once it has also
+ *  delivered nothing for BLOCK_DOWNLOAD_RATE_EXPIRY its rate is forgotten, so that a stale
+ *  rate no longer weighs on the limits of the peers still downloading. */
+void UpdateIdleBlockDownload(CNodeState& state, int64_t nNow) {
+    if (state.nBlocksInFlight != 0)
+        return;
+    // The block we stalled on was re-requested from another peer, and nothing else is pending here.
+    state.nStallingSince = 0;
+    if (state.nBlockDownloadRate != 0 && state.nLastBlockReceived < nNow - BLOCK_DOWNLOAD_RATE_EXPIRY * 1000000) {
+        nBlockDownloadRateSum -= state.nBlockDownloadRate;
+        nPeersWithBlockDownloadRate--;
+        state.nBlockDownloadRate = 0;
+    }
+}
+
+// Requires cs_main.
+/** Start the stall timer of the peer holding up the download window, first moving the block it
+ *  holds it up with to an idle peer. The staller's copy is still used if it arrives first; the
+ *  staller is disconnected if the stall persists. */
+void ReRequestStalledBlock(NodeId nodeid, NodeId staller, const CBlockIndex* pindexStalled, uint32_t nFetchFlags, int64_t nNow, std::vector<CInv>& vGetData) {
+    CNodeState *stateStaller = State(staller);
+    assert(stateStaller != nullptr);
+    if (stateStaller->nStallingSince != 0)
+        return;
+    if (pindexStalled != nullptr) {
+        vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindexStalled->GetBlockHash()));
+        MarkBlockAsInFlight(nodeid, pindexStalled->GetBlockHash(), pindexStalled);
+        stateStaller->nBlocksReRequested++;
+        LogPrint(BCLog::NET, "Re-requesting stalled block %s (%d) from peer=%d, stalled by peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+            pindexStalled->nHeight, nodeid, staller);
+    }
+    // Set after the re-request, which resets it when moving the block off the staller
+    stateStaller->nStallingSince = nNow;
+    LogPrint(BCLog::NET, "Stall started peer=%d\n", staller);
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -462,8 +557,9 @@ bool PeerHasHeader(CNodeState *state, const CBlockIndex *pindex)
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const Consensus::Params& consensusParams) {
+ *  at most count entries. If the download window keeps this peer from fetching anything, nodeStaller
+ *  is set to the peer holding up the window, and pindexStalled to the block it holds it up with. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<const CBlockIndex*>& vBlocks, NodeId& nodeStaller, const CBlockIndex*& pindexStalled, const Consensus::Params& consensusParams) {
     if (count == 0)
         return;
 
@@ -499,6 +595,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    const CBlockIndex* pindexWaitingFor = nullptr;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -534,6 +631,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -544,6 +642,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<con
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -560,6 +659,37 @@ void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds)
     if (state) state->m_last_block_announcement = time_in_seconds;
 }
 
+// The following functions are used for testing block download limits and
+// stall handling, see DoS_tests.cpp
+void RequestBlockFromPeer(NodeId node, const CBlockIndex* pindex, int64_t nTimeRequested)
+{
+    LOCK(cs_main);
+    MarkBlockAsInFlight(node, pindex->GetBlockHash(), pindex);
+    mapBlocksInFlight[pindex->GetBlockHash()].second->nTimeRequested = nTimeRequested;
+}
+
+void ReceiveBlockFromPeer(NodeId node, const uint256& hash, size_t nBytes, int64_t nTimeReceived)
+{
+    LOCK(cs_main);
+    UpdateBlockDownloadRate(node, hash, nBytes, nTimeReceived);
+    MarkBlockAsReceived(hash);
+}
+
+void StallBlockDownload(NodeId node, NodeId staller, const CBlockIndex* pindexStalled, int64_t nNow)
+{
+    LOCK(cs_main);
+    std::vector<CInv> vGetData;
+    ReRequestStalledBlock(node, staller, pindexStalled, 0, nNow, vGetData);
+}
+
+bool IsStallingBlockDownload(NodeId node, int64_t nNow)
+{
+    LOCK(cs_main);
+    CNodeState *state = State(node);
+    UpdateIdleBlockDownload(*state, nNow);
+    return state->nStallingSince != 0;
+}
+
 // Returns true for outbound peers, excluding manual connections, feelers, and
 // one-shots
 bool IsOutboundDisconnectionCandidate(const CNode *node)
@@ -573,7 +703,8 @@ void PeerLogicValidation::InitializeNode(CNode *pnode) {
     NodeId nodeid = pnode->GetId();
     {
         LOCK(cs_main);
-        mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
+        auto it = mapNodeState.emplace_hint(mapNodeState.end(), std::piecewise_construct, std::forward_as_tuple(nodeid), std::forward_as_tuple(addr, std::move(addrName)));
+        it->second.nTxAnnounceSeq = txAnnounceQueue.AddReader();
     }
     if(!pnode->fInbound)
         PushNodeVersion(pnode, connman, GetTime());
@@ -595,12 +726,19 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
     for (const QueuedBlock& entry : state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    {
+        LOCK(g_cs_orphans);
+        g_orphanage.EraseForPeer(nodeid);
+    }
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
+    nBlockDownloadRateSum -= state->nBlockDownloadRate;
+    nPeersWithBlockDownloadRate -= (state->nBlockDownloadRate != 0);
+    assert(nPeersWithBlockDownloadRate >= 0);
     g_outbound_peers_with_protect_from_disconnect -= state->m_chain_sync.m_protect;
     assert(g_outbound_peers_with_protect_from_disconnect >= 0);
+    txAnnounceQueue.RemoveReader(state->nTxAnnounceSeq);
 
     mapNodeState.erase(nodeid);
 
@@ -609,6 +747,8 @@ void PeerLogicValidation::FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTim
         assert(mapBlocksInFlight.empty());
         assert(nPreferredDownload == 0);
         assert(nPeersWithValidatedDownloads == 0);
+        assert(nPeersWithBlockDownloadRate == 0);
+        assert(nBlockDownloadRateSum == 0);
         assert(g_outbound_peers_with_protect_from_disconnect == 0);
     }
     LogPrint(BCLog::NET, "Cleared nodestate for peer=%d\n", nodeid);
@@ -622,6 +762,9 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     stats.nMisbehavior = state->nMisbehavior;
     stats.nSyncHeight = state->pindexBestKnownBlock ? state->pindexBestKnownBlock->nHeight : -1;
     stats.nCommonHeight = state->pindexLastCommonBlock ? state->pindexLastCommonBlock->nHeight : -1;
+    stats.nBlockDownloadRate = state->nBlockDownloadRate;
+    stats.nBlocksInTransitLimit = GetBlocksInTransitLimit(*state);
+    stats.nBlocksReRequested = state->nBlocksReRequested;
     for (const QueuedBlock& queue : state->vBlocksInFlight) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
@@ -631,7 +774,7 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// mapOrphanTransactions
+// Orphan transactions
 //
 
 void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
@@ -645,112 +788,6 @@ void AddToCompactExtraTransactions(const CTransactionRef& tx) EXCLUSIVE_LOCKS_RE
     vExtraTxnForCompactIt = (vExtraTxnForCompactIt + 1) % max_extra_txn;
 }
 
-bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
-{
-    const uint256& hash = tx->GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 100 orphans, each of which is at most 99,999 bytes big is
-    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
-    unsigned int sz = GetTransactionWeight(*tx);
-    if (sz >= MAX_STANDARD_TX_WEIGHT)
-    {
-        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME});
-    assert(ret.second);
-    for (const CTxIn& txin : tx->vin) {
-        mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
-    }
-
-    AddToCompactExtraTransactions(tx);
-
-    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
-    return true;
-}
-
-int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans)
-{
-    std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return 0;
-    for (const CTxIn& txin : it->second.tx->vin)
-    {
-        auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(it);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-    return 1;
-}
-
-void EraseOrphansFor(NodeId peer)
-{
-    LOCK(g_cs_orphans);
-    int nErased = 0;
-    std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        std::map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-        }
-    }
-    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    LOCK(g_cs_orphans);
-
-    unsigned int nEvicted = 0;
-    static int64_t nNextSweep;
-    int64_t nNow = GetTime();
-    if (nNextSweep <= nNow) {
-        // Sweep out expired orphan pool entries:
-        int nErased = 0;
-        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
-        std::map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-        while (iter != mapOrphanTransactions.end())
-        {
-            std::map<uint256, COrphanTx>::iterator maybeErase = iter++;
-            if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
-            } else {
-                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
-            }
-        }
-        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
-        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
-        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
-    }
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
-
 // Requires cs_main.
 void Misbehaving(NodeId pnode, int howmuch)
 {
@@ -796,9 +833,14 @@ static bool BlockRequestAllowed(const CBlockIndex* pindex, const Consensus::Para
         (GetBlockProofEquivalentTime(*pindexBestHeader, *pindex, *pindexBestHeader, consensusParams) < STALE_RELAY_AGE_LIMIT);
 }
 
+// Block and compact block messages of recent blocks, serialized once and sent
+// as is to every peer asking for them
+static CBlockMsgCache g_block_msg_cache(DEFAULT_BLOCK_MSG_CACHE_SIZE << 20);
+
 PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &scheduler) : connman(connmanIn), m_stale_tip_check_time(0) {
     // Initialize global variables that cannot be constructed at startup.
     recentRejects.reset(new CRollingBloomFilter(120000, 0.000001));
+    g_block_msg_cache.SetMaxUsage(std::max<int64_t>(0, gArgs.GetArg("-blockmsgcache", DEFAULT_BLOCK_MSG_CACHE_SIZE)) << 20);
 
     const Consensus::Params& consensusParams = Params().GetConsensus();
     // Stale tip checking and peer eviction are on two different timers, but we
@@ -810,32 +852,9 @@ PeerLogicValidation::PeerLogicValidation(CConnman* connmanIn, CScheduler &schedu
 }
 
 void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pblock, const CBlockIndex* pindex, const std::vector<CTransactionRef>& vtxConflicted) {
-    LOCK(g_cs_orphans);
-
-    std::vector<uint256> vOrphanErase;
-
-    for (const CTransactionRef& ptx : pblock->vtx) {
-        const CTransaction& tx = *ptx;
-
-        // Which orphan pool entries must we evict?
-        for (const auto& txin : tx.vin) {
-            auto itByPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
-            if (itByPrev == mapOrphanTransactionsByPrev.end()) continue;
-            for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                const CTransaction& orphanTx = *(*mi)->second.tx;
-                const uint256& orphanHash = orphanTx.GetHash();
-                vOrphanErase.push_back(orphanHash);
-            }
-        }
-    }
-
-    // Erase orphan transactions include or precluded by this block
-    if (vOrphanErase.size()) {
-        int nErased = 0;
-        for (uint256 &orphanHash : vOrphanErase) {
-            nErased += EraseOrphanTx(orphanHash);
-        }
-        LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    {
+        LOCK(g_cs_orphans);
+        g_orphanage.EraseForBlock(*pblock);
     }
 
     g_last_tip_update = GetTime();
@@ -844,13 +863,43 @@ void PeerLogicValidation::BlockConnected(const std::shared_ptr<const CBlock>& pb
 // All of the following cache a recent block, and are protected by cs_most_recent_block
 static CCriticalSection cs_most_recent_block;
 static std::shared_ptr<const CBlock> most_recent_block;
-static std::shared_ptr<const CBlockHeaderAndShortTxIDs> most_recent_compact_block;
 static uint256 most_recent_block_hash;
-static bool fWitnessesPresentInMostRecentCompactBlock;
+// Hash of the last block UpdatedBlockTip() saw become the tip
+static uint256 most_recent_tip_hash;
 
-void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
-    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock = std::make_shared<const CBlockHeaderAndShortTxIDs> (*pblock, true);
+/** Serialize a block in the given encoding, into a message that can be sent to any peer */
+static std::shared_ptr<const CSharedNetMsg> MakeSharedBlockMsg(const CBlock& block, CBlockMsgCache::Type type)
+{
     const CNetMsgMaker msgMaker(PROTOCOL_VERSION);
+    switch (type) {
+    case CBlockMsgCache::BLOCK:
+        return std::make_shared<const CSharedNetMsg>(msgMaker.Make(NetMsgType::BLOCK, block));
+    case CBlockMsgCache::BLOCK_NO_WITNESS:
+        return std::make_shared<const CSharedNetMsg>(msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block));
+    case CBlockMsgCache::CMPCTBLOCK:
+        return std::make_shared<const CSharedNetMsg>(msgMaker.Make(NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(block, true)));
+    case CBlockMsgCache::CMPCTBLOCK_NO_WITNESS:
+        return std::make_shared<const CSharedNetMsg>(msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::CMPCTBLOCK, CBlockHeaderAndShortTxIDs(block, false)));
+    case CBlockMsgCache::NUM_TYPES:
+        break;
+    }
+    assert(!"unknown block message type");
+}
+
+/** A message for a recent block from the block message cache, serialized from pblock if it is not cached yet */
+static std::shared_ptr<const CSharedNetMsg> GetRecentBlockMsg(const std::shared_ptr<const CBlock>& pblock, CBlockMsgCache::Type type)
+{
+    const uint256 hash = pblock->GetHash();
+    std::shared_ptr<const CSharedNetMsg> pmsg = g_block_msg_cache.Get(hash, type);
+    if (!pmsg) {
+        pmsg = MakeSharedBlockMsg(*pblock, type);
+        g_block_msg_cache.Add(hash, type, pmsg);
+    }
+    return pmsg;
+}
+
+void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std::shared_ptr<const CBlock>& pblock) {
+    std::shared_ptr<const CSharedNetMsg> pcmpctmsg = MakeSharedBlockMsg(*pblock, CBlockMsgCache::CMPCTBLOCK);
 
     LOCK(cs_main);
 
@@ -866,12 +915,10 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
         LOCK(cs_most_recent_block);
         most_recent_block_hash = hashBlock;
         most_recent_block = pblock;
-        most_recent_compact_block = pcmpctblock;
-        fWitnessesPresentInMostRecentCompactBlock = fWitnessEnabled;
     }
+    g_block_msg_cache.Add(hashBlock, CBlockMsgCache::CMPCTBLOCK, pcmpctmsg);
 
-    connman->ForEachNode([this, &pcmpctblock, pindex, &msgMaker, fWitnessEnabled, &hashBlock](CNode* pnode) {
-        // TODO: Avoid the repeated-serialization here
+    connman->ForEachNode([this, &pcmpctmsg, pindex, fWitnessEnabled, &hashBlock](CNode* pnode) {
         if (pnode->nVersion < INVALID_CB_NO_BAN_VERSION || pnode->fDisconnect)
             return;
         ProcessBlockAvailability(pnode->GetId());
@@ -883,7 +930,7 @@ void PeerLogicValidation::NewPoWValidBlock(const CBlockIndex *pindex, const std:
 
             LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", "PeerLogicValidation::NewPoWValidBlock",
                     hashBlock.ToString(), pnode->GetId());
-            connman->PushMessage(pnode, msgMaker.Make(NetMsgType::CMPCTBLOCK, *pcmpctblock));
+            connman->PushMessage(pnode, *pcmpctmsg);
             state.pindexBestHeaderSent = pindex;
         }
     });
@@ -893,6 +940,11 @@ void PeerLogicValidation::UpdatedBlockTip(const CBlockIndex *pindexNew, const CB
     const int nNewHeight = pindexNew->nHeight;
     connman->SetBestHeight(nNewHeight);
 
+    {
+        LOCK(cs_most_recent_block);
+        most_recent_tip_hash = pindexNew->GetBlockHash();
+    }
+
     if (!fInitialDownload) {
         // Find the hashes of all blocks that weren't previously in the best chain.
         std::vector<uint256> vHashes;
@@ -979,7 +1031,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             {
                 LOCK(g_cs_orphans);
-                if (mapOrphanTransactions.count(inv.hash)) return true;
+                if (g_orphanage.HaveTx(inv.hash)) return true;
             }
 
             return recentRejects->contains(inv.hash) ||
@@ -995,13 +1047,84 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
-static void RelayTransaction(const CTransaction& tx, CConnman* connman)
+/** Announce a transaction to all peers, through the shared queue */
+static void RelayTransaction(const CTransaction& tx) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    CInv inv(MSG_TX, tx.GetHash());
-    connman->ForEachNode([&inv](CNode* pnode)
-    {
-        pnode->PushInventory(inv);
-    });
+    txAnnounceQueue.Push(tx.GetHash());
+}
+
+/**
+ * Try to accept a transaction that was rejected for paying too little fee
+ * together with an orphan child that pays for it, as a package. On success
+ * state is reset and pchild set to the accepted child.
+ */
+static bool AcceptWithOrphanChild(const CTransactionRef& ptx, CValidationState& state, CTransactionRef& pchild) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    const std::vector<CTransactionRef> vChildren = g_orphanage.GetChildren(*ptx);
+    for (const CTransactionRef& porphanTx : vChildren) {
+        CValidationState statePackage;
+        std::vector<CValidationState> vState;
+        if (AcceptPackageToMemoryPool(mempool, statePackage, {ptx, porphanTx}, vState, 0 /* nAbsurdFee */)) {
+            LogPrint(BCLog::MEMPOOL, "   accepted %s with orphan child %s\n", ptx->GetHash().ToString(), porphanTx->GetHash().ToString());
+            state = CValidationState();
+            pchild = porphanTx;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Reconsider orphans from peer's work set until one of them is accepted or
+ * rejected. The rest waits for the next calls, between the peer's messages,
+ * so that resolving many orphans at once does not hold up other peers.
+ */
+static void ProcessOrphanTx(NodeId peer, std::list<CTransactionRef>& removed_txn) EXCLUSIVE_LOCKS_REQUIRED(cs_main, g_cs_orphans)
+{
+    NodeId fromPeer;
+    while (CTransactionRef porphanTx = g_orphanage.GetTxToReconsider(peer, fromPeer)) {
+        const CTransaction& orphanTx = *porphanTx;
+        const uint256& orphanHash = orphanTx.GetHash();
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+        bool fDone = false;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &removed_txn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
+            LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx);
+            g_orphanage.EraseTx(orphanHash);
+            g_orphanage.AddChildrenToWorkSet(orphanTx, peer);
+            fDone = true;
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // Has inputs but not accepted to mempool
+            // Probably non-standard or insufficient fee
+            LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
+            g_orphanage.EraseTx(orphanHash);
+            if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
+                // Do not use rejection cache for witness transactions or
+                // witness-stripped transactions, as they can have been malleated.
+                // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
+                assert(recentRejects);
+                recentRejects->insert(orphanHash);
+            }
+            fDone = true;
+        }
+        mempool.check(pcoinsTip.get());
+        if (fDone)
+            break;
+    }
 }
 
 static void RelayAddress(const CAddress& addr, bool fReachable, CConnman* connman)
@@ -1044,13 +1167,22 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
 {
     bool send = false;
     std::shared_ptr<const CBlock> a_recent_block;
-    std::shared_ptr<const CBlockHeaderAndShortTxIDs> a_recent_compact_block;
-    bool fWitnessesPresentInARecentCompactBlock;
+    bool fRecentBlockIsTip;
     {
         LOCK(cs_most_recent_block);
         a_recent_block = most_recent_block;
-        a_recent_compact_block = most_recent_compact_block;
-        fWitnessesPresentInARecentCompactBlock = fWitnessesPresentInMostRecentCompactBlock;
+        fRecentBlockIsTip = most_recent_block_hash == most_recent_tip_hash;
+    }
+
+    // A full block request for the most recent block, once it has become the
+    // tip, passes every check below, so serve it without taking cs_main. This
+    // lets message handler threads answer the burst of requests following a
+    // new block in parallel.
+    if ((inv.type == MSG_BLOCK || inv.type == MSG_WITNESS_BLOCK) && fRecentBlockIsTip &&
+            a_recent_block && a_recent_block->GetHash() == inv.hash &&
+            inv.hash != pfrom->hashContinue && !connman->OutboundTargetReached(true)) {
+        connman->PushMessage(pfrom, *GetRecentBlockMsg(a_recent_block, inv.type == MSG_WITNESS_BLOCK ? CBlockMsgCache::BLOCK : CBlockMsgCache::BLOCK_NO_WITNESS));
+        return;
     }
 
     bool need_activate_chain = false;
@@ -1108,20 +1240,51 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
     // it's available before trying to send.
     if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
     {
+        // Full and compact blocks are the same for every peer, so recent ones
+        // are looked up in the block message cache before reading the block.
+        bool fSharedMsg = true;
+        CBlockMsgCache::Type msgType = CBlockMsgCache::BLOCK;
+        if (inv.type == MSG_BLOCK) {
+            msgType = CBlockMsgCache::BLOCK_NO_WITNESS;
+        } else if (inv.type == MSG_CMPCT_BLOCK) {
+            // If a peer is asking for old blocks, we're almost guaranteed
+            // they won't have a useful mempool to match against a compact block,
+            // and we don't feel like constructing the object for them, so
+            // instead we respond with the full, non-compact block.
+            bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
+            if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                msgType = fPeerWantsWitness ? CBlockMsgCache::CMPCTBLOCK : CBlockMsgCache::CMPCTBLOCK_NO_WITNESS;
+            } else {
+                msgType = fPeerWantsWitness ? CBlockMsgCache::BLOCK : CBlockMsgCache::BLOCK_NO_WITNESS;
+            }
+        } else if (inv.type != MSG_WITNESS_BLOCK) {
+            fSharedMsg = false;
+        }
+        const bool fCacheMsg = fSharedMsg && mi->second->nHeight > chainActive.Height() - BLOCK_MSG_CACHE_DEPTH;
+        std::shared_ptr<const CSharedNetMsg> pmsg;
+        if (fCacheMsg)
+            pmsg = g_block_msg_cache.Get(inv.hash, msgType);
+
         std::shared_ptr<const CBlock> pblock;
-        if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
-            pblock = a_recent_block;
-        } else {
-            // Send block from disk
-            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
-            if (!ReadBlockFromDisk(*pblockRead, (*mi).second, consensusParams))
-                assert(!"cannot load block from disk");
-            pblock = pblockRead;
-        }
-        if (inv.type == MSG_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, *pblock));
-        else if (inv.type == MSG_WITNESS_BLOCK)
-            connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::BLOCK, *pblock));
+        if (!pmsg) {
+            if (a_recent_block && a_recent_block->GetHash() == (*mi).second->GetBlockHash()) {
+                pblock = a_recent_block;
+            } else {
+                // Send block from disk
+                std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+                if (!ReadBlockFromDisk(*pblockRead, (*mi).second, consensusParams))
+                    assert(!"cannot load block from disk");
+                pblock = pblockRead;
+            }
+        }
+        if (fSharedMsg) {
+            if (!pmsg) {
+                pmsg = MakeSharedBlockMsg(*pblock, msgType);
+                if (fCacheMsg)
+                    g_block_msg_cache.Add(inv.hash, msgType, pmsg);
+            }
+            connman->PushMessage(pfrom, *pmsg);
+        }
         else if (inv.type == MSG_FILTERED_BLOCK)
         {
             bool sendMerkleBlock = false;
@@ -1148,25 +1311,6 @@ void static ProcessGetBlockData(CNode* pfrom, const Consensus::Params& consensus
             // else
                 // no response
         }
-        else if (inv.type == MSG_CMPCT_BLOCK)
-        {
-            // If a peer is asking for old blocks, we're almost guaranteed
-            // they won't have a useful mempool to match against a compact block,
-            // and we don't feel like constructing the object for them, so
-            // instead we respond with the full, non-compact block.
-            bool fPeerWantsWitness = State(pfrom->GetId())->fWantsCmpctWitness;
-            int nSendFlags = fPeerWantsWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-            if (CanDirectFetch(consensusParams) && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
-                if ((fPeerWantsWitness || !fWitnessesPresentInARecentCompactBlock) && a_recent_compact_block && a_recent_compact_block->header.GetHash() == mi->second->GetBlockHash()) {
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *a_recent_compact_block));
-                } else {
-                    CBlockHeaderAndShortTxIDs cmpctblock(*pblock, fPeerWantsWitness);
-                    connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                }
-            } else {
-                connman->PushMessage(pfrom, msgMaker.Make(nSendFlags, NetMsgType::BLOCK, *pblock));
-            }
-        }
 
         // Trigger the peer node to send a getblocks request for the next batch of inventory
         if (inv.hash == pfrom->hashContinue)
@@ -1490,6 +1634,213 @@ bool static ProcessHeadersMessage(CNode *pfrom, CConnman *connman, const std::ve
     return true;
 }
 
+/**
+ * Validation logic for compact filters request handling.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ *
+ * @param[in]   pfrom           The peer that we received the request from
+ * @param[in]   chainparams     Chain parameters
+ * @param[in]   filter_type     The filter type the request is for. Must be basic filters.
+ * @param[in]   start_height    The start height for the request
+ * @param[in]   stop_hash       The stop_hash for the request
+ * @param[in]   max_height_diff The maximum number of items permitted to request, as specified in BIP 157
+ * @param[out]  stop_index      The CBlockIndex for the stop_hash block, if the request can be serviced.
+ * @param[out]  filter_index    The filter index, if the request can be serviced.
+ * @return                      True if the request can be serviced.
+ */
+static bool PrepareBlockFilterRequest(CNode* pfrom, const CChainParams& chainparams,
+                                      BlockFilterType filter_type, uint32_t start_height,
+                                      const uint256& stop_hash, uint32_t max_height_diff,
+                                      const CBlockIndex*& stop_index,
+                                      BlockFilterIndex*& filter_index)
+{
+    const bool supported_filter_type =
+        (filter_type == BlockFilterType::BASIC &&
+         (pfrom->GetLocalServices() & NODE_COMPACT_FILTERS));
+    if (!supported_filter_type) {
+        LogPrint(BCLog::NET, "peer %d requested unsupported block filter type: %d\n",
+                 pfrom->GetId(), static_cast<uint8_t>(filter_type));
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(stop_hash);
+        stop_index = it != mapBlockIndex.end() ? it->second : nullptr;
+
+        // Check that the stop block exists and the peer would be allowed to fetch it.
+        if (!stop_index || !BlockRequestAllowed(stop_index, chainparams.GetConsensus())) {
+            LogPrint(BCLog::NET, "peer %d requested invalid block hash: %s\n",
+                     pfrom->GetId(), stop_hash.ToString());
+            pfrom->fDisconnect = true;
+            return false;
+        }
+    }
+
+    uint32_t stop_height = stop_index->nHeight;
+    if (start_height > stop_height) {
+        LogPrint(BCLog::NET, "peer %d sent invalid getcfilters/getcfheaders with " /* Continued */
+                 "start height %d and stop height %d\n",
+                 pfrom->GetId(), start_height, stop_height);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+    if (stop_height - start_height >= max_height_diff) {
+        LogPrint(BCLog::NET, "peer %d requested too many cfilters/cfheaders: %d / %d\n",
+                 pfrom->GetId(), stop_height - start_height + 1, max_height_diff);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    filter_index = GetBlockFilterIndex(filter_type);
+    if (!filter_index) {
+        LogPrint(BCLog::NET, "Filter index for supported type %s not found\n", BlockFilterTypeName(filter_type));
+        return false;
+    }
+
+    // The index may still be catching up; ignore the request rather than
+    // serving an incomplete range.
+    if (!filter_index->BlockUntilSyncedToCurrentChain()) {
+        LogPrint(BCLog::NET, "%s is not synced, ignoring request from peer %d\n",
+                 BlockFilterTypeName(filter_type), pfrom->GetId());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handle a cfilters request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFilters(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                               CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> start_height >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, start_height, stop_hash,
+                                   MAX_GETCFILTERS_SIZE, stop_index, filter_index)) {
+        return;
+    }
+
+    std::vector<BlockFilter> filters;
+    if (!filter_index->LookupFilterRange(start_height, stop_index, filters)) {
+        LogPrint(BCLog::NET, "Failed to find block filter in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(filter_type), start_height, stop_hash.ToString());
+        return;
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    for (const auto& filter : filters) {
+        connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFILTER, filter));
+    }
+}
+
+/**
+ * Handle a cfheaders request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFHeaders(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                                CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint32_t start_height;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> start_height >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, start_height, stop_hash,
+                                   MAX_GETCFHEADERS_SIZE, stop_index, filter_index)) {
+        return;
+    }
+
+    uint256 prev_header;
+    if (start_height > 0) {
+        const CBlockIndex* const prev_block =
+            stop_index->GetAncestor(static_cast<int>(start_height - 1));
+        if (!filter_index->LookupFilterHeader(prev_block, prev_header)) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(filter_type), prev_block->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    std::vector<uint256> filter_hashes;
+    if (!filter_index->LookupFilterHashRange(start_height, stop_index, filter_hashes)) {
+        LogPrint(BCLog::NET, "Failed to find block filter hashes in index: filter_type=%s, start_height=%d, stop_hash=%s\n",
+                 BlockFilterTypeName(filter_type), start_height, stop_hash.ToString());
+        return;
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFHEADERS,
+                                              filter_type_ser,
+                                              stop_index->GetBlockHash(),
+                                              prev_header,
+                                              filter_hashes));
+}
+
+/**
+ * Handle a getcfcheckpt request.
+ *
+ * May disconnect from the peer in the case of a bad request.
+ */
+static void ProcessGetCFCheckPt(CNode* pfrom, CDataStream& vRecv, const CChainParams& chainparams,
+                                CConnman* connman)
+{
+    uint8_t filter_type_ser;
+    uint256 stop_hash;
+
+    vRecv >> filter_type_ser >> stop_hash;
+
+    const BlockFilterType filter_type = static_cast<BlockFilterType>(filter_type_ser);
+
+    const CBlockIndex* stop_index;
+    BlockFilterIndex* filter_index;
+    if (!PrepareBlockFilterRequest(pfrom, chainparams, filter_type, /*start_height=*/0, stop_hash,
+                                   /*max_height_diff=*/std::numeric_limits<uint32_t>::max(),
+                                   stop_index, filter_index)) {
+        return;
+    }
+
+    std::vector<uint256> headers(stop_index->nHeight / CFCHECKPT_INTERVAL);
+
+    // Populate headers.
+    const CBlockIndex* block_index = stop_index;
+    for (int i = headers.size() - 1; i >= 0; i--) {
+        int height = (i + 1) * CFCHECKPT_INTERVAL;
+        block_index = block_index->GetAncestor(height);
+
+        if (!filter_index->LookupFilterHeader(block_index, headers[i])) {
+            LogPrint(BCLog::NET, "Failed to find block filter header in index: filter_type=%s, block_hash=%s\n",
+                     BlockFilterTypeName(filter_type), block_index->GetBlockHash().ToString());
+            return;
+        }
+    }
+
+    const CNetMsgMaker msgMaker(pfrom->GetSendVersion());
+    connman->PushMessage(pfrom, msgMaker.Make(NetMsgType::CFCHECKPT,
+                                              filter_type_ser,
+                                              stop_index->GetBlockHash(),
+                                              headers));
+}
+
 bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams, CConnman* connman, const std::atomic<bool>& interruptMsgProc)
 {
     LogPrint(BCLog::NET, "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->GetId());
@@ -2114,8 +2465,6 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             return true;
         }
 
-        std::deque<COutPoint> vWorkQueue;
-        std::vector<uint256> vEraseQueue;
         CTransactionRef ptx;
         vRecv >> ptx;
         const CTransaction& tx = *ptx;
@@ -2132,14 +2481,19 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         mapAlreadyAskedFor.erase(inv.hash);
 
         std::list<CTransactionRef> lRemovedTxn;
+        CTransactionRef pchild; // orphan accepted together with tx as a package
 
         if (!AlreadyHave(inv) &&
-            AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
+            (AcceptToMemoryPool(mempool, state, ptx, &fMissingInputs, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */) ||
+             (state.GetRejectCode() == REJECT_INSUFFICIENTFEE && AcceptWithOrphanChild(ptx, state, pchild)))) {
             mempool.check(pcoinsTip.get());
-            RelayTransaction(tx, connman);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
+            RelayTransaction(tx);
+            if (pchild) {
+                RelayTransaction(*pchild);
+                g_orphanage.EraseTx(pchild->GetHash());
+                g_orphanage.AddChildrenToWorkSet(*pchild, pfrom->GetId());
             }
+            g_orphanage.AddChildrenToWorkSet(tx, pfrom->GetId());
 
             pfrom->nLastTXTime = GetTime();
 
@@ -2148,66 +2502,9 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
-            std::set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const CTransactionRef& porphanTx = (*mi)->second.tx;
-                    const CTransaction& orphanTx = *porphanTx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, porphanTx, &fMissingInputs2, &lRemovedTxn, false /* bypass_limits */, 0 /* nAbsurdFee */)) {
-                        LogPrint(BCLog::MEMPOOL, "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, connman);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint(BCLog::MEMPOOL, "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee
-                        LogPrint(BCLog::MEMPOOL, "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!orphanTx.HasWitness() && !stateDummy.CorruptionPossible()) {
-                            // Do not use rejection cache for witness transactions or
-                            // witness-stripped transactions, as they can have been malleated.
-                            // See https://github.com/bitcoin/bitcoin/issues/8279 for details.
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip.get());
-                }
-            }
-
-            for (uint256 hash : vEraseQueue)
-                EraseOrphanTx(hash);
+            // Reconsider the orphans that depended on it: the first one now,
+            // the others before this peer's next messages
+            ProcessOrphanTx(pfrom->GetId(), lRemovedTxn);
         }
         else if (fMissingInputs)
         {
@@ -2225,11 +2522,12 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                     pfrom->AddInventoryKnown(_inv);
                     if (!AlreadyHave(_inv)) pfrom->AskFor(_inv);
                 }
-                AddOrphanTx(ptx, pfrom->GetId());
+                if (g_orphanage.AddTx(ptx, pfrom->GetId()))
+                    AddToCompactExtraTransactions(ptx);
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                // DoS prevention: do not allow the orphanage to grow unbounded
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, gArgs.GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                unsigned int nEvicted = g_orphanage.LimitOrphans(nMaxOrphanTx);
                 if (nEvicted > 0) {
                     LogPrint(BCLog::MEMPOOL, "mapOrphan overflow, removed %u tx\n", nEvicted);
                 }
@@ -2265,7 +2563,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
                 int nDoS = 0;
                 if (!state.IsInvalid(nDoS) || nDoS == 0) {
                     LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->GetId());
-                    RelayTransaction(tx, connman);
+                    RelayTransaction(tx);
                 } else {
                     LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s)\n", tx.GetHash().ToString(), pfrom->GetId(), FormatStateMessage(state));
                 }
@@ -2617,6 +2915,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
 
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        const size_t nBlockBytes = vRecv.size();
         std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
         vRecv >> *pblock;
 
@@ -2628,6 +2927,7 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
             LOCK(cs_main);
             // Also always process if we requested the block explicitly, as we may
             // need it even though it is not a candidate for a new best tip.
+            UpdateBlockDownloadRate(pfrom->GetId(), hash, nBlockBytes, nTimeReceived);
             forceProcessing |= MarkBlockAsReceived(hash);
             // mapBlockSource is only used for sending reject messages and DoS scores,
             // so the race between here and cs_main in ProcessNewBlock is fine.
@@ -2664,7 +2964,10 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         }
         pfrom->fSentAddr = true;
 
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_addrSend);
+            pfrom->vAddrToSend.clear();
+        }
         std::vector<CAddress> vAddr = connman->GetAddresses();
         FastRandomContext insecure_rand;
         for (const CAddress &addr : vAddr)
@@ -2827,6 +3130,18 @@ bool static ProcessMessage(CNode* pfrom, const std::string& strCommand, CDataStr
         pfrom->fRelayTxes = true;
     }
 
+    else if (strCommand == NetMsgType::GETCFILTERS) {
+        ProcessGetCFilters(pfrom, vRecv, chainparams, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFHEADERS) {
+        ProcessGetCFHeaders(pfrom, vRecv, chainparams, connman);
+    }
+
+    else if (strCommand == NetMsgType::GETCFCHECKPT) {
+        ProcessGetCFCheckPt(pfrom, vRecv, chainparams, connman);
+    }
+
     else if (strCommand == NetMsgType::FEEFILTER) {
         CAmount newFeeFilter = 0;
         vRecv >> newFeeFilter;
@@ -2884,6 +3199,47 @@ static bool SendRejectsAndCheckIfBanned(CNode* pnode, CConnman* connman)
     return false;
 }
 
+void PeerLogicValidation::PrepareMessages(const std::vector<CNode*>& nodes, std::atomic<bool>& interruptMsgProc)
+{
+    std::vector<CTransactionRef> vtx;
+    for (CNode* pnode : nodes) {
+        // Only look at the messages ProcessMessages will get to this round
+        if (pnode->fDisconnect || pnode->fPauseSend || !pnode->vRecvGetData.empty())
+            continue;
+        if (!fRelayTxes && (!pnode->fWhitelisted || !gArgs.GetBoolArg("-whitelistrelay", DEFAULT_WHITELISTRELAY)))
+            continue;
+        {
+            // Queued orphans are worked off before the next message is taken
+            LOCK(g_cs_orphans);
+            if (g_orphanage.HaveTxToReconsider(pnode->GetId()))
+                continue;
+        }
+
+        // Read the transaction in place, leaving the message for ProcessMessages
+        LOCK(pnode->cs_vProcessMsg);
+        if (pnode->vProcessMsg.empty() || pnode->vProcessMsg.front().hdr.GetCommand() != NetMsgType::TX)
+            continue;
+        const CDataStream& vRecv = pnode->vProcessMsg.front().vRecv;
+        try {
+            CTransactionRef ptx;
+            VectorReader(SER_NETWORK, pnode->GetRecvVersion(), vRecv.data(), vRecv.size(), 0) >> ptx;
+            vtx.push_back(ptx);
+        } catch (const std::exception&) {
+            // Malformed messages are dealt with by ProcessMessages
+        }
+    }
+    if (vtx.size() < 2 || interruptMsgProc)
+        return;
+
+    {
+        LOCK(cs_main);
+        vtx.erase(std::remove_if(vtx.begin(), vtx.end(), [](const CTransactionRef& ptx) {
+            return AlreadyHave(CInv(MSG_TX, ptx->GetHash()));
+        }), vtx.end());
+    }
+    PreVerifyTransactionScripts(mempool, vtx, false /* bypass_limits */);
+}
+
 bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& interruptMsgProc)
 {
     const CChainParams& chainparams = Params();
@@ -2903,24 +3259,55 @@ bool PeerLogicValidation::ProcessMessages(CNode* pfrom, std::atomic<bool>& inter
     if (pfrom->fDisconnect)
         return false;
 
+    bool fOrphanWork;
+    std::vector<CTransactionRef> vOrphansToVerify;
+    {
+        LOCK(g_cs_orphans);
+        fOrphanWork = g_orphanage.HaveTxToReconsider(pfrom->GetId());
+        vOrphansToVerify = g_orphanage.TakeTxsToPreVerify(pfrom->GetId());
+    }
+    if (fOrphanWork) {
+        // Verify the scripts of newly queued orphans in one batch, before
+        // taking cs_main to reconsider them one at a time
+        PreVerifyTransactionScripts(mempool, vOrphansToVerify, false /* bypass_limits */);
+        std::list<CTransactionRef> removed_txn;
+        LOCK2(cs_main, g_cs_orphans);
+        ProcessOrphanTx(pfrom->GetId(), removed_txn);
+        for (const CTransactionRef& removedTx : removed_txn)
+            AddToCompactExtraTransactions(removedTx);
+        fOrphanWork = g_orphanage.HaveTxToReconsider(pfrom->GetId());
+    }
+
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return true;
 
+    // Work off queued orphans before taking the next message
+    if (fOrphanWork) return true;
+
     // Don't bother if send buffer is too full to respond anyway
     if (pfrom->fPauseSend)
         return false;
 
     std::list<CNetMessage> msgs;
+    bool fResumeRecv;
     {
         LOCK(pfrom->cs_vProcessMsg);
         if (pfrom->vProcessMsg.empty())
             return false;
+        // Wait for a checksum thread to finish hashing a large message; it
+        // wakes the message handler when done
+        if (!pfrom->vProcessMsg.front().fHashReady)
+            return false;
         // Just take one message
         msgs.splice(msgs.begin(), pfrom->vProcessMsg, pfrom->vProcessMsg.begin());
         pfrom->nProcessQueueSize -= msgs.front().vRecv.size() + CMessageHeader::HEADER_SIZE;
+        fResumeRecv = pfrom->fPauseRecv;
         pfrom->fPauseRecv = pfrom->nProcessQueueSize > connman->GetReceiveFloodSize();
+        fResumeRecv = fResumeRecv && !pfrom->fPauseRecv;
         fMoreWork = !pfrom->vProcessMsg.empty();
     }
+    if (fResumeRecv)
+        connman->UpdateSocketEvents(pfrom);
     CNetMessage& msg(msgs.front());
 
     msg.SetVersion(pfrom->GetRecvVersion());
@@ -3211,6 +3598,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         //
         if (pto->nNextAddrSend < nNow) {
             pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
+            LOCK(pto->cs_addrSend);
             std::vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             for (const CAddress& addr : pto->vAddrToSend)
@@ -3342,28 +3730,25 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                     LogPrint(BCLog::NET, "%s sending header-and-ids %s to peer=%d\n", __func__,
                             vHeaders.front().GetHash().ToString(), pto->GetId());
 
-                    int nSendFlags = state.fWantsCmpctWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS;
-
-                    bool fGotBlockFromCache = false;
-                    {
-                        LOCK(cs_most_recent_block);
-                        if (most_recent_block_hash == pBestIndex->GetBlockHash()) {
-                            if (state.fWantsCmpctWitness || !fWitnessesPresentInMostRecentCompactBlock)
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, *most_recent_compact_block));
-                            else {
-                                CBlockHeaderAndShortTxIDs cmpctblock(*most_recent_block, state.fWantsCmpctWitness);
-                                connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                            }
-                            fGotBlockFromCache = true;
+                    const CBlockMsgCache::Type msgType = state.fWantsCmpctWitness ? CBlockMsgCache::CMPCTBLOCK : CBlockMsgCache::CMPCTBLOCK_NO_WITNESS;
+                    std::shared_ptr<const CSharedNetMsg> pmsg = g_block_msg_cache.Get(pBestIndex->GetBlockHash(), msgType);
+                    if (!pmsg) {
+                        std::shared_ptr<const CBlock> pblock;
+                        {
+                            LOCK(cs_most_recent_block);
+                            if (most_recent_block_hash == pBestIndex->GetBlockHash())
+                                pblock = most_recent_block;
                         }
+                        if (!pblock) {
+                            std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+                            bool ret = ReadBlockFromDisk(*pblockRead, pBestIndex, consensusParams);
+                            assert(ret);
+                            pblock = pblockRead;
+                        }
+                        pmsg = MakeSharedBlockMsg(*pblock, msgType);
+                        g_block_msg_cache.Add(pBestIndex->GetBlockHash(), msgType, pmsg);
                     }
-                    if (!fGotBlockFromCache) {
-                        CBlock block;
-                        bool ret = ReadBlockFromDisk(block, pBestIndex, consensusParams);
-                        assert(ret);
-                        CBlockHeaderAndShortTxIDs cmpctblock(block, state.fWantsCmpctWitness);
-                        connman->PushMessage(pto, msgMaker.Make(nSendFlags, NetMsgType::CMPCTBLOCK, cmpctblock));
-                    }
+                    connman->PushMessage(pto, *pmsg);
                     state.pindexBestHeaderSent = pBestIndex;
                 } else if (state.fPreferHeaders) {
                     if (vHeaders.size() > 1) {
@@ -3435,10 +3820,19 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                 pto->nNextInvSend = PoissonNextSend(nNow, INVENTORY_BROADCAST_INTERVAL >> !pto->fInbound);
             }
 
+            if (fSendTrickle) {
+                // Bring in the transactions relayed since any peer last trickled
+                txAnnounceQueue.Seal(mempool, nNow);
+            }
+
             // Time to send but the peer has requested we not relay transactions.
             if (fSendTrickle) {
                 LOCK(pto->cs_filter);
-                if (!pto->fRelayTxes) pto->setInventoryTxToSend.clear();
+                if (!pto->fRelayTxes) {
+                    pto->setInventoryTxToSend.clear();
+                    txAnnounceQueue.MoveReader(state.nTxAnnounceSeq, txAnnounceQueue.End());
+                    state.nTxAnnounceSeq = txAnnounceQueue.End();
+                }
             }
 
             // Respond to BIP35 mempool requests
@@ -3476,46 +3870,17 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
             // Determine transactions to relay
             if (fSendTrickle) {
-                // Produce a vector with all candidates for sending
-                std::vector<std::set<uint256>::iterator> vInvTx;
-                vInvTx.reserve(pto->setInventoryTxToSend.size());
-                for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
-                    vInvTx.push_back(it);
-                }
                 CAmount filterrate = 0;
                 {
                     LOCK(pto->cs_feeFilter);
                     filterrate = pto->minFeeFilter;
                 }
-                // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
-                // A heap is used so that not all items need sorting if only a few are being sent.
-                CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
-                std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
                 // No reason to drain out at many times the network's capacity,
                 // especially since we have many peers and some will draw much shorter delays.
                 unsigned int nRelayedTransactions = 0;
                 LOCK(pto->cs_filter);
-                while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
-                    // Fetch the top element from the heap
-                    std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
-                    std::set<uint256>::iterator it = vInvTx.back();
-                    vInvTx.pop_back();
-                    uint256 hash = *it;
-                    // Remove it from the to-be-sent set
-                    pto->setInventoryTxToSend.erase(it);
-                    // Check if not in the filter already
-                    if (pto->filterInventoryKnown.contains(hash)) {
-                        continue;
-                    }
-                    // Not in the mempool anymore? don't bother sending it.
-                    auto txinfo = mempool.info(hash);
-                    if (!txinfo.tx) {
-                        continue;
-                    }
-                    if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
-                        continue;
-                    }
-                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*txinfo.tx)) continue;
+                auto announceTx = [&](const uint256& hash, CTransactionRef tx) {
+                    if (pto->pfilter && !pto->pfilter->IsRelevantAndUpdate(*tx)) return;
                     // Send
                     vInv.push_back(CInv(MSG_TX, hash));
                     nRelayedTransactions++;
@@ -3527,7 +3892,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                             vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(tx)));
                         if (ret.second) {
                             vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
@@ -3537,6 +3902,62 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                         vInv.clear();
                     }
                     pto->filterInventoryKnown.insert(hash);
+                };
+
+                // Relayed transactions, from the shared queue in mempool order
+                uint64_t nSeq = std::max(state.nTxAnnounceSeq, txAnnounceQueue.Begin());
+                while (nSeq < txAnnounceQueue.End() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    const CTxAnnounceQueue::Announcement& announcement = txAnnounceQueue.At(nSeq++);
+                    if (filterrate && announcement.nFeePerK < filterrate) {
+                        continue;
+                    }
+                    if (pto->filterInventoryKnown.contains(announcement.hash)) {
+                        continue;
+                    }
+                    // Not in the mempool anymore? don't bother sending it.
+                    if (!mempool.exists(announcement.hash)) {
+                        continue;
+                    }
+                    announceTx(announcement.hash, announcement.tx);
+                }
+                txAnnounceQueue.MoveReader(state.nTxAnnounceSeq, nSeq);
+                state.nTxAnnounceSeq = nSeq;
+                txAnnounceQueue.Trim(nNow - TX_ANNOUNCE_QUEUE_EXPIRY * 1000000);
+
+                // Transactions pushed to this peer alone, which are few
+                if (!pto->setInventoryTxToSend.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                    // Produce a vector with all candidates for sending
+                    std::vector<std::set<uint256>::iterator> vInvTx;
+                    vInvTx.reserve(pto->setInventoryTxToSend.size());
+                    for (std::set<uint256>::iterator it = pto->setInventoryTxToSend.begin(); it != pto->setInventoryTxToSend.end(); it++) {
+                        vInvTx.push_back(it);
+                    }
+                    // Topologically and fee-rate sort the inventory we send for privacy and priority reasons.
+                    // A heap is used so that not all items need sorting if only a few are being sent.
+                    CompareInvMempoolOrder compareInvMempoolOrder(&mempool);
+                    std::make_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                    while (!vInvTx.empty() && nRelayedTransactions < INVENTORY_BROADCAST_MAX) {
+                        // Fetch the top element from the heap
+                        std::pop_heap(vInvTx.begin(), vInvTx.end(), compareInvMempoolOrder);
+                        std::set<uint256>::iterator it = vInvTx.back();
+                        vInvTx.pop_back();
+                        uint256 hash = *it;
+                        // Remove it from the to-be-sent set
+                        pto->setInventoryTxToSend.erase(it);
+                        // Check if not in the filter already
+                        if (pto->filterInventoryKnown.contains(hash)) {
+                            continue;
+                        }
+                        // Not in the mempool anymore? don't bother sending it.
+                        auto txinfo = mempool.info(hash);
+                        if (!txinfo.tx) {
+                            continue;
+                        }
+                        if (filterrate && txinfo.feeRate.GetFeePerK() < filterrate) {
+                            continue;
+                        }
+                        announceTx(hash, std::move(txinfo.tx));
+                    }
                 }
             }
         }
@@ -3545,6 +3966,7 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
 
         // Detect whether we're stalling
         nNow = GetTimeMicros();
+        UpdateIdleBlockDownload(state, nNow);
         if (state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -3608,10 +4030,12 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
         // Message: getdata (blocks)
         //
         std::vector<CInv> vGetData;
-        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        const int nBlocksInTransitLimit = GetBlocksInTransitLimit(state);
+        if (!pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < nBlocksInTransitLimit) {
             std::vector<const CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            const CBlockIndex* pindexStalled = nullptr;
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInTransitLimit - state.nBlocksInFlight, vToDownload, staller, pindexStalled, consensusParams);
             for (const CBlockIndex *pindex : vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -3620,10 +4044,8 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
                     pindex->nHeight, pto->GetId());
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
-                    LogPrint(BCLog::NET, "Stall started peer=%d\n", staller);
-                }
+                // Ask this idle peer for the block holding up the window too
+                ReRequestStalledBlock(pto->GetId(), staller, pindexStalled, GetFetchFlags(pto), nNow, vGetData);
             }
         }
 
@@ -3681,14 +4103,3 @@ bool PeerLogicValidation::SendMessages(CNode* pto, std::atomic<bool>& interruptM
     }
     return true;
 }
-
-class CNetProcessingCleanup
-{
-public:
-    CNetProcessingCleanup() {}
-    ~CNetProcessingCleanup() {
-        // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
-    }
-} instance_of_cnetprocessingcleanup;
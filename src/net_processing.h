@@ -12,10 +12,8 @@
 
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
-/** Expiration time for orphan transactions in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
-/** Minimum time between orphan transactions expire time checks in seconds */
-static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Default for -blockmsgcache, memory in MiB for serialized recent blocks kept to serve peers */
+static const unsigned int DEFAULT_BLOCK_MSG_CACHE_SIZE = 32;
 /** Default number of orphan+recently-replaced txn to keep around for block reconstruction */
 static const unsigned int DEFAULT_BLOCK_RECONSTRUCTION_EXTRA_TXN = 100;
 /** Headers download timeout expressed in microseconds
@@ -50,6 +48,12 @@ public:
 
     void InitializeNode(CNode* pnode) override;
     void FinalizeNode(NodeId nodeid, bool& fUpdateConnectionTime) override;
+    /**
+    * Look ahead at the next message of each node before they are processed
+    * one by one, to verify the scripts of the transactions among them in
+    * one batch.
+    */
+    void PrepareMessages(const std::vector<CNode*>& nodes, std::atomic<bool>& interrupt) override;
     /** Process protocol messages received from a given node */
     bool ProcessMessages(CNode* pfrom, std::atomic<bool>& interrupt) override;
     /**
@@ -74,6 +78,9 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int64_t nBlockDownloadRate;
+    int nBlocksInTransitLimit;
+    int nBlocksReRequested;
 };
 
 /** Get statistics from node state */
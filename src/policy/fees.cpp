@@ -14,6 +14,53 @@
 
 static constexpr double INF_FEERATE = 1e99;
 
+/** Version required to read estimates files in the compact format. It is
+ *  above the version of every released client, so that none of them takes
+ *  the file for the older format. */
+static const int COMPACT_FORMAT_VERSION = 1000000;
+
+/** Smallest decay multiplier before the moving averages are rescaled */
+static constexpr double MIN_DECAY_MULTIPLIER = 1e-9;
+
+/** Moving averages below this are written as zero in the compact format */
+static constexpr double MIN_WRITTEN_AVERAGE = 1e-6;
+
+/** Write the (non-negligible) entries of a vector of moving averages, scaled
+ *  by multiplier, as pairs of the distance from the previous entry's index
+ *  and a float. */
+static void WriteCompact(CAutoFile& fileout, const std::vector<double>& values, double multiplier)
+{
+    std::vector<std::pair<uint64_t, float>> entries;
+    uint64_t last = 0;
+    for (uint64_t i = 0; i < values.size(); i++) {
+        const double value = values[i] * multiplier;
+        if (value < MIN_WRITTEN_AVERAGE) continue;
+        entries.emplace_back(i - last, (float)value);
+        last = i;
+    }
+    WriteCompactSize(fileout, entries.size());
+    for (auto& entry : entries) {
+        fileout << VARINT(entry.first) << entry.second;
+    }
+}
+
+static void ReadCompact(CAutoFile& filein, std::vector<double>& values, size_t size)
+{
+    values.assign(size, 0);
+    uint64_t count = ReadCompactSize(filein);
+    uint64_t index = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t delta;
+        float value;
+        filein >> VARINT(delta) >> value;
+        index += delta;
+        if (index >= size || (i > 0 && delta == 0)) {
+            throw std::runtime_error("Corrupt estimates file. Bucket index out of range");
+        }
+        values[index] = value;
+    }
+}
+
 std::string StringForFeeEstimateHorizon(FeeEstimateHorizon horizon) {
     static const std::map<FeeEstimateHorizon, std::string> horizon_strings = {
         {FeeEstimateHorizon::SHORT_HALFLIFE, "short"},
@@ -98,6 +145,11 @@ private:
 
     double decay;
 
+    // The moving averages above are stored divided by the decay accumulated
+    // since they were last rescaled, so that decaying all of them once per
+    // block only has to update this multiplier.
+    double decayMultiplier;
+
     // Resolution (# of blocks) with which confirmations are tracked
     unsigned int scale;
 
@@ -110,6 +162,9 @@ private:
 
     void resizeInMemoryCounters(size_t newbuckets);
 
+    /** Apply decayMultiplier to the stored moving averages and reset it */
+    void Rescale();
+
 public:
     /**
      * Create new TxConfirmStats. This is called by BlockPolicyEstimator's
@@ -161,12 +216,12 @@ public:
     /** Return the max number of confirms we're tracking */
     unsigned int GetMaxConfirms() const { return scale * confAvg.size(); }
 
-    /** Write state of estimation data to a file*/
+    /** Write state of estimation data to a file in the compact format*/
     void Write(CAutoFile& fileout) const;
 
     /**
      * Read saved state of estimation data from a file and replace all internal data structures and
-     * variables with this state.
+     * variables with this state. nFileVersion is the version required to read the file.
      */
     void Read(CAutoFile& filein, int nFileVersion, size_t numBuckets);
 };
@@ -178,6 +233,7 @@ TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets,
     : buckets(defaultBuckets), bucketMap(defaultBucketMap)
 {
     decay = _decay;
+    decayMultiplier = 1;
     assert(_scale != 0 && "_scale must be non-zero");
     scale = _scale;
     confAvg.resize(maxPeriods);
@@ -221,23 +277,33 @@ void TxConfirmStats::Record(int blocksToConfirm, double val)
         return;
     int periodsToConfirm = (blocksToConfirm + scale - 1)/scale;
     unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    const double weight = 1 / decayMultiplier;
     for (size_t i = periodsToConfirm; i <= confAvg.size(); i++) {
-        confAvg[i - 1][bucketindex]++;
+        confAvg[i - 1][bucketindex] += weight;
     }
-    txCtAvg[bucketindex]++;
-    avg[bucketindex] += val;
+    txCtAvg[bucketindex] += weight;
+    avg[bucketindex] += val * weight;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
+    decayMultiplier *= decay;
+    if (decayMultiplier < MIN_DECAY_MULTIPLIER) {
+        Rescale();
+    }
+}
+
+void TxConfirmStats::Rescale()
+{
+    for (unsigned int j = 0; j < avg.size(); j++) {
         for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay;
+            confAvg[i][j] *= decayMultiplier;
         for (unsigned int i = 0; i < failAvg.size(); i++)
-            failAvg[i][j] = failAvg[i][j] * decay;
-        avg[j] = avg[j] * decay;
-        txCtAvg[j] = txCtAvg[j] * decay;
+            failAvg[i][j] *= decayMultiplier;
+        avg[j] *= decayMultiplier;
+        txCtAvg[j] *= decayMultiplier;
     }
+    decayMultiplier = 1;
 }
 
 // returns -1 on error conditions
@@ -285,9 +351,9 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
             newBucketRange = false;
         }
         curFarBucket = bucket;
-        nConf += confAvg[periodTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
-        failNum += failAvg[periodTarget - 1][bucket];
+        nConf += confAvg[periodTarget - 1][bucket] * decayMultiplier;
+        totalNum += txCtAvg[bucket] * decayMultiplier;
+        failNum += failAvg[periodTarget - 1][bucket] * decayMultiplier;
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
             extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
         extraNum += oldUnconfTxs[bucket];
@@ -344,6 +410,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // and reporting the average which is less accurate
     unsigned int minBucket = std::min(bestNearBucket, bestFarBucket);
     unsigned int maxBucket = std::max(bestNearBucket, bestFarBucket);
+    // Counts are compared in their stored scale, as decayMultiplier cancels out
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
         txSum += txCtAvg[j];
     }
@@ -397,10 +464,16 @@ void TxConfirmStats::Write(CAutoFile& fileout) const
 {
     fileout << decay;
     fileout << scale;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
-    fileout << failAvg;
+    WriteCompact(fileout, avg, decayMultiplier);
+    WriteCompact(fileout, txCtAvg, decayMultiplier);
+    WriteCompactSize(fileout, confAvg.size());
+    for (const std::vector<double>& row : confAvg) {
+        WriteCompact(fileout, row, decayMultiplier);
+    }
+    WriteCompactSize(fileout, failAvg.size());
+    for (const std::vector<double>& row : failAvg) {
+        WriteCompact(fileout, row, decayMultiplier);
+    }
 }
 
 void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets)
@@ -420,15 +493,34 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
         throw std::runtime_error("Corrupt estimates file. Scale must be non-zero");
     }
 
-    filein >> avg;
+    if (nFileVersion >= COMPACT_FORMAT_VERSION) {
+        // Bucket counts are implied by the compact format, so only the
+        // number of periods needs checking below.
+        auto read_periods = [&](std::vector<std::vector<double>>& rows) {
+            uint64_t periods = ReadCompactSize(filein);
+            if (periods > 6 * 24 * 7) {
+                throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
+            }
+            rows.resize(periods);
+            for (std::vector<double>& row : rows) {
+                ReadCompact(filein, row, numBuckets);
+            }
+        };
+        ReadCompact(filein, avg, numBuckets);
+        ReadCompact(filein, txCtAvg, numBuckets);
+        read_periods(confAvg);
+        read_periods(failAvg);
+    } else {
+        filein >> avg >> txCtAvg >> confAvg >> failAvg;
+    }
+    decayMultiplier = 1;
+
     if (avg.size() != numBuckets) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in feerate average bucket count");
     }
-    filein >> txCtAvg;
     if (txCtAvg.size() != numBuckets) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     }
-    filein >> confAvg;
     maxPeriods = confAvg.size();
     maxConfirms = scale * maxPeriods;
 
@@ -441,7 +533,6 @@ void TxConfirmStats::Read(CAutoFile& filein, int nFileVersion, size_t numBuckets
         }
     }
 
-    filein >> failAvg;
     if (maxPeriods != failAvg.size()) {
         throw std::runtime_error("Corrupt estimates file. Mismatch in confirms tracked for failures");
     }
@@ -499,7 +590,7 @@ void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHe
         assert(scale != 0);
         unsigned int periodsAgo = blocksAgo / scale;
         for (size_t i = 0; i < periodsAgo && i < failAvg.size(); i++) {
-            failAvg[i][bucketindex]++;
+            failAvg[i][bucketindex] += 1 / decayMultiplier;
         }
     }
 }
@@ -525,7 +616,7 @@ bool CBlockPolicyEstimator::removeTx(uint256 hash, bool inBlock)
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator()
-    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), trackedTxs(0), untrackedTxs(0)
+    : nBestSeenHeight(0), firstRecordedHeight(0), historicalFirst(0), historicalBest(0), lastWrittenHeight(0), trackedTxs(0), untrackedTxs(0)
 {
     static_assert(MIN_BUCKET_FEERATE > 0, "Min feerate must be nonzero");
     size_t bucketIndex = 0;
@@ -640,6 +731,8 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     shortStats->UpdateMovingAverages();
     longStats->UpdateMovingAverages();
 
+    mapSmartFeeCache.clear();
+
     unsigned int countedTxs = 0;
     // Update averages with data points from current block
     for (const auto& entry : entries) {
@@ -821,6 +914,39 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, FeeCalculation
 {
     LOCK(cs_feeEstimator);
 
+    // Only cache targets that can be tracked, to bound the cache's size
+    if (confTarget <= 0 || (unsigned int)confTarget > longStats->GetMaxConfirms()) {
+        return calculateSmartFee(confTarget, feeCalc, conservative);
+    }
+    auto it = mapSmartFeeCache.find(std::make_pair(confTarget, conservative));
+    if (it == mapSmartFeeCache.end()) {
+        FeeCalculation calc;
+        CFeeRate feeRate = calculateSmartFee(confTarget, &calc, conservative);
+        it = mapSmartFeeCache.emplace(std::make_pair(confTarget, conservative), std::make_pair(feeRate, calc)).first;
+    }
+    if (feeCalc) *feeCalc = it->second.second;
+    return it->second.first;
+}
+
+std::vector<std::pair<unsigned int, CFeeRate>> CBlockPolicyEstimator::estimateSmartFeeCurve(bool conservative) const
+{
+    LOCK(cs_feeEstimator);
+    std::vector<std::pair<unsigned int, CFeeRate>> curve;
+    // Larger targets are clamped to MaxUsableEstimate() by estimateSmartFee
+    const unsigned int maxTarget = MaxUsableEstimate();
+    for (unsigned int target = 2; target <= maxTarget; target++) {
+        CFeeRate feeRate = estimateSmartFee(target, nullptr, conservative);
+        if (feeRate != CFeeRate(0)) {
+            curve.emplace_back(target, feeRate);
+        }
+    }
+    return curve;
+}
+
+CFeeRate CBlockPolicyEstimator::calculateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const
+{
+    AssertLockHeld(cs_feeEstimator);
+
     if (feeCalc) {
         feeCalc->desiredTarget = confTarget;
         feeCalc->returnedTarget = confTarget;
@@ -900,7 +1026,7 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
 {
     try {
         LOCK(cs_feeEstimator);
-        fileout << 149900; // version required to read: 0.14.99 or later
+        fileout << COMPACT_FORMAT_VERSION; // version required to read
         fileout << CLIENT_VERSION; // version that wrote the file
         fileout << nBestSeenHeight;
         if (BlockSpan() > HistoricalBlockSpan()/2) {
@@ -913,6 +1039,7 @@ bool CBlockPolicyEstimator::Write(CAutoFile& fileout) const
         feeStats->Write(fileout);
         shortStats->Write(fileout);
         longStats->Write(fileout);
+        lastWrittenHeight = nBestSeenHeight;
     }
     catch (const std::exception&) {
         LogPrintf("CBlockPolicyEstimator::Write(): unable to write policy estimator data (non-fatal)\n");
@@ -927,7 +1054,7 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
         LOCK(cs_feeEstimator);
         int nVersionRequired, nVersionThatWrote;
         filein >> nVersionRequired >> nVersionThatWrote;
-        if (nVersionRequired > CLIENT_VERSION)
+        if (nVersionRequired > CLIENT_VERSION && nVersionRequired != COMPACT_FORMAT_VERSION)
             return error("CBlockPolicyEstimator::Read(): up-version (%d) fee estimate file", nVersionRequired);
 
         // Read fee estimates file into temporary variables so existing data
@@ -952,9 +1079,9 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             std::unique_ptr<TxConfirmStats> fileFeeStats(new TxConfirmStats(buckets, bucketMap, MED_BLOCK_PERIODS, MED_DECAY, MED_SCALE));
             std::unique_ptr<TxConfirmStats> fileShortStats(new TxConfirmStats(buckets, bucketMap, SHORT_BLOCK_PERIODS, SHORT_DECAY, SHORT_SCALE));
             std::unique_ptr<TxConfirmStats> fileLongStats(new TxConfirmStats(buckets, bucketMap, LONG_BLOCK_PERIODS, LONG_DECAY, LONG_SCALE));
-            fileFeeStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileShortStats->Read(filein, nVersionThatWrote, numBuckets);
-            fileLongStats->Read(filein, nVersionThatWrote, numBuckets);
+            fileFeeStats->Read(filein, nVersionRequired, numBuckets);
+            fileShortStats->Read(filein, nVersionRequired, numBuckets);
+            fileLongStats->Read(filein, nVersionRequired, numBuckets);
 
             // Fee estimates file parsed correctly
             // Copy buckets from file and refresh our bucketmap
@@ -972,6 +1099,8 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
             nBestSeenHeight = nFileBestSeenHeight;
             historicalFirst = nFileHistoricalFirst;
             historicalBest = nFileHistoricalBest;
+            lastWrittenHeight = nBestSeenHeight;
+            mapSmartFeeCache.clear();
         }
     }
     catch (const std::exception& e) {
@@ -981,6 +1110,12 @@ bool CBlockPolicyEstimator::Read(CAutoFile& filein)
     return true;
 }
 
+bool CBlockPolicyEstimator::HasUnwrittenBlocks() const
+{
+    LOCK(cs_feeEstimator);
+    return nBestSeenHeight != lastWrittenHeight;
+}
+
 void CBlockPolicyEstimator::FlushUnconfirmed(CTxMemPool& pool) {
     int64_t startclear = GetTimeMicros();
     std::vector<uint256> txids;
@@ -989,6 +1124,7 @@ void CBlockPolicyEstimator::FlushUnconfirmed(CTxMemPool& pool) {
     for (auto& txid : txids) {
         removeTx(txid, false);
     }
+    mapSmartFeeCache.clear();
     int64_t endclear = GetTimeMicros();
     LogPrint(BCLog::ESTIMATEFEE, "Recorded %u unconfirmed txs from mempool in %gs\n",txids.size(), (endclear - startclear)*0.000001);
 }
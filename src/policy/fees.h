@@ -207,10 +207,18 @@ public:
     /** Estimate feerate needed to get be included in a block within confTarget
      *  blocks. If no answer can be given at confTarget, return an estimate at
      *  the closest target where one can be given.  'conservative' estimates are
-     *  valid over longer time horizons also.
+     *  valid over longer time horizons also.  Answers are cached until the
+     *  next block is processed, so they do not follow mempool changes in
+     *  between.
      */
     CFeeRate estimateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const;
 
+    /** Return the estimateSmartFee() answer for every target from 2 up to
+     *  the highest target a reasonable estimate can be given for, leaving out
+     *  targets without an answer.
+     */
+    std::vector<std::pair<unsigned int, CFeeRate>> estimateSmartFeeCurve(bool conservative) const;
+
     /** Return a specific fee estimate calculation with a given success
      * threshold and time horizon, and optionally return detailed data about
      * calculation
@@ -223,6 +231,9 @@ public:
     /** Read estimation data from a file */
     bool Read(CAutoFile& filein);
 
+    /** Whether blocks were processed since estimation data was last written or read */
+    bool HasUnwrittenBlocks() const;
+
     /** Empty mempool transactions on shutdown to record failure to confirm for txs still in mempool */
     void FlushUnconfirmed(CTxMemPool& pool);
 
@@ -234,6 +245,7 @@ private:
     unsigned int firstRecordedHeight;
     unsigned int historicalFirst;
     unsigned int historicalBest;
+    mutable unsigned int lastWrittenHeight;
 
     struct TxStatsInfo
     {
@@ -258,9 +270,14 @@ private:
 
     mutable CCriticalSection cs_feeEstimator;
 
+    /** estimateSmartFee() answers by target and conservativeness, cleared for every new block */
+    mutable std::map<std::pair<int, bool>, std::pair<CFeeRate, FeeCalculation>> mapSmartFeeCache;
+
     /** Process a transaction confirmed in a block*/
     bool processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry* entry);
 
+    /** Compute an estimateSmartFee() answer */
+    CFeeRate calculateSmartFee(int confTarget, FeeCalculation *feeCalc, bool conservative) const;
     /** Helper for estimateSmartFee */
     double estimateCombinedFee(unsigned int confTarget, double successThreshold, bool checkShorterHorizon, EstimationResult *result) const;
     /** Helper for estimateSmartFee */
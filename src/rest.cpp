@@ -6,6 +6,7 @@
 #include <chain.h>
 #include <chainparams.h>
 #include <core_io.h>
+#include <index/txindex.h>
 #include <primitives/block.h>
 #include <primitives/transaction.h>
 #include <validation.h>
@@ -350,6 +351,10 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    if (g_txindex) {
+        g_txindex->BlockUntilSyncedToCurrentChain();
+    }
+
     CTransactionRef tx;
     uint256 hashBlock = uint256();
     if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
@@ -388,6 +393,56 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     }
 }
 
+UniValue getaddressbalance(const JSONRPCRequest& request);
+UniValue getaddressutxos(const JSONRPCRequest& request);
+UniValue getaddresshistory(const JSONRPCRequest& request);
+
+static bool rest_address(HTTPRequest* req, const std::string& strURIPart)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string param;
+    const RetFormat rf = ParseDataFormat(param, strURIPart);
+
+    // param is "<balance|utxos|history>/<address or hex script>"
+    std::vector<std::string> path;
+    boost::split(path, param, boost::is_any_of("/"));
+    if (path.size() != 2)
+        return RESTERR(req, HTTP_BAD_REQUEST, "Invalid URI format. Expected /rest/address/<balance|utxos|history>/<address>.json");
+
+    UniValue (*actor)(const JSONRPCRequest&);
+    if (path[0] == "balance") {
+        actor = getaddressbalance;
+    } else if (path[0] == "utxos") {
+        actor = getaddressutxos;
+    } else if (path[0] == "history") {
+        actor = getaddresshistory;
+    } else {
+        return RESTERR(req, HTTP_NOT_FOUND, "Unknown address query: " + path[0]);
+    }
+
+    switch (rf) {
+    case RF_JSON: {
+        JSONRPCRequest jsonRequest;
+        jsonRequest.params = UniValue(UniValue::VARR);
+        jsonRequest.params.push_back(path[1]);
+        UniValue result;
+        try {
+            result = actor(jsonRequest);
+        } catch (const UniValue& objError) {
+            return RESTERR(req, HTTP_BAD_REQUEST, find_value(objError, "message").get_str());
+        }
+        std::string strJSON = result.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+}
+
 static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -582,6 +637,7 @@ static const struct {
       {"/rest/mempool/contents", rest_mempool_contents},
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
+      {"/rest/address/", rest_address},
 };
 
 bool StartREST()
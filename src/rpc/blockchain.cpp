@@ -6,6 +6,7 @@
 #include <rpc/blockchain.h>
 
 #include <amount.h>
+#include <base58.h>
 #include <chain.h>
 #include <chainparams.h>
 #include <checkpoints.h>
@@ -13,10 +14,13 @@
 #include <consensus/validation.h>
 #include <validation.h>
 #include <core_io.h>
+#include <index/addressindex.h>
+#include <index/blockfilterindex.h>
 #include <policy/feerate.h>
 #include <policy/policy.h>
 #include <primitives/transaction.h>
 #include <rpc/server.h>
+#include <script/standard.h>
 #include <streams.h>
 #include <sync.h>
 #include <txdb.h>
@@ -47,6 +51,10 @@ static std::mutex cs_blockchange;
 static std::condition_variable cond_blockchange;
 static CUpdatedBlock latestblock;
 
+/** Default and maximum number of transactions on a getrawmempoolpage page */
+static const int64_t DEFAULT_MEMPOOL_PAGE_SIZE = 1000;
+static const int64_t MAX_MEMPOOL_PAGE_SIZE = 10000;
+
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
 
 /* Calculate the difficulty for a given block index,
@@ -378,28 +386,68 @@ std::string EntryDescriptionString()
            "       ... ]\n";
 }
 
-void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
+/** The fields of a mempool entry that entryToJSON() reports, copied while
+ *  holding mempool.cs so that the JSON can be built after releasing it. */
+struct MempoolEntrySnapshot
+{
+    CTransactionRef tx;
+    size_t nTxSize;
+    CAmount nFee;
+    CAmount nModifiedFee;
+    int64_t nTime;
+    unsigned int nHeight;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
+    std::vector<uint256> vDepends;
+};
+
+static MempoolEntrySnapshot SnapshotEntry(const CTxMemPoolEntry& e)
 {
     AssertLockHeld(mempool.cs);
 
-    info.push_back(Pair("size", (int)e.GetTxSize()));
-    info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
-    info.push_back(Pair("modifiedfee", ValueFromAmount(e.GetModifiedFee())));
-    info.push_back(Pair("time", e.GetTime()));
-    info.push_back(Pair("height", (int)e.GetHeight()));
-    info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
-    info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
-    info.push_back(Pair("descendantfees", e.GetModFeesWithDescendants()));
-    info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
-    info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
-    info.push_back(Pair("ancestorfees", e.GetModFeesWithAncestors()));
-    info.push_back(Pair("wtxid", mempool.vTxHashes[e.vTxHashesIdx].first.ToString()));
-    const CTransaction& tx = e.GetTx();
-    std::set<std::string> setDepends;
-    for (const CTxIn& txin : tx.vin)
+    MempoolEntrySnapshot snapshot;
+    snapshot.tx = e.GetSharedTx();
+    snapshot.nTxSize = e.GetTxSize();
+    snapshot.nFee = e.GetFee();
+    snapshot.nModifiedFee = e.GetModifiedFee();
+    snapshot.nTime = e.GetTime();
+    snapshot.nHeight = e.GetHeight();
+    snapshot.nCountWithDescendants = e.GetCountWithDescendants();
+    snapshot.nSizeWithDescendants = e.GetSizeWithDescendants();
+    snapshot.nModFeesWithDescendants = e.GetModFeesWithDescendants();
+    snapshot.nCountWithAncestors = e.GetCountWithAncestors();
+    snapshot.nSizeWithAncestors = e.GetSizeWithAncestors();
+    snapshot.nModFeesWithAncestors = e.GetModFeesWithAncestors();
+    for (const CTxIn& txin : e.GetTx().vin)
     {
         if (mempool.exists(txin.prevout.hash))
-            setDepends.insert(txin.prevout.hash.ToString());
+            snapshot.vDepends.push_back(txin.prevout.hash);
+    }
+    return snapshot;
+}
+
+void entryToJSON(UniValue &info, const MempoolEntrySnapshot &e)
+{
+    info.push_back(Pair("size", (int)e.nTxSize));
+    info.push_back(Pair("fee", ValueFromAmount(e.nFee)));
+    info.push_back(Pair("modifiedfee", ValueFromAmount(e.nModifiedFee)));
+    info.push_back(Pair("time", e.nTime));
+    info.push_back(Pair("height", (int)e.nHeight));
+    info.push_back(Pair("descendantcount", e.nCountWithDescendants));
+    info.push_back(Pair("descendantsize", e.nSizeWithDescendants));
+    info.push_back(Pair("descendantfees", e.nModFeesWithDescendants));
+    info.push_back(Pair("ancestorcount", e.nCountWithAncestors));
+    info.push_back(Pair("ancestorsize", e.nSizeWithAncestors));
+    info.push_back(Pair("ancestorfees", e.nModFeesWithAncestors));
+    info.push_back(Pair("wtxid", e.tx->GetWitnessHash().ToString()));
+    std::set<std::string> setDepends;
+    for (const uint256& hash : e.vDepends)
+    {
+        setDepends.insert(hash.ToString());
     }
 
     UniValue depends(UniValue::VARR);
@@ -411,20 +459,33 @@ void entryToJSON(UniValue &info, const CTxMemPoolEntry &e)
     info.push_back(Pair("depends", depends));
 }
 
+/** Render snapshots as a JSON object keyed by txid */
+static UniValue SnapshotsToJSON(const std::vector<MempoolEntrySnapshot>& snapshots)
+{
+    UniValue o(UniValue::VOBJ);
+    for (const MempoolEntrySnapshot& e : snapshots)
+    {
+        UniValue info(UniValue::VOBJ);
+        entryToJSON(info, e);
+        o.push_back(Pair(e.tx->GetHash().ToString(), info));
+    }
+    return o;
+}
+
 UniValue mempoolToJSON(bool fVerbose)
 {
     if (fVerbose)
     {
-        LOCK(mempool.cs);
-        UniValue o(UniValue::VOBJ);
-        for (const CTxMemPoolEntry& e : mempool.mapTx)
+        std::vector<MempoolEntrySnapshot> snapshots;
         {
-            const uint256& hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(hash.ToString(), info));
+            LOCK(mempool.cs);
+            snapshots.reserve(mempool.mapTx.size());
+            for (const CTxMemPoolEntry& e : mempool.mapTx)
+            {
+                snapshots.push_back(SnapshotEntry(e));
+            }
         }
-        return o;
+        return SnapshotsToJSON(snapshots);
     }
     else
     {
@@ -471,6 +532,93 @@ UniValue getrawmempool(const JSONRPCRequest& request)
     return mempoolToJSON(fVerbose);
 }
 
+UniValue getrawmempoolpage(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 3)
+        throw std::runtime_error(
+            "getrawmempoolpage ( \"start\" count verbose )\n"
+            "\nReturns a page of the transactions in the memory pool, ordered by transaction id.\n"
+            "Only the entries on the page are copied while the mempool is locked, so walking a large mempool\n"
+            "page by page does not hold up transaction relay.\n"
+            "\nArguments:\n"
+            "1. \"start\"   (string, optional) Return transactions following this one, as returned in \"next\" (default: from the first)\n"
+            "2. count     (numeric, optional, default=" + std::to_string(DEFAULT_MEMPOOL_PAGE_SIZE) + ") The maximum number of transactions to return (at most " + std::to_string(MAX_MEMPOOL_PAGE_SIZE) + ")\n"
+            "3. verbose   (boolean, optional, default=false) True for json objects, false for transaction ids\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"transactions\" : [      (json array of strings for verbose = false) The transaction ids\n"
+            "     \"transactionid\"\n"
+            "     ,...\n"
+            "  ],\n"
+            "  \"transactions\" : {      (json object for verbose = true)\n"
+            "    \"transactionid\" : {\n"
+            + EntryDescriptionString()
+            + "    }, ...\n"
+            "  },\n"
+            "  \"next\" : \"transactionid\"  (string, optional) start of the next page, if there is one\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getrawmempoolpage", "")
+            + HelpExampleCli("getrawmempoolpage", "\"mytxid\" 100 true")
+            + HelpExampleRpc("getrawmempoolpage", "\"mytxid\", 100, true")
+        );
+
+    bool fStart = !request.params[0].isNull() && !request.params[0].get_str().empty();
+    uint256 start;
+    if (fStart)
+        start = ParseHashV(request.params[0], "start");
+    int64_t count = DEFAULT_MEMPOOL_PAGE_SIZE;
+    if (!request.params[1].isNull()) {
+        count = request.params[1].get_int64();
+        if (count < 1 || count > MAX_MEMPOOL_PAGE_SIZE)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid count");
+    }
+    bool fVerbose = false;
+    if (!request.params[2].isNull())
+        fVerbose = request.params[2].get_bool();
+
+    std::vector<uint256> vtxid;
+    std::vector<MempoolEntrySnapshot> snapshots;
+    bool fMore;
+    {
+        LOCK(mempool.cs);
+
+        // Walk the txid index from start, so that a page costs no more than
+        // its own entries
+        const auto& byTxid = mempool.mapTx.get<ordered_txid>();
+        auto it = fStart ? byTxid.upper_bound(start) : byTxid.begin();
+        std::vector<CTxMemPool::txiter> page;
+        for (; it != byTxid.end() && page.size() < (size_t)count; ++it) {
+            page.push_back(mempool.mapTx.project<0>(it));
+        }
+        fMore = it != byTxid.end();
+
+        for (CTxMemPool::txiter it : page) {
+            if (fVerbose) {
+                snapshots.push_back(SnapshotEntry(*it));
+            } else {
+                vtxid.push_back(it->GetTx().GetHash());
+            }
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    uint256 last;
+    if (fVerbose) {
+        result.push_back(Pair("transactions", SnapshotsToJSON(snapshots)));
+        if (!snapshots.empty()) last = snapshots.back().tx->GetHash();
+    } else {
+        UniValue a(UniValue::VARR);
+        for (const uint256& hash : vtxid)
+            a.push_back(hash.ToString());
+        result.push_back(Pair("transactions", a));
+        if (!vtxid.empty()) last = vtxid.back();
+    }
+    if (fMore)
+        result.push_back(Pair("next", last.ToString()));
+    return result;
+}
+
 UniValue getmempoolancestors(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2) {
@@ -503,35 +651,39 @@ UniValue getmempoolancestors(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<uint256> vAncestors;
+    std::vector<MempoolEntrySnapshot> snapshots;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
+
+        CTxMemPool::setEntries setAncestors;
+        uint64_t noLimit = std::numeric_limits<uint64_t>::max();
+        std::string dummy;
+        mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
 
-    CTxMemPool::setEntries setAncestors;
-    uint64_t noLimit = std::numeric_limits<uint64_t>::max();
-    std::string dummy;
-    mempool.CalculateMemPoolAncestors(*it, setAncestors, noLimit, noLimit, noLimit, noLimit, dummy, false);
+        for (CTxMemPool::txiter ancestorIt : setAncestors) {
+            if (fVerbose) {
+                snapshots.push_back(SnapshotEntry(*ancestorIt));
+            } else {
+                vAncestors.push_back(ancestorIt->GetTx().GetHash());
+            }
+        }
+    }
 
     if (!fVerbose) {
         UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            o.push_back(ancestorIt->GetTx().GetHash().ToString());
+        for (const uint256& ancestor : vAncestors) {
+            o.push_back(ancestor.ToString());
         }
 
         return o;
     } else {
-        UniValue o(UniValue::VOBJ);
-        for (CTxMemPool::txiter ancestorIt : setAncestors) {
-            const CTxMemPoolEntry &e = *ancestorIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
-        }
-        return o;
+        return SnapshotsToJSON(snapshots);
     }
 }
 
@@ -567,35 +719,39 @@ UniValue getmempooldescendants(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    std::vector<uint256> vDescendants;
+    std::vector<MempoolEntrySnapshot> snapshots;
+    {
+        LOCK(mempool.cs);
+
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
-    }
+        CTxMemPool::setEntries setDescendants;
+        mempool.CalculateDescendants(it, setDescendants);
+        // CTxMemPool::CalculateDescendants will include the given tx
+        setDescendants.erase(it);
 
-    CTxMemPool::setEntries setDescendants;
-    mempool.CalculateDescendants(it, setDescendants);
-    // CTxMemPool::CalculateDescendants will include the given tx
-    setDescendants.erase(it);
+        for (CTxMemPool::txiter descendantIt : setDescendants) {
+            if (fVerbose) {
+                snapshots.push_back(SnapshotEntry(*descendantIt));
+            } else {
+                vDescendants.push_back(descendantIt->GetTx().GetHash());
+            }
+        }
+    }
 
     if (!fVerbose) {
         UniValue o(UniValue::VARR);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            o.push_back(descendantIt->GetTx().GetHash().ToString());
+        for (const uint256& descendant : vDescendants) {
+            o.push_back(descendant.ToString());
         }
 
         return o;
     } else {
-        UniValue o(UniValue::VOBJ);
-        for (CTxMemPool::txiter descendantIt : setDescendants) {
-            const CTxMemPoolEntry &e = *descendantIt;
-            const uint256& _hash = e.GetTx().GetHash();
-            UniValue info(UniValue::VOBJ);
-            entryToJSON(info, e);
-            o.push_back(Pair(_hash.ToString(), info));
-        }
-        return o;
+        return SnapshotsToJSON(snapshots);
     }
 }
 
@@ -619,16 +775,19 @@ UniValue getmempoolentry(const JSONRPCRequest& request)
 
     uint256 hash = ParseHashV(request.params[0], "parameter 1");
 
-    LOCK(mempool.cs);
+    MempoolEntrySnapshot snapshot;
+    {
+        LOCK(mempool.cs);
 
-    CTxMemPool::txiter it = mempool.mapTx.find(hash);
-    if (it == mempool.mapTx.end()) {
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        CTxMemPool::txiter it = mempool.mapTx.find(hash);
+        if (it == mempool.mapTx.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Transaction not in mempool");
+        }
+        snapshot = SnapshotEntry(*it);
     }
 
-    const CTxMemPoolEntry &e = *it;
     UniValue info(UniValue::VOBJ);
-    entryToJSON(info, e);
+    entryToJSON(info, snapshot);
     return info;
 }
 
@@ -1618,6 +1777,234 @@ UniValue savemempool(const JSONRPCRequest& request)
     return NullUniValue;
 }
 
+/** Resolve an address or hex-encoded scriptPubKey argument to the hash it is indexed under. */
+static uint256 AddressIndexScriptHash(const UniValue& param)
+{
+    if (!g_addressindex) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled. Use -addressindex to enable it");
+    }
+
+    const std::string& str = param.get_str();
+    CScript script;
+    CTxDestination dest = DecodeDestination(str);
+    if (IsValidDestination(dest)) {
+        script = GetScriptForDestination(dest);
+    } else if (!str.empty() && IsHex(str)) {
+        std::vector<unsigned char> data(ParseHex(str));
+        script = CScript(data.begin(), data.end());
+    } else {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid address or script");
+    }
+
+    if (!g_addressindex->BlockUntilSyncedToCurrentChain()) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index is still being built");
+    }
+    return AddressIndex::GetScriptHash(script);
+}
+
+UniValue getaddressbalance(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw std::runtime_error(
+            "getaddressbalance \"address\"\n"
+            "\nReturns the confirmed balance of an address or script. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"          (string, required) A litecoin address or hex-encoded scriptPubKey\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : x.xxx,   (numeric) The sum of unspent outputs in " + CURRENCY_UNIT + "\n"
+            "  \"received\" : x.xxx,  (numeric) The sum of all outputs ever received in " + CURRENCY_UNIT + "\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+            + HelpExampleRpc("getaddressbalance", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+        );
+
+    const uint256 script_hash = AddressIndexScriptHash(request.params[0]);
+
+    std::vector<AddressDelta> deltas;
+    std::vector<AddressUnspent> unspent;
+    if (!g_addressindex->FindDeltas(script_hash, deltas) || !g_addressindex->FindUnspent(script_hash, unspent)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+    }
+
+    CAmount balance = 0;
+    for (const AddressUnspent& entry : unspent) {
+        balance += entry.amount;
+    }
+    CAmount received = 0;
+    for (const AddressDelta& delta : deltas) {
+        if (!delta.spending) received += delta.amount;
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("balance", ValueFromAmount(balance)));
+    ret.push_back(Pair("received", ValueFromAmount(received)));
+    return ret;
+}
+
+UniValue getaddressutxos(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw std::runtime_error(
+            "getaddressutxos \"address\"\n"
+            "\nReturns the confirmed unspent outputs of an address or script. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"          (string, required) A litecoin address or hex-encoded scriptPubKey\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"hash\",    (string) The transaction id\n"
+            "    \"vout\" : n,         (numeric) The output number\n"
+            "    \"amount\" : x.xxx,   (numeric) The output value in " + CURRENCY_UNIT + "\n"
+            "    \"height\" : n        (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+            + HelpExampleRpc("getaddressutxos", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+        );
+
+    const uint256 script_hash = AddressIndexScriptHash(request.params[0]);
+
+    std::vector<AddressUnspent> unspent;
+    if (!g_addressindex->FindUnspent(script_hash, unspent)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+    }
+
+    UniValue ret(UniValue::VARR);
+    for (const AddressUnspent& entry : unspent) {
+        UniValue o(UniValue::VOBJ);
+        o.push_back(Pair("txid", entry.outpoint.hash.GetHex()));
+        o.push_back(Pair("vout", (int)entry.outpoint.n));
+        o.push_back(Pair("amount", ValueFromAmount(entry.amount)));
+        o.push_back(Pair("height", entry.height));
+        ret.push_back(o);
+    }
+    return ret;
+}
+
+UniValue getaddresshistory(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() != 1)
+        throw std::runtime_error(
+            "getaddresshistory \"address\"\n"
+            "\nReturns all confirmed balance changes of an address or script, in chain order. Requires -addressindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"          (string, required) A litecoin address or hex-encoded scriptPubKey\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"txid\" : \"hash\",      (string) The transaction id\n"
+            "    \"height\" : n,         (numeric) The height of the block containing the transaction\n"
+            "    \"index\" : n,          (numeric) The output number, or the input number if spending\n"
+            "    \"spending\" : true|false, (boolean) Whether this entry spends a previous output\n"
+            "    \"amount\" : x.xxx      (numeric) The change in balance in " + CURRENCY_UNIT + ", negative if spending\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+            + HelpExampleRpc("getaddresshistory", "\"LER4HnAEFwYHbmGxCfP2po1nPrUeiK8KM2\"")
+        );
+
+    const uint256 script_hash = AddressIndexScriptHash(request.params[0]);
+
+    std::vector<AddressDelta> deltas;
+    if (!g_addressindex->FindDeltas(script_hash, deltas)) {
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Unable to read address index");
+    }
+
+    UniValue ret(UniValue::VARR);
+    for (const AddressDelta& delta : deltas) {
+        UniValue o(UniValue::VOBJ);
+        o.push_back(Pair("txid", delta.txid.GetHex()));
+        o.push_back(Pair("height", delta.height));
+        o.push_back(Pair("index", (int)delta.index));
+        o.push_back(Pair("spending", delta.spending));
+        o.push_back(Pair("amount", ValueFromAmount(delta.amount)));
+        ret.push_back(o);
+    }
+    return ret;
+}
+
+UniValue getblockfilter(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
+        throw std::runtime_error(
+            "getblockfilter \"blockhash\" ( \"filtertype\" )\n"
+            "\nRetrieve a BIP 157 content filter for a particular block. Requires -blockfilterindex.\n"
+            "\nArguments:\n"
+            "1. \"blockhash\"        (string, required) The hash of the block\n"
+            "2. \"filtertype\"       (string, optional, default=basic) The type name of the filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"hex\",   (string) the hex-encoded filter data\n"
+            "  \"header\" : \"hex\",   (string) the hex-encoded filter header\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\" \"basic\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\", \"basic\"")
+        );
+
+    uint256 block_hash = ParseHashV(request.params[0], "blockhash");
+    std::string filtertype_name = "basic";
+    if (!request.params[1].isNull()) {
+        filtertype_name = request.params[1].get_str();
+    }
+
+    BlockFilterType filtertype;
+    if (!BlockFilterTypeByName(filtertype_name, filtertype)) {
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Unknown filtertype");
+    }
+
+    BlockFilterIndex* index = GetBlockFilterIndex(filtertype);
+    if (!index) {
+        throw JSONRPCError(RPC_MISC_ERROR, "Index is not enabled for filtertype " + filtertype_name);
+    }
+
+    const CBlockIndex* block_index;
+    bool block_was_connected;
+    {
+        LOCK(cs_main);
+        BlockMap::const_iterator it = mapBlockIndex.find(block_hash);
+        if (it == mapBlockIndex.end()) {
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        }
+        block_index = it->second;
+        block_was_connected = block_index->IsValid(BLOCK_VALID_SCRIPTS);
+    }
+
+    bool index_ready = index->BlockUntilSyncedToCurrentChain();
+
+    BlockFilter filter;
+    uint256 filter_header;
+    if (!index->LookupFilter(block_index, filter) ||
+        !index->LookupFilterHeader(block_index, filter_header)) {
+        int err_code;
+        std::string errmsg = "Filter not found.";
+
+        if (!block_was_connected) {
+            err_code = RPC_INVALID_ADDRESS_OR_KEY;
+            errmsg += " Block was not connected to active chain.";
+        } else if (!index_ready) {
+            err_code = RPC_MISC_ERROR;
+            errmsg += " Block filters are still in the process of being indexed.";
+        } else {
+            err_code = RPC_INTERNAL_ERROR;
+            errmsg += " This error is unexpected and indicates index corruption.";
+        }
+
+        throw JSONRPCError(err_code, errmsg);
+    }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    ret.push_back(Pair("header", filter_header.GetHex()));
+    return ret;
+}
+
 static const CRPCCommand commands[] =
 { //  category              name                      actor (function)         argNames
   //  --------------------- ------------------------  -----------------------  ----------
@@ -1628,6 +2015,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblock",               &getblock,               {"blockhash","verbosity|verbose"} },
     { "blockchain",         "getblockhash",           &getblockhash,           {"height"} },
     { "blockchain",         "getblockheader",         &getblockheader,         {"blockhash","verbose"} },
+    { "blockchain",         "getblockfilter",         &getblockfilter,         {"blockhash","filtertype"} },
     { "blockchain",         "getchaintips",           &getchaintips,           {} },
     { "blockchain",         "getdifficulty",          &getdifficulty,          {} },
     { "blockchain",         "getmempoolancestors",    &getmempoolancestors,    {"txid","verbose"} },
@@ -1635,6 +2023,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        {"txid"} },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         {} },
     { "blockchain",         "getrawmempool",          &getrawmempool,          {"verbose"} },
+    { "blockchain",         "getrawmempoolpage",      &getrawmempoolpage,      {"start","count","verbose"} },
     { "blockchain",         "gettxout",               &gettxout,               {"txid","n","include_mempool"} },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        {} },
     { "blockchain",         "pruneblockchain",        &pruneblockchain,        {"height"} },
@@ -1643,6 +2032,10 @@ static const CRPCCommand commands[] =
 
     { "blockchain",         "preciousblock",          &preciousblock,          {"blockhash"} },
 
+    { "blockchain",         "getaddressbalance",      &getaddressbalance,      {"address"} },
+    { "blockchain",         "getaddressutxos",        &getaddressutxos,        {"address"} },
+    { "blockchain",         "getaddresshistory",      &getaddresshistory,      {"address"} },
+
     /* Not shown in help */
     { "hidden",             "invalidateblock",        &invalidateblock,        {"blockhash"} },
     { "hidden",             "reconsiderblock",        &reconsiderblock,        {"blockhash"} },
@@ -26,6 +26,8 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <chrono>
+#include <deque>
 #include <memory>
 #include <stdint.h>
 
@@ -264,6 +266,49 @@ UniValue prioritisetransaction(const JSONRPCRequest& request)
 
 
 // NOTE: Assumes a conclusive result; if result is inconclusive, it must be handled by caller
+/** Encode the non-coinbase transactions of a block template for getblocktemplate */
+static UniValue BlockTemplateTransactions(const CBlockTemplate& block_template, bool fPreSegWit)
+{
+    UniValue transactions(UniValue::VARR);
+    std::map<uint256, int64_t> setTxIndex;
+    int i = 0;
+    for (const auto& it : block_template.block.vtx) {
+        const CTransaction& tx = *it;
+        uint256 txHash = tx.GetHash();
+        setTxIndex[txHash] = i++;
+
+        if (tx.IsCoinBase())
+            continue;
+
+        UniValue entry(UniValue::VOBJ);
+
+        entry.push_back(Pair("data", EncodeHexTx(tx)));
+        entry.push_back(Pair("txid", txHash.GetHex()));
+        entry.push_back(Pair("hash", tx.GetWitnessHash().GetHex()));
+
+        UniValue deps(UniValue::VARR);
+        for (const CTxIn &in : tx.vin)
+        {
+            if (setTxIndex.count(in.prevout.hash))
+                deps.push_back(setTxIndex[in.prevout.hash]);
+        }
+        entry.push_back(Pair("depends", deps));
+
+        int index_in_template = i - 1;
+        entry.push_back(Pair("fee", block_template.vTxFees[index_in_template]));
+        int64_t nTxSigOps = block_template.vTxSigOpsCost[index_in_template];
+        if (fPreSegWit) {
+            assert(nTxSigOps % WITNESS_SCALE_FACTOR == 0);
+            nTxSigOps /= WITNESS_SCALE_FACTOR;
+        }
+        entry.push_back(Pair("sigops", nTxSigOps));
+        entry.push_back(Pair("weight", GetTransactionWeight(tx)));
+
+        transactions.push_back(entry);
+    }
+    return transactions;
+}
+
 static UniValue BIP22ValidationResult(const CValidationState& state)
 {
     if (state.IsValid())
@@ -291,6 +336,83 @@ std::string gbt_vb_name(const Consensus::DeploymentPos pos) {
     return s;
 }
 
+/** getblocktemplate results handed out recently, to answer delta requests. Protected by cs_main. */
+struct RecentBlockTemplate
+{
+    std::string longpollid;
+    bool supports_segwit;
+    std::shared_ptr<const CBlockTemplate> block_template;
+};
+static std::deque<RecentBlockTemplate> recent_block_templates;
+static const size_t MAX_RECENT_BLOCK_TEMPLATES = 16;
+
+static unsigned int nTransactionsUpdatedLast;
+
+static std::shared_ptr<const CBlockTemplate> FindRecentBlockTemplate(const std::string& longpollid, bool supports_segwit)
+{
+    AssertLockHeld(cs_main);
+    for (const RecentBlockTemplate& entry : recent_block_templates) {
+        if (entry.longpollid == longpollid && entry.supports_segwit == supports_segwit)
+            return entry.block_template;
+    }
+    return nullptr;
+}
+
+static void RememberBlockTemplate(const std::string& longpollid, bool supports_segwit, const std::shared_ptr<const CBlockTemplate>& block_template)
+{
+    AssertLockHeld(cs_main);
+    for (RecentBlockTemplate& entry : recent_block_templates) {
+        if (entry.longpollid == longpollid && entry.supports_segwit == supports_segwit) {
+            entry.block_template = block_template;
+            return;
+        }
+    }
+    recent_block_templates.push_back(RecentBlockTemplate{longpollid, supports_segwit, block_template});
+    if (recent_block_templates.size() > MAX_RECENT_BLOCK_TEMPLATES)
+        recent_block_templates.pop_front();
+}
+
+/**
+ * Describe the transactions of block_template relative to those of base, see
+ * the "delta" result of getblocktemplate. transactions is the encoding of
+ * block_template's transactions.
+ */
+static UniValue BlockTemplateDelta(const CBlockTemplate& base, const CBlockTemplate& block_template, const UniValue& transactions)
+{
+    // Positions in the "transactions" list are 1-based, as the coinbase is left out
+    std::map<uint256, int64_t> base_positions;
+    for (size_t i = 1; i < base.block.vtx.size(); ++i)
+        base_positions[base.block.vtx[i]->GetHash()] = i;
+
+    UniValue added(UniValue::VARR);
+    UniValue order(UniValue::VARR);
+    for (size_t i = 1; i < block_template.block.vtx.size(); ++i) {
+        auto it = base_positions.find(block_template.block.vtx[i]->GetHash());
+        if (it != base_positions.end()) {
+            order.push_back(it->second);
+            base_positions.erase(it);
+        } else {
+            added.push_back(transactions[i - 1]);
+            order.push_back(-(int64_t)added.size());
+        }
+    }
+
+    UniValue removed(UniValue::VARR);
+    for (size_t i = 1; i < base.block.vtx.size(); ++i) {
+        const uint256& txid = base.block.vtx[i]->GetHash();
+        if (base_positions.count(txid))
+            removed.push_back(txid.GetHex());
+    }
+
+    UniValue delta(UniValue::VOBJ);
+    delta.push_back(Pair("removed", removed));
+    delta.push_back(Pair("added", added));
+    delta.push_back(Pair("order", order));
+    return delta;
+}
+
+static UniValue BlockTemplateResult(const CachedBlockTemplate& cached, const std::set<std::string>& setClientRules, int64_t nMaxVersionPreVB, const std::string& strDeltaBase);
+
 UniValue getblocktemplate(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() > 1)
@@ -315,7 +437,9 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "       \"rules\":[            (array, optional) A list of strings\n"
             "           \"support\"          (string) client side supported softfork deployment\n"
             "           ,...\n"
-            "       ]\n"
+            "       ],\n"
+            "       \"longpollid\":\"xxxx\"  (string, optional) wait until there is newer work than the template with this longpollid\n"
+            "       \"delta\":true|false    (boolean, optional, default=false) describe the transactions relative to the template with \"longpollid\"\n"
             "     }\n"
             "\n"
 
@@ -345,6 +469,12 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             "      }\n"
             "      ,...\n"
             "  ],\n"
+            "  \"delta\" : {                     (json object) only if \"delta\" was requested and that template is still known; replaces \"transactions\"\n"
+            "      \"longpollid\" : \"xxxx\",       (string) the longpollid of the template the changes are relative to\n"
+            "      \"removed\" : [ \"txid\", ... ],  (array of string) transactions of that template which are not in this one\n"
+            "      \"added\" : [ {...}, ... ],      (array) the new transactions, as in \"transactions\"\n"
+            "      \"order\" : [ n, ... ]           (array of numeric) the transactions of this template in order: n > 0 is the n-th (1-based) transaction of the old template, n < 0 the -n-th of \"added\"\n"
+            "  },\n"
             "  \"coinbaseaux\" : {                 (json object) data that should be included in the coinbase's scriptSig content\n"
             "      \"flags\" : \"xx\"                  (string) key name is to be ignored, and value included in scriptSig\n"
             "  },\n"
@@ -374,6 +504,8 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
     std::string strMode = "template";
     UniValue lpval = NullUniValue;
+    bool fDelta = false;
+    std::string strDeltaBase;
     std::set<std::string> setClientRules;
     int64_t nMaxVersionPreVB = -1;
     if (!request.params[0].isNull())
@@ -389,6 +521,11 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         else
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
         lpval = find_value(oparam, "longpollid");
+        const UniValue& deltaval = find_value(oparam, "delta");
+        if (deltaval.isBool())
+            fDelta = deltaval.get_bool();
+        else if (!deltaval.isNull())
+            throw JSONRPCError(RPC_TYPE_ERROR, "delta must be a boolean");
 
         if (strMode == "proposal")
         {
@@ -447,7 +584,18 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Litecoin is downloading blocks...");
 
-    static unsigned int nTransactionsUpdatedLast;
+    if (!g_block_template_cache)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block template cache is not available");
+
+    const struct VBDeploymentInfo& segwit_info = VersionBitsDeploymentInfo[Consensus::DEPLOYMENT_SEGWIT];
+    // If the caller is indicating segwit support, then allow CreateNewBlock()
+    // to select witness transactions, after segwit activates (otherwise
+    // don't).
+    const bool fSupportsSegwit = setClientRules.find(segwit_info.name) != setClientRules.end();
+
+    // From now on, templates for callers like this one are kept up to date
+    // in the background.
+    g_block_template_cache->Start(fSupportsSegwit);
 
     if (!lpval.isNull())
     {
@@ -463,6 +611,8 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
             hashWatchedChain.SetHex(lpstr.substr(0, 64));
             nTransactionsUpdatedLastLP = atoi64(lpstr.substr(64));
+            if (fDelta)
+                strDeltaBase = lpstr;
         }
         else
         {
@@ -471,6 +621,25 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
             nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
         }
 
+        if (request.parkRequest)
+        {
+            // Let the template builder finish the request once there is new
+            // work, instead of holding on to this thread until then.
+            RPCResumeFn resume = request.parkRequest();
+            g_block_template_cache->NotifyOnUpdate(hashWatchedChain, nTransactionsUpdatedLastLP,
+                std::chrono::steady_clock::now() + std::chrono::minutes(1),
+                [resume, setClientRules, nMaxVersionPreVB, strDeltaBase, fSupportsSegwit]() {
+                    resume([setClientRules, nMaxVersionPreVB, strDeltaBase, fSupportsSegwit]() -> UniValue {
+                        if (!IsRPCRunning())
+                            throw JSONRPCError(RPC_CLIENT_NOT_CONNECTED, "Shutting down");
+                        const CachedBlockTemplate cached = g_block_template_cache->Get(fSupportsSegwit);
+                        LOCK(cs_main);
+                        return BlockTemplateResult(cached, setClientRules, nMaxVersionPreVB, strDeltaBase);
+                    });
+                });
+            return NullUniValue;
+        }
+
         // Release the wallet and main lock while waiting
         LEAVE_CRITICAL_SECTION(cs_main);
         {
@@ -495,42 +664,35 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    const struct VBDeploymentInfo& segwit_info = VersionBitsDeploymentInfo[Consensus::DEPLOYMENT_SEGWIT];
-    // If the caller is indicating segwit support, then allow CreateNewBlock()
-    // to select witness transactions, after segwit activates (otherwise
-    // don't).
-    bool fSupportsSegwit = setClientRules.find(segwit_info.name) != setClientRules.end();
-
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static std::unique_ptr<CBlockTemplate> pblocktemplate;
-    // Cache whether the last invocation was with segwit support, to avoid returning
-    // a segwit-block to a non-segwit caller.
-    static bool fLastTemplateSupportsSegwit = true;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5) ||
-        fLastTemplateSupportsSegwit != fSupportsSegwit)
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = nullptr;
+    // Get the template without cs_main, so that a build of it that is in
+    // progress in the background can finish and be used.
+    LEAVE_CRITICAL_SECTION(cs_main);
+    const CachedBlockTemplate cached = g_block_template_cache->Get(fSupportsSegwit);
+    ENTER_CRITICAL_SECTION(cs_main);
+
+    return BlockTemplateResult(cached, setClientRules, nMaxVersionPreVB, strDeltaBase);
+}
 
-        // Store the pindexBest used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-        fLastTemplateSupportsSegwit = fSupportsSegwit;
+/**
+ * Build the getblocktemplate result for a template request, once any long
+ * poll is over.
+ */
+static UniValue BlockTemplateResult(const CachedBlockTemplate& cached, const std::set<std::string>& setClientRules, int64_t nMaxVersionPreVB, const std::string& strDeltaBase)
+{
+    AssertLockHeld(cs_main);
 
-        // Create new block
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy, fSupportsSegwit);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    const struct VBDeploymentInfo& segwit_info = VersionBitsDeploymentInfo[Consensus::DEPLOYMENT_SEGWIT];
+    const bool fSupportsSegwit = setClientRules.find(segwit_info.name) != setClientRules.end();
 
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    if (!cached.block_template)
+        throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
+    nTransactionsUpdatedLast = cached.transactions_updated;
+    const CBlockTemplate* pblocktemplate = cached.block_template.get();
+    const CBlockIndex* pindexPrev = cached.pindex_prev;
+
+    // The cached template is shared, so adjust a copy of the block
+    CBlock block = pblocktemplate->block;
+    CBlock* pblock = &block; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
     // Update nTime
@@ -542,44 +704,21 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
 
     UniValue aCaps(UniValue::VARR); aCaps.push_back("proposal");
 
-    UniValue transactions(UniValue::VARR);
-    std::map<uint256, int64_t> setTxIndex;
-    int i = 0;
-    for (const auto& it : pblock->vtx) {
-        const CTransaction& tx = *it;
-        uint256 txHash = tx.GetHash();
-        setTxIndex[txHash] = i++;
-
-        if (tx.IsCoinBase())
-            continue;
-
-        UniValue entry(UniValue::VOBJ);
-
-        entry.push_back(Pair("data", EncodeHexTx(tx)));
-        entry.push_back(Pair("txid", txHash.GetHex()));
-        entry.push_back(Pair("hash", tx.GetWitnessHash().GetHex()));
-
-        UniValue deps(UniValue::VARR);
-        for (const CTxIn &in : tx.vin)
-        {
-            if (setTxIndex.count(in.prevout.hash))
-                deps.push_back(setTxIndex[in.prevout.hash]);
-        }
-        entry.push_back(Pair("depends", deps));
-
-        int index_in_template = i - 1;
-        entry.push_back(Pair("fee", pblocktemplate->vTxFees[index_in_template]));
-        int64_t nTxSigOps = pblocktemplate->vTxSigOpsCost[index_in_template];
-        if (fPreSegWit) {
-            assert(nTxSigOps % WITNESS_SCALE_FACTOR == 0);
-            nTxSigOps /= WITNESS_SCALE_FACTOR;
-        }
-        entry.push_back(Pair("sigops", nTxSigOps));
-        entry.push_back(Pair("weight", GetTransactionWeight(tx)));
-
-        transactions.push_back(entry);
+    // Encoding the transactions dominates the cost of a request, so keep the
+    // result for the last template around. Protected by cs_main.
+    static std::shared_ptr<const CBlockTemplate> transactions_template;
+    static bool transactions_pre_segwit;
+    static UniValue transactions;
+    if (transactions_template != cached.block_template || transactions_pre_segwit != fPreSegWit) {
+        transactions = BlockTemplateTransactions(*pblocktemplate, fPreSegWit);
+        transactions_template = cached.block_template;
+        transactions_pre_segwit = fPreSegWit;
     }
 
+    const std::string longpollid = pindexPrev->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast);
+    std::shared_ptr<const CBlockTemplate> delta_base = FindRecentBlockTemplate(strDeltaBase, fSupportsSegwit);
+    RememberBlockTemplate(longpollid, fSupportsSegwit, cached.block_template);
+
     UniValue aux(UniValue::VOBJ);
     aux.push_back(Pair("flags", HexStr(COINBASE_FLAGS.begin(), COINBASE_FLAGS.end())));
 
@@ -649,10 +788,16 @@ UniValue getblocktemplate(const JSONRPCRequest& request)
     }
 
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
-    result.push_back(Pair("transactions", transactions));
+    if (delta_base) {
+        UniValue delta = BlockTemplateDelta(*delta_base, *pblocktemplate, transactions);
+        delta.push_back(Pair("longpollid", strDeltaBase));
+        result.push_back(Pair("delta", delta));
+    } else {
+        result.push_back(Pair("transactions", transactions));
+    }
     result.push_back(Pair("coinbaseaux", aux));
     result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue));
-    result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
+    result.push_back(Pair("longpollid", longpollid));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
     result.push_back(Pair("mutable", aMutable));
@@ -872,6 +1017,67 @@ UniValue estimatesmartfee(const JSONRPCRequest& request)
     return result;
 }
 
+UniValue estimatefeecurve(const JSONRPCRequest& request)
+{
+    if (request.fHelp || request.params.size() > 1)
+        throw std::runtime_error(
+            "estimatefeecurve (\"estimate_mode\")\n"
+            "\nReturns the estimatesmartfee feerates for all confirmation targets at once, as the\n"
+            "lowest target of each feerate that is estimated.\n"
+            "\nArguments:\n"
+            "1. \"estimate_mode\" (string, optional, default=CONSERVATIVE) The fee estimate mode, as for estimatesmartfee.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"feerates\" : [         (json array) targets where the estimate changes, in increasing order\n"
+            "    {\n"
+            "      \"blocks\" : n,      (numeric) lowest target this feerate is estimated for\n"
+            "      \"feerate\" : x.x,   (numeric) estimate fee rate in " + CURRENCY_UNIT + "/kB\n"
+            "    }\n"
+            "    ,...\n"
+            "  ],\n"
+            "  \"blocks\" : n,          (numeric) highest target an estimate can be given for\n"
+            "  \"errors\": [ str... ]   (json array of strings, optional) Errors encountered during processing\n"
+            "}\n"
+            "\n"
+            "A feerate applies to the targets up to the next entry's, or to \"blocks\" for the last one.\n"
+            "Targets above \"blocks\" get the same estimate as \"blocks\".\n"
+            "\nExample:\n"
+            + HelpExampleCli("estimatefeecurve", "")
+            + HelpExampleRpc("estimatefeecurve", "\"ECONOMICAL\"")
+            );
+
+    RPCTypeCheck(request.params, {UniValue::VSTR});
+    bool conservative = true;
+    if (!request.params[0].isNull()) {
+        FeeEstimateMode fee_mode;
+        if (!FeeModeFromString(request.params[0].get_str(), fee_mode)) {
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid estimate_mode parameter");
+        }
+        if (fee_mode == FeeEstimateMode::ECONOMICAL) conservative = false;
+    }
+
+    UniValue result(UniValue::VOBJ);
+    UniValue feerates(UniValue::VARR);
+    std::vector<std::pair<unsigned int, CFeeRate>> curve = ::feeEstimator.estimateSmartFeeCurve(conservative);
+    for (size_t i = 0; i < curve.size(); i++) {
+        if (i > 0 && curve[i].second == curve[i - 1].second) continue;
+        UniValue point(UniValue::VOBJ);
+        point.push_back(Pair("blocks", (int)curve[i].first));
+        point.push_back(Pair("feerate", ValueFromAmount(curve[i].second.GetFeePerK())));
+        feerates.push_back(point);
+    }
+    result.push_back(Pair("feerates", feerates));
+    if (curve.empty()) {
+        UniValue errors(UniValue::VARR);
+        errors.push_back("Insufficient data or no feerate found");
+        result.push_back(Pair("errors", errors));
+        result.push_back(Pair("blocks", 0));
+    } else {
+        result.push_back(Pair("blocks", (int)curve.back().first));
+    }
+    return result;
+}
+
 UniValue estimaterawfee(const JSONRPCRequest& request)
 {
     if (request.fHelp || request.params.size() < 1 || request.params.size() > 2)
@@ -988,6 +1194,7 @@ static const CRPCCommand commands[] =
 
     { "util",               "estimatefee",            &estimatefee,            {"nblocks"} },
     { "util",               "estimatesmartfee",       &estimatesmartfee,       {"conf_target", "estimate_mode"} },
+    { "util",               "estimatefeecurve",       &estimatefeecurve,       {"estimate_mode"} },
 
     { "hidden",             "estimaterawfee",         &estimaterawfee,         {"conf_target", "threshold"} },
 };
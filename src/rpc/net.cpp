@@ -101,6 +101,9 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ],\n"
+            "    \"blockdownloadrate\": n,    (numeric) The average rate at which the peer delivered requested blocks, in bytes per second, or 0 if none lately\n"
+            "    \"inflightlimit\": n,        (numeric) The number of blocks we may ask from this peer at once\n"
+            "    \"blocksrerequested\": n,    (numeric) The number of blocks the peer stalled on that we asked from other peers\n"
             "    \"whitelisted\": true|false, (boolean) Whether the peer is whitelisted\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,              (numeric) The total bytes sent aggregated by message type\n"
@@ -167,6 +170,9 @@ UniValue getpeerinfo(const JSONRPCRequest& request)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("blockdownloadrate", statestats.nBlockDownloadRate));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInTransitLimit));
+            obj.push_back(Pair("blocksrerequested", statestats.nBlocksReRequested));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -10,6 +10,7 @@
 #include <rpc/protocol.h>
 #include <uint256.h>
 
+#include <functional>
 #include <list>
 #include <map>
 #include <stdint.h>
@@ -36,6 +37,12 @@ struct UniValueType {
     UniValue::VType type;
 };
 
+/**
+ * Finishes a parked request: runs the function on an RPC worker thread and
+ * replies with its result, or with the JSONRPCError it throws.
+ */
+typedef std::function<void(const std::function<UniValue()>&)> RPCResumeFn;
+
 class JSONRPCRequest
 {
 public:
@@ -45,6 +52,13 @@ public:
     bool fHelp;
     std::string URI;
     std::string authUser;
+    /**
+     * Set by transports that can reply to a request later without holding a
+     * thread in the meantime; empty otherwise. A method that calls it takes
+     * over the reply: it must return right away, and call the returned
+     * function exactly once to produce the result.
+     */
+    std::function<RPCResumeFn()> parkRequest;
 
     JSONRPCRequest() : id(NullUniValue), params(NullUniValue), fHelp(false) {}
     void parse(const UniValue& valRequest);
@@ -11,6 +11,7 @@
 #include <pow.h>
 #include <script/sign.h>
 #include <serialize.h>
+#include <txorphanage.h>
 #include <util.h>
 #include <validation.h>
 
@@ -20,17 +21,6 @@
 
 #include <boost/test/unit_test.hpp>
 
-// Tests these internal-to-net_processing.cpp methods:
-extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransactionRef tx;
-    NodeId fromPeer;
-    int64_t nTimeExpire;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -41,6 +31,10 @@ CService ip(uint32_t i)
 static NodeId id = 0;
 
 void UpdateLastBlockAnnounceTime(NodeId node, int64_t time_in_seconds);
+void RequestBlockFromPeer(NodeId node, const CBlockIndex* pindex, int64_t nTimeRequested);
+void ReceiveBlockFromPeer(NodeId node, const uint256& hash, size_t nBytes, int64_t nTimeReceived);
+void StallBlockDownload(NodeId node, NodeId staller, const CBlockIndex* pindexStalled, int64_t nNow);
+bool IsStallingBlockDownload(NodeId node, int64_t nNow);
 
 BOOST_FIXTURE_TEST_SUITE(DoS_tests, TestingSetup)
 
@@ -175,6 +169,114 @@ BOOST_AUTO_TEST_CASE(stale_tip_peer_management)
     CConnmanTest::ClearNodes();
 }
 
+BOOST_AUTO_TEST_CASE(block_download_limit)
+{
+    std::vector<CNode*> vNodes;
+    for (int i = 0; i < 5; i++) {
+        CAddress addr(ip(0xa0b0c001 + i), NODE_NONE);
+        vNodes.emplace_back(new CNode(id++, ServiceFlags(NODE_NETWORK|NODE_WITNESS), 0, INVALID_SOCKET, addr, 0, 0, CAddress(), "", /*fInboundIn=*/ false));
+        peerLogic->InitializeNode(vNodes.back());
+    }
+    std::vector<NodeId> vIds;
+    for (const CNode* node : vNodes) {
+        vIds.push_back(node->GetId());
+    }
+
+    // Blocks to download, only their hash and height matter
+    std::vector<uint256> vHashes(5);
+    std::vector<CBlockIndex> vIndex(vHashes.size());
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        vHashes[i] = InsecureRand256();
+        vIndex[i].phashBlock = &vHashes[i];
+        vIndex[i].nHeight = i + 1;
+    }
+
+    const int64_t nStart = GetTimeMicros();
+    CNodeStateStats stats;
+    BOOST_CHECK(GetNodeStateStats(vIds[0], stats));
+    BOOST_CHECK_EQUAL(stats.nBlockDownloadRate, 0);
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+
+    // A second block arriving right after the first is timed from the
+    // first's arrival, and averaged with it
+    RequestBlockFromPeer(vIds[0], &vIndex[0], nStart);
+    RequestBlockFromPeer(vIds[0], &vIndex[1], nStart);
+    ReceiveBlockFromPeer(vIds[0], vHashes[0], 1000000, nStart + 1000000);
+    BOOST_CHECK(GetNodeStateStats(vIds[0], stats));
+    BOOST_CHECK_EQUAL(stats.nBlockDownloadRate, 1000000);
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    ReceiveBlockFromPeer(vIds[0], vHashes[1], 3000000, nStart + 2000000);
+    BOOST_CHECK(GetNodeStateStats(vIds[0], stats));
+    BOOST_CHECK_EQUAL(stats.nBlockDownloadRate, 1500000);
+
+    // Once two peers have a rate, limits scale with rate over the average
+    RequestBlockFromPeer(vIds[1], &vIndex[0], nStart);
+    ReceiveBlockFromPeer(vIds[1], vHashes[0], 500000, nStart + 1000000);
+    BOOST_CHECK(GetNodeStateStats(vIds[0], stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_PEER * 3 / 2);
+    BOOST_CHECK(GetNodeStateStats(vIds[1], stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_PEER / 2);
+
+    // Limits are bounded for peers far from the average
+    RequestBlockFromPeer(vIds[2], &vIndex[0], nStart);
+    ReceiveBlockFromPeer(vIds[2], vHashes[0], 1000000000, nStart + 1000000);
+    for (int i = 3; i < 5; i++) {
+        RequestBlockFromPeer(vIds[i], &vIndex[0], nStart);
+        ReceiveBlockFromPeer(vIds[i], vHashes[0], 1000, nStart + 1000000);
+    }
+    BOOST_CHECK(GetNodeStateStats(vIds[2], stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER);
+    BOOST_CHECK(GetNodeStateStats(vIds[3], stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MIN_BLOCKS_IN_TRANSIT_PER_SLOW_PEER);
+
+    // A block a peer stalls on moves to an idle peer, once per stall
+    const int64_t nNow = nStart + 10000000;
+    RequestBlockFromPeer(vIds[3], &vIndex[2], nStart);
+    RequestBlockFromPeer(vIds[3], &vIndex[3], nStart);
+    StallBlockDownload(vIds[4], vIds[3], &vIndex[2], nNow);
+    StallBlockDownload(vIds[4], vIds[3], &vIndex[3], nNow);
+    CNodeStateStats statsStaller, statsIdle;
+    BOOST_CHECK(GetNodeStateStats(vIds[3], statsStaller));
+    BOOST_CHECK_EQUAL(statsStaller.nBlocksReRequested, 1);
+    BOOST_CHECK(statsStaller.vHeightInFlight == std::vector<int>({vIndex[3].nHeight}));
+    BOOST_CHECK(GetNodeStateStats(vIds[4], statsIdle));
+    BOOST_CHECK(statsIdle.vHeightInFlight == std::vector<int>({vIndex[2].nHeight}));
+
+    // The staller stops stalling once nothing is pending from it
+    BOOST_CHECK(IsStallingBlockDownload(vIds[3], nNow));
+    RequestBlockFromPeer(vIds[1], &vIndex[4], nStart);
+    StallBlockDownload(vIds[0], vIds[1], &vIndex[4], nNow);
+    CNodeStateStats statsEmptied;
+    BOOST_CHECK(GetNodeStateStats(vIds[1], statsEmptied));
+    BOOST_CHECK_EQUAL(statsEmptied.nBlocksReRequested, 1);
+    BOOST_CHECK(statsEmptied.vHeightInFlight.empty());
+    BOOST_CHECK(!IsStallingBlockDownload(vIds[1], nNow));
+
+    // The rate of a peer idle for too long is forgotten, but not that of a
+    // peer with blocks pending
+    const int64_t nExpiry = nStart + 1000000 + BLOCK_DOWNLOAD_RATE_EXPIRY * 1000000;
+    BOOST_CHECK(GetNodeStateStats(vIds[1], stats));
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MIN_BLOCKS_IN_TRANSIT_PER_SLOW_PEER);
+    IsStallingBlockDownload(vIds[2], nExpiry);
+    BOOST_CHECK(GetNodeStateStats(vIds[2], stats));
+    BOOST_CHECK(stats.nBlockDownloadRate != 0);
+    IsStallingBlockDownload(vIds[2], nExpiry + 1);
+    IsStallingBlockDownload(vIds[4], nExpiry + 1);
+    BOOST_CHECK(GetNodeStateStats(vIds[2], stats));
+    BOOST_CHECK_EQUAL(stats.nBlockDownloadRate, 0);
+    BOOST_CHECK_EQUAL(stats.nBlocksInTransitLimit, MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK(GetNodeStateStats(vIds[4], stats));
+    BOOST_CHECK(stats.nBlockDownloadRate != 0);
+    BOOST_CHECK(GetNodeStateStats(vIds[1], stats));
+    BOOST_CHECK(stats.nBlocksInTransitLimit > MIN_BLOCKS_IN_TRANSIT_PER_SLOW_PEER);
+
+    bool dummy;
+    for (CNode* node : vNodes) {
+        peerLogic->FinalizeNode(node->GetId(), dummy);
+        delete node;
+    }
+}
+
 BOOST_AUTO_TEST_CASE(DoS_banning)
 {
     std::atomic<bool> interruptDummy(false);
@@ -291,14 +393,9 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     peerLogic->FinalizeNode(dummyNode.GetId(), dummy);
 }
 
-CTransactionRef RandomOrphan()
+static CTransactionRef RandomOrphan(const std::vector<CTransactionRef>& orphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    LOCK(cs_main);
-    it = mapOrphanTransactions.lower_bound(InsecureRand256());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return orphans[InsecureRandRange(orphans.size())];
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -307,6 +404,9 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
     keystore.AddKey(key);
+    TxOrphanage orphanage;
+    std::vector<CTransactionRef> orphans;
+    LOCK(g_cs_orphans);
 
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
@@ -320,13 +420,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphans.push_back(MakeTransactionRef(tx));
+        BOOST_CHECK(orphanage.AddTx(orphans.back(), i));
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(orphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -337,13 +438,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(MakeTransactionRef(tx), i);
+        orphans.push_back(MakeTransactionRef(tx));
+        orphanage.AddTx(orphans.back(), i);
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransactionRef txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan(orphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -361,25 +463,119 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
+        BOOST_CHECK(!orphanage.AddTx(MakeTransactionRef(tx), i));
     }
 
-    LOCK(cs_main);
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanage.Size();
+        orphanage.EraseForPeer(i);
+        BOOST_CHECK(orphanage.Size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanage.PeerBytes(i), 0U);
     }
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
+    // Test LimitOrphans() function:
+    orphanage.LimitOrphans(40);
+    BOOST_CHECK(orphanage.Size() <= 40);
+    orphanage.LimitOrphans(10);
+    BOOST_CHECK(orphanage.Size() <= 10);
+    orphanage.LimitOrphans(0);
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
+    for (NodeId i = 0; i < 50; i++)
+        BOOST_CHECK_EQUAL(orphanage.PeerBytes(i), 0U);
+}
+
+static CTransactionRef MakeOrphan(const uint256& hashPrev, unsigned int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(nOutputs);
+    for (CTxOut& txout : tx.vout) {
+        txout.nValue = 1*CENT;
+        txout.scriptPubKey = CScript() << OP_TRUE;
+    }
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanPeerQuota)
+{
+    const CTransactionRef first = MakeOrphan(InsecureRand256());
+    const size_t nSize = first->GetTotalSize();
+    // Room for three orphans of peer 0
+    TxOrphanage orphanage(3 * nSize);
+    LOCK(g_cs_orphans);
+
+    BOOST_CHECK(orphanage.AddTx(first, 0));
+    BOOST_CHECK(!orphanage.AddTx(first, 1));
+    std::vector<CTransactionRef> others;
+    for (int i = 0; i < 3; i++) {
+        others.push_back(MakeOrphan(InsecureRand256()));
+        BOOST_CHECK(orphanage.AddTx(others.back(), 0));
+    }
+    const CTransactionRef other_peer = MakeOrphan(InsecureRand256());
+    BOOST_CHECK(orphanage.AddTx(other_peer, 1));
+
+    // The oldest orphan of peer 0 made room for its fourth one
+    BOOST_CHECK(!orphanage.HaveTx(first->GetHash()));
+    for (const CTransactionRef& tx : others)
+        BOOST_CHECK(orphanage.HaveTx(tx->GetHash()));
+    BOOST_CHECK(orphanage.HaveTx(other_peer->GetHash()));
+    BOOST_CHECK_EQUAL(orphanage.Size(), 4U);
+    BOOST_CHECK_EQUAL(orphanage.PeerBytes(0), 3 * nSize);
+    BOOST_CHECK_EQUAL(orphanage.PeerBytes(1), nSize);
+
+    BOOST_CHECK_EQUAL(orphanage.EraseTx(others[0]->GetHash()), 1);
+    BOOST_CHECK_EQUAL(orphanage.EraseTx(others[0]->GetHash()), 0);
+    BOOST_CHECK_EQUAL(orphanage.PeerBytes(0), 2 * nSize);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_orphanWorkSet)
+{
+    TxOrphanage orphanage;
+    LOCK(g_cs_orphans);
+
+    // A parent with two outputs, spent by one child each, and a grandchild
+    const CTransactionRef parent = MakeOrphan(InsecureRand256(), 2);
+    CMutableTransaction child0(*MakeOrphan(parent->GetHash()));
+    const CTransactionRef child1 = MakeOrphan(parent->GetHash());
+    child0.vin[0].prevout.n = 1;
+    const CTransactionRef grandchild = MakeOrphan(child1->GetHash());
+    BOOST_CHECK(orphanage.AddTx(MakeTransactionRef(child0), 1));
+    BOOST_CHECK(orphanage.AddTx(child1, 2));
+    BOOST_CHECK(orphanage.AddTx(grandchild, 2));
+
+    BOOST_CHECK_EQUAL(orphanage.GetChildren(*parent).size(), 2U);
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(0));
+    BOOST_CHECK_EQUAL(orphanage.AddChildrenToWorkSet(*parent, 0).size(), 2U);
+    BOOST_CHECK(orphanage.HaveTxToReconsider(0));
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(1));
+
+    // Orphans erased meanwhile are skipped, and each queued orphan is handed
+    // out for pre-verification once
+    orphanage.EraseTx(child0.GetHash());
+    std::vector<CTransactionRef> vToVerify = orphanage.TakeTxsToPreVerify(0);
+    BOOST_CHECK_EQUAL(vToVerify.size(), 1U);
+    BOOST_CHECK(vToVerify[0] == child1);
+    BOOST_CHECK(orphanage.TakeTxsToPreVerify(0).empty());
+    NodeId originator = -1;
+    CTransactionRef tx = orphanage.GetTxToReconsider(0, originator);
+    BOOST_CHECK(tx == child1);
+    BOOST_CHECK_EQUAL(originator, 2);
+    BOOST_CHECK(!orphanage.GetTxToReconsider(0, originator));
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(0));
+
+    // Erasing a peer's orphans leaves the work sets of other peers alone
+    orphanage.AddChildrenToWorkSet(*child1, 0);
+    orphanage.AddChildrenToWorkSet(*child1, 2);
+    orphanage.EraseForPeer(2);
+    BOOST_CHECK(!orphanage.HaveTxToReconsider(2));
+    BOOST_CHECK(orphanage.HaveTxToReconsider(0));
+    BOOST_CHECK(!orphanage.GetTxToReconsider(0, originator));
+    BOOST_CHECK_EQUAL(orphanage.Size(), 0U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <chainparams.h>
+#include <consensus/validation.h>
+#include <index/addressindex.h>
+#include <key.h>
+#include <script/standard.h>
+#include <test/test_bitcoin.h>
+#include <util.h>
+#include <utiltime.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+static CAmount SumUnspent(const AddressIndex& index, const CScript& script)
+{
+    std::vector<AddressUnspent> unspent;
+    BOOST_CHECK(index.FindUnspent(AddressIndex::GetScriptHash(script), unspent));
+    CAmount total = 0;
+    for (const AddressUnspent& entry : unspent) {
+        total += entry.amount;
+    }
+    return total;
+}
+
+BOOST_FIXTURE_TEST_CASE(addressindex_connect_disconnect, TestChain100Setup)
+{
+    AddressIndex addressindex(1 << 20, true);
+    addressindex.Start();
+
+    // Allow the address index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!addressindex.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    const CScript coinbase_script = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const uint256 coinbase_hash = AddressIndex::GetScriptHash(coinbase_script);
+
+    // Every coinbase of the initial chain pays to coinbase_script.
+    std::vector<AddressUnspent> unspent;
+    BOOST_CHECK(addressindex.FindUnspent(coinbase_hash, unspent));
+    BOOST_CHECK_EQUAL(unspent.size(), coinbaseTxns.size());
+    CAmount coinbase_total = 0;
+    for (const CTransaction& tx : coinbaseTxns) {
+        coinbase_total += tx.vout[0].nValue;
+    }
+    BOOST_CHECK_EQUAL(SumUnspent(addressindex, coinbase_script), coinbase_total);
+
+    // Spend the first coinbase to a new key.
+    CKey key;
+    key.MakeNewKey(true);
+    const CScript dest_script = GetScriptForDestination(key.GetPubKey().GetID());
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vout.resize(1);
+    spend.vout[0].nValue = coinbaseTxns[0].vout[0].nValue - CENT;
+    spend.vout[0].scriptPubKey = dest_script;
+    std::vector<unsigned char> sig;
+    uint256 sighash = SignatureHash(coinbase_script, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(sighash, sig));
+    sig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << sig;
+
+    const CBlock block = CreateAndProcessBlock({spend}, coinbase_script);
+    BOOST_REQUIRE_EQUAL(chainActive.Tip()->GetBlockHash(), block.GetHash());
+    BOOST_CHECK(addressindex.BlockUntilSyncedToCurrentChain());
+
+    // The spent coinbase left the unspent set; the new block's coinbase (which
+    // includes the fee) was added.
+    BOOST_CHECK_EQUAL(SumUnspent(addressindex, coinbase_script),
+                      coinbase_total - coinbaseTxns[0].vout[0].nValue + block.vtx[0]->vout[0].nValue);
+    BOOST_CHECK_EQUAL(SumUnspent(addressindex, dest_script), spend.vout[0].nValue);
+
+    std::vector<AddressDelta> deltas;
+    BOOST_CHECK(addressindex.FindDeltas(coinbase_hash, deltas));
+    BOOST_REQUIRE_EQUAL(deltas.size(), coinbaseTxns.size() + 2);
+    for (size_t i = 1; i < deltas.size(); ++i) {
+        BOOST_CHECK(deltas[i - 1].height <= deltas[i].height);
+    }
+    const AddressDelta& debit = deltas[deltas.size() - 1];
+    BOOST_CHECK(debit.spending);
+    BOOST_CHECK(debit.txid == spend.GetHash());
+    BOOST_CHECK_EQUAL(debit.amount, -coinbaseTxns[0].vout[0].nValue);
+
+    // Disconnecting the block reverts all of its entries.
+    {
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    }
+    SyncWithValidationInterfaceQueue();
+
+    BOOST_CHECK_EQUAL(SumUnspent(addressindex, coinbase_script), coinbase_total);
+    BOOST_CHECK_EQUAL(SumUnspent(addressindex, dest_script), 0);
+    deltas.clear();
+    BOOST_CHECK(addressindex.FindDeltas(coinbase_hash, deltas));
+    BOOST_CHECK_EQUAL(deltas.size(), coinbaseTxns.size());
+
+    addressindex.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -31,7 +31,7 @@ static CBlock BuildBlockTestCase() {
     block.vtx[0] = MakeTransactionRef(tx);
     block.nVersion = 1;
     block.hashPrevBlock = InsecureRand256();
-    block.nBits = 0x1e0ffff0;
+    block.nBits = 0x207fffff;
 
     tx.vin[0].prevout.hash = InsecureRand256();
     tx.vin[0].prevout.n = 0;
@@ -273,6 +273,45 @@ BOOST_AUTO_TEST_CASE(SufficientPreforwardRTTest)
     BOOST_CHECK_EQUAL(pool.mapTx.find(txhash)->GetSharedTx().use_count(), SHARED_TX_OFFSET + 0);
 }
 
+BOOST_AUTO_TEST_CASE(LargeMempoolRoundTripTest)
+{
+    // Enough candidates to match short IDs on several threads
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    CBlock block(BuildBlockTestCase());
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    std::vector<std::pair<uint256, CTransactionRef>> extra;
+    for (int i = 0; i < 20000; i++) {
+        tx.vin[0].prevout.hash = InsecureRand256();
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        tx.vin[0].prevout.hash = InsecureRand256();
+        CTransactionRef ref = MakeTransactionRef(tx);
+        extra.emplace_back(ref->GetWitnessHash(), ref);
+    }
+    pool.addUnchecked(block.vtx[1]->GetHash(), entry.FromTx(*block.vtx[1]));
+    extra.emplace_back(block.vtx[2]->GetWitnessHash(), block.vtx[2]);
+    LOCK(pool.cs);
+
+    // On one thread and on several, whatever the number of cores
+    CBlockHeaderAndShortTxIDs shortIDs(block, true);
+    for (int nThreads : {1, 4}) {
+        PartiallyDownloadedBlock partialBlock(&pool);
+        partialBlock.nMatchThreads = nThreads;
+        BOOST_CHECK(partialBlock.InitData(shortIDs, extra) == READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(0));
+        BOOST_CHECK(partialBlock.IsTxAvailable(1));
+        BOOST_CHECK(partialBlock.IsTxAvailable(2));
+
+        CBlock block2;
+        BOOST_CHECK(partialBlock.FillBlock(block2, {}) == READ_STATUS_OK);
+        BOOST_CHECK_EQUAL(block.GetHash().ToString(), block2.GetHash().ToString());
+    }
+}
+
 BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
 {
     CTxMemPool pool;
@@ -287,7 +326,7 @@ BOOST_AUTO_TEST_CASE(EmptyBlockRoundTripTest)
     block.vtx[0] = MakeTransactionRef(std::move(coinbase));
     block.nVersion = 1;
     block.hashPrevBlock = InsecureRand256();
-    block.nBits = 0x1e0ffff0;
+    block.nBits = 0x207fffff;
 
     bool mutated;
     block.hashMerkleRoot = BlockMerkleRoot(block, &mutated);
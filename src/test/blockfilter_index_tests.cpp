@@ -0,0 +1,188 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockfilter.h>
+#include <chainparams.h>
+#include <coins.h>
+#include <consensus/validation.h>
+#include <index/blockfilterindex.h>
+#include <script/standard.h>
+#include <test/test_bitcoin.h>
+#include <undo.h>
+#include <util.h>
+#include <utiltime.h>
+#include <validation.h>
+#include <validationinterface.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockfilter_index_tests)
+
+static bool ComputeFilter(BlockFilterType filter_type, const CBlockIndex* block_index,
+                          BlockFilter& filter)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, block_index, Params().GetConsensus())) {
+        return false;
+    }
+
+    CBlockUndo block_undo;
+    if (block_index->nHeight > 0 && !UndoReadFromDisk(block_undo, block_index)) {
+        return false;
+    }
+
+    filter = BlockFilter(filter_type, block, block_undo);
+    return true;
+}
+
+static bool CheckFilterLookups(BlockFilterIndex& filter_index, const CBlockIndex* block_index,
+                               uint256& last_header)
+{
+    BlockFilter expected_filter;
+    if (!ComputeFilter(filter_index.GetFilterType(), block_index, expected_filter)) {
+        BOOST_ERROR("ComputeFilter failed on block " << block_index->nHeight);
+        return false;
+    }
+
+    BlockFilter filter;
+    uint256 filter_header;
+    std::vector<BlockFilter> filters;
+    std::vector<uint256> filter_hashes;
+
+    BOOST_CHECK(filter_index.LookupFilter(block_index, filter));
+    BOOST_CHECK(filter_index.LookupFilterHeader(block_index, filter_header));
+    BOOST_CHECK(filter_index.LookupFilterRange(block_index->nHeight, block_index, filters));
+    BOOST_CHECK(filter_index.LookupFilterHashRange(block_index->nHeight, block_index,
+                                                   filter_hashes));
+
+    BOOST_CHECK_EQUAL(filters.size(), 1U);
+    BOOST_CHECK_EQUAL(filter_hashes.size(), 1U);
+
+    BOOST_CHECK_EQUAL(filter.GetHash(), expected_filter.GetHash());
+    BOOST_CHECK_EQUAL(filter_header, expected_filter.ComputeHeader(last_header));
+    BOOST_CHECK_EQUAL(filters[0].GetHash(), expected_filter.GetHash());
+    BOOST_CHECK_EQUAL(filter_hashes[0], expected_filter.GetHash());
+
+    filters.clear();
+    filter_hashes.clear();
+    last_header = filter_header;
+    return true;
+}
+
+BOOST_FIXTURE_TEST_CASE(blockfilter_index_initial_sync, TestChain100Setup)
+{
+    BlockFilterIndex filter_index(BlockFilterType::BASIC, 1 << 20, true);
+
+    uint256 last_header;
+
+    // Filter should not be found in the index before it is started.
+    {
+        LOCK(cs_main);
+
+        BlockFilter filter;
+        uint256 filter_header;
+        std::vector<BlockFilter> filters;
+        std::vector<uint256> filter_hashes;
+
+        for (const CBlockIndex* block_index = chainActive.Genesis();
+             block_index != nullptr;
+             block_index = chainActive.Next(block_index)) {
+            BOOST_CHECK(!filter_index.LookupFilter(block_index, filter));
+            BOOST_CHECK(!filter_index.LookupFilterHeader(block_index, filter_header));
+            BOOST_CHECK(!filter_index.LookupFilterRange(block_index->nHeight, block_index, filters));
+            BOOST_CHECK(!filter_index.LookupFilterHashRange(block_index->nHeight, block_index,
+                                                            filter_hashes));
+        }
+    }
+
+    // BlockUntilSyncedToCurrentChain should return false before index is started.
+    BOOST_CHECK(!filter_index.BlockUntilSyncedToCurrentChain());
+
+    filter_index.Start();
+
+    // Allow filter index to catch up with the block index.
+    constexpr int64_t timeout_ms = 10 * 1000;
+    int64_t time_start = GetTimeMillis();
+    while (!filter_index.BlockUntilSyncedToCurrentChain()) {
+        BOOST_REQUIRE(time_start + timeout_ms > GetTimeMillis());
+        MilliSleep(100);
+    }
+
+    // Check that filter index has all blocks that were in the chain before it started.
+    {
+        LOCK(cs_main);
+        const CBlockIndex* block_index;
+        for (block_index = chainActive.Genesis();
+             block_index != nullptr;
+             block_index = chainActive.Next(block_index)) {
+            CheckFilterLookups(filter_index, block_index, last_header);
+        }
+    }
+
+    // Range lookups over the whole chain return the filters in height order.
+    {
+        LOCK(cs_main);
+        std::vector<BlockFilter> filters;
+        std::vector<uint256> filter_hashes;
+        BOOST_CHECK(filter_index.LookupFilterRange(0, chainActive.Tip(), filters));
+        BOOST_CHECK(filter_index.LookupFilterHashRange(0, chainActive.Tip(), filter_hashes));
+        BOOST_REQUIRE_EQUAL(filters.size(), static_cast<size_t>(chainActive.Height() + 1));
+        BOOST_REQUIRE_EQUAL(filter_hashes.size(), filters.size());
+        for (size_t i = 0; i < filters.size(); ++i) {
+            BOOST_CHECK_EQUAL(filters[i].GetBlockHash(), chainActive[i]->GetBlockHash());
+            BOOST_CHECK_EQUAL(filter_hashes[i], filters[i].GetHash());
+        }
+    }
+
+    // Check that new blocks get indexed.
+    const CScript coinbase_script = GetScriptForDestination(coinbaseKey.GetPubKey().GetID());
+    for (int i = 0; i < 5; i++) {
+        const CBlock block = CreateAndProcessBlock({}, coinbase_script);
+        BOOST_CHECK(filter_index.BlockUntilSyncedToCurrentChain());
+
+        LOCK(cs_main);
+        const CBlockIndex* block_index = mapBlockIndex[block.GetHash()];
+        BOOST_REQUIRE(block_index == chainActive.Tip());
+        CheckFilterLookups(filter_index, block_index, last_header);
+    }
+
+    // Disconnect the tip and replace it with a different block. The filter of
+    // the stale block must remain retrievable by hash.
+    CBlockIndex* stale_index;
+    uint256 fork_header;
+    {
+        LOCK(cs_main);
+        stale_index = chainActive.Tip();
+        BOOST_CHECK(filter_index.LookupFilterHeader(stale_index->pprev, fork_header));
+    }
+    BlockFilter stale_filter;
+    BOOST_CHECK(filter_index.LookupFilter(stale_index, stale_filter));
+    {
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), stale_index));
+    }
+    SyncWithValidationInterfaceQueue();
+
+    const CScript other_script = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const CBlock block = CreateAndProcessBlock({}, other_script);
+    BOOST_CHECK(filter_index.BlockUntilSyncedToCurrentChain());
+    {
+        LOCK(cs_main);
+        const CBlockIndex* block_index = chainActive.Tip();
+        BOOST_REQUIRE_EQUAL(block_index->GetBlockHash(), block.GetHash());
+        BOOST_REQUIRE(block_index->nHeight == stale_index->nHeight);
+
+        uint256 header = fork_header;
+        CheckFilterLookups(filter_index, block_index, header);
+
+        BlockFilter filter;
+        BOOST_CHECK(filter_index.LookupFilter(stale_index, filter));
+        BOOST_CHECK_EQUAL(filter.GetHash(), stale_filter.GetHash());
+    }
+
+    filter_index.Interrupt();
+    filter_index.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
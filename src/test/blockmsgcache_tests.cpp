@@ -0,0 +1,86 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <blockmsgcache.h>
+#include <random.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockmsgcache_tests, BasicTestingSetup)
+
+static std::shared_ptr<const CSharedNetMsg> MakeMsg(size_t nSize)
+{
+    CSerializedNetMsg msg;
+    msg.data.resize(nSize);
+    msg.command = "block";
+    return std::make_shared<const CSharedNetMsg>(std::move(msg));
+}
+
+BOOST_AUTO_TEST_CASE(blockmsgcache_get_add)
+{
+    CBlockMsgCache cache(1 << 20);
+    const uint256 hash = InsecureRand256();
+    BOOST_CHECK(!cache.Get(hash, CBlockMsgCache::BLOCK));
+
+    auto msg = MakeMsg(1000);
+    cache.Add(hash, CBlockMsgCache::BLOCK, msg);
+    BOOST_CHECK(cache.Get(hash, CBlockMsgCache::BLOCK) == msg);
+    BOOST_CHECK(!cache.Get(hash, CBlockMsgCache::CMPCTBLOCK));
+    BOOST_CHECK_EQUAL(cache.Size(), 1U);
+    const size_t nUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage >= 1000 + CMessageHeader::HEADER_SIZE);
+
+    // Other encodings of the same block share its entry
+    auto cmpctmsg = MakeMsg(100);
+    cache.Add(hash, CBlockMsgCache::CMPCTBLOCK, cmpctmsg);
+    BOOST_CHECK(cache.Get(hash, CBlockMsgCache::CMPCTBLOCK) == cmpctmsg);
+    BOOST_CHECK(cache.Get(hash, CBlockMsgCache::BLOCK) == msg);
+    BOOST_CHECK_EQUAL(cache.Size(), 1U);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > nUsage);
+
+    // Replacing a message releases the usage of the old one
+    const size_t nUsageBoth = cache.DynamicMemoryUsage();
+    cache.Add(hash, CBlockMsgCache::BLOCK, MakeMsg(1000));
+    BOOST_CHECK(cache.Get(hash, CBlockMsgCache::BLOCK) != msg);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nUsageBoth);
+}
+
+BOOST_AUTO_TEST_CASE(blockmsgcache_eviction)
+{
+    CBlockMsgCache cache(1 << 20);
+    auto msg = MakeMsg(10000);
+    cache.Add(InsecureRand256(), CBlockMsgCache::BLOCK, msg);
+    const size_t nMsgUsage = cache.DynamicMemoryUsage();
+
+    // Room for exactly three messages
+    cache.SetMaxUsage(3 * nMsgUsage);
+    std::vector<uint256> hashes;
+    for (int i = 0; i < 3; i++) {
+        hashes.push_back(InsecureRand256());
+        cache.Add(hashes.back(), CBlockMsgCache::BLOCK, msg);
+    }
+    BOOST_CHECK_EQUAL(cache.Size(), 3U);
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), 3 * nMsgUsage);
+
+    // Looking up the oldest block makes the second one least recently used
+    BOOST_CHECK(cache.Get(hashes[0], CBlockMsgCache::BLOCK));
+    cache.Add(InsecureRand256(), CBlockMsgCache::BLOCK, msg);
+    BOOST_CHECK_EQUAL(cache.Size(), 3U);
+    BOOST_CHECK(cache.Get(hashes[0], CBlockMsgCache::BLOCK));
+    BOOST_CHECK(!cache.Get(hashes[1], CBlockMsgCache::BLOCK));
+    BOOST_CHECK(cache.Get(hashes[2], CBlockMsgCache::BLOCK));
+
+    // A message larger than the limit is not kept, and does not evict others
+    const uint256 hashLarge = InsecureRand256();
+    cache.Add(hashLarge, CBlockMsgCache::BLOCK, MakeMsg(100000));
+    BOOST_CHECK(!cache.Get(hashLarge, CBlockMsgCache::BLOCK));
+    BOOST_CHECK_EQUAL(cache.Size(), 3U);
+
+    cache.SetMaxUsage(0);
+    BOOST_CHECK_EQUAL(cache.Size(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,6 +8,7 @@
 #include <undo.h>
 #include <utilstrencodings.h>
 #include <test/test_bitcoin.h>
+#include <txdb.h>
 #include <validation.h>
 #include <consensus/validation.h>
 
@@ -855,4 +856,61 @@ BOOST_AUTO_TEST_CASE(ccoins_write)
                     CheckWriteCoins(parent_value, child_value, parent_value, parent_flags, child_flags, parent_flags);
 }
 
+BOOST_AUTO_TEST_CASE(ccoins_getcoins)
+{
+    CCoinsViewDB db(1 << 20, true, true);
+    std::vector<COutPoint> stored;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 50; ++i) {
+            uint256 txid = InsecureRand256();
+            for (uint32_t n = 0; n < 4; ++n) {
+                Coin coin(CTxOut(InsecureRandRange(1000) + 1, CScript() << OP_TRUE << i), i, n == 0);
+                cache.AddCoin(COutPoint(txid, n), std::move(coin), false);
+                stored.emplace_back(txid, n);
+            }
+        }
+        cache.SetBestBlock(InsecureRand256());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Mix stored, unknown and duplicate outpoints in random order.
+    std::vector<COutPoint> outpoints;
+    for (int i = 0; i < 150; ++i) {
+        outpoints.push_back(InsecureRandBool() ? stored[InsecureRandRange(stored.size())]
+                                               : COutPoint(InsecureRand256(), 0));
+    }
+    outpoints.push_back(outpoints.front());
+
+    std::vector<Coin> coins;
+    size_t found = db.GetCoins(outpoints, coins);
+    BOOST_REQUIRE_EQUAL(coins.size(), outpoints.size());
+    size_t expected_found = 0;
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        Coin coin;
+        if (db.GetCoin(outpoints[i], coin)) {
+            ++expected_found;
+            BOOST_CHECK(coins[i] == coin);
+            BOOST_CHECK(!coins[i].IsSpent());
+        } else {
+            BOOST_CHECK(coins[i].IsSpent());
+        }
+    }
+    BOOST_CHECK_EQUAL(found, expected_found);
+
+    // A cache only looks up what it does not hold yet, and sees its own spends.
+    CCoinsViewCacheTest cache(&db);
+    cache.SpendCoin(stored[0]);
+    cache.PrefetchCoins(outpoints);
+    cache.SelfTest();
+    for (const COutPoint& outpoint : outpoints) {
+        BOOST_CHECK_EQUAL(cache.HaveCoinInCache(outpoint), outpoint != stored[0] && db.HaveCoin(outpoint));
+    }
+    std::vector<Coin> cached_coins;
+    cache.GetCoins({stored[0], stored[1]}, cached_coins);
+    BOOST_CHECK(cached_coins[0].IsSpent());
+    BOOST_CHECK(!cached_coins[1].IsSpent());
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
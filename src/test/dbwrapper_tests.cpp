@@ -119,6 +119,96 @@ BOOST_AUTO_TEST_CASE(dbwrapper_iterator)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_readmany)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (bool obfuscate : {false, true}) {
+        fs::path ph = fs::temp_directory_path() / fs::unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        // Only even keys are present, so that lookups hit both adjacent
+        // entries and gaps in the key space.
+        std::map<uint32_t, uint256> written;
+        CDBBatch batch(dbw);
+        for (uint32_t i = 0; i < 1000; i += 2) {
+            written[i] = InsecureRand256();
+            batch.Write(std::make_pair('r', i), written[i]);
+        }
+        BOOST_CHECK(dbw.WriteBatch(batch));
+        BOOST_CHECK(dbw.Write(std::make_pair('q', uint32_t(0)), InsecureRand256()));
+
+        std::vector<std::pair<char, uint32_t>> keys;
+        for (int i = 0; i < 300; ++i) {
+            keys.emplace_back('r', InsecureRandRange(1100));
+        }
+        // Duplicates, and keys sorting before and after all stored ones.
+        keys.push_back(keys.front());
+        keys.emplace_back('a', 0);
+        keys.emplace_back('z', 0);
+
+        std::vector<uint256> values;
+        size_t found = dbw.ReadMany(keys, values);
+        BOOST_REQUIRE_EQUAL(values.size(), keys.size());
+
+        size_t expected_found = 0;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            uint256 res;
+            bool present = dbw.Read(keys[i], res);
+            if (present) {
+                ++expected_found;
+                BOOST_CHECK_EQUAL(values[i].ToString(), res.ToString());
+                BOOST_CHECK_EQUAL(res.ToString(), written.at(keys[i].second).ToString());
+            } else {
+                BOOST_CHECK(values[i].IsNull());
+            }
+        }
+        BOOST_CHECK_EQUAL(found, expected_found);
+
+        BOOST_CHECK_EQUAL(dbw.ReadMany(std::vector<char>(), values), 0U);
+        BOOST_CHECK(values.empty());
+    }
+}
+
+// Keys that do not fit the inline key buffer, and values of various sizes.
+BOOST_AUTO_TEST_CASE(dbwrapper_key_sizes)
+{
+    // Perform tests both obfuscated and non-obfuscated.
+    for (bool obfuscate : {false, true}) {
+        fs::path ph = fs::temp_directory_path() / fs::unique_path();
+        CDBWrapper dbw(ph, (1 << 20), true, false, obfuscate);
+
+        for (size_t key_size : {0, 1, 32, 63, 64, 65, 200}) {
+            std::string key(key_size, 'k');
+            std::vector<unsigned char> in(key_size * 3 + 1, 0x5a);
+            in.back() = static_cast<unsigned char>(key_size);
+            std::vector<unsigned char> res;
+
+            BOOST_CHECK(dbw.Write(key, in));
+            BOOST_CHECK(dbw.Exists(key));
+            BOOST_CHECK(dbw.Read(key, res));
+            BOOST_CHECK(res == in);
+
+            std::unique_ptr<CDBIterator> it(dbw.NewIterator());
+            it->Seek(key);
+            std::string key_res;
+            BOOST_REQUIRE(it->Valid());
+            BOOST_CHECK(it->GetKey(key_res));
+            BOOST_CHECK_EQUAL(key_res, key);
+            BOOST_CHECK(it->GetValue(res));
+            BOOST_CHECK(res == in);
+
+            // A value that is too short for the requested type fails to deserialize.
+            if (in.size() < 32) {
+                uint256 too_large;
+                BOOST_CHECK(!dbw.Read(key, too_large));
+            }
+
+            BOOST_CHECK(dbw.Erase(key));
+            BOOST_CHECK(!dbw.Exists(key));
+        }
+    }
+}
+
 // Test that we do not obfuscation if there is existing data.
 BOOST_AUTO_TEST_CASE(existing_data_no_obfuscate)
 {
@@ -0,0 +1,89 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <flatset.h>
+#include <memusage.h>
+#include <random.h>
+
+#include <test/test_bitcoin.h>
+
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(flatset_tests, BasicTestingSetup)
+
+typedef flatset<4, int> smallset;
+
+static bool Matches(const smallset& flat, const std::set<int>& real)
+{
+    return flat.size() == real.size() && std::equal(flat.begin(), flat.end(), real.begin());
+}
+
+BOOST_AUTO_TEST_CASE(flatset_basics)
+{
+    smallset s{3, 1, 2, 3};
+    BOOST_CHECK_EQUAL(s.size(), 3U);
+    BOOST_CHECK(s.insert(0).second);
+    BOOST_CHECK(!s.insert(2).second);
+    BOOST_CHECK_EQUAL(*s.insert(2).first, 2);
+    BOOST_CHECK(Matches(s, {0, 1, 2, 3}));
+    // Up to N keys are stored inline
+    BOOST_CHECK_EQUAL(s.allocated_memory(), 0U);
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(s), 0U);
+
+    BOOST_CHECK(s.insert(4).second);
+    BOOST_CHECK(s.allocated_memory() > 0);
+    BOOST_CHECK_EQUAL(s.count(4), 1U);
+    BOOST_CHECK_EQUAL(s.count(5), 0U);
+    BOOST_CHECK(s.find(5) == s.end());
+
+    BOOST_CHECK_EQUAL(s.erase(1), 1U);
+    BOOST_CHECK_EQUAL(s.erase(1), 0U);
+    BOOST_CHECK_EQUAL(*s.erase(s.find(2)), 3);
+    BOOST_CHECK(Matches(s, {0, 3, 4}));
+    BOOST_CHECK(s == smallset({4, 0, 3}));
+    BOOST_CHECK(s != smallset({0, 3}));
+
+    s.clear();
+    BOOST_CHECK(s.empty());
+    BOOST_CHECK(s.begin() == s.end());
+}
+
+BOOST_AUTO_TEST_CASE(flatset_random)
+{
+    FastRandomContext ctx(true);
+    for (int run = 0; run < 100; ++run) {
+        smallset flat;
+        std::set<int> real;
+        for (int op = 0; op < 200; ++op) {
+            const int key = ctx.randrange(64);
+            switch (ctx.randrange(4)) {
+            case 0:
+                BOOST_CHECK_EQUAL(flat.insert(key).second, real.insert(key).second);
+                break;
+            case 1:
+                BOOST_CHECK_EQUAL(flat.erase(key), real.erase(key));
+                break;
+            case 2:
+                BOOST_CHECK_EQUAL(flat.count(key), real.count(key));
+                break;
+            case 3: {
+                // Range insert of unsorted keys, with duplicates
+                std::vector<int> keys;
+                for (int i = ctx.randrange(8); i > 0; --i) {
+                    keys.push_back(ctx.randrange(64));
+                }
+                flat.insert(keys.begin(), keys.end());
+                real.insert(keys.begin(), keys.end());
+                break;
+            }
+            }
+            BOOST_CHECK(Matches(flat, real));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
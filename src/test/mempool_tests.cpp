@@ -103,6 +103,23 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     testPool.removeRecursive(txParent);
     BOOST_CHECK_EQUAL(testPool.size(), poolSize - 6);
     BOOST_CHECK_EQUAL(testPool.size(), 0);
+
+    // Descendants of several entries at once, one of which descends from
+    // another, and of entries already accounted for
+    testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    for (int i = 0; i < 3; i++)
+    {
+        testPool.addUnchecked(txChild[i].GetHash(), entry.FromTx(txChild[i]));
+        testPool.addUnchecked(txGrandChild[i].GetHash(), entry.FromTx(txGrandChild[i]));
+    }
+    LOCK(testPool.cs);
+    CTxMemPool::setEntries setDescendants;
+    testPool.CalculateDescendants({testPool.mapTx.find(txChild[0].GetHash()), testPool.mapTx.find(txGrandChild[0].GetHash()),
+                                   testPool.mapTx.find(txChild[1].GetHash())}, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 4U);
+    BOOST_CHECK(!setDescendants.count(testPool.mapTx.find(txChild[2].GetHash())));
+    testPool.CalculateDescendants(CTxMemPool::setEntries{testPool.mapTx.find(txParent.GetHash())}, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 7U);
 }
 
 template<typename name>
@@ -523,17 +540,20 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx6.GetHash(), entry.Fee(1100LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    // we only require this remove, at max, 2 txn, because its not clear what we're really optimizing for aside from that
+    // The cluster is chunked as [tx4] [tx5 tx6 tx7], as tx7 pays for both of
+    // its parents, so the last chunk is evicted as a whole
     pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
     BOOST_CHECK(pool.exists(tx4.GetHash()));
-    BOOST_CHECK(pool.exists(tx6.GetHash()));
+    BOOST_CHECK(!pool.exists(tx5.GetHash()));
+    BOOST_CHECK(!pool.exists(tx6.GetHash()));
     BOOST_CHECK(!pool.exists(tx7.GetHash()));
 
-    if (!pool.exists(tx5.GetHash()))
-        pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    // With a high fee tx6 the cluster is chunked as [tx4 tx6] [tx5 tx7]
+    pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5));
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(12000LL).FromTx(tx6));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7));
 
-    pool.TrimToSize(pool.DynamicMemoryUsage() / 2); // should maximize mempool size by only removing 5/7
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1); // should only remove the worst chunk, 5/7
     BOOST_CHECK(pool.exists(tx4.GetHash()));
     BOOST_CHECK(!pool.exists(tx5.GetHash()));
     BOOST_CHECK(pool.exists(tx6.GetHash()));
@@ -571,4 +591,212 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolClusterTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_1;
+    txA.vout.resize(1);
+    txA.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    txA.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000LL).FromTx(txA));
+
+    CMutableTransaction txB = txA;
+    txB.vin[0].scriptSig = CScript() << OP_2;
+    pool.addUnchecked(txB.GetHash(), entry.Fee(2000LL).FromTx(txB));
+
+    CTxMemPool::txiter itA = pool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itB = pool.mapTx.find(txB.GetHash());
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(itA).vTxs.size(), 1U);
+
+    // A child of both joins their clusters, and pays for them
+    CMutableTransaction txC;
+    txC.vin.resize(2);
+    txC.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txC.vin[1].prevout = COutPoint(txB.GetHash(), 0);
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    txC.vout[0].nValue = 20 * COIN;
+    CTxMemPool::setEntries setAncestors{itA, itB};
+    BOOST_CHECK_EQUAL(pool.CalculateClusterCount(setAncestors), 2U);
+    pool.addUnchecked(txC.GetHash(), entry.Fee(10000LL).FromTx(txC));
+    CTxMemPool::txiter itC = pool.mapTx.find(txC.GetHash());
+
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+    const CTxMemPool::Cluster& cluster = pool.GetCluster(itC);
+    BOOST_CHECK_EQUAL(cluster.vTxs.size(), 3U);
+    BOOST_CHECK(cluster.vTxs.back() == itC);
+    BOOST_CHECK_EQUAL(cluster.vChunks.size(), 1U);
+    BOOST_CHECK_EQUAL(cluster.vChunks[0].nModFees, 13000);
+    BOOST_CHECK_EQUAL(cluster.vChunks[0].nSize, itA->GetTxSize() + itB->GetTxSize() + itC->GetTxSize());
+
+    // Lowering the child's fee splits the chunk, best parent first
+    pool.PrioritiseTransaction(txC.GetHash(), -9500LL);
+    const CTxMemPool::Cluster& lowered = pool.GetCluster(itC);
+    BOOST_CHECK_EQUAL(lowered.vChunks.size(), 3U);
+    BOOST_CHECK(lowered.vTxs[0] == itB);
+    BOOST_CHECK(lowered.vTxs[1] == itA);
+    BOOST_CHECK(lowered.vTxs[2] == itC);
+
+    // Removing the child splits the cluster again
+    pool.removeRecursive(txC);
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 2U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(itA).vTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(itB).vTxs.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.GetCluster(itB).vChunks[0].nModFees, 2000);
+
+    // The worst chunk of any cluster is evicted first
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!pool.exists(txA.GetHash()));
+    BOOST_CHECK(pool.exists(txB.GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolClusterReorgTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A transaction from a disconnected block, whose three children stayed in
+    // the mempool
+    CMutableTransaction parent;
+    parent.vin.resize(1);
+    parent.vin[0].scriptSig = CScript() << OP_1;
+    parent.vout.resize(3);
+    for (int i = 0; i < 3; ++i) {
+        parent.vout[i].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        parent.vout[i].nValue = COIN;
+    }
+    std::vector<CMutableTransaction> children(3);
+    const CAmount fees[] = {30000, 1000, 20000};
+    for (int i = 0; i < 3; ++i) {
+        children[i].vin.resize(1);
+        children[i].vin[0].prevout = COutPoint(parent.GetHash(), i);
+        children[i].vout.resize(1);
+        children[i].vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        children[i].vout[0].nValue = COIN;
+        pool.addUnchecked(children[i].GetHash(), entry.Fee(fees[i]).FromTx(children[i]));
+    }
+    pool.addUnchecked(parent.GetHash(), entry.Fee(10000LL).FromTx(parent));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 4U);
+
+    // Linking them makes a single cluster, which the lowest feerate child
+    // does not fit into anymore
+    pool.UpdateTransactionsFromBlock({parent.GetHash()}, 3);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK(!pool.exists(children[1].GetHash()));
+    BOOST_CHECK_EQUAL(pool.GetClusters().size(), 1U);
+    const CTxMemPool::Cluster& cluster = pool.GetCluster(pool.mapTx.find(parent.GetHash()));
+    BOOST_CHECK_EQUAL(cluster.vTxs.size(), 3U);
+    BOOST_CHECK(cluster.vTxs[0]->GetTx().GetHash() == parent.GetHash());
+    BOOST_CHECK(cluster.vTxs[1]->GetTx().GetHash() == children[0].GetHash());
+    BOOST_CHECK(cluster.vTxs[2]->GetTx().GetHash() == children[2].GetHash());
+    BOOST_CHECK_EQUAL(pool.mapTx.find(parent.GetHash())->GetCountWithDescendants(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolLargeClusterTest)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A cluster too large to search ancestor sets in is still put in a
+    // valid order: a fan of children of one transaction, each with a child
+    // of its own
+    CMutableTransaction root;
+    root.vin.resize(1);
+    root.vin[0].scriptSig = CScript() << OP_1;
+    root.vout.resize(100);
+    for (CTxOut& out : root.vout) {
+        out.scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        out.nValue = COIN;
+    }
+    pool.addUnchecked(root.GetHash(), entry.Fee(1000LL).FromTx(root));
+    for (int i = 0; i < 100; ++i) {
+        CMutableTransaction child;
+        child.vin.resize(1);
+        child.vin[0].prevout = COutPoint(root.GetHash(), i);
+        child.vout.resize(1);
+        child.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        child.vout[0].nValue = COIN;
+        pool.addUnchecked(child.GetHash(), entry.Fee(1000LL).FromTx(child));
+        CMutableTransaction grandchild;
+        grandchild.vin.resize(1);
+        grandchild.vin[0].prevout = COutPoint(child.GetHash(), 0);
+        grandchild.vout.resize(1);
+        grandchild.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        grandchild.vout[0].nValue = COIN;
+        pool.addUnchecked(grandchild.GetHash(), entry.Fee(1000LL * i).FromTx(grandchild));
+    }
+
+    const CTxMemPool::Cluster& cluster = pool.GetCluster(pool.mapTx.find(root.GetHash()));
+    BOOST_REQUIRE_EQUAL(cluster.vTxs.size(), 201U);
+    std::set<uint256> setSeen;
+    for (CTxMemPool::txiter it : cluster.vTxs) {
+        for (const CTxIn& txin : it->GetTx().vin) {
+            BOOST_CHECK(!pool.exists(txin.prevout.hash) || setSeen.count(txin.prevout.hash));
+        }
+        setSeen.insert(it->GetTx().GetHash());
+    }
+    BOOST_CHECK(cluster.vTxs[0]->GetTx().GetHash() == root.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolTrimBatchTest)
+{
+    TestMemPoolEntryHelper entry;
+
+    // Lone transactions and a parent that pays more than its child, which
+    // puts the child in a chunk of its own. In order of eviction:
+    // lone1, child, lone2, parent, lone3.
+    std::vector<CMutableTransaction> txs(5);
+    const CAmount fees[] = {1000, 2000, 3000, 50000, 60000};
+    for (size_t i = 0; i < txs.size(); ++i) {
+        txs[i].vin.resize(1);
+        txs[i].vin[0].scriptSig = CScript() << (int64_t)i;
+        txs[i].vout.resize(1);
+        txs[i].vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        txs[i].vout[0].nValue = 10 * COIN;
+    }
+    txs[1].vin[0].prevout = COutPoint(txs[3].GetHash(), 0);
+
+    // However much has to go, a single call only removes the worst
+    // transactions, merging the chunks of a cluster with those of others.
+    for (int divisor = 8; divisor >= 0; --divisor) {
+        CTxMemPool pool;
+        for (size_t i : {0, 3, 1, 2, 4}) {
+            pool.addUnchecked(txs[i].GetHash(), entry.Fee(fees[i]).FromTx(txs[i]));
+        }
+        pool.TrimToSize(divisor ? pool.DynamicMemoryUsage() * (divisor - 1) / 8 : 0);
+        bool fRemoved = false;
+        for (size_t i = txs.size(); i-- > 0; ) {
+            if (!pool.exists(txs[i].GetHash())) {
+                fRemoved = true;
+            } else {
+                BOOST_CHECK(!fRemoved);
+            }
+        }
+        if (divisor == 0) {
+            BOOST_CHECK_EQUAL(pool.size(), 0U);
+            // The minimum fee is bumped to the best chunk that was removed
+            BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), CFeeRate(fees[4], GetVirtualTransactionSize(txs[4])).GetFeePerK() + 1000);
+        }
+    }
+
+    // Expiry removes the descendants of expired transactions, even when they
+    // are newer
+    CTxMemPool pool;
+    pool.addUnchecked(txs[3].GetHash(), entry.Fee(fees[3]).Time(100).FromTx(txs[3]));
+    pool.addUnchecked(txs[1].GetHash(), entry.Fee(fees[1]).Time(300).FromTx(txs[1]));
+    pool.addUnchecked(txs[0].GetHash(), entry.Fee(fees[0]).Time(300).FromTx(txs[0]));
+    BOOST_CHECK_EQUAL(pool.Expire(200), 2);
+    BOOST_CHECK(pool.exists(txs[0].GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
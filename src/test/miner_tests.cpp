@@ -520,4 +520,100 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     fCheckpointsEnabled = true;
 }
 
+BOOST_AUTO_TEST_CASE(block_template_cache)
+{
+    // Not started, so templates are only built on demand by Get()
+    BlockTemplateCache cache(Params(), DEFAULT_BLOCK_TEMPLATE_REFRESH);
+    SetMockTime(GetTime());
+
+    CachedBlockTemplate first = cache.Get(true);
+    BOOST_REQUIRE(first.block_template);
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(first.pindex_prev == chainActive.Tip());
+    }
+    BOOST_CHECK_EQUAL(first.transactions_updated, mempool.GetTransactionsUpdated());
+
+    // Unchanged mempool and tip: the same template is handed out
+    BOOST_CHECK(cache.Get(true).block_template == first.block_template);
+    // Templates for non-segwit callers are cached separately
+    BOOST_CHECK(cache.Get(false).block_template != first.block_template);
+
+    // Mempool changes are only picked up once the refresh interval passed
+    mempool.AddTransactionsUpdated(1);
+    BOOST_CHECK(cache.Get(true).block_template == first.block_template);
+    SetMockTime(GetTime() + DEFAULT_BLOCK_TEMPLATE_REFRESH + 1);
+    CachedBlockTemplate second = cache.Get(true);
+    BOOST_CHECK(second.block_template != first.block_template);
+    BOOST_CHECK_EQUAL(second.transactions_updated, mempool.GetTransactionsUpdated());
+    BOOST_CHECK(cache.Get(true).block_template == second.block_template);
+
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(block_template_cache_waiters)
+{
+    BlockTemplateCache cache(Params(), DEFAULT_BLOCK_TEMPLATE_REFRESH);
+    SetMockTime(GetTime());
+    const auto now = std::chrono::steady_clock::now();
+
+    CachedBlockTemplate first = cache.Get(true);
+    BOOST_REQUIRE(first.block_template);
+    uint256 tip_hash;
+    {
+        LOCK(cs_main);
+        tip_hash = chainActive.Tip()->GetBlockHash();
+    }
+
+    // Nothing new yet
+    int same_tip = 0;
+    cache.NotifyOnUpdate(tip_hash, first.transactions_updated, now, [&same_tip] { ++same_tip; });
+    int grace = 0;
+    cache.NotifyOnUpdate(tip_hash, first.transactions_updated - 1, now + std::chrono::hours(1), [&grace] { ++grace; });
+    BOOST_CHECK_EQUAL(same_tip, 0);
+    BOOST_CHECK_EQUAL(grace, 0);
+
+    // A waiter on another tip is due right away
+    int other_tip = 0;
+    cache.NotifyOnUpdate(uint256(), first.transactions_updated, now + std::chrono::hours(1), [&other_tip] { ++other_tip; });
+    BOOST_CHECK_EQUAL(other_tip, 1);
+
+    // A template with other transactions wakes waiters past their grace period only
+    mempool.AddTransactionsUpdated(1);
+    SetMockTime(GetTime() + DEFAULT_BLOCK_TEMPLATE_REFRESH + 1);
+    BOOST_CHECK(cache.Get(true).block_template != first.block_template);
+    BOOST_CHECK_EQUAL(same_tip, 1);
+    BOOST_CHECK_EQUAL(grace, 0);
+
+    // Stopping notifies everyone left, and later waiters right away
+    cache.Stop();
+    BOOST_CHECK_EQUAL(grace, 1);
+    int late = 0;
+    cache.NotifyOnUpdate(tip_hash, mempool.GetTransactionsUpdated(), now, [&late] { ++late; });
+    BOOST_CHECK_EQUAL(late, 1);
+
+    BOOST_CHECK_EQUAL(same_tip, 1);
+    BOOST_CHECK_EQUAL(other_tip, 1);
+    SetMockTime(0);
+}
+
+BOOST_AUTO_TEST_CASE(block_template_cache_builder)
+{
+    BlockTemplateCache cache(Params(), DEFAULT_BLOCK_TEMPLATE_REFRESH);
+
+    // Callers and the builder share one template per tip, whichever of
+    // them got to build it first
+    cache.Start(true);
+    CachedBlockTemplate built = cache.Get(true);
+    BOOST_REQUIRE(built.block_template);
+    BOOST_CHECK(cache.Get(true).block_template == built.block_template);
+
+    // A template the builder does not keep is built on demand
+    CachedBlockTemplate other = cache.Get(false);
+    BOOST_REQUIRE(other.block_template);
+    BOOST_CHECK(other.block_template != built.block_template);
+
+    cache.Stop();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
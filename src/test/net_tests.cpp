@@ -187,4 +187,85 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnetmessage_read_in_pieces)
+{
+    // Small messages are hashed while they are read, large ones afterwards
+    for (size_t nSize : {1000, 300000}) {
+        std::vector<unsigned char> payload(nSize);
+        for (size_t i = 0; i < payload.size(); i++)
+            payload[i] = i & 0xff;
+        CSerializedNetMsg serialized;
+        serialized.data = payload;
+        serialized.command = "block";
+        const CSharedNetMsg shared(std::move(serialized));
+        const char* pch = reinterpret_cast<const char*>(shared.data->data());
+
+        for (unsigned int nChunk : {1, 7, 1000, 100000}) {
+            CNetMessage msg(Params().MessageStart(), SER_NETWORK, INIT_PROTO_VERSION);
+            size_t nPos = 0;
+            while (nPos < shared.data->size()) {
+                unsigned int nBytes = std::min<size_t>(nChunk, shared.data->size() - nPos);
+                int handled = msg.in_data ? msg.readData(pch + nPos, nBytes) : msg.readHeader(pch + nPos, nBytes);
+                BOOST_CHECK(handled > 0);
+                nPos += handled;
+            }
+            BOOST_CHECK(msg.complete());
+            BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+            BOOST_CHECK_EQUAL(msg.hdr.nMessageSize, payload.size());
+            BOOST_CHECK_EQUAL(msg.vRecv.size(), payload.size());
+            BOOST_CHECK(memcmp(msg.vRecv.data(), payload.data(), payload.size()) == 0);
+            BOOST_CHECK_EQUAL(msg.fHashOffload, nSize > 64 * 1024);
+            BOOST_CHECK_EQUAL(msg.fHashReady, !msg.fHashOffload);
+            if (msg.fHashOffload) {
+                msg.ComputeMessageHash();
+                msg.fHashReady = true;
+            }
+            BOOST_CHECK(memcmp(msg.GetMessageHash().begin(), msg.hdr.pchChecksum, CMessageHeader::CHECKSUM_SIZE) == 0);
+            // The buffer is sized for the message, not beyond it
+            BOOST_CHECK(msg.vRecv.capacity() <= std::max<size_t>(payload.size(), 1024 * 1024));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(cnode_shared_send_buffer)
+{
+    SOCKET hSocket = INVALID_SOCKET;
+    NodeId id = 0;
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    std::unique_ptr<CNode> pnode1(new CNode(id++, NODE_NETWORK, 0, hSocket, addr, 0, 0, CAddress(), "", true));
+    std::unique_ptr<CNode> pnode2(new CNode(id++, NODE_NETWORK, 0, hSocket, addr, 1, 1, CAddress(), "", true));
+
+    const std::vector<unsigned char> payload(1000, 0x42);
+    auto make_msg = [&payload] {
+        CSerializedNetMsg msg;
+        msg.data = payload;
+        msg.command = "block";
+        return msg;
+    };
+    CSharedNetMsg msg(make_msg());
+    CConnman connman(0x1337, 0x1337);
+    BOOST_CHECK_EQUAL(msg.data->size(), CMessageHeader::HEADER_SIZE + payload.size());
+    BOOST_CHECK(std::equal(payload.begin(), payload.end(), msg.data->begin() + CMessageHeader::HEADER_SIZE));
+
+    // Both peers queue the same buffer rather than a copy of it
+    connman.PushMessage(pnode1.get(), msg);
+    connman.PushMessage(pnode2.get(), msg);
+    for (CNode* pnode : {pnode1.get(), pnode2.get()}) {
+        LOCK(pnode->cs_vSend);
+        BOOST_CHECK_EQUAL(pnode->vSendMsg.size(), 1U);
+        BOOST_CHECK(pnode->vSendMsg.front() == msg.data);
+        BOOST_CHECK_EQUAL(pnode->nSendSize, msg.data->size());
+    }
+
+    // Unshared messages queue the header and payload as separate buffers
+    connman.PushMessage(pnode1.get(), make_msg());
+    LOCK(pnode1->cs_vSend);
+    BOOST_CHECK_EQUAL(pnode1->vSendMsg.size(), 3U);
+    BOOST_CHECK(*pnode1->vSendMsg[1] == std::vector<unsigned char>(msg.data->begin(), msg.data->begin() + CMessageHeader::HEADER_SIZE));
+    BOOST_CHECK(*pnode1->vSendMsg[2] == payload);
+    BOOST_CHECK_EQUAL(pnode1->nSendSize, 2 * msg.data->size());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
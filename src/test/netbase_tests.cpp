@@ -4,9 +4,11 @@
 
 #include <netbase.h>
 #include <test/test_bitcoin.h>
+#include <util.h>
 #include <utilstrencodings.h>
 
 #include <string>
+#include <thread>
 
 #include <boost/test/unit_test.hpp>
 
@@ -302,4 +304,59 @@ BOOST_AUTO_TEST_CASE(netbase_getgroup)
     BOOST_CHECK(CreateInternal("baz.net").GetGroup() == internal_group);
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(netbase_high_socket)
+{
+    // Sockets numbered beyond FD_SETSIZE are only usable when nothing waits
+    // on them with select()
+    const int nHighSocket = FD_SETSIZE + 1;
+    if (RaiseFileDescriptorLimit(nHighSocket + 1) <= nHighSocket) {
+        BOOST_TEST_MESSAGE("Skipping netbase_high_socket: descriptor limit too low");
+        return;
+    }
+
+    SOCKET hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    struct sockaddr_in sockaddr = {};
+    sockaddr.sin_family = AF_INET;
+    sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(sockaddr);
+    BOOST_REQUIRE(bind(hListen, (struct sockaddr*)&sockaddr, len) == 0);
+    BOOST_REQUIRE(listen(hListen, 1) == 0);
+    BOOST_REQUIRE(getsockname(hListen, (struct sockaddr*)&sockaddr, &len) == 0);
+    const CService addrProxy(LookupNumeric("127.0.0.1", ntohs(sockaddr.sin_port)));
+
+    SOCKET hSocket = CreateSocket(addrProxy);
+    BOOST_REQUIRE(hSocket != INVALID_SOCKET);
+    SOCKET hHigh = dup2(hSocket, nHighSocket);
+    CloseSocket(hSocket);
+    BOOST_REQUIRE(hHigh == nHighSocket);
+
+#ifdef USE_EPOLL
+    BOOST_CHECK(IsSelectableSocket(hHigh));
+
+    // Connecting and the SOCKS5 handshake wait on the socket with poll().
+    // The proxy only answers after a while, so that the client has to wait.
+    // Earlier tests may have left the handshake interrupted at shutdown.
+    InterruptSocks5(false);
+    std::thread proxy([hListen] {
+        SOCKET hAccepted = accept(hListen, nullptr, nullptr);
+        MilliSleep(100);
+        const char reply[] = {0x05, 0x00, 0x05, 0x00, 0x00, 0x01, 0x7f, 0x00, 0x00, 0x01, 0x00, 0x50};
+        send(hAccepted, reply, sizeof(reply), MSG_NOSIGNAL);
+        MilliSleep(100);
+        CloseSocket(hAccepted);
+    });
+    bool fProxyConnectionFailed = false;
+    BOOST_CHECK(ConnectThroughProxy(proxyType(addrProxy), "example.com", 80, hHigh, 5000, &fProxyConnectionFailed));
+    BOOST_CHECK(!fProxyConnectionFailed);
+    proxy.join();
+#else
+    BOOST_CHECK(!IsSelectableSocket(hHigh));
+#endif
+
+    CloseSocket(hHigh);
+    CloseSocket(hListen);
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
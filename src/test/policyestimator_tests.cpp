@@ -2,8 +2,10 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include <fs.h>
 #include <policy/policy.h>
 #include <policy/fees.h>
+#include <streams.h>
 #include <txmempool.h>
 #include <uint256.h>
 #include <util.h>
@@ -179,4 +181,76 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesCacheAndPersist)
+{
+    CBlockPolicyEstimator feeEst;
+    CTxMemPool mpool(&feeEst);
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // Higher fee transactions confirm sooner: fee level j waits j blocks
+    std::vector<std::vector<CTransactionRef>> waiting(10);
+    int blocknum = 0;
+    while (blocknum < 100) {
+        for (int j = 0; j < 10; j++) {
+            for (int k = 0; k < 4; k++) {
+                tx.vin[0].prevout.n = 10000 * blocknum + 100 * j + k;
+                mpool.addUnchecked(tx.GetHash(), entry.Fee(1000 * (10 - j)).Time(GetTime()).Height(blocknum).FromTx(tx));
+                waiting[(blocknum + j) % 10].push_back(mpool.get(tx.GetHash()));
+            }
+        }
+        std::vector<CTransactionRef> block;
+        block.swap(waiting[blocknum % 10]);
+        mpool.removeForBlock(block, ++blocknum);
+
+        if (blocknum == 60) {
+            // Answers stay the same until the next block
+            CFeeRate before = feeEst.estimateSmartFee(2, nullptr, false);
+            BOOST_CHECK(before != CFeeRate(0));
+            tx.vin[0].prevout.n = 999999;
+            mpool.addUnchecked(tx.GetHash(), entry.Fee(100000).Height(blocknum).FromTx(tx));
+            BOOST_CHECK(feeEst.estimateSmartFee(2, nullptr, false) == before);
+            mpool.removeRecursive(tx);
+        }
+    }
+
+    // The curve has the same answers as asking for every target
+    std::vector<std::pair<unsigned int, CFeeRate>> curve = feeEst.estimateSmartFeeCurve(false);
+    BOOST_CHECK(!curve.empty());
+    for (const auto& point : curve) {
+        FeeCalculation feeCalc;
+        BOOST_CHECK(feeEst.estimateSmartFee(point.first, &feeCalc, false) == point.second);
+        BOOST_CHECK_EQUAL(feeCalc.desiredTarget, (int)point.first);
+    }
+
+    // Estimates survive a round trip through the compact file format
+    BOOST_CHECK(feeEst.HasUnwrittenBlocks());
+    fs::path path = fs::temp_directory_path() / fs::unique_path();
+    {
+        CAutoFile fileout(fsbridge::fopen(path, "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_CHECK(feeEst.Write(fileout));
+    }
+    BOOST_CHECK(!feeEst.HasUnwrittenBlocks());
+    CBlockPolicyEstimator readEst;
+    {
+        CAutoFile filein(fsbridge::fopen(path, "rb"), SER_DISK, CLIENT_VERSION);
+        // Released clients refuse the file rather than misread it
+        int nVersionRequired;
+        filein >> nVersionRequired;
+        BOOST_CHECK(nVersionRequired > CLIENT_VERSION);
+        BOOST_CHECK_EQUAL(fseek(filein.Get(), 0, SEEK_SET), 0);
+        BOOST_CHECK(readEst.Read(filein));
+    }
+    fs::remove(path);
+    for (int target = 2; target <= 24; target++) {
+        CAmount orig = feeEst.estimateRawFee(target, 0.85, FeeEstimateHorizon::MED_HALFLIFE).GetFeePerK();
+        CAmount read = readEst.estimateRawFee(target, 0.85, FeeEstimateHorizon::MED_HALFLIFE).GetFeePerK();
+        BOOST_CHECK(std::abs(orig - read) <= 1);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
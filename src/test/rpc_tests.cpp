@@ -8,6 +8,8 @@
 #include <base58.h>
 #include <core_io.h>
 #include <netbase.h>
+#include <txmempool.h>
+#include <validation.h>
 
 #include <test/test_bitcoin.h>
 
@@ -345,4 +347,58 @@ BOOST_AUTO_TEST_CASE(rpc_convert_values_generatetoaddress)
     BOOST_CHECK_EQUAL(result[2].get_int(), 9);
 }
 
+BOOST_AUTO_TEST_CASE(rpc_getrawmempoolpage)
+{
+    TestMemPoolEntryHelper entry;
+    std::set<std::string> setTxids;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = 1 * COIN;
+    for (int i = 0; i < 5; i++) {
+        tx.vin[0].scriptSig = CScript() << i;
+        mempool.addUnchecked(tx.GetHash(), entry.Fee(1000).FromTx(tx));
+        setTxids.insert(tx.GetHash().ToString());
+    }
+
+    // Pages of two cover the mempool once in txid order, and only the last
+    // has no "next"
+    std::set<std::string> setSeen;
+    std::vector<uint256> vSeen;
+    std::string start;
+    for (int page = 0; page < 3; page++) {
+        UniValue r = CallRPC("getrawmempoolpage " + start + " 2");
+        const UniValue& txids = find_value(r.get_obj(), "transactions");
+        BOOST_CHECK_EQUAL(txids.size(), page < 2 ? 2U : 1U);
+        for (size_t i = 0; i < txids.size(); i++) {
+            BOOST_CHECK(setSeen.insert(txids[i].get_str()).second);
+            vSeen.push_back(uint256S(txids[i].get_str()));
+        }
+        const UniValue& next = find_value(r.get_obj(), "next");
+        BOOST_CHECK_EQUAL(next.isNull(), page == 2);
+        if (!next.isNull()) start = next.get_str();
+    }
+    BOOST_CHECK(setSeen == setTxids);
+    BOOST_CHECK(std::is_sorted(vSeen.begin(), vSeen.end()));
+
+    // A page can start after a transaction that left the mempool
+    mempool.removeRecursive(*mempool.get(vSeen[1]));
+    UniValue after = find_value(CallRPC("getrawmempoolpage " + vSeen[1].GetHex() + " 1").get_obj(), "transactions");
+    BOOST_CHECK_EQUAL(after.size(), 1U);
+    BOOST_CHECK_EQUAL(after[0].get_str(), vSeen[2].GetHex());
+
+    // Verbose pages hold the same entries as getrawmempool
+    UniValue r = CallRPC("getrawmempoolpage  10 true");
+    const UniValue& entries = find_value(r.get_obj(), "transactions");
+    BOOST_CHECK_EQUAL(entries.size(), 4U);
+    UniValue all = CallRPC("getrawmempool true");
+    for (const std::string& txid : setTxids) {
+        BOOST_CHECK_EQUAL(find_value(entries, txid).write(), find_value(all, txid).write());
+    }
+
+    BOOST_CHECK_THROW(CallRPC("getrawmempoolpage  0"), std::runtime_error);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
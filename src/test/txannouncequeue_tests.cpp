@@ -0,0 +1,112 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txannouncequeue.h>
+#include <txmempool.h>
+
+#include <test/test_bitcoin.h>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txannouncequeue_tests, TestingSetup)
+
+static CMutableTransaction MakeTx(const uint256& hashPrev)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(txannouncequeue_order)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    // A low fee parent with a child, and an unrelated high fee transaction
+    const CMutableTransaction txParent = MakeTx(InsecureRand256());
+    const CMutableTransaction txChild = MakeTx(txParent.GetHash());
+    const CMutableTransaction txHighFee = MakeTx(InsecureRand256());
+    const CMutableTransaction txGone = MakeTx(InsecureRand256());
+    pool.addUnchecked(txParent.GetHash(), entry.Fee(1000).FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.Fee(50000).FromTx(txChild));
+    pool.addUnchecked(txHighFee.GetHash(), entry.Fee(20000).FromTx(txHighFee));
+
+    CTxAnnounceQueue queue;
+    queue.Push(txChild.GetHash());
+    queue.Push(txParent.GetHash());
+    queue.Push(txGone.GetHash());
+    queue.Push(txHighFee.GetHash());
+    queue.Push(txChild.GetHash());
+    BOOST_CHECK_EQUAL(queue.Begin(), queue.End());
+    queue.Seal(pool, 1000);
+
+    // Duplicates and transactions not in the mempool are dropped; parents
+    // come first, then higher fee rates
+    BOOST_CHECK_EQUAL(queue.End() - queue.Begin(), 3U);
+    BOOST_CHECK(queue.At(0).hash == txHighFee.GetHash());
+    BOOST_CHECK(queue.At(1).hash == txParent.GetHash());
+    BOOST_CHECK(queue.At(2).hash == txChild.GetHash());
+    BOOST_CHECK(queue.At(2).tx->GetHash() == txChild.GetHash());
+    BOOST_CHECK(queue.At(0).nFeePerK > queue.At(1).nFeePerK);
+
+    // Sealing again appends only what was pushed since
+    queue.Seal(pool, 2000);
+    BOOST_CHECK_EQUAL(queue.End(), 3U);
+    queue.Push(txParent.GetHash());
+    queue.Seal(pool, 2000);
+    BOOST_CHECK_EQUAL(queue.End(), 4U);
+    BOOST_CHECK(queue.At(3).hash == txParent.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(txannouncequeue_trim)
+{
+    CTxMemPool pool;
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    CTxAnnounceQueue queue;
+    const uint64_t nReader1 = queue.AddReader();
+    const uint64_t nReader2 = queue.AddReader();
+    BOOST_CHECK_EQUAL(nReader1, 0U);
+    for (int i = 0; i < 4; i++) {
+        const CMutableTransaction tx = MakeTx(InsecureRand256());
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(tx));
+        queue.Push(tx.GetHash());
+        queue.Seal(pool, 1000 * (i + 1));
+    }
+    BOOST_CHECK_EQUAL(queue.End(), 4U);
+
+    // Nothing is dropped while a reader has not walked past it
+    queue.MoveReader(nReader1, 3);
+    queue.Trim(0);
+    BOOST_CHECK_EQUAL(queue.Begin(), 0U);
+
+    // Positions stay valid as announcements before them are dropped
+    const uint256 hash = queue.At(2).hash;
+    queue.MoveReader(nReader2, 2);
+    queue.Trim(0);
+    BOOST_CHECK_EQUAL(queue.Begin(), 2U);
+    BOOST_CHECK_EQUAL(queue.End(), 4U);
+    BOOST_CHECK(queue.At(2).hash == hash);
+
+    // Expired announcements are dropped even if not walked past
+    queue.Trim(4000);
+    BOOST_CHECK_EQUAL(queue.Begin(), 3U);
+
+    // Readers past the newest announcement, or gone, keep nothing queued
+    queue.MoveReader(3, queue.End());
+    queue.RemoveReader(2);
+    queue.Trim(0);
+    BOOST_CHECK_EQUAL(queue.Begin(), queue.End());
+    queue.RemoveReader(queue.End());
+    BOOST_CHECK_EQUAL(queue.AddReader(), queue.End());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
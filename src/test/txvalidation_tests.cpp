@@ -8,6 +8,7 @@
 #include <consensus/validation.h>
 #include <primitives/transaction.h>
 #include <script/script.h>
+#include <script/sign.h>
 #include <test/test_bitcoin.h>
 
 #include <boost/test/unit_test.hpp>
@@ -58,4 +59,97 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_reject_coinbase, TestChain100Setup)
     BOOST_CHECK_EQUAL(nDoS, 100);
 }
 
+static CTransactionRef SpendP2PK(const CKey& key, const COutPoint& prevout, CAmount nValue, bool fValidSig = true)
+{
+    CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.nVersion = 1;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    if (!fValidSig) vchSig[10] ^= 1;
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return MakeTransactionRef(tx);
+}
+
+/**
+ * A parent that pays no fee gets into the mempool together with a child
+ * paying for both, but only as a whole.
+ */
+BOOST_FIXTURE_TEST_CASE(tx_mempool_package_cpfp, TestChain100Setup)
+{
+    const COutPoint coin(coinbaseTxns[0].GetHash(), 0);
+    const CAmount nValue = coinbaseTxns[0].vout[0].nValue;
+    CTransactionRef parent = SpendP2PK(coinbaseKey, coin, nValue);
+    CTransactionRef child = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), nValue - CENT);
+    CTransactionRef badchild = SpendP2PK(coinbaseKey, COutPoint(parent->GetHash(), 0), nValue - CENT, false);
+
+    LOCK(cs_main);
+
+    CValidationState state;
+    BOOST_CHECK(!AcceptToMemoryPool(mempool, state, parent, nullptr /* pfMissingInputs */,
+                                    nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "min relay fee not met");
+
+    std::vector<CValidationState> vState;
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {child, parent}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-sorted");
+
+    // Everything but the last transaction must be a parent of it
+    CTransactionRef unrelated = SpendP2PK(coinbaseKey, COutPoint(coinbaseTxns[2].GetHash(), 0), nValue - CENT);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {parent, unrelated}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-not-child-with-parents");
+
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {parent}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package min relay fee not met");
+
+    // An invalid child takes the parent down with it
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {parent, badchild}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-invalid-tx");
+    BOOST_CHECK(vState[1].IsInvalid());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    state = CValidationState();
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, {parent, child}, vState, 0));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(mempool.exists(parent->GetHash()));
+    BOOST_CHECK(mempool.exists(child->GetHash()));
+
+    // Resubmitting skips the transactions that are in already
+    BOOST_CHECK(AcceptPackageToMemoryPool(mempool, state, {parent, child}, vState, 0));
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+
+    // Packages may not replace mempool transactions
+    CTransactionRef doublespend = SpendP2PK(coinbaseKey, coin, nValue - 2 * CENT);
+    CTransactionRef doublespendchild = SpendP2PK(coinbaseKey, COutPoint(doublespend->GetHash(), 0), nValue - 3 * CENT);
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {doublespend}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-invalid-tx");
+    BOOST_CHECK_EQUAL(vState[0].GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {doublespend, doublespendchild}, vState, 0));
+    BOOST_CHECK(!mempool.exists(doublespendchild->GetHash()));
+    mempool.clear();
+
+    // A parent paying for itself goes in on its own, whatever its child
+    CTransactionRef parent2 = SpendP2PK(coinbaseKey, coin, nValue - CENT);
+    CTransactionRef badchild2 = SpendP2PK(coinbaseKey, COutPoint(parent2->GetHash(), 0), nValue - 2 * CENT, false);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptPackageToMemoryPool(mempool, state, {parent2, badchild2}, vState, 0));
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "package-invalid-tx");
+    BOOST_CHECK(vState[0].IsValid());
+    BOOST_CHECK(mempool.exists(parent2->GetHash()));
+    BOOST_CHECK(!mempool.exists(badchild2->GetHash()));
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -91,6 +91,283 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_accept, TestChain100Setup)
+{
+    // Transactions accepted in a batch get the same verdicts as they would
+    // one at a time, even when an invalid one is verified together with them.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int OUTPUTS = 8;
+
+    // Split a mature coinbase output into outputs the batch can spend
+    CMutableTransaction fanout;
+    fanout.nVersion = 1;
+    fanout.vin.resize(1);
+    fanout.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    fanout.vout.resize(OUTPUTS);
+    for (int i = 0; i < OUTPUTS; i++) {
+        fanout.vout[i].nValue = 5*COIN;
+        fanout.vout[i].scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, fanout, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    fanout.vin[0].scriptSig << vchSig;
+    CBlock block = CreateAndProcessBlock({fanout}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < OUTPUTS; i++) {
+        CMutableTransaction spend;
+        spend.nVersion = 1;
+        spend.vin.resize(1);
+        spend.vin[0].prevout = COutPoint(fanout.GetHash(), i);
+        spend.vout.resize(1);
+        spend.vout[0].nValue = 4*COIN;
+        spend.vout[0].scriptPubKey = scriptPubKey;
+        hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        // Spoil the signature of the third spend
+        if (i == 2) vchSig[10] ^= 1;
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        spend.vin[0].scriptSig << vchSig;
+        vtx.push_back(MakeTransactionRef(spend));
+    }
+    // A double spend of the first output, and a spend of the second spend,
+    // are checked one by one after the independent ones
+    CMutableTransaction doublespend(*vtx[0]);
+    doublespend.vout[0].nValue = 3*COIN;
+    hash = SignatureHash(scriptPubKey, doublespend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    doublespend.vin[0].scriptSig = CScript() << vchSig;
+    vtx.push_back(MakeTransactionRef(doublespend));
+    CMutableTransaction child;
+    child.nVersion = 1;
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(vtx[1]->GetHash(), 0);
+    child.vout.resize(1);
+    child.vout[0].nValue = 3*COIN;
+    child.vout[0].scriptPubKey = scriptPubKey;
+    hash = SignatureHash(scriptPubKey, child, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    child.vin[0].scriptSig << vchSig;
+    vtx.push_back(MakeTransactionRef(child));
+
+    // Only the results of the valid independent spends end up in the script
+    // execution cache
+    PreVerifyTransactionScripts(mempool, vtx, false /* bypass_limits */);
+    {
+        LOCK(cs_main);
+        for (int i = 0; i <= OUTPUTS; i++) { // all but the child spend confirmed outputs
+            CValidationState state;
+            PrecomputedTransactionData txdata(*vtx[i]);
+            std::vector<CScriptCheck> checks;
+            BOOST_CHECK(CheckInputs(*vtx[i], state, *pcoinsTip, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, true, txdata, &checks));
+            BOOST_CHECK_EQUAL(checks.empty(), i < OUTPUTS && i != 2);
+        }
+    }
+
+    std::vector<bool> vAccepted;
+    std::vector<CValidationState> vState;
+    AcceptToMemoryPoolBatch(mempool, vtx, vAccepted, vState, nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
+    BOOST_CHECK_EQUAL(vAccepted.size(), vtx.size());
+    BOOST_CHECK_EQUAL(vState.size(), vtx.size());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        bool fExpected = i != 2 && i != (size_t)OUTPUTS;
+        BOOST_CHECK_EQUAL(vAccepted[i], fExpected);
+        BOOST_CHECK_EQUAL(mempool.exists(vtx[i]->GetHash()), fExpected);
+    }
+    BOOST_CHECK(vState[2].GetRejectReason().find("mandatory-script-verify-flag-failed") == 0);
+    BOOST_CHECK_EQUAL(vState[OUTPUTS].GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK_EQUAL(mempool.size(), OUTPUTS);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch_first_failure, TestChain100Setup)
+{
+    // A transaction whose first input only fails a policy flag and whose
+    // later inputs fail a mandatory one is rejected as non-standard, without
+    // a DoS score, whichever of its inputs fail first on the check threads.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const int INPUTS = 8;
+
+    CMutableTransaction fanout;
+    fanout.nVersion = 1;
+    fanout.vin.resize(1);
+    fanout.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    fanout.vout.resize(INPUTS + 1);
+    for (int i = 0; i <= INPUTS; i++) {
+        fanout.vout[i].nValue = 5*COIN;
+        fanout.vout[i].scriptPubKey = scriptPubKey;
+    }
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, fanout, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    fanout.vin[0].scriptSig << vchSig;
+    CBlock block = CreateAndProcessBlock({fanout}, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    CMutableTransaction spend;
+    spend.nVersion = 1;
+    spend.vin.resize(INPUTS);
+    for (int i = 0; i < INPUTS; i++) {
+        spend.vin[i].prevout = COutPoint(fanout.GetHash(), i);
+    }
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 4*COIN*INPUTS;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    for (int i = 0; i < INPUTS; i++) {
+        hash = SignatureHash(scriptPubKey, spend, i, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        if (i == 0) {
+            // The extra element left on the stack only violates CLEANSTACK
+            spend.vin[i].scriptSig << OP_1 << vchSig;
+        } else {
+            vchSig[10] ^= 1;
+            spend.vin[i].scriptSig << vchSig;
+        }
+    }
+
+    // A valid transaction verified in the same batch
+    CMutableTransaction other;
+    other.nVersion = 1;
+    other.vin.resize(1);
+    other.vin[0].prevout = COutPoint(fanout.GetHash(), INPUTS);
+    other.vout.resize(1);
+    other.vout[0].nValue = 4*COIN;
+    other.vout[0].scriptPubKey = scriptPubKey;
+    hash = SignatureHash(scriptPubKey, other, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    other.vin[0].scriptSig << vchSig;
+
+    std::vector<CTransactionRef> vtx{MakeTransactionRef(spend), MakeTransactionRef(other)};
+    std::vector<bool> vAccepted;
+    std::vector<CValidationState> vState;
+    AcceptToMemoryPoolBatch(mempool, vtx, vAccepted, vState, nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
+    BOOST_CHECK(!vAccepted[0]);
+    BOOST_CHECK(vAccepted[1]);
+    int nDoS = -1;
+    BOOST_CHECK(vState[0].IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(vState[0].GetRejectCode(), REJECT_NONSTANDARD);
+    BOOST_CHECK(vState[0].GetRejectReason().find("non-mandatory-script-verify-flag") == 0);
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_persist_roundtrip, TestChain100Setup)
+{
+    // A dumped mempool loads back with children after their parents, and
+    // with the script flags the transactions were verified against.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    std::vector<CMutableTransaction> chain(2);
+    COutPoint prevout(coinbaseTxns[0].GetHash(), 0);
+    for (size_t i = 0; i < chain.size(); i++) {
+        chain[i].nVersion = 1;
+        chain[i].vin.resize(1);
+        chain[i].vin[0].prevout = prevout;
+        chain[i].vout.resize(1);
+        chain[i].vout[0].nValue = (40 - 10 * i) * COIN;
+        chain[i].vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, chain[i], 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        chain[i].vin[0].scriptSig << vchSig;
+        BOOST_CHECK(ToMemPool(chain[i]));
+        prevout = COutPoint(chain[i].GetHash(), 0);
+    }
+
+    // The file is written in the background from a copy of the mempool
+    BOOST_CHECK(DumpMempool(true /* fBackground */));
+    mempool.clear();
+    WaitForMempoolDump();
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), chain.size());
+    LOCK(mempool.cs);
+    for (const CMutableTransaction& tx : chain) {
+        auto it = mempool.mapTx.find(tx.GetHash());
+        BOOST_CHECK(it != mempool.mapTx.end());
+        BOOST_CHECK(it->GetScriptFlags() != 0);
+    }
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_persist_script_flags, TestChain100Setup)
+{
+    // The script flags recorded in mempool.dat only spare LoadMempool() the
+    // policy script checks if this node wrote the file at the current tip.
+    // A transaction that passes the block script flags but not the policy
+    // ones shows whether the policy checks were run. Each case uses its own
+    // transaction, as the script cache outlives the mempool.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    auto make_spend = [&](CAmount nValue) {
+        CMutableTransaction spend;
+        spend.nVersion = 1;
+        spend.vin.resize(1);
+        spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+        spend.vout.resize(1);
+        spend.vout[0].nValue = nValue;
+        spend.vout[0].scriptPubKey = scriptPubKey;
+        std::vector<unsigned char> vchSig;
+        uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+        BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+        vchSig.push_back((unsigned char)SIGHASH_ALL);
+        // The extra element left on the stack only violates CLEANSTACK
+        spend.vin[0].scriptSig << OP_1 << vchSig;
+        BOOST_CHECK(!ToMemPool(spend));
+        return spend;
+    };
+    auto dump_tagged = [&](const CMutableTransaction& spend) {
+        {
+            LOCK2(cs_main, mempool.cs);
+            CTxMemPoolEntry entry = TestMemPoolEntryHelper().Time(GetTime()).FromTx(spend);
+            entry.SetScriptFlags(SCRIPT_VERIFY_P2SH);
+            mempool.addUnchecked(spend.GetHash(), entry);
+        }
+        BOOST_CHECK(DumpMempool());
+        mempool.clear();
+    };
+
+    // Unchanged tip and flags, the recorded flags are trusted
+    CMutableTransaction spend = make_spend(40 * COIN);
+    dump_tagged(spend);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK(mempool.exists(spend.GetHash()));
+    mempool.clear();
+
+    // A file authenticated with another key is verified
+    spend = make_spend(39 * COIN);
+    dump_tagged(spend);
+    std::vector<unsigned char> vchKey(32, 0);
+    FILE* keyfile = fsbridge::fopen(GetDataDir() / "mempool.key", "wb");
+    BOOST_CHECK(keyfile);
+    fwrite(vchKey.data(), 1, vchKey.size(), keyfile);
+    fclose(keyfile);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK(!mempool.exists(spend.GetHash()));
+
+    // So is a file dumped at another tip, also when relabelled with the
+    // current one
+    spend = make_spend(38 * COIN);
+    dump_tagged(spend);
+    const uint256 hashTip = CreateAndProcessBlock({}, scriptPubKey).GetHash();
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK(!mempool.exists(spend.GetHash()));
+    FILE* file = fsbridge::fopen(GetDataDir() / "mempool.dat", "r+b");
+    BOOST_CHECK(file);
+    fseek(file, sizeof(uint64_t), SEEK_SET);
+    fwrite(hashTip.begin(), 1, hashTip.size(), file);
+    fclose(file);
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK(!mempool.exists(spend.GetHash()));
+    mempool.clear();
+}
+
 // Run CheckInputs (using pcoinsTip) on the given transaction, for all script
 // flags.  Test that CheckInputs passes for all flags that don't overlap with
 // the failing_flags argument, but otherwise fails.
@@ -0,0 +1,75 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txannouncequeue.h>
+
+#include <txmempool.h>
+
+#include <algorithm>
+#include <assert.h>
+
+CTxAnnounceQueue::CTxAnnounceQueue() : nBeginSeq(0)
+{
+}
+
+void CTxAnnounceQueue::Push(const uint256& hash)
+{
+    vPending.push_back(hash);
+}
+
+void CTxAnnounceQueue::Seal(CTxMemPool& pool, int64_t nNow)
+{
+    if (vPending.empty())
+        return;
+    std::sort(vPending.begin(), vPending.end());
+    vPending.erase(std::unique(vPending.begin(), vPending.end()), vPending.end());
+
+    LOCK(pool.cs);
+    std::vector<uint256> vHashes;
+    vHashes.reserve(vPending.size());
+    for (const uint256& hash : vPending) {
+        if (pool.exists(hash))
+            vHashes.push_back(hash);
+    }
+    vPending.clear();
+    // Parents before their children, then by descending fee rate
+    std::sort(vHashes.begin(), vHashes.end(), [&pool](const uint256& a, const uint256& b) {
+        return pool.CompareDepthAndScore(a, b);
+    });
+    for (const uint256& hash : vHashes) {
+        TxMempoolInfo info = pool.info(hash);
+        queue.push_back(Announcement{hash, std::move(info.tx), info.feeRate.GetFeePerK(), nNow});
+    }
+}
+
+uint64_t CTxAnnounceQueue::AddReader()
+{
+    mapReaders[End()]++;
+    return End();
+}
+
+void CTxAnnounceQueue::MoveReader(uint64_t nFrom, uint64_t nTo)
+{
+    if (nFrom == nTo)
+        return;
+    RemoveReader(nFrom);
+    mapReaders[nTo]++;
+}
+
+void CTxAnnounceQueue::RemoveReader(uint64_t nSeq)
+{
+    auto it = mapReaders.find(nSeq);
+    assert(it != mapReaders.end());
+    if (--it->second == 0)
+        mapReaders.erase(it);
+}
+
+void CTxAnnounceQueue::Trim(int64_t nTimeCutoff)
+{
+    const uint64_t nSeq = mapReaders.empty() ? End() : mapReaders.begin()->first;
+    while (!queue.empty() && (nBeginSeq < nSeq || queue.front().nTime < nTimeCutoff)) {
+        queue.pop_front();
+        nBeginSeq++;
+    }
+}
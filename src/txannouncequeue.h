@@ -0,0 +1,82 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXANNOUNCEQUEUE_H
+#define BITCOIN_TXANNOUNCEQUEUE_H
+
+#include <amount.h>
+#include <primitives/transaction.h>
+#include <uint256.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+class CTxMemPool;
+
+/**
+ * Transactions to announce to all peers, shared between them. Relayed
+ * transactions are collected as they are accepted, then looked up in the
+ * mempool and sorted topologically and by fee rate once, when the first peer
+ * is due to trickle them. Every peer then walks the same sorted queue from
+ * its own position, leaving only its known-inventory and fee filters to
+ * apply rather than repeating the mempool lookups and ordering.
+ *
+ * Positions are sequence numbers that keep increasing as announcements are
+ * appended and trimmed. The queue keeps count of the peers at each position,
+ * so that it knows which announcements all of them have walked past without
+ * visiting every peer. Not thread-safe; callers serialize access.
+ */
+class CTxAnnounceQueue
+{
+public:
+    struct Announcement {
+        uint256 hash;
+        CTransactionRef tx;
+        //! Fee rate in the mempool when queued, to check against peers' fee filters
+        CAmount nFeePerK;
+        int64_t nTime;
+    };
+
+    CTxAnnounceQueue();
+
+    /** Queue a transaction for announcement at the next Seal */
+    void Push(const uint256& hash);
+
+    /**
+     * Append the transactions pushed since the last call, sorted by the
+     * mempool. Those no longer in the mempool are dropped.
+     */
+    void Seal(CTxMemPool& pool, int64_t nNow);
+
+    /** Add a reader positioned past the newest announcement, and return its position */
+    uint64_t AddReader();
+
+    /** Move a reader from position nFrom to nTo */
+    void MoveReader(uint64_t nFrom, uint64_t nTo);
+
+    /** Remove a reader at position nSeq */
+    void RemoveReader(uint64_t nSeq);
+
+    /** Drop announcements every reader has walked past, and those queued before nTimeCutoff */
+    void Trim(int64_t nTimeCutoff);
+
+    /** Position of the oldest announcement still queued */
+    uint64_t Begin() const { return nBeginSeq; }
+
+    /** Position past the newest announcement */
+    uint64_t End() const { return nBeginSeq + queue.size(); }
+
+    /** The announcement at a position in [Begin(), End()) */
+    const Announcement& At(uint64_t nSeq) const { return queue[nSeq - nBeginSeq]; }
+
+private:
+    std::vector<uint256> vPending;
+    std::deque<Announcement> queue;
+    uint64_t nBeginSeq;
+    //! Number of readers at each position
+    std::map<uint64_t, int> mapReaders;
+};
+
+#endif // BITCOIN_TXANNOUNCEQUEUE_H
@@ -18,6 +18,8 @@
 #include <utilmoneystr.h>
 #include <utiltime.h>
 
+#include <queue>
+
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp):
@@ -37,6 +39,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nEpoch = 0;
+    nScriptFlags = 0;
 }
 
 void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
@@ -61,13 +66,17 @@ size_t CTxMemPoolEntry::GetTxSize() const
 // descendants.
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendants, const std::set<uint256> &setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const uint64_t epoch = ++nEpoch;
+    vecEntries stageEntries, allDescendants;
+    for (const txiter cit : GetMemPoolChildren(updateIt)) {
+        cit->nEpoch = epoch;
+        stageEntries.push_back(cit);
+        allDescendants.push_back(cit);
+    }
 
     while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
+        const txiter cit = stageEntries.back();
+        stageEntries.pop_back();
         const setEntries &setChildren = GetMemPoolChildren(cit);
         for (const txiter childEntry : setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
@@ -75,29 +84,38 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
                 // We've already calculated this one, just add the entries for this set
                 // but don't traverse again.
                 for (const txiter cacheEntry : cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (cacheEntry->nEpoch != epoch) {
+                        cacheEntry->nEpoch = epoch;
+                        allDescendants.push_back(cacheEntry);
+                    }
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
+            } else if (childEntry->nEpoch != epoch) {
                 // Schedule for later processing
-                stageEntries.insert(childEntry);
+                childEntry->nEpoch = epoch;
+                stageEntries.push_back(childEntry);
+                allDescendants.push_back(childEntry);
             }
         }
     }
-    // setAllDescendants now contains all in-mempool descendants of updateIt.
+    // allDescendants now contains all in-mempool descendants of updateIt.
     // Update and add to cached descendant map
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    for (txiter cit : setAllDescendants) {
+    vecEntries cached;
+    for (txiter cit : allDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
             modifyCount++;
-            cachedDescendants[updateIt].insert(cit);
+            cached.push_back(cit);
             // Update ancestor state for each descendant
             mapTx.modify(cit, update_ancestor_state(updateIt->GetTxSize(), updateIt->GetModifiedFee(), 1, updateIt->GetSigOpCost()));
         }
     }
+    if (!cached.empty()) {
+        cachedDescendants[updateIt].insert(cached.begin(), cached.end());
+    }
     mapTx.modify(updateIt, update_descendant_state(modifySize, modifyFee, modifyCount));
 }
 
@@ -106,7 +124,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap &cachedDescendan
 // for each entry, look for descendants that are outside vHashesToUpdate, and
 // add fee/size information for such descendants to the parent.
 // for each such descendant, also update the ancestor state to include the parent.
-void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate)
+void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate, uint64_t limitClusterCount)
 {
     LOCK(cs);
     // For each entry in vHashesToUpdate, store the set of in-mempool, but not
@@ -118,6 +136,19 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
     // accounted for in the state of their ancestors)
     std::set<uint256> setAlreadyIncluded(vHashesToUpdate.begin(), vHashesToUpdate.end());
 
+    // Clusters that gained links, and which of them the links join together.
+    // They are merged and relinearized once all links are in place, rather
+    // than once per link.
+    std::set<uint64_t> setLinked;
+    std::map<uint64_t, uint64_t> mapJoinedTo;
+    auto joined_root = [&mapJoinedTo](uint64_t id) {
+        std::map<uint64_t, uint64_t>::const_iterator jit;
+        while ((jit = mapJoinedTo.find(id)) != mapJoinedTo.end()) {
+            id = jit->second;
+        }
+        return id;
+    };
+
     // Iterate in reverse, so that whenever we are looking at a transaction
     // we are sure that all in-mempool descendants have already been processed.
     // This maximizes the benefit of the descendant cache and guarantees that
@@ -143,17 +174,54 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256> &vHashes
             if (setChildren.insert(childIter).second && !setAlreadyIncluded.count(childHash)) {
                 UpdateChild(it, childIter, true);
                 UpdateParent(childIter, it, true);
+                const uint64_t parentRoot = joined_root(mapLinks[it].cluster);
+                const uint64_t childRoot = joined_root(mapLinks[childIter].cluster);
+                if (parentRoot != childRoot) {
+                    mapJoinedTo[childRoot] = parentRoot;
+                }
+                setLinked.insert(mapLinks[it].cluster);
+                setLinked.insert(mapLinks[childIter].cluster);
             }
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+
+    // Merge the clusters of every connected component. Merged clusters were
+    // simply concatenated, which does not need to be a valid order anymore,
+    // and new links within a cluster can invalidate its order as well.
+    std::map<uint64_t, setEntries> mapComponents;
+    for (uint64_t id : setLinked) {
+        mapComponents[joined_root(id)].insert(mapClusters[id].vTxs.front());
+    }
+    for (const auto& component : mapComponents) {
+        const uint64_t id = MergeClusters(component.second);
+        LinearizeCluster(id);
+
+        // The links may have grown the cluster past the limit that applies
+        // at acceptance. Evict its worst chunks until it fits again; as every
+        // transaction comes after its ancestors in the linearization, this
+        // takes along all descendants of what is evicted.
+        const Cluster& cluster = mapClusters[id];
+        size_t nKeep = cluster.vTxs.size();
+        for (size_t i = cluster.vChunks.size(); i > 0 && nKeep > limitClusterCount; --i) {
+            nKeep = i > 1 ? cluster.vChunks[i - 2].nEnd : 0;
+        }
+        if (nKeep < cluster.vTxs.size()) {
+            setEntries setEvict;
+            setEvict.insert(cluster.vTxs.begin() + nKeep, cluster.vTxs.end());
+            RemoveStaged(setEvict, false, MemPoolRemovalReason::SIZELIMIT);
+        }
+    }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntries &setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string &errString, bool fSearchForParents /* = true */) const
 {
     LOCK(cs);
 
-    setEntries parentHashes;
+    // Ancestors found so far, the ones from position i onwards (see below)
+    // still need their parents walked.
+    const uint64_t epoch = ++nEpoch;
+    vecEntries ancestors;
     const CTransaction &tx = entry.GetTx();
 
     if (fSearchForParents) {
@@ -162,9 +230,10 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // iterate mapTx to find parents.
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && piter->nEpoch != epoch) {
+                piter->nEpoch = epoch;
+                ancestors.push_back(piter);
+                if (ancestors.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -174,16 +243,17 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        for (const txiter piter : GetMemPoolParents(it)) {
+            piter->nEpoch = epoch;
+            ancestors.push_back(piter);
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+    for (size_t i = 0; i < ancestors.size(); ++i) {
+        txiter stageit = ancestors[i];
 
-        setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -200,16 +270,18 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry &entry, setEntr
         const setEntries & setMemPoolParents = GetMemPoolParents(stageit);
         for (const txiter &phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (phash->nEpoch != epoch) {
+                phash->nEpoch = epoch;
+                ancestors.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (ancestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
         }
     }
 
+    setAncestors.insert(ancestors.begin(), ancestors.end());
     return true;
 }
 
@@ -329,7 +401,7 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
 }
 
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator), nEpoch(0)
 {
     _clear(); //lock free clear
 
@@ -397,15 +469,21 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // to clean up the mess we're leaving here.
 
     // Update ancestors with information about this tx
+    setEntries setClusterMembers;
+    setClusterMembers.insert(newit);
     for (const uint256 &phash : setParentTransactions) {
         txiter pit = mapTx.find(phash);
         if (pit != mapTx.end()) {
             UpdateParent(newit, pit, true);
+            setClusterMembers.insert(pit);
         }
     }
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
 
+    // Join the clusters of all in-mempool parents
+    LinearizeCluster(MergeClusters(setClusterMembers));
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     if (minerPolicyEstimator) {minerPolicyEstimator->processTransaction(entry, validFeeEstimate);}
@@ -449,25 +527,34 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
 // can save time by not iterating over those entries.
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries &setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
+    CalculateDescendants(setEntries{entryit}, setDescendants);
+}
+
+// As above, for all entries of setRoots in a single traversal, so that
+// setDescendants is only merged into once.
+void CTxMemPool::CalculateDescendants(const setEntries &setRoots, setEntries &setDescendants)
+{
+    const uint64_t epoch = ++nEpoch;
+    vecEntries stage;
+    for (txiter rootit : setRoots) {
+        if (setDescendants.count(rootit) == 0) {
+            rootit->nEpoch = epoch;
+            stage.push_back(rootit);
+        }
     }
     // Traverse down the children of entry, only adding children that are not
     // accounted for in setDescendants already (because those children have either
     // already been walked, or will be walked in this iteration).
-    while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
-
-        const setEntries &setChildren = GetMemPoolChildren(it);
+    for (size_t i = 0; i < stage.size(); ++i) {
+        const setEntries &setChildren = GetMemPoolChildren(stage[i]);
         for (const txiter &childiter : setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+            if (childiter->nEpoch != epoch && !setDescendants.count(childiter)) {
+                childiter->nEpoch = epoch;
+                stage.push_back(childiter);
             }
         }
     }
+    setDescendants.insert(stage.begin(), stage.end());
 }
 
 void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReason reason)
@@ -475,10 +562,10 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReaso
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        setEntries txToRemove;
+        std::vector<txiter> txToRemove;
         txiter origit = mapTx.find(origTx.GetHash());
         if (origit != mapTx.end()) {
-            txToRemove.insert(origit);
+            txToRemove.push_back(origit);
         } else {
             // When recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
@@ -490,13 +577,11 @@ void CTxMemPool::removeRecursive(const CTransaction &origTx, MemPoolRemovalReaso
                     continue;
                 txiter nextit = mapTx.find(it->second->GetHash());
                 assert(nextit != mapTx.end());
-                txToRemove.insert(nextit);
+                txToRemove.push_back(nextit);
             }
         }
         setEntries setAllRemoves;
-        for (txiter it : txToRemove) {
-            CalculateDescendants(it, setAllRemoves);
-        }
+        CalculateDescendants(setEntries(txToRemove.begin(), txToRemove.end()), setAllRemoves);
 
         RemoveStaged(setAllRemoves, false, reason);
     }
@@ -506,7 +591,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
 {
     // Remove transactions spending a coinbase which are now immature and no-longer-final transactions
     LOCK(cs);
-    setEntries txToRemove;
+    std::vector<txiter> txToRemove;
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->GetTx();
         LockPoints lp = it->GetLockPoints();
@@ -514,7 +599,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
         if (!CheckFinalTx(tx, flags) || !CheckSequenceLocks(tx, flags, &lp, validLP)) {
             // Note if CheckSequenceLocks fails the LockPoints may still be invalid
             // So it's critical that we remove the tx and not depend on the LockPoints.
-            txToRemove.insert(it);
+            txToRemove.push_back(it);
         } else if (it->GetSpendsCoinbase()) {
             for (const CTxIn& txin : tx.vin) {
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
@@ -523,7 +608,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
                 const Coin &coin = pcoins->AccessCoin(txin.prevout);
                 if (nCheckFrequency != 0) assert(!coin.IsSpent());
                 if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
-                    txToRemove.insert(it);
+                    txToRemove.push_back(it);
                     break;
                 }
             }
@@ -533,9 +618,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache *pcoins, unsigned int nMem
         }
     }
     setEntries setAllRemoves;
-    for (txiter it : txToRemove) {
-        CalculateDescendants(it, setAllRemoves);
-    }
+    CalculateDescendants(setEntries(txToRemove.begin(), txToRemove.end()), setAllRemoves);
     RemoveStaged(setAllRemoves, false, MemPoolRemovalReason::REORG);
 }
 
@@ -591,6 +674,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 void CTxMemPool::_clear()
 {
     mapLinks.clear();
+    mapClusters.clear();
+    setClusterTails.clear();
+    nNextClusterId = 1;
     mapTx.clear();
     mapNextTx.clear();
     totalTxSize = 0;
@@ -736,6 +822,60 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
 
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
+
+    // Check that clusters are the connected components of mapLinks, with a
+    // valid linearization and correct chunks.
+    size_t nClusterTxs = 0;
+    for (const auto& item : mapClusters) {
+        const Cluster& cluster = item.second;
+        assert(!cluster.vTxs.empty());
+        nClusterTxs += cluster.vTxs.size();
+        setEntries setSeen;
+        for (txiter it : cluster.vTxs) {
+            const TxLinks& links = mapLinks.find(it)->second;
+            assert(links.cluster == item.first);
+            for (txiter parent : links.parents) {
+                assert(setSeen.count(parent));
+            }
+            setSeen.insert(it);
+        }
+        setEntries setReached;
+        std::vector<txiter> vToVisit{cluster.vTxs.front()};
+        setReached.insert(cluster.vTxs.front());
+        while (!vToVisit.empty()) {
+            const TxLinks& links = mapLinks.find(vToVisit.back())->second;
+            vToVisit.pop_back();
+            for (const setEntries* neighbours : {&links.parents, &links.children}) {
+                for (txiter it : *neighbours) {
+                    if (setReached.insert(it).second) vToVisit.push_back(it);
+                }
+            }
+        }
+        assert(setReached.size() == cluster.vTxs.size());
+        size_t nStart = 0;
+        for (size_t i = 0; i < cluster.vChunks.size(); ++i) {
+            const ClusterChunk& chunk = cluster.vChunks[i];
+            assert(chunk.nEnd > nStart);
+            CAmount nFeesCheck = 0;
+            uint64_t nSizeCheck = 0;
+            for (size_t j = nStart; j < chunk.nEnd; ++j) {
+                nFeesCheck += cluster.vTxs[j]->GetModifiedFee();
+                nSizeCheck += cluster.vTxs[j]->GetTxSize();
+            }
+            assert(chunk.nModFees == nFeesCheck);
+            assert(chunk.nSize == nSizeCheck);
+            if (i > 0) {
+                const ClusterChunk& prev = cluster.vChunks[i - 1];
+                assert(CompareClusterTailByFeerate()({chunk.nModFees, chunk.nSize, 0}, {prev.nModFees, prev.nSize, 0}));
+            }
+            nStart = chunk.nEnd;
+        }
+        assert(nStart == cluster.vTxs.size());
+        const ClusterChunk& tail = cluster.vChunks.back();
+        assert(setClusterTails.count({tail.nModFees, tail.nSize, item.first}));
+    }
+    assert(nClusterTxs == mapTx.size());
+    assert(setClusterTails.size() == mapClusters.size());
 }
 
 bool CTxMemPool::CompareDepthAndScore(const uint256& hasha, const uint256& hashb)
@@ -856,6 +996,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            LinearizeCluster(mapLinks[it].cluster);
             ++nTransactionsUpdated;
         }
     }
@@ -904,32 +1045,89 @@ bool CCoinsViewMemPool::GetCoin(const COutPoint &outpoint, Coin &coin) const {
     return base->GetCoin(outpoint, coin);
 }
 
+size_t CCoinsViewMemPool::GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const {
+    // Outpoints of mempool transactions are resolved here, as in GetCoin; the
+    // remaining ones are passed to the base view as a single batch.
+    coins.assign(outpoints.size(), Coin());
+    std::vector<COutPoint> base_outpoints;
+    std::vector<size_t> base_positions;
+    size_t found = 0;
+    for (size_t i = 0; i < outpoints.size(); ++i) {
+        const COutPoint& outpoint = outpoints[i];
+        CTransactionRef ptx = mempool.get(outpoint.hash);
+        if (ptx) {
+            if (outpoint.n < ptx->vout.size()) {
+                coins[i] = Coin(ptx->vout[outpoint.n], MEMPOOL_HEIGHT, false);
+                ++found;
+            }
+        } else {
+            base_outpoints.push_back(outpoint);
+            base_positions.push_back(i);
+        }
+    }
+    if (!base_outpoints.empty()) {
+        std::vector<Coin> base_coins;
+        found += base->GetCoins(base_outpoints, base_coins);
+        for (size_t i = 0; i < base_positions.size(); ++i) {
+            coins[base_positions[i]] = std::move(base_coins[i]);
+        }
+    }
+    return found;
+}
+
 size_t CTxMemPool::DynamicMemoryUsage() const {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    // Estimate the overhead of mapTx to be 15 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
+    // Cluster linearizations are bounded by one txiter and one chunk per transaction.
+    size_t nClusterUsage = memusage::DynamicUsage(mapClusters) + memusage::DynamicUsage(setClusterTails) + (sizeof(txiter) + sizeof(ClusterChunk)) * mapTx.size();
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + nClusterUsage + cachedInnerUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries &stage, bool updateDescendants, MemPoolRemovalReason reason) {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
+    // Drop the staged entries from their clusters' linearizations while the
+    // iterators are still valid; what remains is still in a valid order.
+    std::set<uint64_t> setClusters;
+    for (const txiter& it : stage) {
+        setClusters.insert(mapLinks[it].cluster);
+    }
+    for (uint64_t id : setClusters) {
+        std::vector<txiter>& vTxs = mapClusters[id].vTxs;
+        vTxs.erase(std::remove_if(vTxs.begin(), vTxs.end(), [&stage](txiter it) { return stage.count(it) > 0; }), vTxs.end());
+    }
     for (const txiter& it : stage) {
         removeUnchecked(it, reason);
     }
+    for (uint64_t id : setClusters) {
+        SplitCluster(id);
+    }
 }
 
 int CTxMemPool::Expire(int64_t time) {
     LOCK(cs);
+    // Collect the expired entries and all of their descendants in a single
+    // traversal, rather than one CalculateDescendants() call per entry.
+    const uint64_t epoch = ++nEpoch;
+    std::vector<txiter> vRemove;
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
+        txiter removeit = mapTx.project<0>(it);
+        if (removeit->nEpoch != epoch) {
+            removeit->nEpoch = epoch;
+            vRemove.push_back(removeit);
+        }
         it++;
     }
-    setEntries stage;
-    for (txiter removeit : toremove) {
-        CalculateDescendants(removeit, stage);
+    for (size_t i = 0; i < vRemove.size(); ++i) {
+        for (txiter childiter : GetMemPoolChildren(vRemove[i])) {
+            if (childiter->nEpoch != epoch) {
+                childiter->nEpoch = epoch;
+                vRemove.push_back(childiter);
+            }
+        }
     }
+    setEntries stage(vRemove.begin(), vRemove.end());
     RemoveStaged(stage, false, MemPoolRemovalReason::EXPIRY);
     return stage.size();
 }
@@ -946,22 +1144,26 @@ bool CTxMemPool::addUnchecked(const uint256&hash, const CTxMemPoolEntry &entry,
 
 void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    setEntries &children = mapLinks[entry].children;
+    cachedInnerUsage -= memusage::DynamicUsage(children);
+    if (add) {
+        children.insert(child);
+    } else {
+        children.erase(child);
     }
+    cachedInnerUsage += memusage::DynamicUsage(children);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    setEntries &parents = mapLinks[entry].parents;
+    cachedInnerUsage -= memusage::DynamicUsage(parents);
+    if (add) {
+        parents.insert(parent);
+    } else {
+        parents.erase(parent);
     }
+    cachedInnerUsage += memusage::DynamicUsage(parents);
 }
 
 const CTxMemPool::setEntries & CTxMemPool::GetMemPoolParents(txiter entry) const
@@ -980,6 +1182,247 @@ const CTxMemPool::setEntries & CTxMemPool::GetMemPoolChildren(txiter entry) cons
     return it->second.children;
 }
 
+const CTxMemPool::Cluster & CTxMemPool::GetCluster(txiter entry) const
+{
+    assert (entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    clusterMap::const_iterator cit = mapClusters.find(it->second.cluster);
+    assert(cit != mapClusters.end());
+    return cit->second;
+}
+
+uint64_t CTxMemPool::CalculateClusterCount(const setEntries &setAncestors) const
+{
+    AssertLockHeld(cs);
+    std::set<uint64_t> setClusters;
+    uint64_t nCount = 0;
+    for (txiter it : setAncestors) {
+        uint64_t id = mapLinks.find(it)->second.cluster;
+        if (setClusters.insert(id).second) {
+            nCount += mapClusters.find(id)->second.vTxs.size();
+        }
+    }
+    return nCount;
+}
+
+uint64_t CTxMemPool::MergeClusters(const setEntries& entries)
+{
+    // Keep the largest cluster, so that the fewest entries need relabeling
+    std::set<uint64_t> setClusters;
+    uint64_t target = 0;
+    for (txiter it : entries) {
+        uint64_t id = mapLinks[it].cluster;
+        if (id == 0 || !setClusters.insert(id).second) continue;
+        if (target == 0 || mapClusters[id].vTxs.size() > mapClusters[target].vTxs.size()) {
+            target = id;
+        }
+    }
+    if (target == 0) {
+        target = nNextClusterId++;
+    }
+    Cluster& cluster = mapClusters[target];
+    for (uint64_t id : setClusters) {
+        if (id == target) continue;
+        clusterMap::iterator cit = mapClusters.find(id);
+        const ClusterChunk& tail = cit->second.vChunks.back();
+        setClusterTails.erase({tail.nModFees, tail.nSize, id});
+        for (txiter it : cit->second.vTxs) {
+            mapLinks[it].cluster = target;
+        }
+        cluster.vTxs.insert(cluster.vTxs.end(), cit->second.vTxs.begin(), cit->second.vTxs.end());
+        mapClusters.erase(cit);
+    }
+    // Entries not in any cluster yet (ie being added) go last
+    for (txiter it : entries) {
+        uint64_t& id = mapLinks[it].cluster;
+        if (id == 0) {
+            id = target;
+            cluster.vTxs.push_back(it);
+        }
+    }
+    return target;
+}
+
+void CTxMemPool::LinearizeCluster(uint64_t id)
+{
+    Cluster& cluster = mapClusters[id];
+    const size_t n = cluster.vTxs.size();
+    std::map<txiter, size_t, CompareIteratorByHash> mapPos;
+    for (size_t i = 0; i < n; ++i) {
+        mapPos.emplace(cluster.vTxs[i], i);
+    }
+    std::vector<size_t> vParentsLeft(n);
+    for (size_t i = 0; i < n; ++i) {
+        vParentsLeft[i] = mapLinks[cluster.vTxs[i]].parents.size();
+    }
+
+    if (n > ClusterTxSet().size()) {
+        // Too large to search ancestor sets: take the transaction with the
+        // best ancestor score among those whose parents have all been taken.
+        auto worse_ancestor_score = [&cluster](size_t a, size_t b) {
+            const CTxMemPoolEntry& ea = *cluster.vTxs[a];
+            const CTxMemPoolEntry& eb = *cluster.vTxs[b];
+            return (double)ea.GetModFeesWithAncestors() * eb.GetSizeWithAncestors() < (double)eb.GetModFeesWithAncestors() * ea.GetSizeWithAncestors();
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(worse_ancestor_score)> ready(worse_ancestor_score);
+        for (size_t i = 0; i < n; ++i) {
+            if (vParentsLeft[i] == 0) ready.push(i);
+        }
+        std::vector<txiter> vLinearized;
+        vLinearized.reserve(n);
+        while (!ready.empty()) {
+            const size_t i = ready.top();
+            ready.pop();
+            vLinearized.push_back(cluster.vTxs[i]);
+            for (txiter child : mapLinks[cluster.vTxs[i]].children) {
+                const size_t c = mapPos[child];
+                if (--vParentsLeft[c] == 0) ready.push(c);
+            }
+        }
+        assert(vLinearized.size() == n);
+        cluster.vTxs.swap(vLinearized);
+        ChunkCluster(id);
+        return;
+    }
+
+    // Find a topological order and the in-cluster ancestors (including
+    // itself) of every transaction.
+    std::vector<size_t> vTopo;
+    std::vector<ClusterTxSet> vAncestors(n);
+    for (size_t i = 0; i < n; ++i) {
+        vAncestors[i].set(i);
+        if (vParentsLeft[i] == 0) vTopo.push_back(i);
+    }
+    for (size_t k = 0; k < vTopo.size(); ++k) {
+        const size_t i = vTopo[k];
+        for (txiter child : mapLinks[cluster.vTxs[i]].children) {
+            const size_t c = mapPos[child];
+            vAncestors[c] |= vAncestors[i];
+            if (--vParentsLeft[c] == 0) vTopo.push_back(c);
+        }
+    }
+    assert(vTopo.size() == n);
+
+    std::vector<CAmount> vFees(n, 0);
+    std::vector<uint64_t> vSizes(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < n; ++j) {
+            if (!vAncestors[i][j]) continue;
+            vFees[i] += cluster.vTxs[j]->GetModifiedFee();
+            vSizes[i] += cluster.vTxs[j]->GetTxSize();
+        }
+    }
+
+    // Repeatedly take the best remaining ancestor set
+    std::vector<txiter> vLinearized;
+    vLinearized.reserve(n);
+    ClusterTxSet setDone;
+    std::vector<size_t> vTaken;
+    while (vLinearized.size() < n) {
+        size_t best = n;
+        for (size_t i = 0; i < n; ++i) {
+            if (setDone[i]) continue;
+            if (best == n || (double)vFees[i] * vSizes[best] > (double)vFees[best] * vSizes[i]) {
+                best = i;
+            }
+        }
+        vTaken.clear();
+        for (size_t j : vTopo) {
+            if (vAncestors[best][j] && !setDone[j]) {
+                setDone[j] = true;
+                vTaken.push_back(j);
+                vLinearized.push_back(cluster.vTxs[j]);
+            }
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (setDone[i]) continue;
+            for (size_t j : vTaken) {
+                if (!vAncestors[i][j]) continue;
+                vFees[i] -= cluster.vTxs[j]->GetModifiedFee();
+                vSizes[i] -= cluster.vTxs[j]->GetTxSize();
+            }
+        }
+    }
+    cluster.vTxs.swap(vLinearized);
+    ChunkCluster(id);
+}
+
+void CTxMemPool::ChunkCluster(uint64_t id)
+{
+    Cluster& cluster = mapClusters[id];
+    if (!cluster.vChunks.empty()) {
+        const ClusterChunk& tail = cluster.vChunks.back();
+        setClusterTails.erase({tail.nModFees, tail.nSize, id});
+    }
+    // Append transactions one at a time, merging the last chunk into the
+    // previous one for as long as that does not have a higher feerate.
+    std::vector<ClusterChunk>& vChunks = cluster.vChunks;
+    vChunks.clear();
+    for (size_t i = 0; i < cluster.vTxs.size(); ++i) {
+        vChunks.push_back({cluster.vTxs[i]->GetModifiedFee(), cluster.vTxs[i]->GetTxSize(), i + 1});
+        while (vChunks.size() > 1) {
+            ClusterChunk& last = vChunks.back();
+            ClusterChunk& prev = vChunks[vChunks.size() - 2];
+            if ((double)prev.nModFees * last.nSize > (double)last.nModFees * prev.nSize) break;
+            prev.nModFees += last.nModFees;
+            prev.nSize += last.nSize;
+            prev.nEnd = last.nEnd;
+            vChunks.pop_back();
+        }
+    }
+    if (!vChunks.empty()) {
+        setClusterTails.insert({vChunks.back().nModFees, vChunks.back().nSize, id});
+    }
+}
+
+void CTxMemPool::SplitCluster(uint64_t id)
+{
+    clusterMap::iterator cit = mapClusters.find(id);
+    if (cit->second.vTxs.empty()) {
+        const ClusterChunk& tail = cit->second.vChunks.back();
+        setClusterTails.erase({tail.nModFees, tail.nSize, id});
+        mapClusters.erase(cit);
+        return;
+    }
+
+    // Relabel the remaining transactions by connected component; the first
+    // component keeps the cluster's key.
+    std::vector<txiter> vTxs;
+    vTxs.swap(cit->second.vTxs);
+    for (txiter it : vTxs) {
+        mapLinks[it].cluster = 0;
+    }
+    std::vector<uint64_t> vComponents;
+    std::vector<txiter> vToVisit;
+    for (txiter start : vTxs) {
+        if (mapLinks[start].cluster != 0) continue;
+        const uint64_t component = vComponents.empty() ? id : nNextClusterId++;
+        vComponents.push_back(component);
+        mapLinks[start].cluster = component;
+        vToVisit.push_back(start);
+        while (!vToVisit.empty()) {
+            const TxLinks& links = mapLinks[vToVisit.back()];
+            vToVisit.pop_back();
+            for (const setEntries* neighbours : {&links.parents, &links.children}) {
+                for (txiter it : *neighbours) {
+                    uint64_t& label = mapLinks[it].cluster;
+                    if (label == 0) {
+                        label = component;
+                        vToVisit.push_back(it);
+                    }
+                }
+            }
+        }
+    }
+    for (txiter it : vTxs) {
+        mapClusters[mapLinks[it].cluster].vTxs.push_back(it);
+    }
+    for (uint64_t component : vComponents) {
+        ChunkCluster(component);
+    }
+}
+
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const {
     LOCK(cs);
     if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
@@ -1015,22 +1458,70 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate) {
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining) {
     LOCK(cs);
 
+    // Chunks are removed worst feerate first. Only the last chunk of a
+    // cluster is in setClusterTails, but as the chunks of a cluster have
+    // decreasing feerates, once a cluster's tail has been picked its
+    // previous chunk can be merged into the walk in the same order.
+    struct ChunkRef {
+        ClusterTail chunk;
+        size_t nChunk; //!< Position of the chunk in the cluster's vChunks
+    };
+    auto worse_last = [](const ChunkRef& a, const ChunkRef& b) { return CompareClusterTailByFeerate()(b.chunk, a.chunk); };
+
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
-
-        // We set the new mempool min fee to the feerate of the removed set, plus the
-        // "minimum reasonable fee rate" (ie some value under which we consider txn
-        // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
-        // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += incrementalRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
-
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+    size_t nUsage;
+    while (!mapTx.empty() && (nUsage = DynamicMemoryUsage()) > sizelimit) {
+        // Select as many chunks as we expect to need to get below sizelimit,
+        // so that they are removed (and the ancestors and clusters they leave
+        // behind updated) in one go. The estimate leaves out memory that is
+        // not freed for every entry (eg emptied clusters), so it never
+        // exceeds what their removal frees; if it falls short, we come
+        // around again.
+        const size_t nExcess = nUsage - sizelimit;
+        size_t nFreed = 0;
+        std::vector<txiter> vStage;
+        std::vector<ChunkRef> vPrevChunks; // heap with the worst chunk on top
+        std::set<ClusterTail, CompareClusterTailByFeerate>::const_iterator tailit = setClusterTails.begin();
+        while (nFreed < nExcess) {
+            ChunkRef next;
+            if (tailit != setClusterTails.end() && (vPrevChunks.empty() || CompareClusterTailByFeerate()(*tailit, vPrevChunks.front().chunk))) {
+                next.chunk = *tailit++;
+                next.nChunk = mapClusters[next.chunk.cluster].vChunks.size() - 1;
+            } else if (!vPrevChunks.empty()) {
+                std::pop_heap(vPrevChunks.begin(), vPrevChunks.end(), worse_last);
+                next = vPrevChunks.back();
+                vPrevChunks.pop_back();
+            } else {
+                break;
+            }
+            const Cluster& cluster = mapClusters[next.chunk.cluster];
+
+            // We set the new mempool min fee to the feerate of the removed set, plus the
+            // "minimum reasonable fee rate" (ie some value under which we consider txn
+            // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
+            // equal to txn which were removed with no block in between.
+            CFeeRate removed(next.chunk.nModFees, next.chunk.nSize);
+            removed += incrementalRelayFee;
+            maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
+
+            const size_t nChunkStart = next.nChunk > 0 ? cluster.vChunks[next.nChunk - 1].nEnd : 0;
+            for (size_t i = nChunkStart; i < cluster.vChunks[next.nChunk].nEnd; ++i) {
+                txiter it = cluster.vTxs[i];
+                vStage.push_back(it);
+                nFreed += memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) + it->DynamicMemoryUsage() +
+                          memusage::IncrementalDynamicUsage(mapNextTx) * it->GetTx().vin.size() +
+                          memusage::IncrementalDynamicUsage(mapLinks) + sizeof(txiter) + sizeof(ClusterChunk);
+            }
+            if (next.nChunk > 0) {
+                const ClusterChunk& prev = cluster.vChunks[next.nChunk - 1];
+                vPrevChunks.push_back({{prev.nModFees, prev.nSize, next.chunk.cluster}, next.nChunk - 1});
+                std::push_heap(vPrevChunks.begin(), vPrevChunks.end(), worse_last);
+            }
+        }
+        trackPackageRemoved(maxFeeRateRemoved);
+
+        setEntries stage(vStage.begin(), vStage.end());
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_TXMEMPOOL_H
 #define BITCOIN_TXMEMPOOL_H
 
+#include <bitset>
 #include <memory>
 #include <set>
 #include <map>
@@ -15,6 +16,7 @@
 
 #include <amount.h>
 #include <coins.h>
+#include <flatset.h>
 #include <indirectmap.h>
 #include <policy/feerate.h>
 #include <primitives/transaction.h>
@@ -74,6 +76,7 @@ private:
     int64_t sigOpCost;         //!< Total sigop cost
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
+    unsigned int nScriptFlags; //!< Block script flags the scripts were verified against, 0 if unknown
 
     // Information about descendants of this transaction that are in the
     // mempool; if we remove this transaction we must remove all of these
@@ -115,6 +118,9 @@ public:
     void UpdateFeeDelta(int64_t feeDelta);
     // Update the LockPoints after a reorg
     void UpdateLockPoints(const LockPoints& lp);
+    // Record the block script flags the scripts were verified against
+    void SetScriptFlags(unsigned int flags) { nScriptFlags = flags; }
+    unsigned int GetScriptFlags() const { return nScriptFlags; }
 
     uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
     uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
@@ -128,6 +134,7 @@ public:
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last mempool graph traversal that visited this entry
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -314,6 +321,7 @@ public:
 struct descendant_score {};
 struct entry_time {};
 struct ancestor_score {};
+struct ordered_txid {};
 
 class CBlockPolicyEstimator;
 
@@ -425,12 +433,25 @@ public:
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
+ * Clusters:
+ *
+ * The parent/child links in mapLinks split the mempool into connected
+ * components, which we call clusters (see Cluster).  Every cluster caches a
+ * linearization of its transactions, split into chunks of decreasing feerate.
+ * Eviction (TrimToSize()) removes the lowest feerate chunk in the mempool, and
+ * block assembly walks the chunks of all clusters in order of feerate, so
+ * neither needs to recompute ancestor or descendant sets.  Clusters are
+ * merged whenever a link is added (addUnchecked() and
+ * UpdateTransactionsFromBlock()) and split again in RemoveStaged().
+ *
  * Computational limits:
  *
  * Updating all in-mempool ancestors of a newly added transaction can be slow,
  * if no bound exists on how many in-mempool ancestors there may be.
  * CalculateMemPoolAncestors() takes configurable limits that are designed to
- * prevent these calculations from being too CPU intensive.
+ * prevent these calculations from being too CPU intensive.  Relinearizing a
+ * cluster is quadratic in its size, which CalculateClusterCount() lets
+ * callers bound.
  *
  */
 class CTxMemPool
@@ -475,6 +496,11 @@ public:
                 boost::multi_index::tag<ancestor_score>,
                 boost::multi_index::identity<CTxMemPoolEntry>,
                 CompareTxMemPoolEntryByAncestorFee
+            >,
+            // ordered by txid
+            boost::multi_index::ordered_unique<
+                boost::multi_index::tag<ordered_txid>,
+                mempoolentry_txid
             >
         >
     > indexed_transaction_set;
@@ -490,24 +516,96 @@ public:
             return a->GetTx().GetHash() < b->GetTx().GetHash();
         }
     };
-    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    typedef flatset<8, txiter, CompareIteratorByHash> setEntries;
 
     const setEntries & GetMemPoolParents(txiter entry) const;
     const setEntries & GetMemPoolChildren(txiter entry) const;
+
+    /** A run of consecutive transactions in a cluster's linearization */
+    struct ClusterChunk {
+        CAmount nModFees; //!< Sum of the modified fees of the chunk's transactions
+        uint64_t nSize;   //!< Sum of the virtual sizes of the chunk's transactions
+        size_t nEnd;      //!< One past the position of the chunk's last transaction
+    };
+
+    /** A connected component of the in-mempool transaction graph.  vTxs is a
+     *  topologically valid order of the cluster's transactions, and vChunks
+     *  splits it into chunks of strictly decreasing feerate: the order in
+     *  which the cluster's transactions should be mined (or evicted in
+     *  reverse). */
+    struct Cluster {
+        std::vector<txiter> vTxs;
+        std::vector<ClusterChunk> vChunks;
+    };
+    typedef std::map<uint64_t, Cluster> clusterMap;
+
+    const Cluster & GetCluster(txiter entry) const;
+    const clusterMap & GetClusters() const { return mapClusters; }
+
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
+    //! Entries found during a graph traversal, in the order they were found
+    typedef prevector<8, txiter> vecEntries;
+
+    /** Graph traversals mark the entries they visit with a new epoch, instead
+     *  of looking them up in a set of visited entries.  Traversals must not
+     *  be nested. */
+    mutable uint64_t nEpoch;
 
     struct TxLinks {
         setEntries parents;
         setEntries children;
+        uint64_t cluster = 0; //!< Key of the entry's cluster in mapClusters
     };
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
+    /** The last chunk of a cluster, as indexed in setClusterTails */
+    struct ClusterTail {
+        CAmount nModFees;
+        uint64_t nSize;
+        uint64_t cluster;
+    };
+
+    /** Sort cluster tails by increasing feerate */
+    struct CompareClusterTailByFeerate {
+        bool operator()(const ClusterTail& a, const ClusterTail& b) const
+        {
+            double f1 = (double)a.nModFees * b.nSize;
+            double f2 = (double)b.nModFees * a.nSize;
+            if (f1 == f2) {
+                return a.cluster < b.cluster;
+            }
+            return f1 < f2;
+        }
+    };
+
+    uint64_t nNextClusterId;
+    clusterMap mapClusters;
+    //! The last chunk of every cluster, worst feerate first
+    std::set<ClusterTail, CompareClusterTailByFeerate> setClusterTails;
+
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    /** A set of positions in a cluster of at most 128 transactions */
+    typedef std::bitset<128> ClusterTxSet;
+
+    /** Merge the clusters of the given entries into one and return its key. */
+    uint64_t MergeClusters(const setEntries& entries);
+    /** Recompute a cluster's linearization from scratch, picking the
+     *  remaining transaction with the best feerate including its remaining
+     *  in-cluster ancestors each time. Clusters larger than a ClusterTxSet
+     *  are ordered by ancestor score instead. */
+    void LinearizeCluster(uint64_t id);
+    /** Recompute a cluster's chunks from its linearization, and update its
+     *  entry in setClusterTails. */
+    void ChunkCluster(uint64_t id);
+    /** Split a cluster whose transactions were removed into its remaining
+     *  connected components, keeping the order of its linearization. */
+    void SplitCluster(uint64_t id);
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
@@ -578,8 +676,10 @@ public:
      *  child transactions present in vHashesToUpdate, which are already accounted
      *  for).  Note: vHashesToUpdate should be the set of transactions from the
      *  disconnected block that have been accepted back into the mempool.
+     *  Clusters that the new links grow beyond limitClusterCount transactions
+     *  have their lowest feerate chunks evicted.
      */
-    void UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate);
+    void UpdateTransactionsFromBlock(const std::vector<uint256> &vHashesToUpdate, uint64_t limitClusterCount);
 
     /** Try to calculate all in-mempool ancestors of entry.
      *  (these are all calculated including the tx itself)
@@ -597,6 +697,13 @@ public:
      *  Assumes that setDescendants includes all in-mempool descendants of anything
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries &setDescendants);
+    /** As above, for several transactions at once. Prefer this over one call
+     *  per transaction, as each call merges into setDescendants. */
+    void CalculateDescendants(const setEntries &setRoots, setEntries &setDescendants);
+
+    /** Return the number of transactions in the cluster a transaction with
+     *  the given in-mempool ancestors would join, not counting itself. */
+    uint64_t CalculateClusterCount(const setEntries &setAncestors) const;
 
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
@@ -606,7 +713,9 @@ public:
       */
     CFeeRate GetMinFee(size_t sizelimit) const;
 
-    /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+    /** Remove transactions from the mempool until its dynamic size is <= sizelimit,
+      *  evicting the chunk with the lowest feerate among all clusters first.
+      *  Chunks are removed in batches sized to free the expected excess.
       *  pvNoSpendsRemaining, if set, will be populated with the list of outpoints
       *  which are not in mempool which no longer have any spends in this mempool.
       */
@@ -703,6 +812,7 @@ protected:
 public:
     CCoinsViewMemPool(CCoinsView* baseIn, const CTxMemPool& mempoolIn);
     bool GetCoin(const COutPoint &outpoint, Coin &coin) const override;
+    size_t GetCoins(const std::vector<COutPoint>& outpoints, std::vector<Coin>& coins) const override;
 };
 
 /**
@@ -0,0 +1,287 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <txorphanage.h>
+
+#include <consensus/validation.h>
+#include <policy/policy.h>
+#include <random.h>
+#include <util.h>
+#include <utiltime.h>
+
+#include <algorithm>
+
+CCriticalSection g_cs_orphans;
+
+TxOrphanage::TxOrphanage(size_t nMaxPeerBytesIn) : nMaxPeerBytes(nMaxPeerBytesIn), nNextSweep(0)
+{
+}
+
+bool TxOrphanage::AddTx(const CTransactionRef& tx, NodeId peer)
+{
+    AssertLockHeld(g_cs_orphans);
+    const uint256& hash = tx->GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    // 100 orphans, each of which is at most 99,999 bytes big is
+    // at most 10 megabytes of orphans and somewhat more byprev index (in the worst case):
+    unsigned int sz = GetTransactionWeight(*tx);
+    if (sz >= MAX_STANDARD_TX_WEIGHT)
+    {
+        LogPrint(BCLog::MEMPOOL, "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    PeerOrphans& peerOrphans = mapPeers[peer];
+    auto ret = mapOrphans.emplace(hash, OrphanTx{tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, tx->GetTotalSize(), vOrphans.size(), {}});
+    assert(ret.second);
+    OrphanTx* orphan = &ret.first->second;
+    vOrphans.push_back(orphan);
+    orphan->itPeer = peerOrphans.orphans.insert(peerOrphans.orphans.end(), orphan);
+    peerOrphans.nBytes += orphan->nSize;
+    for (const CTxIn& txin : tx->vin) {
+        mapOrphansByPrev[txin.prevout].insert(orphan);
+    }
+
+    // Make room within the peer's quota by dropping its oldest orphans, but
+    // always keep the one just added
+    int nErased = 0;
+    while (peerOrphans.nBytes > nMaxPeerBytes && peerOrphans.orphans.front() != orphan) {
+        nErased += EraseTx(mapOrphans.find(peerOrphans.orphans.front()->tx->GetHash()));
+    }
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx over the quota of peer=%d\n", nErased, peer);
+
+    LogPrint(BCLog::MEMPOOL, "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
+             mapOrphans.size(), mapOrphansByPrev.size());
+    return true;
+}
+
+bool TxOrphanage::HaveTx(const uint256& txid) const
+{
+    AssertLockHeld(g_cs_orphans);
+    return mapOrphans.count(txid);
+}
+
+int TxOrphanage::EraseTx(const uint256& txid)
+{
+    AssertLockHeld(g_cs_orphans);
+    auto it = mapOrphans.find(txid);
+    if (it == mapOrphans.end())
+        return 0;
+    return EraseTx(it);
+}
+
+int TxOrphanage::EraseTx(std::unordered_map<uint256, OrphanTx, SaltedTxidHasher>::iterator it)
+{
+    AssertLockHeld(g_cs_orphans);
+    OrphanTx* orphan = &it->second;
+    for (const CTxIn& txin : orphan->tx->vin)
+    {
+        auto itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(orphan);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    // Fill the gap in vOrphans with the last orphan
+    vOrphans[orphan->nPos] = vOrphans.back();
+    vOrphans[orphan->nPos]->nPos = orphan->nPos;
+    vOrphans.pop_back();
+
+    // The peer entry stays while it has a work set, which may still refer to
+    // orphans of other peers
+    auto itPeer = mapPeers.find(orphan->fromPeer);
+    assert(itPeer != mapPeers.end());
+    itPeer->second.orphans.erase(orphan->itPeer);
+    itPeer->second.nBytes -= orphan->nSize;
+    if (itPeer->second.orphans.empty() && itPeer->second.workSet.empty())
+        mapPeers.erase(itPeer);
+
+    mapOrphans.erase(it);
+    return 1;
+}
+
+void TxOrphanage::EraseForPeer(NodeId peer)
+{
+    AssertLockHeld(g_cs_orphans);
+    auto itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return;
+    itPeer->second.workSet.clear();
+    itPeer->second.nToPreVerify = 0;
+    std::vector<uint256> vOrphanErase;
+    for (const OrphanTx* orphan : itPeer->second.orphans) {
+        vOrphanErase.push_back(orphan->tx->GetHash());
+    }
+    // Erasing the last orphan drops the peer entry
+    if (vOrphanErase.empty())
+        mapPeers.erase(itPeer);
+    int nErased = 0;
+    for (const uint256& orphanHash : vOrphanErase) {
+        nErased += EraseTx(orphanHash);
+    }
+    if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx from peer=%d\n", nErased, peer);
+}
+
+void TxOrphanage::EraseForBlock(const CBlock& block)
+{
+    AssertLockHeld(g_cs_orphans);
+    std::vector<uint256> vOrphanErase;
+
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
+
+        // Which orphan pool entries must we evict?
+        for (const auto& txin : tx.vin) {
+            auto itByPrev = mapOrphansByPrev.find(txin.prevout);
+            if (itByPrev == mapOrphansByPrev.end()) continue;
+            for (const OrphanTx* orphan : itByPrev->second) {
+                vOrphanErase.push_back(orphan->tx->GetHash());
+            }
+        }
+    }
+
+    // Erase orphan transactions included or precluded by this block
+    if (vOrphanErase.size()) {
+        int nErased = 0;
+        for (const uint256& orphanHash : vOrphanErase) {
+            nErased += EraseTx(orphanHash);
+        }
+        LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx included or conflicted by block\n", nErased);
+    }
+}
+
+unsigned int TxOrphanage::LimitOrphans(unsigned int nMaxOrphans)
+{
+    AssertLockHeld(g_cs_orphans);
+
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextSweep <= nNow) {
+        // Sweep out expired orphan pool entries:
+        int nErased = 0;
+        int64_t nMinExpTime = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+        auto iter = mapOrphans.begin();
+        while (iter != mapOrphans.end())
+        {
+            auto maybeErase = iter++;
+            if (maybeErase->second.nTimeExpire <= nNow) {
+                nErased += EraseTx(maybeErase);
+            } else {
+                nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
+            }
+        }
+        // Sweep again 5 minutes after the next entry that expires in order to batch the linear scan.
+        nNextSweep = nMinExpTime + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nErased > 0) LogPrint(BCLog::MEMPOOL, "Erased %d orphan tx due to expiration\n", nErased);
+    }
+    FastRandomContext rng;
+    while (mapOrphans.size() > nMaxOrphans)
+    {
+        // Evict a random orphan:
+        const OrphanTx* orphan = vOrphans[rng.randrange(vOrphans.size())];
+        EraseTx(mapOrphans.find(orphan->tx->GetHash()));
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+std::vector<CTransactionRef> TxOrphanage::GetChildren(const CTransaction& tx) const
+{
+    AssertLockHeld(g_cs_orphans);
+    std::vector<CTransactionRef> vChildren;
+    std::set<const OrphanTx*> setSeen;
+    for (size_t i = 0; i < tx.vout.size(); i++) {
+        auto itByPrev = mapOrphansByPrev.find(COutPoint(tx.GetHash(), i));
+        if (itByPrev == mapOrphansByPrev.end())
+            continue;
+        for (const OrphanTx* orphan : itByPrev->second) {
+            if (setSeen.insert(orphan).second) {
+                vChildren.push_back(orphan->tx);
+            }
+        }
+    }
+    return vChildren;
+}
+
+std::vector<CTransactionRef> TxOrphanage::AddChildrenToWorkSet(const CTransaction& tx, NodeId peer)
+{
+    AssertLockHeld(g_cs_orphans);
+    std::vector<CTransactionRef> vChildren = GetChildren(tx);
+    if (!vChildren.empty()) {
+        PeerOrphans& peerOrphans = mapPeers[peer];
+        for (const CTransactionRef& child : vChildren) {
+            peerOrphans.workSet.push_back(child->GetHash());
+        }
+        peerOrphans.nToPreVerify += vChildren.size();
+    }
+    return vChildren;
+}
+
+std::vector<CTransactionRef> TxOrphanage::TakeTxsToPreVerify(NodeId peer)
+{
+    AssertLockHeld(g_cs_orphans);
+    std::vector<CTransactionRef> vtx;
+    auto itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return vtx;
+    const std::deque<uint256>& workSet = itPeer->second.workSet;
+    for (size_t i = workSet.size() - itPeer->second.nToPreVerify; i < workSet.size(); i++) {
+        auto it = mapOrphans.find(workSet[i]);
+        if (it != mapOrphans.end())
+            vtx.push_back(it->second.tx);
+    }
+    itPeer->second.nToPreVerify = 0;
+    return vtx;
+}
+
+bool TxOrphanage::HaveTxToReconsider(NodeId peer) const
+{
+    AssertLockHeld(g_cs_orphans);
+    auto itPeer = mapPeers.find(peer);
+    return itPeer != mapPeers.end() && !itPeer->second.workSet.empty();
+}
+
+CTransactionRef TxOrphanage::GetTxToReconsider(NodeId peer, NodeId& originator)
+{
+    AssertLockHeld(g_cs_orphans);
+    auto itPeer = mapPeers.find(peer);
+    if (itPeer == mapPeers.end())
+        return nullptr;
+    CTransactionRef tx;
+    std::deque<uint256>& workSet = itPeer->second.workSet;
+    while (!tx && !workSet.empty()) {
+        auto it = mapOrphans.find(workSet.front());
+        workSet.pop_front();
+        itPeer->second.nToPreVerify = std::min(itPeer->second.nToPreVerify, workSet.size());
+        if (it != mapOrphans.end()) {
+            tx = it->second.tx;
+            originator = it->second.fromPeer;
+        }
+    }
+    if (itPeer->second.orphans.empty() && workSet.empty())
+        mapPeers.erase(itPeer);
+    return tx;
+}
+
+size_t TxOrphanage::Size() const
+{
+    AssertLockHeld(g_cs_orphans);
+    return mapOrphans.size();
+}
+
+size_t TxOrphanage::PeerBytes(NodeId peer) const
+{
+    AssertLockHeld(g_cs_orphans);
+    auto itPeer = mapPeers.find(peer);
+    return itPeer == mapPeers.end() ? 0 : itPeer->second.nBytes;
+}
@@ -0,0 +1,136 @@
+// Copyright (c) 2018 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANAGE_H
+#define BITCOIN_TXORPHANAGE_H
+
+#include <coins.h>
+#include <net.h>
+#include <primitives/block.h>
+#include <primitives/transaction.h>
+#include <sync.h>
+#include <txmempool.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transactions expire time checks in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+/** Serialized size of the orphans one peer may have in the pool before its oldest are evicted */
+static const size_t MAX_ORPHAN_PEER_BYTES = 1000000;
+
+/** Guards the orphanage, and the extra transactions kept for compact block reconstruction */
+extern CCriticalSection g_cs_orphans;
+
+/**
+ * Transactions whose inputs are not all known yet, kept until their parents
+ * arrive. Orphans are indexed by txid and by the outpoints they spend in hash
+ * tables, and listed per announcing peer in arrival order, so that erasing a
+ * peer's orphans costs only as much as that peer has.
+ *
+ * Each peer also has a quota of serialized bytes: a peer flooding orphans
+ * evicts its own oldest ones rather than those of other peers.
+ *
+ * Orphans whose parent got accepted are queued in the work set of the peer
+ * that sent the parent, so that they can be reconsidered one at a time
+ * between that peer's messages rather than all at once.
+ */
+class TxOrphanage
+{
+public:
+    explicit TxOrphanage(size_t nMaxPeerBytesIn = MAX_ORPHAN_PEER_BYTES);
+
+    /** Add an orphan announced by peer, unless it is already known or too large */
+    bool AddTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Whether an orphan with this txid is in the pool */
+    bool HaveTx(const uint256& txid) const EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Erase an orphan by txid, returning the number erased */
+    int EraseTx(const uint256& txid) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Erase all orphans announced by peer, and forget its work set */
+    void EraseForPeer(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Erase all orphans included in or conflicted by a block */
+    void EraseForBlock(const CBlock& block) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Erase expired orphans, then random ones until at most nMaxOrphans are left; returns the number of random evictions */
+    unsigned int LimitOrphans(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Orphans spending an output of tx, each listed once */
+    std::vector<CTransactionRef> GetChildren(const CTransaction& tx) const EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /**
+     * Queue the orphans spending an output of tx for reconsideration while
+     * processing peer's messages. Returns the newly queued orphans.
+     */
+    std::vector<CTransactionRef> AddChildrenToWorkSet(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /**
+     * Take the orphans queued in peer's work set since the last call, so that
+     * their scripts can be verified in one batch before reconsidering them.
+     */
+    std::vector<CTransactionRef> TakeTxsToPreVerify(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Whether peer has orphans queued for reconsideration */
+    bool HaveTxToReconsider(NodeId peer) const EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /**
+     * Take the next orphan from peer's work set, skipping those erased
+     * meanwhile. Returns nullptr when the work set is empty; otherwise
+     * originator is set to the peer that announced the orphan.
+     */
+    CTransactionRef GetTxToReconsider(NodeId peer, NodeId& originator) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Number of orphans */
+    size_t Size() const EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    /** Serialized size of the orphans announced by peer */
+    size_t PeerBytes(NodeId peer) const EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+private:
+    struct OrphanTx {
+        CTransactionRef tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        size_t nSize;
+        //! Position in vOrphans
+        size_t nPos;
+        //! Position in the announcing peer's list
+        std::list<OrphanTx*>::iterator itPeer;
+    };
+
+    struct PeerOrphans {
+        //! Orphans announced by the peer, oldest first
+        std::list<OrphanTx*> orphans;
+        size_t nBytes = 0;
+        //! Orphans to reconsider while processing the peer's messages
+        std::deque<uint256> workSet;
+        //! Number of orphans at the back of workSet not taken by TakeTxsToPreVerify yet
+        size_t nToPreVerify = 0;
+    };
+
+    /** Erase an orphan, returning the number erased */
+    int EraseTx(std::unordered_map<uint256, OrphanTx, SaltedTxidHasher>::iterator it) EXCLUSIVE_LOCKS_REQUIRED(g_cs_orphans);
+
+    const size_t nMaxPeerBytes;
+    int64_t nNextSweep;
+
+    // Elements of an unordered_map stay put when it rehashes, so the other
+    // indexes refer to orphans by pointer.
+    std::unordered_map<uint256, OrphanTx, SaltedTxidHasher> mapOrphans;
+    std::unordered_map<COutPoint, std::set<OrphanTx*>, SaltedOutpointHasher> mapOrphansByPrev;
+    //! All orphans in no particular order, for picking one at random
+    std::vector<OrphanTx*> vOrphans;
+    std::map<NodeId, PeerOrphans> mapPeers;
+};
+
+#endif // BITCOIN_TXORPHANAGE_H
@@ -14,8 +14,10 @@
 #include <consensus/merkle.h>
 #include <consensus/tx_verify.h>
 #include <consensus/validation.h>
+#include <crypto/hmac_sha256.h>
 #include <cuckoocache.h>
 #include <hash.h>
+#include <index/txindex.h>
 #include <init.h>
 #include <policy/fees.h>
 #include <policy/policy.h>
@@ -40,7 +42,9 @@
 #include <validationinterface.h>
 #include <warnings.h>
 
+#include <deque>
 #include <future>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -214,7 +218,6 @@ uint256 hashBestBlock;
 int nScriptCheckThreads = 0;
 std::atomic_bool fImporting(false);
 std::atomic_bool fReindex(false);
-bool fTxIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -351,7 +354,7 @@ bool TestLockPointValidity(const LockPoints* lp)
     return true;
 }
 
-bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints)
+bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool useExistingLockPoints, const CCoinsView* pcoinsView)
 {
     AssertLockHeld(cs_main);
     AssertLockHeld(mempool.cs);
@@ -378,12 +381,13 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
     else {
         // pcoinsTip contains the UTXO set for chainActive.Tip()
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), mempool);
+        const CCoinsView& coins = pcoinsView ? *pcoinsView : viewMemPool;
         std::vector<int> prevheights;
         prevheights.resize(tx.vin.size());
         for (size_t txinIndex = 0; txinIndex < tx.vin.size(); txinIndex++) {
             const CTxIn& txin = tx.vin[txinIndex];
             Coin coin;
-            if (!viewMemPool.GetCoin(txin.prevout, coin)) {
+            if (!coins.GetCoin(txin.prevout, coin)) {
                 return error("%s: Missing input", __func__);
             }
             if (coin.nHeight == MEMPOOL_HEIGHT) {
@@ -426,12 +430,7 @@ bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp, bool
 // Returns the script flags which should be checked for a given block
 static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consensus::Params& chainparams);
 
-static void LimitMempoolSize(CTxMemPool& pool, size_t limit, unsigned long age) {
-    int expired = pool.Expire(GetTime() - age);
-    if (expired != 0) {
-        LogPrint(BCLog::MEMPOOL, "Expired %i transactions from the memory pool\n", expired);
-    }
-
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit) {
     std::vector<COutPoint> vNoSpendsRemaining;
     pool.TrimToSize(limit, &vNoSpendsRemaining);
     for (const COutPoint& removed : vNoSpendsRemaining)
@@ -482,6 +481,10 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
     // Iterate disconnectpool in reverse, so that we add transactions
     // back to the mempool starting with the earliest transaction that had
     // been previously seen in a block.
+    if (fAddToMempool) {
+        std::vector<CTransactionRef> vtx(disconnectpool.queuedTx.get<insertion_order>().rbegin(), disconnectpool.queuedTx.get<insertion_order>().rend());
+        PreVerifyTransactionScripts(mempool, vtx, true /* bypass_limits */);
+    }
     auto it = disconnectpool.queuedTx.get<insertion_order>().rbegin();
     while (it != disconnectpool.queuedTx.get<insertion_order>().rend()) {
         // ignore validation errors in resurrected transactions
@@ -503,18 +506,18 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions &disconnectpool, bool f
     // previously-confirmed transactions back to the mempool.
     // UpdateTransactionsFromBlock finds descendants of any transactions in
     // the disconnectpool that were added back and cleans up the mempool state.
-    mempool.UpdateTransactionsFromBlock(vHashUpdate);
+    mempool.UpdateTransactionsFromBlock(vHashUpdate, gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT));
 
     // We also need to remove any now-immature transactions
     mempool.removeForReorg(pcoinsTip.get(), chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
     // Re-limit mempool size, in case we added any transactions
-    LimitMempoolSize(mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    LimitMempoolSize(mempool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
 }
 
 // Used to avoid mempool polluting consensus critical paths if CCoinsViewMempool
 // were somehow broken and returning the wrong scriptPubKeys
 static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, CTxMemPool& pool,
-                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata) {
+                 unsigned int flags, bool cacheSigStore, PrecomputedTransactionData& txdata, const CCoinsViewCache* pPackageCoins = nullptr) {
     AssertLockHeld(cs_main);
 
     // pool.cs should be locked already, but go ahead and re-take the lock here
@@ -537,6 +540,11 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
             assert(txFrom->GetHash() == txin.prevout.hash);
             assert(txFrom->vout.size() > txin.prevout.n);
             assert(txFrom->vout[txin.prevout.n] == coin.out);
+        } else if (pPackageCoins && !pcoinsTip->HaveCoin(txin.prevout)) {
+            // Output of an earlier member of the package being validated
+            const Coin& coinFromPackage = pPackageCoins->AccessCoin(txin.prevout);
+            assert(coinFromPackage.nHeight == MEMPOOL_HEIGHT);
+            assert(coinFromPackage.out == coin.out);
         } else {
             const Coin& coinFromDisk = pcoinsTip->AccessCoin(txin.prevout);
             assert(!coinFromDisk.IsSpent());
@@ -547,9 +555,16 @@ static bool CheckInputsFromMempoolAndCache(const CTransaction& tx, CValidationSt
     return CheckInputs(tx, state, view, true, flags, cacheSigStore, true, txdata);
 }
 
+/**
+ * Validate a transaction and add it to the mempool. When pPackageCoins is
+ * given, the transaction is a member of a package: its inputs may be outputs
+ * of the earlier members, cached in *pPackageCoins on top of the mempool, and
+ * instead of being added its entry is appended to *pPackageEntries.
+ */
 static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx,
                               bool* pfMissingInputs, int64_t nAcceptTime, std::list<CTransactionRef>* plTxnReplaced,
-                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache)
+                              bool bypass_limits, const CAmount& nAbsurdFee, std::vector<COutPoint>& coins_to_uncache,
+                              CCoinsViewCache* pPackageCoins = nullptr, std::vector<CTxMemPoolEntry>* pPackageEntries = nullptr)
 {
     const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
@@ -643,13 +658,25 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 
         LockPoints lp;
         CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
-        view.SetBackend(viewMemPool);
+        if (pPackageCoins) {
+            view.SetBackend(*pPackageCoins);
+        } else {
+            view.SetBackend(viewMemPool);
+        }
 
-        // do all inputs exist?
-        for (const CTxIn txin : tx.vin) {
+        // Fetch all inputs that are not cached yet in one batch.
+        std::vector<COutPoint> prevouts;
+        prevouts.reserve(tx.vin.size());
+        for (const CTxIn& txin : tx.vin) {
             if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
                 coins_to_uncache.push_back(txin.prevout);
             }
+            prevouts.push_back(txin.prevout);
+        }
+        view.PrefetchCoins(prevouts);
+
+        // do all inputs exist?
+        for (const CTxIn txin : tx.vin) {
             if (!view.HaveCoin(txin.prevout)) {
                 // Are inputs missing because we already have the tx?
                 for (size_t out = 0; out < tx.vout.size(); out++) {
@@ -675,9 +702,8 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
         // be mined yet.
-        // Must keep pool.cs for this unless we change CheckSequenceLocks to take a
-        // CoinsViewCache instead of create its own
-        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
+        // The inputs are looked up in view, which has them all cached.
+        if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp, false, &view))
             return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
 
         CAmount nFees = 0;
@@ -749,6 +775,15 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
         }
 
+        // Bound the size of the cluster this transaction would join, as its
+        // linearization is recomputed on every change.
+        size_t nLimitCluster = gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT);
+        uint64_t nClusterCount = pool.CalculateClusterCount(setAncestors) + 1;
+        if (nClusterCount > nLimitCluster) {
+            return state.DoS(0, false, REJECT_NONSTANDARD, "too-large-cluster", false,
+                strprintf("cluster would have %u transactions [limit: %u]", nClusterCount, nLimitCluster));
+        }
+
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
         // pathological case by making sure setConflicts and setAncestors don't
@@ -832,9 +867,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
             if (nConflictingCount <= maxDescendantsToVisit) {
                 // If not too many to replace, then calculate the set of
                 // transactions that would have to be evicted
-                for (CTxMemPool::txiter it : setIterConflicting) {
-                    pool.CalculateDescendants(it, allConflicting);
-                }
+                pool.CalculateDescendants(setIterConflicting, allConflicting);
                 for (CTxMemPool::txiter it : allConflicting) {
                     nConflictingFees += it->GetModifiedFee();
                     nConflictingSize += it->GetTxSize();
@@ -929,7 +962,8 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
         // invalid blocks (using TestBlockValidity), however allowing such
         // transactions into the mempool can be exploited as a DoS attack.
         unsigned int currentBlockScriptVerifyFlags = GetBlockScriptFlags(chainActive.Tip(), Params().GetConsensus());
-        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata))
+        entry.SetScriptFlags(currentBlockScriptVerifyFlags);
+        if (!CheckInputsFromMempoolAndCache(tx, state, view, pool, currentBlockScriptVerifyFlags, true, txdata, pPackageCoins))
         {
             // If we're using promiscuousmempoolflags, we may hit this normally
             // Check if current block has some flags that scriptVerifyFlags
@@ -943,10 +977,20 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
                         __func__, hash.ToString(), FormatStateMessage(state));
                 } else {
                     LogPrintf("Warning: -promiscuousmempool flags set to not include currently enforced soft forks, this may break mining or otherwise cause instability!\n");
+                    entry.SetScriptFlags(MANDATORY_SCRIPT_VERIFY_FLAGS);
                 }
             }
         }
 
+        if (pPackageEntries) {
+            // Package members may not replace mempool transactions
+            if (fReplacementTransaction) {
+                return state.Invalid(false, REJECT_DUPLICATE, "package-mempool-conflict");
+            }
+            pPackageEntries->push_back(entry);
+            return true;
+        }
+
         // Remove conflicting transactions from the mempool
         for (const CTxMemPool::txiter it : allConflicting)
         {
@@ -972,7 +1016,7 @@ static bool AcceptToMemoryPoolWorker(const CChainParams& chainparams, CTxMemPool
 
         // trim mempool and check if tx was trimmed
         if (!bypass_limits) {
-            LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
             if (!pool.exists(hash))
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
         }
@@ -1025,28 +1069,8 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
             return true;
         }
 
-        if (fTxIndex) {
-            CDiskTxPos postx;
-            if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
-                CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (const std::exception& e) {
-                    return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-                }
-                hashBlock = header.GetHash();
-                if (txOut->GetHash() != hash)
-                    return error("%s: txid mismatch", __func__);
-                return true;
-            }
-
-            // transaction not found in index, nothing more can be done
-            return false;
+        if (g_txindex) {
+            return g_txindex->FindTx(hash, hashBlock, txOut);
         }
 
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -1323,7 +1347,18 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     const CScriptWitness *witness = &ptxTo->vin[nIn].scriptWitness;
-    return VerifyScript(scriptSig, m_tx_out.scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, m_tx_out.nValue, cacheStore, *txdata), &error);
+    if (VerifyScript(scriptSig, m_tx_out.scriptPubKey, witness, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, m_tx_out.nValue, cacheStore, *txdata), &error)) {
+        return true;
+    }
+    if (pnFailedIn) {
+        // Keep the lowest failing input, as the checks of a transaction run
+        // on several threads. All inputs before it passed, so a serial check
+        // starting there fails the same way as one in input order.
+        int nFailedIn = pnFailedIn->load();
+        while ((nFailedIn < 0 || (int)nIn < nFailedIn) && !pnFailedIn->compare_exchange_weak(nFailedIn, nIn)) {}
+        return true;
+    }
+    return false;
 }
 
 int GetSpendHeight(const CCoinsViewCache& inputs)
@@ -1337,6 +1372,29 @@ int GetSpendHeight(const CCoinsViewCache& inputs)
 static CuckooCache::cache<uint256, SignatureCacheHasher> scriptExecutionCache;
 static uint256 scriptExecutionCacheNonce(GetRandHash());
 
+/**
+ * Inputs found to fail script verification by PreVerifyTransactionScripts, by
+ * script execution cache entry. CheckInputs verifies such an input first, so
+ * that rejecting the transaction does not verify all its inputs again. The
+ * oldest entries are dropped beyond MAX_SCRIPT_FAILURES; each entry keeps its
+ * position in lScriptFailuresOrder so that it can be removed from both.
+ * Guarded by cs_main.
+ */
+static std::map<uint256, std::pair<unsigned int, std::list<uint256>::iterator>> mapScriptFailures;
+static std::list<uint256> lScriptFailuresOrder;
+static const size_t MAX_SCRIPT_FAILURES = 1000;
+
+/** The script execution cache entry for the scripts of tx verified with flags */
+static uint256 GetScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 hashCacheEntry;
+    // We only use the first 19 bytes of nonce to avoid a second SHA
+    // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
+    static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+    return hashCacheEntry;
+}
+
 void InitScriptExecutionCache() {
     // nMaxCacheSize is unsigned. If -maxsigcachesize is set to zero,
     // setup_bytes creates the minimum possible cache (2 elements).
@@ -1382,17 +1440,25 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
             // correct (ie that the transaction hash which is in tx's prevouts
             // properly commits to the scriptPubKey in the inputs view of that
             // transaction).
-            uint256 hashCacheEntry;
-            // We only use the first 19 bytes of nonce to avoid a second SHA
-            // round - giving us 19 + 32 + 4 = 55 bytes (+ 8 + 1 = 64)
-            static_assert(55 - sizeof(flags) - 32 >= 128/8, "Want at least 128 bits of nonce for script execution cache");
-            CSHA256().Write(scriptExecutionCacheNonce.begin(), 55 - sizeof(flags) - 32).Write(tx.GetWitnessHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(hashCacheEntry.begin());
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, flags);
             AssertLockHeld(cs_main); //TODO: Remove this requirement by making CuckooCache not require external locks
             if (scriptExecutionCache.contains(hashCacheEntry, !cacheFullScriptStore)) {
                 return true;
             }
 
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            // Start with an input already known to fail, if any
+            unsigned int nFirstIn = 0;
+            if (!pvChecks) {
+                auto itFailure = mapScriptFailures.find(hashCacheEntry);
+                if (itFailure != mapScriptFailures.end()) {
+                    nFirstIn = itFailure->second.first;
+                    lScriptFailuresOrder.erase(itFailure->second.second);
+                    mapScriptFailures.erase(itFailure);
+                }
+            }
+
+            for (unsigned int n = 0; n < tx.vin.size(); n++) {
+                const unsigned int i = (nFirstIn + n) % tx.vin.size();
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const Coin& coin = inputs.AccessCoin(prevout);
                 assert(!coin.IsSpent());
@@ -1472,7 +1538,27 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
     return true;
 }
 
-static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
+/** Abort with a message */
+bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
+{
+    SetMiscWarning(strMessage);
+    LogPrintf("*** %s\n", strMessage);
+    uiInterface.ThreadSafeMessageBox(
+        userMessage.empty() ? _("Error: A fatal internal error occurred, see debug.log for details") : userMessage,
+        "", CClientUIInterface::MSG_ERROR);
+    StartShutdown();
+    return false;
+}
+
+bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
+{
+    AbortNode(strMessage, userMessage);
+    return state.Error(strMessage);
+}
+
+} // namespace
+
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex)
 {
     CDiskBlockPos pos = pindex->GetUndoPos();
     if (pos.IsNull()) {
@@ -1503,26 +1589,6 @@ static bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex *pindex)
     return true;
 }
 
-/** Abort with a message */
-bool AbortNode(const std::string& strMessage, const std::string& userMessage="")
-{
-    SetMiscWarning(strMessage);
-    LogPrintf("*** %s\n", strMessage);
-    uiInterface.ThreadSafeMessageBox(
-        userMessage.empty() ? _("Error: A fatal internal error occurred, see debug.log for details") : userMessage,
-        "", CClientUIInterface::MSG_ERROR);
-    StartShutdown();
-    return false;
-}
-
-bool AbortNode(CValidationState& state, const std::string& strMessage, const std::string& userMessage="")
-{
-    AbortNode(strMessage, userMessage);
-    return state.Error(strMessage);
-}
-
-} // namespace
-
 /**
  * Restore the UTXO in a Coin at a given COutPoint
  * @param undo The Coin to be restored.
@@ -1660,31 +1726,344 @@ static bool WriteUndoDataForBlock(const CBlockUndo& blockundo, CValidationState&
     return true;
 }
 
-static bool WriteTxIndexDataForBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex)
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("litecoin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+/** The script flags AcceptToMemoryPool checks transactions against first */
+static unsigned int GetMempoolScriptFlags(const CChainParams& chainparams)
+{
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!chainparams.RequireStandard()) {
+        scriptVerifyFlags = gArgs.GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+    }
+    return scriptVerifyFlags;
+}
+
+void PreVerifyTransactionScripts(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, bool bypass_limits,
+                                 const std::vector<bool>* pvPolicyChecked)
 {
-    if (!fTxIndex) return true;
+    if (!nScriptCheckThreads || vtx.size() < 2) {
+        return; // verifying them one by one is just as fast
+    }
+
+    // Script checks keep pointers to the transaction data, so reserve it all
+    // up front.
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(vtx.size());
+    std::deque<std::atomic<int>> vFailedIn;
+    std::vector<std::pair<uint256, std::vector<COutPoint>>> vCandidates; // cache entry, coins to uncache
+    std::vector<COutPoint> coins_to_uncache;
+    std::vector<CScriptCheck> vChecks;
 
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
-    for (const CTransactionRef& tx : block.vtx)
     {
-        vPos.push_back(std::make_pair(tx->GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(*tx, SER_DISK, CLIENT_VERSION);
+        LOCK2(cs_main, pool.cs);
+        const CChainParams& chainparams = Params();
+        const bool witnessEnabled = IsWitnessEnabled(chainActive.Tip(), chainparams.GetConsensus());
+        const unsigned int nMempoolScriptFlags = GetMempoolScriptFlags(chainparams);
+        const unsigned int nBlockScriptFlags = GetBlockScriptFlags(chainActive.Tip(), chainparams.GetConsensus());
+        const CFeeRate mempoolMinFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+        CCoinsViewCache view(&viewMemPool);
+        const int nSpendHeight = GetSpendHeight(view);
+        std::set<COutPoint> setSpent;
+
+        for (size_t nTx = 0; nTx < vtx.size(); nTx++) {
+            const CTransaction& tx = *vtx[nTx];
+            // Scripts that passed the policy flags already are only left to
+            // be checked against the block flags
+            const unsigned int scriptVerifyFlags = pvPolicyChecked && (*pvPolicyChecked)[nTx] ? nBlockScriptFlags : nMempoolScriptFlags;
+            CValidationState state;
+            std::string reason;
+            if (pool.exists(tx.GetHash()) || !CheckTransaction(tx, state) || tx.IsCoinBase() ||
+                (fRequireStandard && !IsStandardTx(tx, reason, witnessEnabled))) {
+                continue;
+            }
+            // Spending the outputs of an earlier candidate is fine, they are
+            // added to the view below. Spending the same output is not.
+            bool fConflict = false;
+            for (const CTxIn& txin : tx.vin) {
+                fConflict |= setSpent.count(txin.prevout) > 0;
+            }
+            if (fConflict) {
+                continue;
+            }
+
+            std::vector<COutPoint> coins_fetched;
+            bool fHaveInputs = true;
+            for (const CTxIn& txin : tx.vin) {
+                if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                    coins_fetched.push_back(txin.prevout);
+                }
+                if (!view.HaveCoin(txin.prevout)) {
+                    fHaveInputs = false;
+                    break;
+                }
+            }
+
+            CAmount nFees = 0;
+            bool fPolicyOk = fHaveInputs && Consensus::CheckTxInputs(tx, state, view, nSpendHeight, nFees) &&
+                (!fRequireStandard || (AreInputsStandard(tx, view) && (!tx.HasWitness() || IsWitnessStandard(tx, view))));
+            if (fPolicyOk) {
+                int64_t nSigOpsCost = GetTransactionSigOpCost(tx, view, STANDARD_SCRIPT_VERIFY_FLAGS);
+                int64_t nSize = GetVirtualTransactionSize(tx, nSigOpsCost);
+                CAmount nModifiedFees = nFees;
+                pool.ApplyDelta(tx.GetHash(), nModifiedFees);
+                fPolicyOk = nSigOpsCost <= MAX_STANDARD_TX_SIGOPS_COST &&
+                    (bypass_limits || (nModifiedFees >= mempoolMinFee.GetFee(nSize) && nModifiedFees >= ::minRelayTxFee.GetFee(nSize)));
+            }
+            uint256 hashCacheEntry = GetScriptExecutionCacheEntry(tx, scriptVerifyFlags);
+            // Known failures are left to the serial path, which starts at the
+            // failing input
+            if (!fPolicyOk || scriptExecutionCache.contains(hashCacheEntry, false) || mapScriptFailures.count(hashCacheEntry)) {
+                coins_to_uncache.insert(coins_to_uncache.end(), coins_fetched.begin(), coins_fetched.end());
+                continue;
+            }
+
+            txdata.emplace_back(tx);
+            const size_t nFirstCheck = vChecks.size();
+            if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, false, txdata.back(), &vChecks)) {
+                vChecks.resize(nFirstCheck);
+                coins_to_uncache.insert(coins_to_uncache.end(), coins_fetched.begin(), coins_fetched.end());
+                continue;
+            }
+            vFailedIn.emplace_back(-1);
+            for (size_t i = nFirstCheck; i < vChecks.size(); i++) {
+                vChecks[i].SetFailedInput(&vFailedIn.back());
+            }
+            vCandidates.emplace_back(hashCacheEntry, std::move(coins_fetched));
+            for (const CTxIn& txin : tx.vin) {
+                setSpent.insert(txin.prevout);
+            }
+            // Let later transactions of the batch spend its outputs
+            AddCoins(view, tx, MEMPOOL_HEIGHT);
+        }
     }
 
-    if (!pblocktree->WriteTxIndex(vPos)) {
-        return AbortNode(state, "Failed to write transaction index");
+    // The checks only refer to vtx and txdata, and script validity does not
+    // depend on the chain state, so other messages, blocks and RPCs can take
+    // cs_main meanwhile. The queue control must be released before taking
+    // cs_main again, as ConnectBlock takes them in the opposite order.
+    {
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+        control.Add(vChecks);
+        control.Wait();
     }
 
-    return true;
+    LOCK(cs_main);
+    for (size_t i = 0; i < vCandidates.size(); i++) {
+        if (vFailedIn[i] >= 0) {
+            coins_to_uncache.insert(coins_to_uncache.end(), vCandidates[i].second.begin(), vCandidates[i].second.end());
+            if (!mapScriptFailures.count(vCandidates[i].first)) {
+                lScriptFailuresOrder.push_back(vCandidates[i].first);
+                mapScriptFailures.emplace(vCandidates[i].first, std::make_pair((unsigned int)vFailedIn[i], std::prev(lScriptFailuresOrder.end())));
+            }
+            while (lScriptFailuresOrder.size() > MAX_SCRIPT_FAILURES) {
+                mapScriptFailures.erase(lScriptFailuresOrder.front());
+                lScriptFailuresOrder.pop_front();
+            }
+        } else {
+            scriptExecutionCache.insert(vCandidates[i].first);
+        }
+    }
+    for (const COutPoint& outpoint : coins_to_uncache) {
+        pcoinsTip->Uncache(outpoint);
+    }
 }
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx,
+                             std::vector<bool>& vAccepted, std::vector<CValidationState>& vState,
+                             std::list<CTransactionRef>* plTxnReplaced, bool bypass_limits, const CAmount nAbsurdFee)
+{
+    PreVerifyTransactionScripts(pool, vtx, bypass_limits);
 
-void ThreadScriptCheck() {
-    RenameThread("litecoin-scriptch");
-    scriptcheckqueue.Thread();
+    LOCK(cs_main);
+    vAccepted.assign(vtx.size(), false);
+    vState.assign(vtx.size(), CValidationState());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        vAccepted[i] = AcceptToMemoryPool(pool, vState[i], vtx[i], nullptr /* pfMissingInputs */, plTxnReplaced, bypass_limits, nAbsurdFee);
+    }
+}
+
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               std::vector<CValidationState>& vState, const CAmount nAbsurdFee)
+{
+    vState.assign(package.size(), CValidationState());
+    if (package.empty() || package.size() > MAX_PACKAGE_COUNT) {
+        return state.Invalid(false, REJECT_INVALID, "package-bad-count");
+    }
+
+    // Parents must come before their children, and no two transactions may
+    // spend the same output
+    std::set<uint256> setLater;
+    for (const CTransactionRef& ptx : package) {
+        if (!setLater.insert(ptx->GetHash()).second) {
+            return state.Invalid(false, REJECT_INVALID, "package-contains-duplicates");
+        }
+    }
+    std::set<COutPoint> setSpent;
+    for (const CTransactionRef& ptx : package) {
+        setLater.erase(ptx->GetHash());
+        for (const CTxIn& txin : ptx->vin) {
+            if (setLater.count(txin.prevout.hash)) {
+                return state.Invalid(false, REJECT_INVALID, "package-not-sorted");
+            }
+            if (!setSpent.insert(txin.prevout).second) {
+                return state.Invalid(false, REJECT_INVALID, "conflict-in-package");
+            }
+        }
+    }
+
+    // The package is a child with its parents: every other transaction must
+    // be spent by the last one
+    std::set<uint256> setParents;
+    for (const CTxIn& txin : package.back()->vin) {
+        setParents.insert(txin.prevout.hash);
+    }
+    for (size_t i = 0; i + 1 < package.size(); i++) {
+        if (!setParents.count(package[i]->GetHash())) {
+            return state.Invalid(false, REJECT_INVALID, "package-not-child-with-parents");
+        }
+    }
+
+    PreVerifyTransactionScripts(pool, package, true /* bypass_limits */);
+
+    const CChainParams& chainparams = Params();
+    LOCK2(cs_main, pool.cs);
+
+    // Transactions that pay for themselves go in on their own, with the usual
+    // checks. Only those rejected for their fee, and the ones spending them,
+    // rely on the rest of the package.
+    std::vector<size_t> vInPackage;
+    for (size_t i = 0; i < package.size(); i++) {
+        if (pool.exists(package[i]->GetHash())) {
+            continue;
+        }
+        bool fMissingInputs = false;
+        if (AcceptToMemoryPool(pool, vState[i], package[i], &fMissingInputs, nullptr /* plTxnReplaced */,
+                               false /* bypass_limits */, nAbsurdFee)) {
+            continue;
+        }
+        if (!fMissingInputs && vState[i].GetRejectCode() != REJECT_INSUFFICIENTFEE) {
+            return state.Invalid(false, REJECT_INVALID, "package-invalid-tx", strprintf("%s: %s", package[i]->GetHash().ToString(), FormatStateMessage(vState[i])));
+        }
+        vState[i] = CValidationState();
+        vInPackage.push_back(i);
+    }
+    if (vInPackage.empty()) {
+        return true;
+    }
+
+    // Validate the rest against the outputs of the earlier ones, without
+    // adding any of them yet. Fees are left to the package as a whole.
+    CCoinsViewMemPool viewMemPool(pcoinsTip.get(), pool);
+    CCoinsViewCache packageCoins(&viewMemPool);
+    std::vector<CTxMemPoolEntry> vEntries;
+    std::vector<COutPoint> coins_to_uncache;
+    auto reject = [&](const CValidationState& reason) {
+        for (const COutPoint& outpoint : coins_to_uncache) {
+            pcoinsTip->Uncache(outpoint);
+        }
+        state = reason;
+        return false;
+    };
+    for (size_t i : vInPackage) {
+        const CTransactionRef& ptx = package[i];
+        bool fMissingInputs = false;
+        if (!AcceptToMemoryPoolWorker(chainparams, pool, vState[i], ptx, &fMissingInputs, GetTime(), nullptr /* plTxnReplaced */,
+                                      true /* bypass_limits */, nAbsurdFee, coins_to_uncache, &packageCoins, &vEntries)) {
+            CValidationState reason;
+            if (fMissingInputs) {
+                reason.Invalid(false, REJECT_INVALID, "package-missing-inputs", ptx->GetHash().ToString());
+            } else if (vState[i].GetRejectReason() == "package-mempool-conflict" || vState[i].GetRejectReason() == "txn-mempool-conflict") {
+                reason.Invalid(false, REJECT_DUPLICATE, "package-mempool-conflict", ptx->GetHash().ToString());
+            } else {
+                reason.Invalid(false, REJECT_INVALID, "package-invalid-tx", strprintf("%s: %s", ptx->GetHash().ToString(), FormatStateMessage(vState[i])));
+            }
+            return reject(reason);
+        }
+        AddCoins(packageCoins, *ptx, MEMPOOL_HEIGHT);
+    }
+
+    CAmount nPackageFees = 0;
+    int64_t nPackageSize = 0;
+    for (const CTxMemPoolEntry& entry : vEntries) {
+        nPackageFees += entry.GetModifiedFee();
+        nPackageSize += entry.GetTxSize();
+    }
+    if (nPackageSize > MAX_PACKAGE_SIZE * 1000) {
+        CValidationState reason;
+        reason.Invalid(false, REJECT_NONSTANDARD, "package-too-large");
+        return reject(reason);
+    }
+    CAmount mempoolRejectFee = pool.GetMinFee(gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nPackageSize);
+    if (mempoolRejectFee > 0 && nPackageFees < mempoolRejectFee) {
+        CValidationState reason;
+        reason.DoS(0, false, REJECT_INSUFFICIENTFEE, "package mempool min fee not met", false, strprintf("%d < %d", nPackageFees, mempoolRejectFee));
+        return reject(reason);
+    }
+    if (nPackageFees < ::minRelayTxFee.GetFee(nPackageSize)) {
+        CValidationState reason;
+        reason.DoS(0, false, REJECT_INSUFFICIENTFEE, "package min relay fee not met", false, strprintf("%d < %d", nPackageFees, ::minRelayTxFee.GetFee(nPackageSize)));
+        return reject(reason);
+    }
+
+    // Each member was checked against the mempool limits on its own. As the
+    // child descends from all of them, check it as if the whole package and
+    // every in-mempool ancestor of it were its ancestors.
+    CTxMemPool::setEntries setAncestors;
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    for (const CTxMemPoolEntry& entry : vEntries) {
+        CTxMemPool::setEntries setEntryAncestors;
+        pool.CalculateMemPoolAncestors(entry, setEntryAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy);
+        setAncestors.insert(setEntryAncestors.begin(), setEntryAncestors.end());
+    }
+    uint64_t nAncestorsSize = nPackageSize;
+    std::string errString;
+    for (CTxMemPool::txiter it : setAncestors) {
+        nAncestorsSize += it->GetTxSize();
+        if (it->GetCountWithDescendants() + vEntries.size() > (uint64_t)gArgs.GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT)) {
+            errString = strprintf("tx %s would have too many descendants", it->GetTx().GetHash().ToString());
+        } else if (it->GetSizeWithDescendants() + nPackageSize > (uint64_t)gArgs.GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000) {
+            errString = strprintf("exceeds descendant size limit for tx %s", it->GetTx().GetHash().ToString());
+        }
+    }
+    if (setAncestors.size() + vEntries.size() > (uint64_t)gArgs.GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT)) {
+        errString = "package has too many ancestors";
+    } else if (nAncestorsSize > (uint64_t)gArgs.GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000) {
+        errString = "package exceeds ancestor size limit";
+    } else if (pool.CalculateClusterCount(setAncestors) + vEntries.size() > (uint64_t)gArgs.GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT)) {
+        errString = "package would make too large a cluster";
+    }
+    if (!errString.empty()) {
+        CValidationState reason;
+        reason.DoS(0, false, REJECT_NONSTANDARD, "package-too-long-mempool-chain", false, errString);
+        return reject(reason);
+    }
+
+    // All checked, so add the whole package. The mempool is only trimmed once
+    // all of it is in.
+    for (const CTxMemPoolEntry& entry : vEntries) {
+        pool.addUnchecked(entry.GetTx().GetHash(), entry, false /* validFeeEstimate */);
+    }
+    LimitMempoolSize(pool, gArgs.GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+    bool fTrimmed = false;
+    for (const CTxMemPoolEntry& entry : vEntries) {
+        if (pool.exists(entry.GetTx().GetHash())) {
+            GetMainSignals().TransactionAddedToMempool(entry.GetSharedTx());
+        } else {
+            fTrimmed = true;
+        }
+    }
+    if (fTrimmed) {
+        return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "package mempool full");
+    }
+    return true;
 }
 
 // Protected by cs_main
@@ -1766,6 +2145,30 @@ static unsigned int GetBlockScriptFlags(const CBlockIndex* pindex, const Consens
     return flags;
 }
 
+/** Load the coins spent by a block into the view with one batched lookup.
+ *  Inputs spending outputs created earlier in the same block are skipped, as
+ *  they cannot be in the UTXO set yet. */
+static void PrefetchBlockInputs(const CBlock& block, const CCoinsViewCache& view)
+{
+    std::vector<uint256> block_txids;
+    block_txids.reserve(block.vtx.size());
+    for (const CTransactionRef& tx : block.vtx) {
+        block_txids.push_back(tx->GetHash());
+    }
+    std::sort(block_txids.begin(), block_txids.end());
+
+    std::vector<COutPoint> prevouts;
+    for (const CTransactionRef& tx : block.vtx) {
+        if (tx->IsCoinBase()) continue;
+        for (const CTxIn& txin : tx->vin) {
+            if (!std::binary_search(block_txids.begin(), block_txids.end(), txin.prevout.hash)) {
+                prevouts.push_back(txin.prevout);
+            }
+        }
+    }
+    view.PrefetchCoins(prevouts);
+}
+
 
 
 static int64_t nTimeCheck = 0;
@@ -1911,6 +2314,7 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
+    PrefetchBlockInputs(block, view);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
         const CTransaction &tx = *(block.vtx[i]);
@@ -1995,9 +2399,6 @@ bool CChainState::ConnectBlock(const CBlock& block, CValidationState& state, CBl
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (!WriteTxIndexDataForBlock(block, state, pindex))
-        return false;
-
     assert(pindex->phashBlock);
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -3810,10 +4211,6 @@ bool static LoadBlockIndexDB(const CChainParams& chainparams)
     pblocktree->ReadReindexing(fReindexing);
     if(fReindexing) fReindex = true;
 
-    // Check whether we have a transaction index
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
-
     return true;
 }
 
@@ -4197,9 +4594,6 @@ bool LoadBlockIndex(const CChainParams& chainparams)
         // needs_init.
 
         LogPrintf("Initializing databases...\n");
-        // Use the provided setting for -txindex in the new database
-        fTxIndex = gArgs.GetBoolArg("-txindex", DEFAULT_TXINDEX);
-        pblocktree->WriteFlag("txindex", fTxIndex);
     }
     return true;
 }
@@ -4567,7 +4961,109 @@ int VersionBitsTipStateSinceHeight(const Consensus::Params& params, Consensus::D
     return VersionBitsStateSinceHeight(chainActive.Tip(), params, pos, versionbitscache);
 }
 
-static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Version 2 adds the tip and script flags the dump was taken at, an HMAC of
+ *  the file, and for each transaction the block script flags its scripts
+ *  passed. */
+static const uint64_t MEMPOOL_DUMP_VERSION = 2;
+//! Number of transactions LoadMempool() verifies the scripts of at once
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+//! Size of the key mempool.dat is authenticated with
+static const size_t MEMPOOL_KEY_SIZE = 32;
+
+/**
+ * Read the key mempool.dat is authenticated with. It is kept in a file of its
+ * own, so that the script flags recorded in mempool.dat are only trusted if
+ * this node wrote them. If fCreate, a missing key is generated.
+ */
+static bool GetMempoolKey(std::vector<unsigned char>& vchKey, bool fCreate)
+{
+    const fs::path path = GetDataDir() / "mempool.key";
+    vchKey.resize(MEMPOOL_KEY_SIZE);
+    FILE* file = fsbridge::fopen(path, "rb");
+    if (file) {
+        bool fRead = fread(vchKey.data(), 1, vchKey.size(), file) == vchKey.size();
+        fclose(file);
+        if (fRead) {
+            return true;
+        }
+    }
+    if (!fCreate) {
+        return false;
+    }
+    GetStrongRandBytes(vchKey.data(), vchKey.size());
+    file = fsbridge::fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    bool fWritten = fwrite(vchKey.data(), 1, vchKey.size(), file) == vchKey.size();
+    FileCommit(file);
+    fclose(file);
+    return fWritten;
+}
+
+/** Writes to a file, computing the HMAC of what was written */
+class CHMACFileWriter
+{
+private:
+    CAutoFile& file;
+    CHMAC_SHA256 hmac;
+
+public:
+    CHMACFileWriter(CAutoFile& fileIn, const std::vector<unsigned char>& vchKey) : file(fileIn), hmac(vchKey.data(), vchKey.size()) {}
+
+    int GetType() const { return file.GetType(); }
+    int GetVersion() const { return file.GetVersion(); }
+
+    void write(const char* pch, size_t nSize)
+    {
+        hmac.Write((const unsigned char*)pch, nSize);
+        file.write(pch, nSize);
+    }
+
+    template<typename T>
+    CHMACFileWriter& operator<<(const T& obj)
+    {
+        ::Serialize(*this, obj);
+        return *this;
+    }
+
+    uint256 GetHMAC()
+    {
+        uint256 result;
+        hmac.Finalize(result.begin());
+        return result;
+    }
+};
+
+/**
+ * Check the HMAC of the file, which covers everything but the HMAC itself,
+ * read just before the current position. The position is left unchanged.
+ */
+static bool CheckMempoolHMAC(CAutoFile& file, const std::vector<unsigned char>& vchKey, const uint256& hmacExpected)
+{
+    FILE* f = file.Get();
+    const long pos = ftell(f);
+    const long nHMACPos = pos - (long)hmacExpected.size();
+    if (nHMACPos < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        return false;
+    }
+    CHMAC_SHA256 hmac(vchKey.data(), vchKey.size());
+    unsigned char buf[65536];
+    std::vector<unsigned char> vchHeader(nHMACPos);
+    bool fOk = fread(vchHeader.data(), 1, vchHeader.size(), f) == vchHeader.size() && fseek(f, pos, SEEK_SET) == 0;
+    hmac.Write(vchHeader.data(), vchHeader.size());
+    size_t nRead;
+    while (fOk && (nRead = fread(buf, 1, sizeof(buf), f)) > 0) {
+        hmac.Write(buf, nRead);
+    }
+    fOk = fOk && !ferror(f);
+    if (fseek(f, pos, SEEK_SET) != 0) {
+        throw std::ios_base::failure("CheckMempoolHMAC: fseek failed");
+    }
+    uint256 hmacActual;
+    hmac.Finalize(hmacActual.begin());
+    return fOk && hmacActual == hmacExpected;
+}
 
 bool LoadMempool(void)
 {
@@ -4584,32 +5080,96 @@ bool LoadMempool(void)
     int64_t expired = 0;
     int64_t failed = 0;
     int64_t already_there = 0;
+    int64_t skipped_scripts = 0;
     int64_t nNow = GetTime();
 
     try {
         uint64_t version;
         file >> version;
-        if (version != MEMPOOL_DUMP_VERSION) {
+        if (version != 1 && version != MEMPOOL_DUMP_VERSION) {
             return false;
         }
+        // The recorded script flags are only trusted if nothing they depend
+        // on changed since the dump, and if this node wrote them
+        bool fTrustScriptFlags = false;
+        if (version >= 2) {
+            uint256 hashTip;
+            uint32_t nMempoolScriptFlags;
+            uint256 hmac;
+            file >> hashTip;
+            file >> nMempoolScriptFlags;
+            file >> hmac;
+            {
+                LOCK(cs_main);
+                fTrustScriptFlags = hashTip == chainActive.Tip()->GetBlockHash() && nMempoolScriptFlags == GetMempoolScriptFlags(chainparams);
+            }
+            std::vector<unsigned char> vchKey;
+            if (fTrustScriptFlags) {
+                fTrustScriptFlags = GetMempoolKey(vchKey, false) && CheckMempoolHMAC(file, vchKey, hmac);
+                if (!fTrustScriptFlags) {
+                    LogPrintf("Mempool file not written by this node, verifying all scripts\n");
+                }
+            }
+        }
         uint64_t num;
         file >> num;
-        while (num--) {
-            CTransactionRef tx;
-            int64_t nTime;
-            int64_t nFeeDelta;
-            file >> tx;
-            file >> nTime;
-            file >> nFeeDelta;
-
-            CAmount amountdelta = nFeeDelta;
-            if (amountdelta) {
-                mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+        while (num) {
+            // Read the transactions in batches, so that their scripts can be
+            // verified concurrently before they are accepted one by one.
+            std::vector<CTransactionRef> vtx;
+            std::vector<int64_t> vTime;
+            std::vector<uint32_t> vScriptFlags;
+            while (num && vtx.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                --num;
+                CTransactionRef tx;
+                int64_t nTime;
+                int64_t nFeeDelta;
+                uint32_t nScriptFlags = 0;
+                file >> tx;
+                file >> nTime;
+                file >> nFeeDelta;
+                if (version >= 2) {
+                    file >> nScriptFlags;
+                }
+
+                CAmount amountdelta = nFeeDelta;
+                if (amountdelta) {
+                    mempool.PrioritiseTransaction(tx->GetHash(), amountdelta);
+                }
+                if (nTime + nExpiryTimeout > nNow) {
+                    vtx.push_back(tx);
+                    vTime.push_back(nTime);
+                    vScriptFlags.push_back(fTrustScriptFlags ? nScriptFlags : 0);
+                } else {
+                    ++expired;
+                }
             }
-            CValidationState state;
-            if (nTime + nExpiryTimeout > nNow) {
+
+            // Transactions whose scripts passed the policy flags before are
+            // not checked against them again. They are still verified
+            // concurrently against the block script flags, like the rest are
+            // against the policy flags, so that the remaining serial checks
+            // hit the caches. Nothing from the file ever enters the cache
+            // under flags that blocks are validated with.
+            std::vector<bool> vPolicyChecked(vtx.size(), false);
+            {
+                LOCK(cs_main);
+                const unsigned int nMempoolScriptFlags = GetMempoolScriptFlags(chainparams);
+                if (nMempoolScriptFlags != GetBlockScriptFlags(chainActive.Tip(), chainparams.GetConsensus())) {
+                    for (size_t i = 0; i < vtx.size(); i++) {
+                        if (vScriptFlags[i]) {
+                            scriptExecutionCache.insert(GetScriptExecutionCacheEntry(*vtx[i], nMempoolScriptFlags));
+                            vPolicyChecked[i] = true;
+                            ++skipped_scripts;
+                        }
+                    }
+                }
+            }
+            PreVerifyTransactionScripts(mempool, vtx, false /* bypass_limits */, &vPolicyChecked);
+            for (size_t i = 0; i < vtx.size(); i++) {
+                CValidationState state;
                 LOCK(cs_main);
-                AcceptToMemoryPoolWithTime(chainparams, mempool, state, tx, nullptr /* pfMissingInputs */, nTime,
+                AcceptToMemoryPoolWithTime(chainparams, mempool, state, vtx[i], nullptr /* pfMissingInputs */, vTime[i],
                                            nullptr /* plTxnReplaced */, false /* bypass_limits */, 0 /* nAbsurdFee */);
                 if (state.IsValid()) {
                     ++count;
@@ -4618,17 +5178,15 @@ bool LoadMempool(void)
                     // wallet(s) having loaded it while we were processing
                     // mempool transactions; consider these as valid, instead of
                     // failed, but mark them as 'already there'
-                    if (mempool.exists(tx->GetHash())) {
+                    if (mempool.exists(vtx[i]->GetHash())) {
                         ++already_there;
                     } else {
                         ++failed;
                     }
                 }
-            } else {
-                ++expired;
+                if (ShutdownRequested())
+                    return false;
             }
-            if (ShutdownRequested())
-                return false;
         }
         std::map<uint256, CAmount> mapDeltas;
         file >> mapDeltas;
@@ -4641,26 +5199,44 @@ bool LoadMempool(void)
         return false;
     }
 
-    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there\n", count, failed, expired, already_there);
+    LogPrintf("Imported mempool transactions from disk: %i succeeded, %i failed, %i expired, %i already there, %i without policy script checks\n", count, failed, expired, already_there, skipped_scripts);
     return true;
 }
 
-bool DumpMempool(void)
-{
-    int64_t start = GetTimeMicros();
-
+namespace {
+/** What DumpMempool() copies from the mempool, to write it without the locks */
+struct MempoolDump {
+    struct Entry {
+        CTransactionRef tx;
+        int64_t nTime;
+        int64_t nFeeDelta;
+        uint32_t nScriptFlags;
+        uint64_t nCountWithAncestors;
+    };
     std::map<uint256, CAmount> mapDeltas;
-    std::vector<TxMempoolInfo> vinfo;
+    std::vector<Entry> vEntries;
+    uint256 hashTip;
+    uint32_t nMempoolScriptFlags;
+    int64_t nStart;
+    int64_t nCopied;
+};
 
-    {
-        LOCK(mempool.cs);
-        for (const auto &i : mempool.mapDeltas) {
-            mapDeltas[i.first] = i.second;
-        }
-        vinfo = mempool.infoAll();
-    }
+/** Held while a dump is copied and written, so that only one writes at a time */
+std::mutex cs_mempool_dump;
+/** The thread writing a background dump, if any. Guarded by cs_mempool_dump. */
+std::thread g_mempool_dump_thread;
+} // namespace
 
-    int64_t mid = GetTimeMicros();
+static bool WriteMempoolDump(MempoolDump& dump)
+{
+    std::vector<MempoolDump::Entry>& vEntries = dump.vEntries;
+    std::map<uint256, CAmount>& mapDeltas = dump.mapDeltas;
+
+    // Parents have fewer ancestors than their children, so this order lets
+    // LoadMempool() accept every transaction after its parents
+    std::sort(vEntries.begin(), vEntries.end(), [](const MempoolDump::Entry& a, const MempoolDump::Entry& b) {
+        return a.nCountWithAncestors < b.nCountWithAncestors;
+    });
 
     try {
         FILE* filestr = fsbridge::fopen(GetDataDir() / "mempool.dat.new", "wb");
@@ -4669,24 +5245,40 @@ bool DumpMempool(void)
         }
 
         CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        std::vector<unsigned char> vchKey;
+        if (!GetMempoolKey(vchKey, true)) {
+            return false;
+        }
 
+        // The HMAC covers the whole file and is only known once the rest
+        // is written
+        CHMACFileWriter writer(file, vchKey);
         uint64_t version = MEMPOOL_DUMP_VERSION;
-        file << version;
-
-        file << (uint64_t)vinfo.size();
-        for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
+        writer << version;
+        writer << dump.hashTip;
+        writer << dump.nMempoolScriptFlags;
+        const long nHMACPos = ftell(file.Get());
+        file << uint256();
+
+        writer << (uint64_t)vEntries.size();
+        for (const auto& i : vEntries) {
+            writer << *(i.tx);
+            writer << i.nTime;
+            writer << i.nFeeDelta;
+            writer << i.nScriptFlags;
             mapDeltas.erase(i.tx->GetHash());
         }
 
-        file << mapDeltas;
+        writer << mapDeltas;
+        if (nHMACPos < 0 || fseek(file.Get(), nHMACPos, SEEK_SET) != 0) {
+            throw std::ios_base::failure("DumpMempool: fseek failed");
+        }
+        file << writer.GetHMAC();
         FileCommit(file.Get());
         file.fclose();
         RenameOver(GetDataDir() / "mempool.dat.new", GetDataDir() / "mempool.dat");
         int64_t last = GetTimeMicros();
-        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (mid-start)*MICRO, (last-mid)*MICRO);
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (dump.nCopied-dump.nStart)*MICRO, (last-dump.nCopied)*MICRO);
     } catch (const std::exception& e) {
         LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
         return false;
@@ -4694,6 +5286,56 @@ bool DumpMempool(void)
     return true;
 }
 
+bool DumpMempool(bool fBackground)
+{
+    std::unique_lock<std::mutex> lock(cs_mempool_dump);
+    if (g_mempool_dump_thread.joinable()) {
+        g_mempool_dump_thread.join();
+    }
+
+    std::shared_ptr<MempoolDump> dump = std::make_shared<MempoolDump>();
+    dump->nStart = GetTimeMicros();
+    {
+        // Only copy what is needed under the locks, sorting and writing
+        // happen after they are released
+        LOCK2(cs_main, mempool.cs);
+        dump->hashTip = chainActive.Tip() ? chainActive.Tip()->GetBlockHash() : uint256();
+        dump->nMempoolScriptFlags = GetMempoolScriptFlags(Params());
+        for (const auto &i : mempool.mapDeltas) {
+            dump->mapDeltas[i.first] = i.second;
+        }
+        dump->vEntries.reserve(mempool.mapTx.size());
+        for (const CTxMemPoolEntry& e : mempool.mapTx) {
+            dump->vEntries.push_back({e.GetSharedTx(), e.GetTime(), e.GetModifiedFee() - e.GetFee(), e.GetScriptFlags(), e.GetCountWithAncestors()});
+        }
+    }
+    dump->nCopied = GetTimeMicros();
+
+    if (!fBackground) {
+        return WriteMempoolDump(*dump);
+    }
+    g_mempool_dump_thread = std::thread(&TraceThread<std::function<void()>>, "memdump",
+        std::function<void()>([dump] { WriteMempoolDump(*dump); }));
+    return true;
+}
+
+void WaitForMempoolDump()
+{
+    std::unique_lock<std::mutex> lock(cs_mempool_dump);
+    if (g_mempool_dump_thread.joinable()) {
+        g_mempool_dump_thread.join();
+    }
+}
+
+void ExpireMempool()
+{
+    LOCK(cs_main);
+    int expired = mempool.Expire(GetTime() - gArgs.GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (expired != 0) {
+        LogPrint(BCLog::MEMPOOL, "Expired %i transactions from the memory pool\n", expired);
+    }
+}
+
 //! Guess how far we are in the verification process at the given block index
 double GuessVerificationProgress(const ChainTxData& data, const CBlockIndex *pindex) {
     if (pindex == nullptr)
@@ -33,6 +33,7 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CBlockUndo;
 class CChainParams;
 class CCoinsViewDB;
 class CInv;
@@ -66,8 +67,16 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -limitclustercount, max number of transactions in an in-mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
+/** Maximum number of transactions in a package submitted together */
+static const unsigned int MAX_PACKAGE_COUNT = 25;
+/** Maximum virtual size of a package in kilobytes */
+static const unsigned int MAX_PACKAGE_SIZE = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 336;
+/** Time between runs of the mempool expiry task, in seconds */
+static const int64_t MEMPOOL_EXPIRY_INTERVAL = 60;
 /** Maximum kilobytes for transactions to store for processing during reorg */
 static const unsigned int MAX_DISCONNECTED_TX_POOL_SIZE = 20000;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -83,6 +92,12 @@ static const int MAX_SCRIPTCHECK_THREADS = 16;
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds on the number of blocks in transit from a single peer once download rates are known: peers
+ *  faster than average may have more, slower ones fewer, in proportion to their rate. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_SLOW_PEER = 4;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_FAST_PEER = 64;
+/** Time in seconds after which the download rate of a peer we no longer download from is forgotten. */
+static const int64_t BLOCK_DOWNLOAD_RATE_EXPIRY = 10 * 60;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
@@ -146,6 +161,7 @@ static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
+static const bool DEFAULT_PEERBLOCKFILTERS = false;
 
 /** Default for -stopatheight */
 static const int DEFAULT_STOPATHEIGHT = 0;
@@ -170,7 +186,6 @@ extern uint256 hashBestBlock;
 extern std::atomic_bool fImporting;
 extern std::atomic_bool fReindex;
 extern int nScriptCheckThreads;
-extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
@@ -311,6 +326,41 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                         bool* pfMissingInputs, std::list<CTransactionRef>* plTxnReplaced,
                         bool bypass_limits, const CAmount nAbsurdFee);
 
+/** Verify the scripts of a batch of transactions concurrently on the script
+ * check threads, and remember the ones that pass in the script execution
+ * cache, so that accepting them into the mempool afterwards, one at a time,
+ * does not verify their scripts again.
+ * Transactions may spend outputs of earlier transactions of the batch.
+ * Transactions that are in the mempool already, miss inputs, spend the same
+ * outputs as an earlier transaction of the batch, fail the cheaper mempool
+ * policy checks or are already known to fail are skipped. For those that fail, the failing input
+ * is remembered, so that rejecting them afterwards only verifies that input.
+ * Transactions marked in pvPolicyChecked are known to pass the policy script
+ * flags and are verified against the block script flags instead.
+ * The scripts are verified without holding cs_main, unless the caller does. **/
+void PreVerifyTransactionScripts(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx, bool bypass_limits,
+                                 const std::vector<bool>* pvPolicyChecked = nullptr);
+
+/** (try to) add a batch of transactions to the memory pool, in order.
+ * Their scripts are verified concurrently first, see PreVerifyTransactionScripts.
+ * vAccepted and vState receive the result for each transaction.
+ * plTxnReplaced will be appended to with all transactions replaced from mempool **/
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransactionRef>& vtx,
+                             std::vector<bool>& vAccepted, std::vector<CValidationState>& vState,
+                             std::list<CTransactionRef>* plTxnReplaced, bool bypass_limits, const CAmount nAbsurdFee);
+
+/** (try to) add a package of transactions to the memory pool.
+ * The package is a child preceded by its parents, sorted so that parents come
+ * before their children, and must not conflict with the mempool. Each
+ * transaction is first tried on its own; those rejected for paying too little
+ * are then checked together, with their fees measured against the mempool
+ * minimum feerate as a whole, and only added once all of them passed.
+ * Package members that are in the mempool already are skipped.
+ * state receives why the package was rejected, vState the result of each
+ * transaction. **/
+bool AcceptPackageToMemoryPool(CTxMemPool& pool, CValidationState& state, const std::vector<CTransactionRef>& package,
+                               std::vector<CValidationState>& vState, const CAmount nAbsurdFee);
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState &state);
 
@@ -351,10 +401,12 @@ bool TestLockPointValidity(const LockPoints* lp);
  * of the block needed for calculation or skips the calculation and uses the LockPoints
  * passed in for evaluation.
  * The LockPoints should not be considered valid if CheckSequenceLocks returns false.
+ * The inputs are looked up in pcoinsView if given, otherwise in the mempool and
+ * pcoinsTip.
  *
  * See consensus/consensus.h for flag definitions.
  */
-bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = nullptr, bool useExistingLockPoints = false);
+bool CheckSequenceLocks(const CTransaction &tx, int flags, LockPoints* lp = nullptr, bool useExistingLockPoints = false, const CCoinsView* pcoinsView = nullptr);
 
 /**
  * Closure representing one script verification
@@ -370,14 +422,20 @@ private:
     bool cacheStore;
     ScriptError error;
     PrecomputedTransactionData *txdata;
+    std::atomic<int> *pnFailedIn;
 
 public:
-    CScriptCheck(): ptxTo(nullptr), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    CScriptCheck(): ptxTo(nullptr), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), pnFailedIn(nullptr) {}
     CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, PrecomputedTransactionData* txdataIn) :
-        m_tx_out(outIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
+        m_tx_out(outIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn), pnFailedIn(nullptr) { }
 
     bool operator()();
 
+    /** Report a failure by lowering *pnFailedInIn (-1 for none) to the
+     *  input's index instead of failing the check, so that checks of
+     *  unrelated transactions queued together still run */
+    void SetFailedInput(std::atomic<int>* pnFailedInIn) { pnFailedIn = pnFailedInIn; }
+
     void swap(CScriptCheck &check) {
         std::swap(ptxTo, check.ptxTo);
         std::swap(m_tx_out, check.m_tx_out);
@@ -386,6 +444,7 @@ public:
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
         std::swap(txdata, check.txdata);
+        std::swap(pnFailedIn, check.pnFailedIn);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -398,6 +457,7 @@ void InitScriptExecutionCache();
 /** Functions for disk access for blocks */
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+bool UndoReadFromDisk(CBlockUndo& blockundo, const CBlockIndex* pindex);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -479,10 +539,19 @@ static const unsigned int REJECT_HIGHFEE = 0x100;
 /** Get block file info entry for one block file */
 CBlockFileInfo* GetBlockFileInfo(size_t n);
 
-/** Dump the mempool to disk. */
-bool DumpMempool();
+/** Dump the mempool to disk. With fBackground, the mempool is only copied
+ *  before returning and the file is written by a background thread, see
+ *  WaitForMempoolDump(). */
+bool DumpMempool(bool fBackground = false);
+
+/** Wait until a background mempool dump is written. */
+void WaitForMempoolDump();
 
 /** Load the mempool from disk. */
 bool LoadMempool();
 
+/** Remove transactions older than -mempoolexpiry from the mempool. Run
+ *  periodically from the scheduler rather than on every acceptance. */
+void ExpireMempool();
+
 #endif // BITCOIN_VALIDATION_H
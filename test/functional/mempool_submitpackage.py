@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the submitpackage RPC.
+
+A child pays for a parent that pays no fee on its own. Transactions paying
+for themselves are accepted on their own, the others as a whole or not at all.
+"""
+
+from decimal import Decimal
+
+from test_framework.messages import CTransaction, FromHex, ToHex
+from test_framework.script import CScript, OP_TRUE
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, assert_raises_rpc_error
+
+class SubmitPackageTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.num_nodes = 1
+        self.setup_clean_chain = True
+        self.extra_args = [["-checkmempool"]]
+
+    def spend(self, txid, value):
+        """Spend output 0 of txid, paid to the anyone-can-spend address."""
+        node = self.nodes[0]
+        tx = FromHex(CTransaction(), node.createrawtransaction([{"txid": txid, "vout": 0}], {self.address: value}))
+        tx.vin[0].scriptSig = CScript([CScript([OP_TRUE])])
+        tx.rehash()
+        return tx
+
+    def run_test(self):
+        node = self.nodes[0]
+        self.address = node.decodescript(CScript([OP_TRUE]).hex())["p2sh"]
+        node.generatetoaddress(110, self.address)
+        coinbase = [node.getblock(node.getblockhash(n))["tx"][0] for n in range(1, 5)]
+        value = node.gettxout(coinbase[0], 0)["value"]
+        fee = Decimal("0.01")
+
+        self.log.info("A parent paying no fee is rejected on its own")
+        parent = self.spend(coinbase[0], value)
+        child = self.spend(parent.hash, value - fee)
+        assert_raises_rpc_error(-26, "min relay fee not met", node.sendrawtransaction, ToHex(parent))
+
+        self.log.info("The package must be a child with its parents, sorted")
+        assert_raises_rpc_error(-26, "package-not-sorted", node.submitpackage, [ToHex(child), ToHex(parent)])
+        unrelated = self.spend(coinbase[1], value - fee)
+        assert_raises_rpc_error(-26, "package-not-child-with-parents", node.submitpackage, [ToHex(parent), ToHex(unrelated)])
+        assert_equal(node.getrawmempool(), [])
+
+        self.log.info("A parent without a child paying for it is rejected")
+        assert_raises_rpc_error(-26, "package min relay fee not met", node.submitpackage, [ToHex(parent)])
+
+        self.log.info("An invalid child takes a parent relying on it down")
+        badchild = self.spend(parent.hash, value - fee)
+        badchild.vin[0].scriptSig = CScript([CScript([OP_TRUE, OP_TRUE])])
+        assert_raises_rpc_error(-26, "package-invalid-tx", node.submitpackage, [ToHex(parent), ToHex(badchild)])
+        assert_equal(node.getrawmempool(), [])
+
+        self.log.info("The child pays for its parent")
+        assert_equal(node.submitpackage([ToHex(parent), ToHex(child)]), [parent.hash, child.hash])
+        assert_equal(sorted(node.getrawmempool()), sorted([parent.hash, child.hash]))
+        assert_equal(node.getmempoolentry(child.hash)["ancestorcount"], 2)
+
+        self.log.info("Resubmitting skips the transactions in the mempool already")
+        node.submitpackage([ToHex(parent), ToHex(child)])
+        assert_equal(node.getmempoolinfo()["size"], 2)
+
+        self.log.info("A parent paying for itself is accepted whatever its child")
+        parent2 = self.spend(coinbase[2], value - fee)
+        badchild2 = self.spend(parent2.hash, value - 2 * fee)
+        badchild2.vin[0].scriptSig = CScript([CScript([OP_TRUE, OP_TRUE])])
+        assert_raises_rpc_error(-26, "package-invalid-tx", node.submitpackage, [ToHex(parent2), ToHex(badchild2)])
+        assert parent2.hash in node.getrawmempool()
+        assert badchild2.hash not in node.getrawmempool()
+
+        self.log.info("Packages may not replace mempool transactions")
+        doublespend = self.spend(coinbase[0], value - 2 * fee)
+        doublespendchild = self.spend(doublespend.hash, value - 3 * fee)
+        assert_raises_rpc_error(-26, "package-invalid-tx", node.submitpackage, [ToHex(doublespend), ToHex(doublespendchild)])
+        assert_equal(node.getmempoolinfo()["size"], 3)
+
+        self.log.info("The package is mined")
+        block = node.getblock(node.generatetoaddress(1, self.address)[0])
+        assert_equal(node.getrawmempool(), [])
+        assert child.hash in block["tx"]
+
+if __name__ == '__main__':
+    SubmitPackageTest().main()
@@ -66,6 +66,28 @@ class GetBlockTemplateLPTest(BitcoinTestFramework):
         thr.join(60 + 20)
         assert(not thr.is_alive())
 
+        # Test 5: a delta response describes the changes relative to the template of the longpollid
+        templat = self.nodes[0].getblocktemplate()
+        old_txids = [tx['txid'] for tx in templat['transactions']]
+        assert_equal(old_txids, [txid])
+        self.nodes[0].generate(1)
+        (new_txid, txhex, fee) = random_transaction(self.nodes, Decimal("1.1"), min_relay_fee, Decimal("0.001"), 20)
+        sync_mempools(self.nodes)
+        delta_templat = self.nodes[0].getblocktemplate({'longpollid': templat['longpollid'], 'delta': True})
+        full_templat = self.nodes[0].getblocktemplate()
+        assert('transactions' not in delta_templat)
+        delta = delta_templat['delta']
+        assert_equal(delta['longpollid'], templat['longpollid'])
+        assert_equal(delta['removed'], [txid])
+        assert_equal([tx['txid'] for tx in delta['added']], [new_txid])
+        # Applying the delta yields the transactions of the full template
+        rebuilt = [old_txids[n - 1] if n > 0 else delta['added'][-n - 1]['txid'] for n in delta['order']]
+        assert_equal(rebuilt, [tx['txid'] for tx in full_templat['transactions']])
+        # Unknown longpollids get the full list
+        templat = self.nodes[0].getblocktemplate({'longpollid': '00' * 32 + '0', 'delta': True})
+        assert('delta' not in templat)
+        assert_equal([tx['txid'] for tx in templat['transactions']], [new_txid])
+
 if __name__ == '__main__':
     GetBlockTemplateLPTest().main()
 
@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test relay between peers served by different network threads.
+
+With -netthreads=4 a peer is handled by the shard its id maps to. Blocks,
+addresses and pings are relayed between peers on all shards.
+"""
+
+import time
+
+from test_framework.blocktools import create_block, create_coinbase
+from test_framework.messages import CAddress, msg_addr, msg_block, msg_ping
+from test_framework.mininode import P2PInterface, mininode_lock, network_thread_start
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, sync_blocks, wait_until
+
+NET_THREADS = 4
+NUM_PEERS = 8
+
+class AddrReceiver(P2PInterface):
+    def __init__(self):
+        super().__init__()
+        self.addrs_received = set()
+
+    def on_addr(self, message):
+        for addr in message.addrs:
+            self.addrs_received.add(addr.ip)
+
+class NetThreadsTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 2
+        self.extra_args = [["-netthreads=%d" % NET_THREADS]] * self.num_nodes
+
+    def run_test(self):
+        node = self.nodes[0]
+        self.address = node.decodescript("51")["p2sh"]
+        # Leave initial block download so that blocks are announced
+        node.generatetoaddress(1, self.address)
+        sync_blocks(self.nodes)
+
+        self.log.info("Connect %d peers over %d shards" % (NUM_PEERS, NET_THREADS))
+        peers = [node.add_p2p_connection(AddrReceiver()) for _ in range(NUM_PEERS)]
+        network_thread_start()
+        for peer in peers:
+            peer.wait_for_verack()
+            peer.sync_with_ping()
+        shards = set(info["id"] % NET_THREADS for info in node.getpeerinfo())
+        assert_equal(shards, set(range(NET_THREADS)))
+
+        self.log.info("A mined block is relayed to the other node and all peers")
+        tip = node.generatetoaddress(1, self.address)[0]
+        sync_blocks(self.nodes)
+        for peer in peers:
+            peer.wait_for_block(int(tip, 16))
+
+        self.log.info("A block from a peer is relayed to the other node and all other peers")
+        block = create_block(int(tip, 16), create_coinbase(node.getblockcount() + 1), node.getblock(tip)["time"] + 1)
+        block.nVersion = 0x20000000
+        block.solve()
+        peers[0].send_message(msg_block(block))
+        wait_until(lambda: node.getbestblockhash() == block.hash, timeout=30)
+        sync_blocks(self.nodes)
+        for peer in peers[1:]:
+            peer.wait_for_block(block.sha256)
+
+        self.log.info("Addresses from a peer are relayed to peers on other shards")
+        addrs = msg_addr()
+        for i in range(10):
+            addr = CAddress()
+            addr.time = int(time.time())
+            addr.ip = "1.2.3.%d" % (i + 1)
+            addr.port = 9333
+            addrs.addrs.append(addr)
+        peers[0].send_message(addrs)
+        relayed = set(addr.ip for addr in addrs.addrs)
+        wait_until(lambda: any(peer.addrs_received & relayed for peer in peers[1:]), timeout=120, lock=mininode_lock)
+
+        self.log.info("Pings from all peers are answered in parallel")
+        with mininode_lock:
+            pongs = [peer.message_count["pong"] for peer in peers]
+        for i in range(50):
+            for peer in peers:
+                peer.send_message(msg_ping(nonce=i + 1))
+        for peer, n in zip(peers, pongs):
+            wait_until(lambda: peer.message_count["pong"] == n + 50, timeout=60, lock=mininode_lock)
+
+if __name__ == '__main__':
+    NetThreadsTest().main()
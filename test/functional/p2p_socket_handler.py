@@ -0,0 +1,67 @@
+#!/usr/bin/env python3
+# Copyright (c) 2018 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+"""Test the socket handler with many peers and full buffers.
+
+Where epoll is available this runs against the epoll backend: peers are
+registered and removed as they come and go, and a peer's interest switches
+between reading and writing as its send queue fills and its receive buffer
+pauses.
+"""
+
+from test_framework.messages import CInv, msg_getdata, msg_ping
+from test_framework.mininode import P2PInterface, mininode_lock, network_thread_join, network_thread_start
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, wait_until
+
+NUM_PEERS = 40
+
+class SocketHandlerTest(BitcoinTestFramework):
+    def set_test_params(self):
+        self.setup_clean_chain = True
+        self.num_nodes = 1
+        # Small buffers make the node pause sending and receiving often
+        self.extra_args = [["-maxsendbuffer=1", "-maxreceivebuffer=1"]]
+
+    def run_test(self):
+        node = self.nodes[0]
+        blocks = node.generatetoaddress(200, node.decodescript("51")["p2sh"])
+
+        self.log.info("Connect %d peers" % NUM_PEERS)
+        peers = [node.add_p2p_connection(P2PInterface()) for _ in range(NUM_PEERS)]
+        network_thread_start()
+        for peer in peers:
+            peer.wait_for_verack()
+            peer.sync_with_ping()
+        assert_equal(len(node.getpeerinfo()), NUM_PEERS)
+
+        self.log.info("A peer asking for more blocks than fit its send buffer gets all of them")
+        peer = peers[0]
+        peer.send_message(msg_getdata([CInv(2, int(h, 16)) for h in blocks]))
+        wait_until(lambda: peer.message_count["block"] == len(blocks), timeout=60, lock=mininode_lock)
+
+        self.log.info("A peer sending more than fits its receive buffer gets all answers")
+        peer = peers[1]
+        with mininode_lock:
+            pongs = peer.message_count["pong"]
+        for i in range(200):
+            peer.send_message(msg_ping(nonce=i + 1))
+        wait_until(lambda: peer.message_count["pong"] == pongs + 200, timeout=60, lock=mininode_lock)
+
+        self.log.info("The other peers are still served")
+        for peer in peers[2:]:
+            peer.sync_with_ping()
+
+        self.log.info("Disconnected peers are removed, and new ones served")
+        node.disconnect_p2ps()
+        network_thread_join()
+        wait_until(lambda: len(node.getpeerinfo()) == 0, timeout=30)
+        peer = node.add_p2p_connection(P2PInterface())
+        network_thread_start()
+        peer.wait_for_verack()
+        peer.sync_with_ping()
+        assert_equal(len(node.getpeerinfo()), 1)
+
+if __name__ == '__main__':
+    SocketHandlerTest().main()
@@ -10,10 +10,12 @@ Tests correspond to code in rpc/net.cpp.
 from test_framework.test_framework import BitcoinTestFramework
 from test_framework.util import (
     assert_equal,
+    assert_greater_than,
     assert_greater_than_or_equal,
     assert_raises_rpc_error,
     connect_nodes_bi,
     p2p_port,
+    sync_blocks,
     wait_until,
 )
 
@@ -28,6 +30,7 @@ class NetTest(BitcoinTestFramework):
         self._test_getnetworkinginfo()
         self._test_getaddednodeinfo()
         self._test_getpeerinfo()
+        self._test_getpeerinfo_block_download()
 
     def _test_connection_count(self):
         # connect_nodes_bi connects each node to the other
@@ -96,5 +99,33 @@ class NetTest(BitcoinTestFramework):
         assert_equal(peer_info[0][0]['addrbind'], peer_info[1][0]['addr'])
         assert_equal(peer_info[1][0]['addrbind'], peer_info[0][0]['addr'])
 
+    def _test_getpeerinfo_block_download(self):
+        for peer in self.nodes[1].getpeerinfo():
+            assert_equal(peer['blockdownloadrate'], 0)
+            assert_equal(peer['inflightlimit'], 16)
+            assert_equal(peer['blocksrerequested'], 0)
+
+        # Blocks mined while disconnected are downloaded with getdata,
+        # which gives the peers they came from a download rate
+        self.nodes[0].setnetworkactive(False)
+        wait_until(lambda: self.nodes[0].getnetworkinfo()['connections'] == 0, timeout=3)
+        self.nodes[0].generatetoaddress(20, self.nodes[0].decodescript("51")["p2sh"])
+        self.nodes[0].setnetworkactive(True)
+        connect_nodes_bi(self.nodes, 0, 1)
+        sync_blocks(self.nodes)
+
+        peer_info = self.nodes[1].getpeerinfo()
+        rated = [peer for peer in peer_info if peer['blockdownloadrate'] > 0]
+        assert_greater_than(len(rated), 0)
+        for peer in peer_info:
+            # With a single rate known the default limit holds, with two it
+            # scales between the bounds
+            if len(rated) == 1:
+                assert_equal(peer['inflightlimit'], 16)
+            else:
+                assert_greater_than_or_equal(peer['inflightlimit'], 4)
+                assert_greater_than_or_equal(64, peer['inflightlimit'])
+            assert_equal(peer['blocksrerequested'], 0)
+
 if __name__ == '__main__':
     NetTest().main()
@@ -182,19 +182,24 @@ def ToHex(obj):
 
 class CAddress():
     def __init__(self):
+        self.time = 0
         self.nServices = 1
         self.pchReserved = b"\x00" * 10 + b"\xff" * 2
         self.ip = "0.0.0.0"
         self.port = 0
 
-    def deserialize(self, f):
+    def deserialize(self, f, with_time=False):
+        if with_time:
+            self.time = struct.unpack("<i", f.read(4))[0]
         self.nServices = struct.unpack("<Q", f.read(8))[0]
         self.pchReserved = f.read(12)
         self.ip = socket.inet_ntoa(f.read(4))
         self.port = struct.unpack(">H", f.read(2))[0]
 
-    def serialize(self):
+    def serialize(self, with_time=False):
         r = b""
+        if with_time:
+            r += struct.pack("<i", self.time)
         r += struct.pack("<Q", self.nServices)
         r += self.pchReserved
         r += socket.inet_aton(self.ip)
@@ -974,11 +979,19 @@ class msg_addr():
     def __init__(self):
         self.addrs = []
 
+    # Addresses in addr messages carry the time they were last seen
     def deserialize(self, f):
-        self.addrs = deser_vector(f, CAddress)
+        self.addrs = []
+        for i in range(deser_compact_size(f)):
+            addr = CAddress()
+            addr.deserialize(f, with_time=True)
+            self.addrs.append(addr)
 
     def serialize(self):
-        return ser_vector(self.addrs)
+        r = ser_compact_size(len(self.addrs))
+        for addr in self.addrs:
+            r += addr.serialize(with_time=True)
+        return r
 
     def __repr__(self):
         return "msg_addr(addrs=%s)" % (repr(self.addrs))